@@ -22,6 +22,8 @@
 */
 
 #include "commands.h"
+#include "gio.h"
+#include "broadcast.h"
 
 GBEGIN_DECL
 
@@ -31,7 +33,8 @@ gerror_t async_cmd_unknown(std::vector<std::string> args, server_t*)
 	return GERROR_NONE;
 }
 
-/** @brief Log a user from the currently loaded database.
+/** @brief Log a user from the currently loaded database. Several users can
+ *  be logged at the same time, the first one being the default user.
  *  
  *  @note 
  *  Command : userlogin [username] [password]
@@ -42,8 +45,9 @@ gerror_t async_cmd_userlogin(std::vector<std::string> args, server_t* server)
 	{
 		std::string username = args[1];
 		std::string pass     = args[2];
-		int err = user_create(&(globalsession.user), username, pass);
-		if(err == GERROR_NONE && globalsession.user != nullptr) {
+		user_t*     user     = nullptr;
+		int err = user_create(server->session.database, &user, username, pass);
+		if(err == GERROR_NONE && user != nullptr && (err = server_login_user(server, user)) == GERROR_NONE) {
 			//server->logged = true;
 			cout << "[Command] Logged as '" << username << "'." << endl;
 		}
@@ -56,19 +60,36 @@ gerror_t async_cmd_userlogin(std::vector<std::string> args, server_t* server)
 	return GERROR_NONE;
 }
 
-/** @brief Unlog the logged user. 
+/** @brief Unlog given user, or every logged users.
  *
  *  If user is not saved already in the database, it will.
  *  @note
- *  Command : userunlog
+ *  Command : userunlog [username]
 **/
-gerror_t async_cmd_userunlog(std::vector<std::string>, server_t* server)
+gerror_t async_cmd_userunlog(std::vector<std::string> args, server_t* server)
 {
-	gerror_t err = server_unlog(server);
+	gerror_t err;
+	if(args.size() > 1)
+	{
+		user_t* user = server_find_user(server, args[1].c_str());
+		if(!user) {
+			cout << "[Command] User '" << args[1] << "' is not logged in." << endl;
+			return GERROR_NONE;
+		}
+		
+		err = server_unlog_user(server, user);
+	}
+	else
+	{
+		err = server_unlog(server);
+	}
 	
-	if(err == GERROR_NONE) {
+	if(err == GERROR_NONE && !server->session.user) {
 		cout << "[Command] Logged as 'null'." << endl;
 	}
+	else if(err == GERROR_NONE) {
+		cout << "[Command] Default user is '" << server->session.user->m_name->buf << "'." << endl;
+	}
 	else {
 		cout << "[Command] Unlogged but error occured : '" << gerror_to_string(err) << "'" << endl;
 	}
@@ -82,8 +103,11 @@ gerror_t async_cmd_userunlog(std::vector<std::string>, server_t* server)
  *  accepted. If you are new, it will send a request to the client to accept 
  *  you.
  *
+ *  The connection is made with the given local user (the default one if none),
+ *  to the given distant user (its default one if none).
+ *
  *  @note
- *  Command : userinit [ip] [port]
+ *  Command : userinit [ip] [port] [local user] [distant user]
 **/ 
 gerror_t async_cmd_userinit(std::vector<std::string> args, server_t* server)
 {
@@ -93,7 +117,9 @@ gerror_t async_cmd_userinit(std::vector<std::string> args, server_t* server)
 	// accepted. If you are new, it will send a request to the client to accept 
 	// you.
 			
-	if(!globalsession.user)
+	user_t* user = server_find_user(server, args.size() > 3 ? args[3].c_str() : nullptr);
+	
+	if(!user)
 	{
 		cout << "[Command] You must be logged in to init your user connection !" << endl;
 	}
@@ -102,12 +128,13 @@ gerror_t async_cmd_userinit(std::vector<std::string> args, server_t* server)
 	{
 		std::string ipclient   = args[1];
 		std::string portclient = args[2];
-		cout << "[Command] Initializing connection with identity '" << globalsession.user->m_name->buf << "' to client '" << ipclient
+		std::string to         = args.size() > 4 ? args[4] : std::string();
+		cout << "[Command] Initializing connection with identity '" << user->m_name->buf << "' to client '" << ipclient
 			 << ":" << portclient << "'." << endl;
 				
-		if(server_init_user_connection(server, ipclient.c_str(), atoi(portclient.c_str())) == GERROR_NONE)
+		if(server_init_user_connection(server, ipclient.c_str(), atoi(portclient.c_str()), user, to.c_str()) == GERROR_NONE)
 		{
-			cout << "[Command] User connected to '" << globalsession.user->m_name->buf << "'." << endl;
+			cout << "[Command] User connected to '" << user->m_name->buf << "'." << endl;
 		}
 		else
 		{
@@ -131,6 +158,18 @@ gerror_t async_cmd_info(std::vector<std::string> args, server_t* server)
 		{
 			cout << "[Command] Server currently running at port : " << server->port << "."      << endl;
 			cout << "[Command] Number of connected clients : " << server->clients.size() << "." << endl;
+			cout << "[Command] File I/O backend : " << (server->args.iouring && gio_uring_available() ? "io_uring" : "read/write") << "." << endl;
+			
+			// Handshakes initiated by this server.
+			const handshake_stats_t* stats[2] = { &server->hs_established, &server->hs_logged };
+			const char*              names[2] = { "Connection established", "User logged" };
+			for(unsigned int i = 0; i < 2; ++i)
+			{
+				if(stats[i]->count == 0)
+					continue;
+				cout << "[Command] " << names[i] << " in (us) : avg " << stats[i]->total / stats[i]->count
+				     << ", min " << stats[i]->min << ", max " << stats[i]->max << " (" << stats[i]->count << " handshakes)." << endl;
+			}
 			return GERROR_NONE;
 		}
 		
@@ -142,7 +181,13 @@ gerror_t async_cmd_info(std::vector<std::string> args, server_t* server)
 				cout << "[Command] Client " << info->name << " currently connected."                                                     << endl;
 				cout << "[Command] Client adress : " << inet_ntoa(info->address.sin_addr) << ":" << ntohs(info->address.sin_port) << "." << endl;
 				if(info->mirror != NULL)
-				cout << "[Command] Client mirror : " << inet_ntoa(info->mirror->address.sin_addr) << ":" << ntohs(info->mirror->address.sin_port) << "." << endl;
+				{
+					cout << "[Command] Client mirror : " << inet_ntoa(info->mirror->address.sin_addr) << ":" << ntohs(info->mirror->address.sin_port) << "." << endl;
+				}
+				if(info->trusted)
+				{
+					cout << "[Command] Client is a trusted local server (local socket)." << endl;
+				}
 
 				return GERROR_NONE;
 			}
@@ -177,6 +222,10 @@ gerror_t async_cmd_openclient(std::vector<std::string> args, server_t* server)
 		server_init_client_connection(server, new_client, adress.c_str(), port);
 		if(!new_client)
 			cout << "[Command] Can't initialize new client connection (adress='" << adress << "', port=" << port << ")." << endl;
+		
+		// The supervisor will keep this client connected (or retry it if we failed).
+		if(server->args.supervise)
+			server_supervise(server, adress, (uint16_t) port);
 	}
 
 	else
@@ -214,7 +263,28 @@ gerror_t async_cmd_sendfile(std::vector<std::string> args, server_t* server)
 		client_t* to = server_find_client_by_name(server, args[1]);
 		if(to != NULL && to->mirror != NULL)
 		{
-			client_send_file(to->mirror, args[2].c_str());
+			client_send_file(to, args[2].c_str());
+		}
+		else
+		{
+			// The file is sent when the client connects again. Only its path is
+			// spooled, so it must still be there.
+			char path[PATH_MAX];
+			if(!realpath(args[2].c_str(), path))
+			{
+				cout << "[Command] Can't find file '" << args[2] << "'." << endl;
+				return GERROR_BADARGS;
+			}
+
+			gerror_t err = server_spool(server, args[1], SPOOL_FILE, path, strlen(path) + 1);
+			if(err == GERROR_NONE)
+			{
+				cout << "[Command] '" << args[1] << "' is not connected, file spooled." << endl;
+			}
+			else
+			{
+				cout << "[Command] '" << args[1] << "' is not connected : " << gerror_to_string(err) << endl;
+			}
 		}
 	}
 
@@ -282,4 +352,205 @@ gerror_t async_cmd_version(std::vector<std::string> args, server_t* server)
     return GERROR_NONE;
 }
 
+/** @brief Display or modify the peers kept connected by the supervisor.
+ *
+ *  @note
+ *  Command : peers [add|remove] [ip] [port]
+**/
+gerror_t async_cmd_peers(std::vector<std::string> args, server_t* server)
+{
+    if(args.size() == 1)
+    {
+        std::vector<supervised_peer_t> peers = server_supervised_peers(server);
+        long now = timer_monotonic_ms();
+        
+        cout << "[Command] Supervised peers : " << peers.size() << (server->args.supervise ? "." : " (supervisor disabled).") << endl;
+        for(unsigned int i = 0; i < peers.size(); ++i)
+        {
+            cout << "[Command]   " << peers[i].ip << ":" << peers[i].port << " : " << peerstate_to_string(peers[i].state)
+                 << " (failures=" << peers[i].failures << ", attempts=" << peers[i].attempts << ecout;
+            if(peers[i].state == PS_BACKOFF || peers[i].state == PS_CIRCUITOPEN)
+            {
+                cout << ", next in " << (peers[i].nextattempt > now ? peers[i].nextattempt - now : 0) << " ms" << ecout;
+            }
+            cout << ")." << endl;
+        }
+        
+        return GERROR_NONE;
+    }
+    
+    else if(args.size() > 3 && (args[1] == "add" || args[1] == "remove"))
+    {
+        int      port = atoi(args[3].c_str());
+        gerror_t err  = args[1] == "add" ? server_supervise(server, args[2], (uint16_t) port)
+                                         : server_unsupervise(server, args[2], (uint16_t) port);
+        if(err != GERROR_NONE)
+        {
+            cout << "[Command] Can't " << args[1] << " peer '" << args[2] << ":" << port << "' (" << gerror_to_string(err) << ")." << endl;
+        }
+        
+        return err;
+    }
+    
+    cout << "[Command]<help> peers [add|remove] [IP adress] [port]"                     << endl;
+    cout << "[Command]<help> Without argues, displays the peers kept connected by the" << endl;
+    cout << "[Command]<help> supervisor, with their state. Otherwise, adds or removes" << endl;
+    cout << "[Command]<help> a peer from the supervisor."                               << endl;
+    return GERROR_NONE;
+}
+
+/** @brief Displays the logged users, and the clients every user is logged with.
+ *
+ *  @note
+ *  Command : users
+**/
+gerror_t async_cmd_users(std::vector<std::string>, server_t* server)
+{
+    std::vector<user_t*> users = server->session.users;
+    cout << "[Command] Logged users : " << users.size() << "." << endl;
+    
+    for(unsigned int i = 0; i < users.size(); ++i)
+    {
+        std::vector<client_t*> peers = server_user_peers(server, users[i]);
+        cout << "[Command]   " << users[i]->m_name->buf << (users[i] == server->session.user ? " (default)" : "")
+             << " : " << peers.size() << " connected user(s)." << endl;
+        
+        for(unsigned int j = 0; j < peers.size(); ++j) {
+            cout << "[Command]     " << peers[j]->logged_user->m_name->buf << " on '" << peers[j]->name << "'." << endl;
+        }
+    }
+    
+    return GERROR_NONE;
+}
+
+/** @brief Subscribes to a channel, or displays the subscribed channels.
+ *
+ *  @note
+ *  Command : subscribe [channel]
+**/
+gerror_t async_cmd_subscribe(std::vector<std::string> args, server_t* server)
+{
+    if(args.size() == 1)
+    {
+        gthread_mutex_lock(&server->mutex);
+        std::vector<std::string> channels = server->channels;
+        gthread_mutex_unlock(&server->mutex);
+        
+        cout << "[Command] Subscribed channels : " << channels.size() << "." << endl;
+        for(unsigned int i = 0; i < channels.size(); ++i) {
+            cout << "[Command]   " << channels[i] << endl;
+        }
+        
+        return GERROR_NONE;
+    }
+    
+    gerror_t err = server_subscribe(server, args[1]);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Command] Can't subscribe to channel '" << args[1] << "' (" << gerror_to_string(err) << ")." << endl;
+    }
+    return err;
+}
+
+/** @brief Unsubscribes from a channel.
+ *
+ *  @note
+ *  Command : unsubscribe [channel]
+**/
+gerror_t async_cmd_unsubscribe(std::vector<std::string> args, server_t* server)
+{
+    if(args.size() < 2)
+    {
+        cout << "[Command]<help> unsubscribe [channel]"                      << endl;
+        cout << "[Command]<help> Stops receiving the messages of a channel." << endl;
+        return GERROR_NONE;
+    }
+    
+    gerror_t err = server_unsubscribe(server, args[1]);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Command] Can't unsubscribe from channel '" << args[1] << "' (" << gerror_to_string(err) << ")." << endl;
+    }
+    return err;
+}
+
+/** @brief Publishes a message to the clients subscribed to a channel.
+ *
+ *  @note
+ *  Command : publish [channel] [message]
+**/
+gerror_t async_cmd_publish(std::vector<std::string> args, server_t* server)
+{
+    if(args.size() < 3)
+    {
+        cout << "[Command]<help> publish [channel] [message]"                           << endl;
+        cout << "[Command]<help> Sends a message to the clients subscribed to a channel." << endl;
+        return GERROR_NONE;
+    }
+    
+    std::string message = args[2];
+    for(unsigned int i = 3; i < args.size(); ++i)
+        message += " " + args[i];
+    
+    broadcast_t* broadcast = nullptr;
+    gerror_t     err       = server_publish(server, args[1], message, broadcast);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Command] Can't publish on channel '" << args[1] << "' (" << gerror_to_string(err) << ")." << endl;
+        return err;
+    }
+    
+    err = broadcast_wait(broadcast, BROADCAST_TIMEOUT);
+    cout << "[Command] Message published to " << broadcast->peers.size() << " subscriber(s)"
+         << (err == GERROR_NONE ? "." : " (some did not receive it).") << endl;
+    broadcast_destroy(broadcast);
+    return err;
+}
+
+/** @brief Sends a message to a server, through the servers connected to
+ *  it if we are not. Without arguments, displays the known routes.
+ *
+ *  @note
+ *  Command : relay [server name] [message]
+**/
+gerror_t async_cmd_relay(std::vector<std::string> args, server_t* server)
+{
+    if(args.size() == 1)
+    {
+        std::map<std::string, route_t> routes = server_routes(server);
+        long now = timer_monotonic_ms();
+        
+        cout << "[Command] Known routes : " << routes.size() << "." << endl;
+        for(std::map<std::string, route_t>::const_iterator it = routes.begin(); it != routes.end(); ++it) {
+            cout << "[Command]   " << it->first << " : " << (uint32_t) it->second.hops << " hops through connection " << it->second.via
+                 << (it->second.expires > now ? "." : " (expired).") << endl;
+        }
+        
+        return GERROR_NONE;
+    }
+    
+    if(args.size() < 3)
+    {
+        cout << "[Command]<help> relay [server name] [message]"                                 << endl;
+        cout << "[Command]<help> Sends a message to a server, relayed by other servers if needed." << endl;
+        return GERROR_NONE;
+    }
+    
+    std::string message = args[2];
+    for(unsigned int i = 3; i < args.size(); ++i)
+        message += " " + args[i];
+    
+    // The receiver reads a whole ClientMessagePacket.
+    char buffer[SERVER_MAXBUFSIZE];
+    memset(buffer, 0, SERVER_MAXBUFSIZE);
+    memcpy(buffer, message.c_str(), std::min<size_t>(message.size(), SERVER_MAXBUFSIZE - 1));
+    
+    gerror_t err = server_relay_send(server, args[1], PT_CLIENT_MESSAGE, buffer, SERVER_MAXBUFSIZE);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Command] Can't send message to '" << args[1] << "' (" << gerror_to_string(err) << ")." << endl;
+    }
+    return err;
+}
+
 GEND_DECL
@@ -0,0 +1,897 @@
+/*
+ File        : broadcast.cpp
+ Description : Sends one packet to every connected server at once.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "broadcast.h"
+#include "transport.h"
+#include <algorithm>
+
+GBEGIN_DECL
+
+// Protects the pending broadcasts of every server, and their peers.
+static pthread_mutex_t broadcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+/** @brief Encodes a packet once, so it can be written as is to
+ *  every connection.
+ *
+ *  @param flags : PacketFlags of the packet. With PF_NOACK, the
+ *  receivers do not answer.
+ *
+ *  @return
+ *  - nullptr if packet_type is PT_UNKNOWN.
+ *  - A frame with one reference, to give to broadcast_frame_release().
+**/
+////////////////////////////////////////////////////////////
+broadcast_frame_t* broadcast_frame_create(uint8_t packet_type, uint8_t flags, const void* data, size_t sz)
+{
+    return broadcast_frame_create_file(packet_type, flags, data, sz, -1, 0, 0);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Encodes a packet whose data is followed by filesize bytes
+ *  of a file, from offset. The file is written to every connection
+ *  with transport_sendfile() : it must stay opened until the frame
+ *  is released.
+ *
+ *  @param fd : The file, or -1 to encode a packet as
+ *  broadcast_frame_create().
+**/
+////////////////////////////////////////////////////////////
+broadcast_frame_t* broadcast_frame_create_file(uint8_t packet_type, uint8_t flags, const void* data, size_t sz,
+                                               int fd, off_t offset, size_t filesize)
+{
+    if(packet_type == PT_UNKNOWN)
+        return nullptr;
+
+    if(fd < 0)
+        filesize = 0;
+
+    size_t           datasz = (data && sz > 0) ? sz : 0;
+    PacketTypePacket ptp(packet_type, flags, (uint32_t) (datasz + filesize));
+    size_t           hsz = ptp.getPacketSize();
+
+    broadcast_frame_t* frame = new broadcast_frame_t;
+    frame->size     = hsz + datasz;
+    frame->data     = (data_t*) malloc(frame->size);
+    frame->refs     = 1;
+    frame->fd       = fd;
+    frame->offset   = offset;
+    frame->filesize = filesize;
+
+    memcpy(frame->data, &ptp, hsz);
+    if(datasz > 0)
+        memcpy(frame->data + hsz, data, sz);
+
+    return frame;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Adds a reference to given frame.
+**/
+////////////////////////////////////////////////////////////
+broadcast_frame_t* broadcast_frame_retain(broadcast_frame_t* frame)
+{
+    if(frame)
+        __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Removes a reference to given frame, and destroys it
+ *  if it was the last one.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_frame_release(broadcast_frame_t* frame)
+{
+    if(frame && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(frame->data);
+        delete frame;
+    }
+}
+
+/** @brief Records the end of the delivery to given peer.
+ *  broadcast_mutex must be locked.
+**/
+static void broadcast_peer_done_(broadcast_t* broadcast, broadcast_peer_t& peer, gerror_t status)
+{
+    if(!peer.pending)
+        return;
+
+    peer.pending = false;
+    peer.status  = status;
+    peer.delay   = timer_monotonic_us() - broadcast->start;
+
+    if(--broadcast->pending == 0)
+        pthread_cond_broadcast(&broadcast->cond);
+}
+
+/** @brief Gives up the answer of a peer which has not answered : it will
+ *  be dropped when it comes, so it is not given to the next broadcast.
+ *  broadcast_mutex must be locked.
+**/
+static void broadcast_peer_late_(broadcast_t* broadcast, broadcast_peer_t& peer)
+{
+    if(!peer.pending)
+        return;
+
+    // The answer keeps its place in the answers owed by the connection.
+    std::map<uint32_t, std::list<broadcast_t*> >::iterator it = broadcast->server->_broadcastanswers.find(peer.id);
+    if(it != broadcast->server->_broadcastanswers.end())
+        std::replace(it->second.begin(), it->second.end(), broadcast, (broadcast_t*) nullptr);
+
+    broadcast_peer_done_(broadcast, peer, GERROR_TIMEDOUT);
+}
+
+/** @brief Writes the frame to the peers of a broadcast until every
+ *  peer has been taken by a sending thread.
+**/
+static void* broadcast_sender_(void* data)
+{
+    broadcast_t* broadcast = (broadcast_t*) data;
+
+    while(1)
+    {
+        gthread_mutex_lock(&broadcast_mutex);
+        uint32_t i = broadcast->next++;
+        gthread_mutex_unlock(&broadcast_mutex);
+
+        if(i >= broadcast->peers.size())
+            break;
+
+        // The peers vector does not change once the broadcast is sent.
+        const broadcast_peer_t& peer = broadcast->peers[i];
+        transport_lock(peer.sock);
+
+        // The writes of a connection are ordered by its lock, so its answers come
+        // back in the order they are expected here. The answer is expected before
+        // the frame is written, as it may come before the write returns.
+        gthread_mutex_lock(&broadcast_mutex);
+        if(peer.pending)
+            broadcast->server->_broadcastanswers[peer.id].push_back(broadcast);
+        gthread_mutex_unlock(&broadcast_mutex);
+
+        bool sent = transport_send(peer.sock, peer.frame->data, peer.frame->size) >= 0 &&
+                    (peer.frame->filesize == 0 || transport_sendfile(peer.sock, peer.frame->fd, peer.frame->offset, peer.frame->filesize) >= 0);
+        transport_unlock(peer.sock);
+
+        if(!sent)
+        {
+            // A peer which does not answer only gets its status.
+            gthread_mutex_lock(&broadcast_mutex);
+            if(peer.pending)
+            {
+                std::map<uint32_t, std::list<broadcast_t*> >::iterator it = broadcast->server->_broadcastanswers.find(peer.id);
+                if(it != broadcast->server->_broadcastanswers.end())
+                    it->second.remove(broadcast);
+                broadcast_peer_done_(broadcast, broadcast->peers[i], GERROR_CANT_SEND_PACKET);
+            }
+            else
+            {
+                broadcast->peers[i].status = GERROR_CANT_SEND_PACKET;
+            }
+            gthread_mutex_unlock(&broadcast_mutex);
+        }
+    }
+
+    return nullptr;
+}
+
+/** @brief Allocates an empty broadcast.
+**/
+static broadcast_t* broadcast_create_(server_t* server)
+{
+    broadcast_t* broadcast = new broadcast_t;
+    broadcast->server  = server;
+    broadcast->next    = 0;
+    broadcast->pending = 0;
+    broadcast->start   = timer_monotonic_us();
+    broadcast->sent    = broadcast->start;
+    pthread_cond_init(&broadcast->cond, nullptr);
+    return broadcast;
+}
+
+/** @brief Adds a peer to given broadcast. The peer takes a reference
+ *  to frame.
+**/
+static void broadcast_add_peer_(broadcast_t* broadcast, const client_t& client, broadcast_frame_t* frame, bool answered)
+{
+    broadcast_peer_t peer;
+    peer.id      = client.mirror->id;
+    peer.name    = client.name;
+    peer.sock    = client.mirror->sock;
+    peer.frame   = broadcast_frame_retain(frame);
+    peer.pending = answered;
+    peer.status  = GERROR_NONE;
+    peer.delay   = 0;
+
+    broadcast->byid[peer.id] = broadcast->peers.size();
+    broadcast->peers.push_back(peer);
+}
+
+/** @brief Writes the frames of given broadcast to its peers.
+ *
+ *  Broadcasts are written at the same time by several threads : only
+ *  the writes to one connection are ordered, by transport_lock().
+ *
+ *  @param answered : True if the peers answer. Each connection then
+ *  expects the answer when its frame is written, so the client
+ *  threads can give it to the broadcast.
+**/
+static void broadcast_start_(broadcast_t* broadcast, bool answered)
+{
+    if(answered)
+    {
+        gthread_mutex_lock(&broadcast_mutex);
+        broadcast->pending = (uint32_t) broadcast->peers.size();
+        gthread_mutex_unlock(&broadcast_mutex);
+    }
+
+    size_t    nsenders = std::min<size_t>(BROADCAST_SENDERS, broadcast->peers.size());
+    pthread_t senders[BROADCAST_SENDERS];
+    size_t    started  = 0;
+
+    for(; started + 1 < nsenders; ++started)
+    {
+        if(pthread_create(&senders[started], nullptr, broadcast_sender_, broadcast) != 0)
+            break;
+    }
+
+    // This thread is a sender too.
+    broadcast_sender_(broadcast);
+
+    for(size_t i = 0; i < started; ++i)
+        pthread_join(senders[i], nullptr);
+
+    broadcast->sent = timer_monotonic_us();
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a packet to every established client of given
+ *  server.
+ *
+ *  The packet is encoded once, and written to the connections by
+ *  up to BROADCAST_SENDERS threads. Then this function returns :
+ *  the answers are collected by the client threads, and
+ *  broadcast_wait() waits for them. A broadcast so takes about one
+ *  round trip, whatever the number of peers.
+ *
+ *  @note
+ *  The packet is sent uncrypted, as every peer would need its own
+ *  encryption.
+ *
+ *  @param server : Server sending the broadcast.
+ *  @param packet_type : Type of the packet to send.
+ *  @param data : Data of the packet. It must be the whole packet
+ *  size, as for send_client_packet().
+ *  @param sz : Size of the data.
+ *  @param ret : Set to the new broadcast, to give to broadcast_destroy().
+ *  @param filter : If not null, only the clients it accepts receive
+ *  the packet. It is called with the server mutex locked.
+ *  @param filterdata : Given to filter.
+ *
+ *  @return
+ *  - GERROR_NONE on success, even if some peers could not be
+ *  written to (see their status).
+ *  - GERROR_BADARGS if server is null or packet_type is invalid.
+**/
+////////////////////////////////////////////////////////////
+gerror_t broadcast_send(server_t* server, uint8_t packet_type, const void* data, size_t sz, broadcast_t*& ret,
+                        broadcast_filter_t filter, void* filterdata)
+{
+    return broadcast_send_file(server, packet_type, data, sz, -1, 0, 0, ret, filter, filterdata);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a packet whose data is followed by filesize
+ *  bytes of a file, from offset, as broadcast_send(). The file
+ *  does not go through user space (see broadcast_frame_create_file()).
+**/
+////////////////////////////////////////////////////////////
+gerror_t broadcast_send_file(server_t* server, uint8_t packet_type, const void* data, size_t sz,
+                             int fd, off_t offset, size_t filesize, broadcast_t*& ret,
+                             broadcast_filter_t filter, void* filterdata)
+{
+    ret = nullptr;
+    if(!server || packet_type == PT_UNKNOWN)
+        return GERROR_BADARGS;
+
+    broadcast_t*       broadcast = broadcast_create_(server);
+    broadcast_frame_t* frame     = broadcast_frame_create_file(packet_type, PF_NONE, data, sz, fd, offset, filesize);
+
+    // Answers come back through client->sock and are read by the client thread,
+    // which finds the broadcast with the ID of the mirror.
+    gthread_mutex_lock(&server->mutex);
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(client.established && client.mirror && (!filter || filter(client, filterdata)))
+            broadcast_add_peer_(broadcast, client, frame, true);
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    broadcast_frame_release(frame);
+    broadcast_start_(broadcast, true);
+
+#ifdef GULTRA_DEBUG
+    cout << "[Broadcast] Sent packet type " << (uint32_t) packet_type << " to " << broadcast->peers.size() << " peers in " << (timer_monotonic_us() - broadcast->start) << " us." << endl;
+#endif // GULTRA_DEBUG
+
+    ret = broadcast;
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Filter keeping only the client whose connection ID
+ *  (client->mirror->id) is given in data.
+**/
+////////////////////////////////////////////////////////////
+bool broadcast_filter_id(const client_t& client, void* data)
+{
+    return client.mirror->id == *(uint32_t*) data;
+}
+
+/** @brief Keeps the client whose name is the std::string given as data.
+**/
+static bool broadcast_filter_name_(const client_t& client, void* data)
+{
+    return client.name == *(const std::string*) data;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a packet which is not answered to the
+ *  established clients accepted by filter.
+ *
+ *  This is used to forward packets flooded or routed by other
+ *  servers : the packet is written once every client got it.
+ *
+ *  @return
+ *  - GERROR_NONE if the packet was written to every accepted
+ *  client.
+ *  - GERROR_BADARGS if server is null or packet_type is invalid.
+ *  - GERROR_CANT_SEND_PACKET if no client was accepted, or one
+ *  could not be written to.
+**/
+////////////////////////////////////////////////////////////
+gerror_t broadcast_forward(server_t* server, uint8_t packet_type, const void* data, size_t sz,
+                           broadcast_filter_t filter, void* filterdata)
+{
+    if(!server || packet_type == PT_UNKNOWN)
+        return GERROR_BADARGS;
+
+    broadcast_t*       broadcast = broadcast_create_(server);
+    broadcast_frame_t* frame     = broadcast_frame_create(packet_type, PF_NOACK, data, sz);
+
+    gthread_mutex_lock(&server->mutex);
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(client.established && client.mirror && (!filter || filter(client, filterdata)))
+            broadcast_add_peer_(broadcast, client, frame, false);
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    broadcast_frame_release(frame);
+    broadcast_start_(broadcast, false);
+
+    gerror_t err = broadcast->peers.empty() ? GERROR_CANT_SEND_PACKET : GERROR_NONE;
+    for(unsigned int i = 0; i < broadcast->peers.size(); ++i)
+    {
+        if(broadcast->peers[i].status != GERROR_NONE)
+            err = GERROR_CANT_SEND_PACKET;
+    }
+
+    broadcast_destroy(broadcast);
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Waits for every peer of given broadcast to answer.
+ *
+ *  @param timeout : Maximum time (ms) since every frame was
+ *  written. It does not count the writes, which may wait for the
+ *  other frames of a connection and take long for big files. Peers
+ *  which have not answered then are given the GERROR_TIMEDOUT
+ *  status, and their answers are ignored.
+ *
+ *  @return
+ *  - GERROR_NONE if every peer received the packet.
+ *  - GERROR_BADARGS if broadcast is null.
+ *  - GERROR_TIMEDOUT if a peer did not answer in time.
+ *  - GERROR_ANSWER_BAD if a peer did not deliver the packet.
+**/
+////////////////////////////////////////////////////////////
+gerror_t broadcast_wait(broadcast_t* broadcast, uint32_t timeout)
+{
+    if(!broadcast)
+        return GERROR_BADARGS;
+
+    long deadline = broadcast->sent + (long) timeout * 1000;
+
+    gthread_mutex_lock(&broadcast_mutex);
+    while(broadcast->pending > 0)
+    {
+        long left = deadline - timer_monotonic_us();
+        if(left <= 0)
+            break;
+
+        struct timeval  now;
+        struct timespec ts;
+        gettimeofday(&now, NULL);
+        long usec = now.tv_usec + left % 1000000;
+        ts.tv_sec  = now.tv_sec + left / 1000000 + usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+
+        pthread_cond_timedwait(&broadcast->cond, &broadcast_mutex, &ts);
+    }
+
+    gerror_t ret = GERROR_NONE;
+    for(unsigned int i = 0; i < broadcast->peers.size(); ++i)
+    {
+        broadcast_peer_late_(broadcast, broadcast->peers[i]);
+
+        if(broadcast->peers[i].status == GERROR_TIMEDOUT)
+            ret = GERROR_TIMEDOUT;
+        else if(broadcast->peers[i].status != GERROR_NONE && ret == GERROR_NONE)
+            ret = GERROR_ANSWER_BAD;
+    }
+    gthread_mutex_unlock(&broadcast_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Stops waiting for the answers of given broadcast and
+ *  destroys it.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_destroy(broadcast_t* broadcast)
+{
+    if(!broadcast)
+        return;
+
+    gthread_mutex_lock(&broadcast_mutex);
+    for(unsigned int i = 0; i < broadcast->peers.size(); ++i)
+        broadcast_peer_late_(broadcast, broadcast->peers[i]);
+    gthread_mutex_unlock(&broadcast_mutex);
+
+    for(unsigned int i = 0; i < broadcast->peers.size(); ++i)
+        broadcast_frame_release(broadcast->peers[i].frame);
+    pthread_cond_destroy(&broadcast->cond);
+    delete broadcast;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Gives an answer read by a client thread to the oldest
+ *  broadcast written to the connection and not answered yet.
+ *
+ *  A connection answers in the order the broadcasts were written
+ *  to it, so the answers owed to broadcasts which timed out keep
+ *  their place : they are dropped instead of being given to a newer
+ *  broadcast. An answer no broadcast waits for is dropped too.
+ *
+ *  @param server : Server reading the answer.
+ *  @param id : ID of the connection (client->mirror->id).
+ *  @param ok : True for PT_RECEIVED_OK, false for PT_RECEIVED_BAD.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_acknowledge(server_t* server, uint32_t id, bool ok)
+{
+    if(!server)
+        return;
+
+    gthread_mutex_lock(&broadcast_mutex);
+
+    std::map<uint32_t, std::list<broadcast_t*> >::iterator answers = server->_broadcastanswers.find(id);
+    if(answers != server->_broadcastanswers.end() && !answers->second.empty())
+    {
+        broadcast_t* broadcast = answers->second.front();
+        answers->second.pop_front();
+        if(answers->second.empty())
+            server->_broadcastanswers.erase(answers);
+
+        // A null broadcast timed out : its answer is dropped.
+        if(broadcast)
+        {
+            std::map<uint32_t, size_t>::const_iterator it = broadcast->byid.find(id);
+            if(it != broadcast->byid.end())
+                broadcast_peer_done_(broadcast, broadcast->peers[it->second], ok ? GERROR_NONE : GERROR_ANSWER_BAD);
+        }
+    }
+    gthread_mutex_unlock(&broadcast_mutex);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Forgets the answers still to come from a closed
+ *  connection.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_forget(server_t* server, uint32_t id)
+{
+    if(!server)
+        return;
+
+    gthread_mutex_lock(&broadcast_mutex);
+    server->_broadcastanswers.erase(id);
+    gthread_mutex_unlock(&broadcast_mutex);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns true if a packet with given ID (multicast or
+ *  route request) has already been received, and remembers it
+ *  otherwise.
+**/
+////////////////////////////////////////////////////////////
+bool broadcast_seen(server_t* server, uint64_t id)
+{
+    gthread_mutex_lock(&broadcast_mutex);
+    std::vector<uint64_t>& seen = server->_multicastseen;
+
+    bool ret = std::find(seen.begin(), seen.end(), id) != seen.end();
+    if(!ret)
+    {
+        if(seen.size() >= MULTICAST_SEENMAX)
+            seen.erase(seen.begin());
+        seen.push_back(id);
+    }
+    gthread_mutex_unlock(&broadcast_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns a new ID for a packet flooded from this server.
+ *
+ *  The first 32 bits identify the origin, the others the packet.
+**/
+////////////////////////////////////////////////////////////
+uint64_t broadcast_new_id(server_t* server)
+{
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < server->name.size(); ++i)
+        hash = (hash ^ (uint8_t) server->name[i]) * 16777619u;
+
+    return ((uint64_t) hash << 32) | __atomic_fetch_add(&server->_multicastseq, 1, __ATOMIC_RELAXED);
+}
+
+/** @brief Subtrees this server gave to its children for one multicast, until
+ *  every child told which of their peers it reaches.
+**/
+struct multicast_repair_t
+{
+    multicast_t multicast;                                       // As sent by the origin or received.
+    std::map<std::string, std::vector<std::string> > subtrees;   // Peers of the subtree of every child, by child name.
+    std::map<std::string, std::vector<std::string> > reached;    // Peers every child reaches, from the pages received.
+};
+
+/** @brief Adds the children of this server in the multicast tree to given
+ *  broadcast.
+ *
+ *  The peers whose name is between multicast.lo and multicast.hi are sorted
+ *  by name and cut in fanout ranges. The first peer of every range is a child,
+ *  which forwards the message to the rest of its range. A child may not be
+ *  connected to every peer of its range : it tells which ones it reaches, and
+ *  broadcast_multicast_reached() sends the message to the others.
+ *
+ *  @param peers : Set to the names of the peers between lo and hi, sorted.
+ *  @param subtrees : Set to the peers of the range of every child, but the
+ *  child, by child name.
+**/
+static void broadcast_multicast_children_(broadcast_t* broadcast, const multicast_t& multicast, uint8_t flags,
+                                          std::vector<std::string>& peers,
+                                          std::map<std::string, std::vector<std::string> >& subtrees)
+{
+    server_t*   server = broadcast->server;
+    std::string lo(multicast.lo);
+    std::string hi(multicast.hi);
+
+    gthread_mutex_lock(&server->mutex);
+
+    std::vector< std::pair<std::string, const client_t*> > clients;
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(!client.established || !client.mirror)
+            continue;
+        if((!lo.empty() && client.name <= lo) || (!hi.empty() && client.name >= hi))
+            continue;
+
+        clients.push_back(std::make_pair(client.name, &client));
+    }
+
+    std::sort(clients.begin(), clients.end());
+
+    size_t count  = clients.size();
+    size_t fanout = std::min<size_t>(multicast.fanout, count);
+
+    for(size_t i = 0; i < count; ++i)
+        peers.push_back(clients[i].first);
+
+    for(size_t g = 0; g < fanout; ++g)
+    {
+        size_t first = g * count / fanout;
+        size_t next  = (g + 1) * count / fanout;
+
+        multicast_t child = multicast;
+        child.hops++;
+        memset(child.lo, 0, SERVER_MAXBUFSIZE);
+        memset(child.hi, 0, SERVER_MAXBUFSIZE);
+        strncpy(child.lo, clients[first].first.c_str(), SERVER_MAXBUFSIZE - 1);
+        strncpy(child.hi, next < count ? clients[next].first.c_str() : multicast.hi, SERVER_MAXBUFSIZE - 1);
+
+        if(next > first + 1)
+            subtrees[clients[first].first].assign(peers.begin() + first + 1, peers.begin() + next);
+
+        multicast_t        serialized = serialize<multicast_t>(child);
+        broadcast_frame_t* frame      = broadcast_frame_create(PT_BROADCAST, flags, &serialized, sizeof(multicast_t));
+        broadcast_add_peer_(broadcast, *clients[first].second, frame, !(flags & PF_NOACK));
+        broadcast_frame_release(frame);
+    }
+
+    gthread_mutex_unlock(&server->mutex);
+}
+
+/** @brief Remembers the subtrees given to the children of this server, until
+ *  they tell which peers they reach. It must be called before the children
+ *  are sent the message, as they may answer before broadcast_start_() returns.
+**/
+static void broadcast_multicast_remember_(server_t* server, const multicast_t& multicast,
+                                          std::map<std::string, std::vector<std::string> >& subtrees)
+{
+    if(subtrees.empty())
+        return;
+
+    multicast_repair_t* repair = new multicast_repair_t;
+    repair->multicast = multicast;
+    repair->subtrees.swap(subtrees);
+
+    gthread_mutex_lock(&broadcast_mutex);
+    std::list<multicast_repair_t*>& repairs = server->_multicastrepairs;
+
+    // A child which never answers (closed, or too old) leaves its subtree here until
+    // newer multicasts push it out.
+    if(repairs.size() >= MULTICAST_REPAIRMAX)
+    {
+        delete repairs.front();
+        repairs.pop_front();
+    }
+    repairs.push_back(repair);
+    gthread_mutex_unlock(&broadcast_mutex);
+}
+
+/** @brief Sends to the parent of this server in the multicast tree the peers it
+ *  reached, in pages of names.
+**/
+static void broadcast_multicast_answer_(server_t* server, client_t* client, const multicast_t& multicast,
+                                        const std::vector<std::string>& peers)
+{
+    uint32_t id = client->mirror->id;
+
+    multicast_reached_t page;
+    memset(&page, 0, sizeof(multicast_reached_t));
+    page.id = multicast.id;
+
+    size_t used = 0;
+    for(size_t i = 0; i <= peers.size(); ++i)
+    {
+        bool last = i == peers.size();
+        if(last || used + peers[i].size() + 1 > SERVER_MAXBUFSIZE)
+        {
+            page.last = last ? 1 : 0;
+
+            multicast_reached_t serialized = serialize<multicast_reached_t>(page);
+            broadcast_forward(server, PT_MULTICAST_REACHED, &serialized, sizeof(multicast_reached_t), broadcast_filter_id, &id);
+
+            memset(page.names, 0, SERVER_MAXBUFSIZE);
+            used = 0;
+        }
+
+        if(!last)
+        {
+            memcpy(page.names + used, peers[i].c_str(), peers[i].size());
+            used += peers[i].size() + 1;
+        }
+    }
+}
+
+/** @brief Returns false for a leaf sent by broadcast_multicast_reached(),
+ *  whose bounds are both the name of the leaf.
+**/
+static bool broadcast_multicast_inside_(const multicast_t& multicast)
+{
+    return multicast.hi[0] == '\0' || strcmp(multicast.lo, multicast.hi) < 0;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Destroys the subtrees remembered for the children of
+ *  given server. It is called by server_destroy().
+**/
+////////////////////////////////////////////////////////////
+void broadcast_multicast_clear(server_t* server)
+{
+    gthread_mutex_lock(&broadcast_mutex);
+    for(std::list<multicast_repair_t*>::iterator it = server->_multicastrepairs.begin(); it != server->_multicastrepairs.end(); ++it)
+        delete *it;
+    server->_multicastrepairs.clear();
+    gthread_mutex_unlock(&broadcast_mutex);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a message down the multicast tree.
+ *
+ *  This server only sends the message to its children, at most
+ *  fanout of them, which forward it to their own children. The
+ *  upload of every server is so O(fanout) instead of O(peers).
+ *
+ *  @note
+ *  Only the children answer this server : broadcast_wait() tells
+ *  if every subtree received the message, not every server of it.
+ *  Peers a child does not reach are sent the message later, by
+ *  broadcast_multicast_reached().
+ *
+ *  @param server : Server sending the message.
+ *  @param message : Message to send.
+ *  @param fanout : Maximum number of children of every server.
+ *  @param ret : Set to the new broadcast, to give to broadcast_destroy().
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_BADARGS if server or message is null, or fanout is 0.
+**/
+////////////////////////////////////////////////////////////
+gerror_t broadcast_multicast(server_t* server, const char* message, uint32_t fanout, broadcast_t*& ret)
+{
+    ret = nullptr;
+    if(!server || !message || fanout == 0)
+        return GERROR_BADARGS;
+
+    multicast_t multicast;
+    memset(&multicast, 0, sizeof(multicast_t));
+    multicast.id     = broadcast_new_id(server);
+    multicast.fanout = (uint8_t) std::min<uint32_t>(fanout, 255);
+    multicast.hops   = 0;
+    strncpy(multicast.origin,  server->name.c_str(), SERVER_MAXBUFSIZE - 1);
+    strncpy(multicast.message, message,              SERVER_MAXBUFSIZE - 1);
+
+    // A copy coming back to us is ignored.
+    broadcast_seen(server, multicast.id);
+
+    std::vector<std::string>                          peers;
+    std::map<std::string, std::vector<std::string> > subtrees;
+
+    broadcast_t* broadcast = broadcast_create_(server);
+    broadcast_multicast_children_(broadcast, multicast, PF_NONE, peers, subtrees);
+    broadcast_multicast_remember_(server, multicast, subtrees);
+    broadcast_start_(broadcast, true);
+
+    ret = broadcast;
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Delivers a multicast received by a client thread, and
+ *  forwards it to the children of this server.
+ *
+ *  Children do not answer a forwarded message, so the client
+ *  thread does not wait for them. The parent is then told which
+ *  peers of our subtree we reach.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_relay(server_t* server, client_t* client, const multicast_t& multicast)
+{
+    if(!server || broadcast_seen(server, multicast.id))
+        return;
+
+    cout << "[Server]{" << multicast.origin << "} " << multicast.message << endl;
+
+#ifdef GULTRA_DEBUG
+    cout << "[Broadcast] Multicast from '" << multicast.origin << "' received from '" << client->name << "' after " << (uint32_t) multicast.hops << " hops." << endl;
+#endif // GULTRA_DEBUG
+
+    std::vector<std::string>                          peers;
+    std::map<std::string, std::vector<std::string> > subtrees;
+
+    broadcast_t* broadcast = broadcast_create_(server);
+    broadcast_multicast_children_(broadcast, multicast, PF_NOACK, peers, subtrees);
+    broadcast_multicast_remember_(server, multicast, subtrees);
+    broadcast_start_(broadcast, false);
+    broadcast_destroy(broadcast);
+
+    // A leaf sent the message by broadcast_multicast_reached() has no subtree.
+    if(broadcast_multicast_inside_(multicast))
+        broadcast_multicast_answer_(server, client, multicast, peers);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a page of the peers a child reaches in its
+ *  subtree. After the last one, the peers of the subtree it does
+ *  not reach are sent the message by this server, as leaves.
+**/
+////////////////////////////////////////////////////////////
+void broadcast_multicast_reached(server_t* server, client_t* client, const multicast_reached_t& reached)
+{
+    if(!server || !client)
+        return;
+
+    multicast_t              multicast;
+    std::vector<std::string> missing;
+
+    gthread_mutex_lock(&broadcast_mutex);
+    std::list<multicast_repair_t*>& repairs = server->_multicastrepairs;
+
+    std::list<multicast_repair_t*>::iterator it = repairs.begin();
+    while(it != repairs.end() && (*it)->multicast.id != reached.id)
+        ++it;
+
+    if(it == repairs.end() || (*it)->subtrees.find(client->name) == (*it)->subtrees.end())
+    {
+        gthread_mutex_unlock(&broadcast_mutex);
+        return;
+    }
+
+    multicast_repair_t*       repair  = *it;
+    std::vector<std::string>& subtree = repair->subtrees[client->name];
+    std::vector<std::string>& names   = repair->reached[client->name];
+
+    for(const char* name = reached.names; *name != '\0' && name < reached.names + SERVER_MAXBUFSIZE; name += strlen(name) + 1)
+        names.push_back(name);
+
+    if(reached.last)
+    {
+        std::sort(names.begin(), names.end());
+        std::set_difference(subtree.begin(), subtree.end(), names.begin(), names.end(), std::back_inserter(missing));
+
+        multicast = repair->multicast;
+        repair->subtrees.erase(client->name);
+        repair->reached.erase(client->name);
+
+        if(repair->subtrees.empty())
+        {
+            delete repair;
+            repairs.erase(it);
+        }
+    }
+    gthread_mutex_unlock(&broadcast_mutex);
+
+    if(missing.empty())
+        return;
+
+#ifdef GULTRA_DEBUG
+    cout << "[Broadcast] '" << client->name << "' does not reach " << missing.size() << " peers of its subtree. Sending them the multicast." << endl;
+#endif // GULTRA_DEBUG
+
+    for(size_t i = 0; i < missing.size(); ++i)
+    {
+        multicast_t leaf = multicast;
+        leaf.hops++;
+        memset(leaf.lo, 0, SERVER_MAXBUFSIZE);
+        memset(leaf.hi, 0, SERVER_MAXBUFSIZE);
+        strncpy(leaf.lo, missing[i].c_str(), SERVER_MAXBUFSIZE - 1);
+        strncpy(leaf.hi, missing[i].c_str(), SERVER_MAXBUFSIZE - 1);
+
+        multicast_t serialized = serialize<multicast_t>(leaf);
+        broadcast_forward(server, PT_BROADCAST, &serialized, sizeof(multicast_t), broadcast_filter_name_, (void*) &missing[i]);
+    }
+}
+
+GEND_DECL
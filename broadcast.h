@@ -0,0 +1,112 @@
+/*
+ File        : broadcast.h
+ Description : Sends one packet to every connected server at once.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BROADCAST__H
+#define __BROADCAST__H
+
+#include "prerequesites.h"
+#include "server.h"
+
+GBEGIN_DECL
+
+#define BROADCAST_SENDERS 8    // Maximum number of threads writing a broadcast to its peers.
+#define BROADCAST_TIMEOUT 5000 // Default time (ms) a broadcast waits for the answers of its peers.
+#define MULTICAST_SEENMAX 1024 // Number of multicast and route request IDs remembered by a server to suppress duplicates.
+#define MULTICAST_REPAIRMAX 64 // Number of multicasts whose children may still tell the peers they reach.
+
+/** @brief An encoded packet (PT_PACKETTYPE header and data), shared by
+ *  every connection it is sent to. It is destroyed by its last release.
+**/
+typedef struct broadcast_frame_t
+{
+    data_t*  data;
+    size_t   size;
+    uint32_t refs;
+    int      fd;       // File whose filesize bytes from offset follow data, or -1.
+    off_t    offset;
+    size_t   filesize;
+} broadcast_frame_t;
+
+/** @brief Delivery of a broadcast to one peer.
+**/
+typedef struct broadcast_peer_t
+{
+    uint32_t           id;      // ID of the connection, as in server->client_by_id.
+    std::string        name;
+    SOCKET             sock;    // Socket the frame is written to.
+    broadcast_frame_t* frame;   // Frame written to this peer. Peers of a broadcast share the same one.
+    bool               pending; // True while the peer has not answered.
+    gerror_t           status;  // GERROR_NONE if delivered, GERROR_ANSWER_BAD, GERROR_CANT_SEND_PACKET or GERROR_TIMEDOUT otherwise.
+    long               delay;   // Time (us) from the start of the broadcast to the answer.
+} broadcast_peer_t;
+
+/** @brief A broadcast sent by a server. The answers are read by the
+ *  client threads, which give them to broadcast_acknowledge().
+**/
+struct broadcast_t
+{
+    server_t*                     server;
+    std::vector<broadcast_peer_t> peers;
+    std::map<uint32_t, size_t>    byid;    // Index of the peers by connection ID.
+    uint32_t                      next;    // Next peer taken by a sending thread.
+    uint32_t                      pending; // Number of peers which have not answered.
+    pthread_cond_t                cond;    // Signaled when pending reaches 0.
+    long                          start;   // Monotonic time (us) the broadcast started.
+    long                          sent;    // Monotonic time (us) every frame was written.
+};
+
+/** @brief Returns true if a broadcast must be sent to given client.
+**/
+typedef bool (*broadcast_filter_t) (const client_t& client, void* data);
+
+bool broadcast_filter_id (const client_t& client, void* data);
+
+broadcast_frame_t* broadcast_frame_create  (uint8_t packet_type, uint8_t flags, const void* data, size_t sz);
+broadcast_frame_t* broadcast_frame_create_file (uint8_t packet_type, uint8_t flags, const void* data, size_t sz,
+                                                int fd, off_t offset, size_t filesize);
+broadcast_frame_t* broadcast_frame_retain  (broadcast_frame_t* frame);
+void               broadcast_frame_release (broadcast_frame_t* frame);
+
+gerror_t broadcast_send        (server_t* server, uint8_t packet_type, const void* data, size_t sz, broadcast_t*& ret,
+                                broadcast_filter_t filter = nullptr, void* filterdata = nullptr);
+gerror_t broadcast_send_file   (server_t* server, uint8_t packet_type, const void* data, size_t sz,
+                                int fd, off_t offset, size_t filesize, broadcast_t*& ret,
+                                broadcast_filter_t filter = nullptr, void* filterdata = nullptr);
+gerror_t broadcast_forward     (server_t* server, uint8_t packet_type, const void* data, size_t sz,
+                                broadcast_filter_t filter = nullptr, void* filterdata = nullptr);
+gerror_t broadcast_wait        (broadcast_t* broadcast, uint32_t timeout);
+void     broadcast_destroy     (broadcast_t* broadcast);
+void     broadcast_acknowledge (server_t* server, uint32_t id, bool ok);
+void     broadcast_forget      (server_t* server, uint32_t id);
+
+bool     broadcast_seen        (server_t* server, uint64_t id);
+uint64_t broadcast_new_id      (server_t* server);
+
+gerror_t broadcast_multicast   (server_t* server, const char* message, uint32_t fanout, broadcast_t*& ret);
+void     broadcast_relay       (server_t* server, client_t* client, const multicast_t& multicast);
+void     broadcast_multicast_reached (server_t* server, client_t* client, const multicast_reached_t& reached);
+void     broadcast_multicast_clear   (server_t* server);
+
+GEND_DECL
+
+#endif // __BROADCAST__H
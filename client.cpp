@@ -24,6 +24,8 @@
 #include "packet.h"
 #include "client.h"
 #include "server.h"
+#include "broadcast.h"
+#include "gio.h"
 
 GBEGIN_DECL
 
@@ -34,8 +36,8 @@ GBEGIN_DECL
  *  @param id : the id that will be used in the client structure. It must be given
  *  by the server (with a function like @ref server_generate_new_id() ) .
  *  @param mirror : A clientptr_t wich points to an already initialized mirror pointer.
- *  @param cserver : A pointer to the server creator. If null, the server specified will
- *  be the default global one. 
+ *  @param cserver : A pointer to the server creator. It may be null for a client
+ *  which is not handled by a server.
  *
  *  @return 
  *  - GERROR_NONE : Operation succeeded. 
@@ -60,18 +62,7 @@ gerror_t client_alloc (clientptr_t* ret, uint32_t id, clientptr_t mirror, void*
     
     client->id      = id;
     client->mirror  = mirror;
-    
-    if(!cserver)
-    {
-#ifdef GULTRA_DEBUG
-        cout << "[Client] Setting server to default one for client '" << id << "'." << endl;
-#endif
-        client->server = &server;
-    }
-    else
-    {
-        client->server = cserver;
-    }
+    client->server  = cserver;
     
     client->logged_user = nullptr;
     
@@ -104,6 +95,39 @@ gerror_t client_free (clientptr_t* ret)
     return GERROR_NONE;
 }
 
+/** @brief Returns true if given socket is a Unix-domain socket connected to a process
+ *  of the same user as this program.
+ *
+ *  Peer credentials are given by the kernel, so this is a cheap and reliable way to
+ *  trust a local process (a GUI front-end, or another node on the same host).
+**/
+bool client_socket_is_trusted(SOCKET sock)
+{
+#ifndef _WIN32
+    struct sockaddr_storage addr;
+    socklen_t               addrlen = sizeof(addr);
+    if(getsockname(sock, (SOCKADDR*) &addr, &addrlen) != 0 || addr.ss_family != AF_UNIX)
+        return false;
+
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t    credlen = sizeof(cred);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0)
+        return false;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if(getpeereid(sock, &uid, &gid) != 0)
+        return false;
+    return uid == getuid();
+#endif // SO_PEERCRED
+
+#else
+    return false;
+#endif // _WIN32
+}
+
 /** @brief Create a Client from given information.
  *
  *  @param client : Pointer to a complete client structure. @note Only fields client_t::name
@@ -114,9 +138,8 @@ gerror_t client_free (clientptr_t* ret)
  *  @return
  *  - GERROR_NONE on success.
  *  - GERROR_BADARGS if one of the given args is null.
- *  - GERROR_INVALID_SOCKET if socket is invalid or can't be created.
  *  - GERROR_INVALID_HOST if host is invalid.
- *  - GERROR_INVALID_CONNECT if can't connect to host.
+ *  - GERROR_INVALID_CONNECT if the transport of the server can't connect to host.
  *  - An error depending on client_send_packet().
 **/
 gerror_t client_create(client_t* client, const char* adress, size_t port)
@@ -124,30 +147,17 @@ gerror_t client_create(client_t* client, const char* adress, size_t port)
     if(!client || !adress || port == 0)
         return GERROR_BADARGS;
 
-    SOCKET sock     = socket(AF_INET, SOCK_STREAM, 0);
-    SOCKADDR_IN sin;
-    struct hostent* hostinfo;
-
-    if(sock == INVALID_SOCKET)
-    {
-        cout << "[Client] Can't create socket !" << endl;
-        return GERROR_INVALID_SOCKET;
-    }
-
-#ifdef GULTRA_DEBUG
-    cout << "[Client] Correctly created socket." << endl;
-#endif // GULTRA_DEBUG
-
-    hostinfo = gethostbyname(adress);
-    if(hostinfo == NULL)
+    // The address identifies the client, whatever the transport.
+    IN_ADDR host;
+    if(transport_resolve(adress, host) != GERROR_NONE)
     {
         cout << "[Client] Unknown host " << adress << "." << endl;
-
-        closesocket(sock);
         return GERROR_INVALID_HOST;
     }
 
-    sin.sin_addr   = *(IN_ADDR*) hostinfo->h_addr;
+    SOCKADDR_IN sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_addr   = host;
     sin.sin_port   = htons(port);
     sin.sin_family = AF_INET;
 
@@ -155,11 +165,27 @@ gerror_t client_create(client_t* client, const char* adress, size_t port)
     cout << "[Client] Correctly created hostinfo." << endl;
 #endif // GULTRA_DEBUG
 
-    if(connect(sock, (SOCKADDR*) &sin, sizeof(SOCKADDR)) == SOCKET_ERROR)
+    // A server on this host may listen on a local socket, which avoids the TCP loopback
+    // stack. The address stays the loopback one, as it identifies the client.
+    server_t*    cserver   = (server_t*) client->server;
+    transport_t* transport = cserver ? cserver->transport : &transport_tcp;
+    if(cserver && cserver->args.localsocket && transport == &transport_tcp && (ntohl(sin.sin_addr.s_addr) >> 24) == 127)
     {
-        cout << "[Client] Can't connect to host '" << adress << ":" << port << "'." << endl;
+        SOCKET lsock = transport_local.open(adress, (uint16_t) port);
+        if(lsock != SOCKET_ERROR)
+        {
+            cout << "[Client] Connected to host '" << adress << ":" << port << "' (local socket)." << endl;
+            client->sock    = lsock;
+            client->address = sin;
+            client->trusted = client_socket_is_trusted(lsock);
+            return GERROR_NONE;
+        }
+    }
 
-        closesocket(sock);
+    SOCKET sock = transport->open(adress, (uint16_t) port);
+    if(sock == SOCKET_ERROR)
+    {
+        cout << "[Client] Can't connect to host '" << adress << ":" << port << "'." << endl;
         return GERROR_INVALID_CONNECT;
     }
 
@@ -184,9 +210,44 @@ gerror_t client_create(client_t* client, const char* adress, size_t port)
 **/
 gerror_t client_send_packet(client_t* client, uint8_t packet_type, const void* data, size_t sz)
 {
+    return client_send_packet_file(client, packet_type, data, sz, -1, 0, 0);
+}
+
+/** @brief Send a packet to a given client, whose data is followed by filesize
+ *  bytes of a file from offset. The file is sent without going through user
+ *  space, so the packet is never crypted.
+ *  @see send_client_packet_file().
+ *
+ *  @param fd : The file, or -1 to send a packet as client_send_packet().
+**/
+gerror_t client_send_packet_file(client_t* client, uint8_t packet_type, const void* data, size_t sz,
+                                 int fd, off_t offset, size_t filesize)
+{
+    // The answer comes back through client->sock, which is read by the client thread once
+    // the client is established : it is waited for as the answer of a broadcast, else both
+    // threads would read it. The client thread itself reads its answers.
+    server_t* server = (server_t*) client->server;
+    if(server && client->established && client->mirror && client->server_thread.thethread != 0 &&
+       !pthread_equal(client->server_thread.thethread, pthread_self()))
+    {
+        uint32_t     id        = client->mirror->id;
+        broadcast_t* broadcast = nullptr;
+        gerror_t     err       = broadcast_send_file(server, packet_type, data, sz, fd, offset, filesize, broadcast, broadcast_filter_id, &id);
+        if(err != GERROR_NONE)
+            return err;
+
+        if(broadcast->peers.empty())
+            err = GERROR_CANT_SEND_PACKET;
+        else if(broadcast_wait(broadcast, BROADCAST_TIMEOUT) != GERROR_NONE)
+            err = broadcast->peers[0].status;
+
+        broadcast_destroy(broadcast);
+        return err;
+    }
+
     SOCKET downsock = client->sock;
     SOCKET upsock = client->mirror ? client->mirror->sock : SOCKET_ERROR;
-    return send_client_packet(upsock, downsock, packet_type, data, sz);
+    return send_client_packet_file(upsock, downsock, packet_type, data, sz, fd, offset, filesize);
 }
 
 /** @brief Close a client connection.
@@ -211,7 +272,7 @@ gerror_t client_close(client_t* client, bool send_close_packet)
         ret = client_send_packet(client, PT_CLIENT_CLOSING_CONNECTION, NULL, 0);
     }
 
-    if(closesocket(client->sock) != 0)
+    if(transport_close(client->sock) != 0)
     {
         if(ret == GERROR_NONE)
             ret = GERROR_CANT_CLOSE_SOCKET;
@@ -236,6 +297,11 @@ gerror_t client_close(client_t* client, bool send_close_packet)
 **/
 gerror_t client_send_cryptpacket(client_t* client, uint8_t packet_type, const void* data, size_t sz)
 {
+    // A trusted local server is reached through a Unix-domain socket, which never leaves
+    // this host : encryption is useless.
+    if(client->trusted)
+        return client_send_packet(client, packet_type, data, sz);
+
     // First we have to create the EncryptionInfoPacket
 
     server_t* server = (server_t*) client->server;
@@ -320,6 +386,100 @@ gerror_t client_send_cryptpacket(client_t* client, uint8_t packet_type, const vo
 }
 
 
+/** @brief Creates the shared memory ring used to send files to given
+ *  client, and gives its name to the distant server.
+ *
+ *  @return
+ *  - GERROR_NONE if the ring is ready (it may already exist).
+ *  - Any error from shmring_create() or client_send_packet().
+**/
+static gerror_t client_prepare_ring(client_t* client)
+{
+    if(client->ringout)
+        return GERROR_NONE;
+
+    gerror_t err = shmring_create(client->ringout);
+    if(err != GERROR_NONE)
+        return err;
+
+    char name[SHMRING_MAXNAME];
+    memset(name, 0, SHMRING_MAXNAME);
+    strncpy(name, client->ringout->name.c_str(), SHMRING_MAXNAME - 1);
+
+    err = client_send_packet(client, PT_CLIENT_SHMRING, name, SHMRING_MAXNAME);
+    if(err != GERROR_NONE)
+        shmring_close(client->ringout);
+
+    return err;
+}
+
+/** @brief Sends an opened file through the shared memory ring of given
+ *  client.
+ *
+ *  Only the info packet goes through the socket. The file is then read
+ *  directly into the ring, and the distant server writes it from there.
+ *  On error, the ring is closed so the distant server stops waiting for
+ *  the remaining data.
+ *
+ *  @note The ring only carries the content of files : every packet, this
+ *  info packet included, still goes through the socket.
+**/
+static gerror_t client_send_file_ring(client_t* client, gio_file_t* file, const char* filename, uint64_t lenght)
+{
+    server_t* server = (server_t*) client->server;
+
+    struct send_file_t sft = send_file_t();
+    sft.lenght    = lenght;
+    sft.has_chunk = false;
+    sft.via_ring  = true;
+    strncpy(sft.name, filename, SERVER_MAXBUFSIZE - 1);
+
+    sft = serialize<send_file_t>(sft);
+    if(server->client_send(client, PT_CLIENT_SENDFILE_INFO, &sft, sizeof(sft)) != GERROR_NONE)
+    {
+        cout << "[Client] Error sending info packet !" << endl;
+        return GERROR_CANT_SEND_PACKET;
+    }
+    sft = deserialize<send_file_t>(sft);
+
+    uint64_t len_send = 0;
+    if(server->bs_callback)
+        server->bs_callback(sft.name, len_send, lenght);
+
+    while(len_send < lenght)
+    {
+        unsigned char* ptr = nullptr;
+        size_t         len = 0;
+
+        gerror_t err = shmring_reserve(client->ringout, ptr, len);
+        if(err != GERROR_NONE)
+        {
+            cout << "[Client] Error writing to shared memory ring : " << gerror_to_string(err) << endl;
+            shmring_close(client->ringout);
+            return err;
+        }
+
+        if(len > lenght - len_send)
+            len = lenght - len_send;
+
+        if(gio_read(file, ptr, len) != GERROR_NONE)
+        {
+            cout << "[Client] Error : Can't terminate file reading." << endl;
+            shmring_close(client->ringout);
+            return GERROR_IO_CANTREAD;
+        }
+
+        shmring_commit(client->ringout, len);
+        len_send += len;
+
+        if(server->bs_callback)
+            server->bs_callback(sft.name, len_send, lenght);
+    }
+
+    return GERROR_NONE;
+}
+
+
 /** @brief Send a file to a given client.
  *
  *  @param filename : A string containing the path to the file to send. This path must
@@ -332,6 +492,10 @@ gerror_t client_send_cryptpacket(client_t* client, uint8_t packet_type, const vo
  *  - GERROR_CANT_SEND_PACKET if a packet could not be send.
  *  - GERROR_IO_CANTREAD if file couldn't be read.
  *  - GERROR_CANTOPENFILE if file couldn't be opened.
+ *  - GERROR_TIMEDOUT or GERROR_NORECEIVE if a trusted server stopped reading its
+ *  shared memory ring.
+ *  - GERROR_TIMEDOUT or GERROR_ANSWER_BAD if the client did not receive the file
+ *  (see server_transfer_send()).
 **/
 gerror_t client_send_file(client_t* client, const char* filename)
 {
@@ -342,12 +506,10 @@ gerror_t client_send_file(client_t* client, const char* filename)
         return GERROR_BUFSIZEEXCEEDED;
 
     server_t* server = (server_t*) client->server;
-    std::ifstream is(filename, std::ifstream::binary);
-    if(is)
+    gio_file_t* file = nullptr;
+    if(gio_open_read(file, filename, server->args.iouring) == GERROR_NONE)
     {
-        is.seekg(0, is.end);
-        const size_t lenght = is.tellg();
-        is.seekg(0, is.beg);
+        const uint64_t lenght = file->size;
 
         cout << "[Client] Sending file '" << filename << "'." << endl;
 
@@ -355,82 +517,18 @@ gerror_t client_send_file(client_t* client, const char* filename)
         timespec_t st = timer_start();
 #endif // GULTRA_DEBUG
 
-        if(lenght < SERVER_MAXBUFSIZE)
+        // A trusted server is on this host : it reads the file from shared memory instead of
+        // receiving it in SERVER_MAXBUFSIZE chunks, each one waiting for its answer.
+        if(client->trusted && server->args.sharedmemory && lenght > 0 &&
+           client_prepare_ring(client) == GERROR_NONE)
         {
-            // On peut envoyer le fichier d'un seul block
-            struct send_file_t sft;
-            sft.has_chunk   = false;
-            sft.lenght = lenght;
-
-            const size_t flenght = strlen(filename);
-            memcpy(sft.name, filename, flenght);
-            sft.name[flenght] = '\0';
-
-#ifdef GULTRA_DEBUG
-            cout << "[Client] Info : " << endl;
-            cout << "[Client] lenght      = " << lenght << "." << endl;
-            cout << "[Client] Chunk count = 1." << endl;
-#endif // GULTRA_DEBUG
-
-            sft = serialize<send_file_t>(sft);
-            {
-                if(server->client_send(client, PT_CLIENT_SENDFILE_INFO, &sft, sizeof(struct send_file_t)) != GERROR_NONE)
-                {
-                    cout << "[Client] Error sending info packet !" << endl;
-
-                    is.close();
-                    return GERROR_CANT_SEND_PACKET;
-                }
-            }
-
-            sft = deserialize<send_file_t>(sft);
-
-            // On lit le fichier dans un buffer de la bonne taille
-            size_t len = SERVER_MAXBUFSIZE;
-            char data[len];
-            is.read(data, lenght);
-            if(!is)
-            {
-                cout << "[Client] Can't read file '" << filename << "'." << endl;
-                server->client_send(client, PT_CLIENT_SENDFILE_TERMINATE, NULL, 0);
-
-                is.close();
-                return GERROR_IO_CANTREAD;
-            }
-
-#ifdef GULTRA_DEBUG
-            cout << "[Client] Sending chunk (size : " << lenght << ", # = 1)." << endl;
-#endif // GULTRA_DEBUG
-
-            // On envoie le tout
-            if(server->client_send(client, PT_CLIENT_SENDFILE_CHUNK, data, len) != GERROR_NONE)
-            {
-                cout << "[Client] Error sending chunk packet !" << endl;
-
-                is.close();
-                return GERROR_CANT_SEND_PACKET;
-            }
-
-            server->bs_callback(sft.name, len, lenght);
+            gerror_t err = client_send_file_ring(client, file, filename, lenght);
+            gio_close(file);
 
-#ifdef GULTRA_DEBUG
-            cout << "[Client] Sending File termination packet." << endl;
-#endif // GULTRA_DEBUG
-
-/*
-            // Et on termine
-            if(server->client_send(client, PT_CLIENT_SENDFILE_TERMINATE, NULL, 0) != GERROR_NONE)
-            {
-                cout << "[Client] Error sending terminate packet !" << endl;
-
-                is.close();
-                return GERROR_CANT_SEND_PACKET;
-            }
-*/
-
-            is.close();
+            if(err != GERROR_NONE)
+                return err;
 
-            cout << "[Client] File '" << filename << "' correctly send to client '" << client->name << "'." << endl;
+            cout << "[Client] File '" << filename << "' correctly send to client '" << client->name << "' (shared memory)." << endl;
 
 #ifdef GULTRA_DEBUG
             long ten = timer_end(st);
@@ -439,129 +537,11 @@ gerror_t client_send_file(client_t* client, const char* filename)
 
             return GERROR_NONE;
         }
-        else
-        {
-            // Il va falloir envoyer le fichier en plusiers chunk
-            struct send_file_t sft;
-            sft.has_chunk      = true;
-            sft.lenght         = lenght;
-            sft.chunk_lenght   = SERVER_MAXBUFSIZE;
-            sft.chunk_lastsize = lenght % SERVER_MAXBUFSIZE;
-            sft.chunk_count    = ((int) lenght/SERVER_MAXBUFSIZE) + 1;
-
-            const size_t flenght  = strlen(filename);
-            memcpy(sft.name, filename, flenght);
-            sft.name[flenght]  = '\0';
-
-#ifdef GULTRA_DEBUG
-            cout << "[Client] Info : " << endl;
-            cout << "[Client] lenght          = " << lenght << "." << endl;
-            cout << "[Client] Chunk count     = " << sft.chunk_count << "." << endl;
-            cout << "[Client] Chunk lenght    = " << sft.chunk_lenght << "." << endl;
-            cout << "[Client] Chunk last size = " << sft.chunk_lastsize << "." << endl;
-#endif // GULTRA_DEBUG
-
-            sft = serialize<send_file_t>(sft);
-            {
-                if(server->client_send(client, PT_CLIENT_SENDFILE_INFO, &sft, sizeof(sft)) != GERROR_NONE)
-                {
-                    cout << "[Client] Error sending info packet !" << endl;
-                    is.close();
-                    return GERROR_CANT_SEND_PACKET;
-                }
-            }
-            sft = deserialize<send_file_t>(sft);
-
-            uint32_t chunks = 0;
-            size_t len      = sft.chunk_lenght;
-            char buffer[len];
-
-            size_t len_send = 0;
-            if(server->bs_callback)
-                server->bs_callback(sft.name, len_send, lenght);
-
-            while(chunks < sft.chunk_count - 1)
-            {
-                is.read(buffer, sft.chunk_lenght);
-                if(!is)
-                {
-                    cout << "[Client] Error : Can't terminate file reading.";
-                    is.close();
-
-                    if(server->client_send(client, PT_CLIENT_SENDFILE_TERMINATE, NULL, 0) != GERROR_NONE)
-                    {
-                        cout << "[Client] Error sending terminate packet !" << endl;
-                        return GERROR_CANT_SEND_PACKET;
-                    }
-                    return GERROR_IO_CANTREAD;
-                }
-
-#ifdef GULTRA_DEBUG
-                cout << "[Client] Sending chunk (size : " << sft.chunk_lenght << ", # = " << chunks << ")." << endl;
-#endif // GULTRA_DEBUG
-
-                if(server->client_send(client, PT_CLIENT_SENDFILE_CHUNK, buffer, sft.chunk_lenght) != GERROR_NONE)
-                {
-                    cout << "[Client] Error sending chunk packet !" << endl;
-                    is.close();
-                    return GERROR_CANT_SEND_PACKET;
-                }
-
-                len_send += len;
-                if(server->bs_callback)
-                    server->bs_callback(sft.name, len_send, lenght);
-                chunks++;
-            }
-
-            memset((void*) buffer, 0, len);
-            is.read(buffer, sft.chunk_lastsize);
-            if(!is)
-            {
-                cout << "[Client] Error : Can't terminate file reading.";
-                is.close();
-
-                if(server->client_send(client, PT_CLIENT_SENDFILE_TERMINATE, NULL, 0) != GERROR_NONE)
-                {
-                    cout << "[Client] Error sending terminate packet !" << endl;
-                    return GERROR_CANT_SEND_PACKET;
-                }
-                return GERROR_IO_CANTREAD;
-            }
-
-            is.close();
-
-#ifdef GULTRA_DEBUG
-            cout << "[Client] Sending chunk (size : " << sft.chunk_lastsize << ", # = " << chunks << ")." << endl;
-#endif // GULTRA_DEBUG
-
-            if(server->client_send(client, PT_CLIENT_SENDFILE_CHUNK, buffer, sft.chunk_lenght) != GERROR_NONE)
-            {
-                cout << "[Client] Error sending chunk packet !" << endl;
-                return GERROR_CANT_SEND_PACKET;
-            }
-
-            len_send += sft.chunk_lenght;
-
-            if(server->bs_callback)
-                server->bs_callback(sft.name, len_send, lenght);
-
-/*
-            if(server->client_send(client, PT_CLIENT_SENDFILE_TERMINATE, NULL, 0) != GERROR_NONE)
-            {
-                cout << "[Client] Error sending terminate packet !" << endl;
-                return GERROR_CANT_SEND_PACKET;
-            }
-*/
 
-            cout << "[Client] File '" << filename << "' correctly send to client '" << client->name << "'." << endl;
-
-#ifdef GULTRA_DEBUG
-            long ten = timer_end(st);
-            cout << "[Client] Time elapsed (microseconds) = " << ten/1000 << "." << endl;
-#endif // GULTRA_DEBUG
-
-            return GERROR_NONE;
-        }
+        // Otherwise the file is sent in chunks the client records, so the transfer goes on
+        // where it stopped if the connection is lost.
+        gio_close(file);
+        return server_transfer_send(server, client, filename);
     }
     else
     {
@@ -24,6 +24,7 @@
 #include "prerequesites.h"
 #include "user.h"
 #include "events.h"
+#include "shmring.h"
 
 GBEGIN_DECL
 
@@ -249,9 +250,18 @@ public:
 
     userptr_t       logged_user;   // [Server-side] Stores the user wich the client is logged with.
     bool            logged;        // [Server-side] True if client is logged with a user.
+    userptr_t       local_user;    // [Server-side] Local user the distant user is logged with. Null if none.
 
     
     bool            idling;        // [Server-side] True if the client thread loop is idling (waiting for a packet).
+    
+    long            connectstart;  // [Server-side] Monotonic time (us) when we initiated the connection, 0 if the distant server did.
+    bool            trusted;       // [Server-side] True if the distant server is a local process of the same user (Unix-domain
+                                   // socket peer credentials). Packets are then sent uncrypted and the user is accepted directly.
+    shmring_t*      ringout;       // [Server-side] Shared memory ring we write files to, if the distant server is trusted.
+    shmring_t*      ringin;        // [Server-side] Shared memory ring the distant server writes files to.
+    std::vector<uint32_t> channels; // [Server-side] Hashes (channel_hash()) of the channels the distant server subscribed to,
+                                    // sorted. Protected by the server mutex.
 
     Client ()
     {
@@ -271,8 +281,13 @@ public:
         
         logged_user                 = nullptr;
         logged                      = false;
+        local_user                  = nullptr;
         
         idling                      = false;
+        connectstart                = 0;
+        trusted                     = false;
+        ringout                     = nullptr;
+        ringin                      = nullptr;
     }
 
     bool operator == (const Client& other) {
@@ -324,9 +339,12 @@ gerror_t client_free                (clientptr_t* ret);
 
 gerror_t client_create				(client_t* client, const char* adress, size_t port);
 gerror_t client_send_packet			(client_t* client, uint8_t packet_type, const void* data, size_t sz);
+gerror_t client_send_packet_file     (client_t* client, uint8_t packet_type, const void* data, size_t sz,
+                                     int fd, off_t offset, size_t filesize);
 gerror_t client_send_cryptpacket	(client_t* client, uint8_t packet_type, const void* data, size_t sz);
 gerror_t client_send_file			(client_t* client, const char* filename);
 gerror_t client_close				(client_t* client, bool send_close_packet = true);
+bool     client_socket_is_trusted   (SOCKET sock);
 
 gerror_t client_thread_setstatus    (clientptr_t client, ClientOperation ope);
 
@@ -347,8 +347,8 @@ gerror_t Client2::close(bool sendClosePacket)
     _thread.currope     = CO_NONE;
     _thread.opedata     = nullptr;
     
-    closesocket(_sockup);
-    closesocket(_sockdown);
+    transport_close(_sockup);
+    transport_close(_sockdown);
     
     // Reinitializing datas.
     _sockup             = INVALID_SOCKET;
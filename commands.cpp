@@ -87,11 +87,11 @@ typedef struct
 
 void* async_cmd_thread_loop (void* d)
 {
-    globalsession._treatingcommand = true;
+    globalsession->_treatingcommand = true;
     
 	async_cmd_private_t* data = (async_cmd_private_t*) d;
     
-    if(data->inbackground) globalsession._treatingcommand = false;
+    if(data->inbackground) globalsession->_treatingcommand = false;
 	
     if(data)
     {
@@ -99,7 +99,7 @@ void* async_cmd_thread_loop (void* d)
         delete data;
     }
 	
-    globalsession._treatingcommand = false;
+    globalsession->_treatingcommand = false;
 	return NULL;
 }
 
@@ -144,7 +144,13 @@ async_cmd_t async_commands [CMD_MAX] =
     
     // New API
     
-    { CMD_VERSION,     async_cmd_version     }
+    { CMD_VERSION,     async_cmd_version     },
+    { CMD_PEERS,       async_cmd_peers       },
+    { CMD_USERS,       async_cmd_users       },
+    { CMD_SUBSCRIBE,   async_cmd_subscribe   },
+    { CMD_UNSUBSCRIBE, async_cmd_unsubscribe },
+    { CMD_PUBLISH,     async_cmd_publish     },
+    { CMD_RELAY,       async_cmd_relay       }
 };
 
 GEND_DECL
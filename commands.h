@@ -52,6 +52,12 @@ typedef enum {
     CMD_NET_ATTACH  = 9,
     
     CMD_VERSION     = 10,
+    CMD_PEERS       = 11,
+    CMD_USERS       = 12,
+    CMD_SUBSCRIBE   = 13,
+    CMD_UNSUBSCRIBE = 14,
+    CMD_PUBLISH     = 15,
+    CMD_RELAY       = 16,
 	
 	CMD_MAX
 } Commands;
@@ -78,6 +84,12 @@ gerror_t async_cmd_netattach   (std::vector<std::string> args, server_t* server)
 
 // New API
 gerror_t async_cmd_version     (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_peers       (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_users       (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_subscribe   (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_unsubscribe (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_publish     (std::vector<std::string> args, server_t* server);
+gerror_t async_cmd_relay       (std::vector<std::string> args, server_t* server);
 
 // This array makes us call any commands where we want.
 extern async_cmd_t async_commands[CMD_MAX];
@@ -0,0 +1,333 @@
+/*
+ File        : crc32c.cpp
+ Description : CRC32C (Castagnoli) checksums of the chunks of file transfers.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "crc32c.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#   define CRC32C_HAS_SSE42 1
+#endif
+
+GBEGIN_DECL
+
+#define CRC32C_POLY    0x82F63B78u // Castagnoli polynomial, reflected.
+#define CRC32C_LANE    8192        // Bytes given to each of the three crc32 instructions in flight.
+#define CRC32C_BUFSIZE (64 * 1024) // Buffer used when a file is not mapped.
+
+/** @brief Tables of the software CRC, and the constants to combine CRCs.
+ *  They are built once, at first use.
+**/
+struct crc32c_tables_t
+{
+    uint32_t slice[8][256]; // slice[k][n] : CRC of byte n followed by k zeros.
+    uint32_t x2n[32];       // x^(2^k) modulo the polynomial.
+    uint32_t lane;          // x^(8 * CRC32C_LANE), to shift the CRC of a lane over the next one.
+    bool     hardware;      // True if the processor has the crc32 instruction.
+
+    crc32c_tables_t();
+};
+
+/** @brief Returns a * b modulo the polynomial, both reflected (x^0 is the
+ *  highest bit).
+**/
+static uint32_t crc32c_multmodp_(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    while(true)
+    {
+        if(a & m)
+        {
+            p ^= b;
+            if((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+/** @brief Returns x^(n * 2^k) modulo the polynomial.
+**/
+static uint32_t crc32c_x2nmodp_(const uint32_t* x2n, uint64_t n, unsigned int k)
+{
+    uint32_t p = 1u << 31; // x^0
+    while(n)
+    {
+        if(n & 1)
+            p = crc32c_multmodp_(x2n[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+crc32c_tables_t::crc32c_tables_t()
+{
+    for(uint32_t n = 0; n < 256; ++n)
+    {
+        uint32_t crc = n;
+        for(int i = 0; i < 8; ++i)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        slice[0][n] = crc;
+    }
+    for(uint32_t n = 0; n < 256; ++n)
+    {
+        for(int k = 1; k < 8; ++k)
+            slice[k][n] = (slice[k - 1][n] >> 8) ^ slice[0][slice[k - 1][n] & 0xFF];
+    }
+
+    x2n[0] = 1u << 30; // x^1
+    for(int k = 1; k < 32; ++k)
+        x2n[k] = crc32c_multmodp_(x2n[k - 1], x2n[k - 1]);
+    lane = crc32c_x2nmodp_(x2n, CRC32C_LANE, 3);
+
+#ifdef CRC32C_HAS_SSE42
+    hardware = __builtin_cpu_supports("sse4.2");
+#else
+    hardware = false;
+#endif // CRC32C_HAS_SSE42
+}
+
+static const crc32c_tables_t& crc32c_tables_()
+{
+    static const crc32c_tables_t tables;
+    return tables;
+}
+
+/** @brief Continues the register (not inverted) of a CRC with tables, eight
+ *  bytes at a time.
+**/
+static uint32_t crc32c_software_(const crc32c_tables_t& t, uint32_t crc, const unsigned char* p, size_t len)
+{
+    while(len > 0 && ((uintptr_t) p & 7) != 0)
+    {
+        crc = t.slice[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(len >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t.slice[7][ word        & 0xFF] ^ t.slice[6][(word >>  8) & 0xFF] ^
+              t.slice[5][(word >> 16) & 0xFF] ^ t.slice[4][(word >> 24) & 0xFF] ^
+              t.slice[3][(word >> 32) & 0xFF] ^ t.slice[2][(word >> 40) & 0xFF] ^
+              t.slice[1][(word >> 48) & 0xFF] ^ t.slice[0][ word >> 56        ];
+        p   += 8;
+        len -= 8;
+    }
+#endif
+
+    while(len > 0)
+    {
+        crc = t.slice[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAS_SSE42
+
+/** @brief Continues the register of a CRC with the crc32 instruction.
+ *
+ *  The instruction takes three cycles, but a new one can start at every
+ *  cycle : big buffers are cut in blocks of three lanes, whose CRCs are
+ *  computed at the same time then shifted over each other.
+**/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware_(const crc32c_tables_t& t, uint32_t crc, const unsigned char* p, size_t len)
+{
+    uint64_t c0 = crc;
+    while(len > 0 && ((uintptr_t) p & 7) != 0)
+    {
+        c0 = __builtin_ia32_crc32qi((uint32_t) c0, *p++);
+        len--;
+    }
+
+    while(len >= 3 * CRC32C_LANE)
+    {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for(size_t i = 0; i < CRC32C_LANE; i += 8)
+        {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + i + CRC32C_LANE, 8);
+            memcpy(&w2, p + i + 2 * CRC32C_LANE, 8);
+            c0 = __builtin_ia32_crc32di(c0, w0);
+            c1 = __builtin_ia32_crc32di(c1, w1);
+            c2 = __builtin_ia32_crc32di(c2, w2);
+        }
+
+        c0   = crc32c_multmodp_(t.lane, (uint32_t) c0) ^ (uint32_t) c1;
+        c0   = crc32c_multmodp_(t.lane, (uint32_t) c0) ^ (uint32_t) c2;
+        p   += 3 * CRC32C_LANE;
+        len -= 3 * CRC32C_LANE;
+    }
+
+    while(len >= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0   = __builtin_ia32_crc32di(c0, w);
+        p   += 8;
+        len -= 8;
+    }
+
+    while(len > 0)
+    {
+        c0 = __builtin_ia32_crc32qi((uint32_t) c0, *p++);
+        len--;
+    }
+    return (uint32_t) c0;
+}
+
+#endif // CRC32C_HAS_SSE42
+
+////////////////////////////////////////////////////////////
+/** @brief Returns true if the checksums are computed by the processor.
+**/
+////////////////////////////////////////////////////////////
+bool crc32c_hardware()
+{
+    return crc32c_tables_().hardware;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the CRC32C of len bytes following the ones whose CRC is
+ *  crc (0 for none).
+**/
+////////////////////////////////////////////////////////////
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    const crc32c_tables_t& t = crc32c_tables_();
+    const unsigned char*   p = reinterpret_cast<const unsigned char*>(data);
+
+#ifdef CRC32C_HAS_SSE42
+    if(t.hardware)
+        return ~crc32c_hardware_(t, ~crc, p, len);
+#endif // CRC32C_HAS_SSE42
+
+    return ~crc32c_software_(t, ~crc, p, len);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the CRC32C of two parts, from the CRC of each part.
+ *  @param len2 : Size of the second part.
+**/
+////////////////////////////////////////////////////////////
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return crc32c_multmodp_(crc32c_x2nmodp_(crc32c_tables_().x2n, len2, 3), crc1) ^ crc2;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the CRC32C of len zeros, without reading them.
+**/
+////////////////////////////////////////////////////////////
+uint32_t crc32c_zeros(uint64_t len)
+{
+    return ~crc32c_multmodp_(crc32c_x2nmodp_(crc32c_tables_().x2n, len, 3), 0xFFFFFFFFu);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Computes the CRC32C of len bytes of an opened file, from offset.
+ *
+ *  The bytes are read with pread(). If map is true, they are mapped instead,
+ *  so they are read from the page cache without being copied ; pread() is
+ *  then only used if the file can't be mapped. A mapped file truncated by
+ *  another process while it is read raises SIGBUS : only map the files we
+ *  own.
+ *
+ *  @return
+ *  - GERROR_NONE        : crc is the CRC of the bytes.
+ *  - GERROR_BADARGS     : fd is invalid.
+ *  - GERROR_ALLOC       : The buffer can't be allocated.
+ *  - GERROR_IO_CANTREAD : The file is shorter, or can't be read.
+**/
+////////////////////////////////////////////////////////////
+gerror_t crc32c_file(int fd, uint64_t offset, uint64_t len, uint32_t& crc, bool map)
+{
+    if(fd < 0)
+        return GERROR_BADARGS;
+
+    crc = 0;
+    if(len == 0)
+        return GERROR_NONE;
+
+    if(map)
+    {
+        // A file shorter than the bytes would fault on the missing pages once mapped.
+        struct stat st;
+        if(fstat(fd, &st) != 0 || (uint64_t) st.st_size < offset + len)
+            return GERROR_IO_CANTREAD;
+
+        uint64_t page  = (uint64_t) sysconf(_SC_PAGESIZE);
+        uint64_t start = offset - offset % page;
+        size_t   size  = (size_t) (offset + len - start);
+
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif // MAP_POPULATE
+
+        void* addr = mmap(nullptr, size, PROT_READ, flags, fd, (off_t) start);
+        if(addr != MAP_FAILED)
+        {
+            crc = crc32c(0, (const unsigned char*) addr + (offset - start), (size_t) len);
+            munmap(addr, size);
+            return GERROR_NONE;
+        }
+    }
+
+    unsigned char* buf = (unsigned char*) malloc(CRC32C_BUFSIZE);
+    if(!buf)
+        return GERROR_ALLOC;
+
+    gerror_t err = GERROR_NONE;
+    while(len > 0)
+    {
+        ssize_t ret = pread(fd, buf, (size_t) std::min<uint64_t>(len, CRC32C_BUFSIZE), (off_t) offset);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+        {
+            err = GERROR_IO_CANTREAD;
+            break;
+        }
+
+        crc     = crc32c(crc, buf, (size_t) ret);
+        offset += (uint64_t) ret;
+        len    -= (uint64_t) ret;
+    }
+
+    free(buf);
+    return err;
+}
+
+GEND_DECL
@@ -0,0 +1,48 @@
+/*
+ File        : crc32c.h
+ Description : CRC32C (Castagnoli) checksums of the chunks of file transfers.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CRC32C__H
+#define __CRC32C__H
+
+#include "prerequesites.h"
+
+GBEGIN_DECL
+
+/** @brief Checksums are computed with the SSE4.2 crc32 instruction when the
+ *  processor has it, otherwise with tables (slicing-by-8).
+ *
+ *  A CRC is continued by giving the CRC of the bytes before : crc32c(0, ...)
+ *  starts a new one. The CRC of two parts is given by crc32c_combine() from
+ *  the CRC of each part, so chunks can be checked in any order and the CRC of
+ *  the file deduced from theirs.
+**/
+
+bool     crc32c_hardware ();
+uint32_t crc32c          (uint32_t crc, const void* data, size_t len);
+uint32_t crc32c_combine  (uint32_t crc1, uint32_t crc2, uint64_t len2);
+uint32_t crc32c_zeros    (uint64_t len);
+gerror_t crc32c_file     (int fd, uint64_t offset, uint64_t len, uint32_t& crc, bool map = false);
+
+GEND_DECL
+
+#endif // __CRC32C__H
@@ -207,7 +207,7 @@ gerror_t database_readheader(const char*& infp, database_header_t* header)
 
 gerror_t database_create(database_t*& to, const std::string& dbname, const std::string& dbpass)
 {
-    to = (database_t*) malloc(sizeof(database_t));
+    to = new database_t;
     to->m_name = netbuf_new(dbname.c_str(), dbname.length());
     
     Encryption::user_create_keypass(to->key, to->iv, dbpass.c_str(), dbpass.length());
@@ -233,7 +233,7 @@ void database_readblockinfo(const char*& cursor, database_blockinfo_t* blkinfo)
 
 void database_internal_adduserblk(database_t* db, database_blk_user_t& user)
 {
-    database_user_t* nuser = (database_user_t*) malloc(sizeof(database_user_t));
+    database_user_t* nuser = new database_user_t;
     nuser->status = user.status;
     
     nuser->m_name = netbuf_copy(user.name);
@@ -443,7 +443,7 @@ database_user_t* database_find_user(database_t* db, const std::string& username)
 
 database_user_t* database_create_user(database_t* db, const std::string& username, const std::string& userpass)
 {
-    database_user_t* nuser = (database_user_t*) malloc(sizeof(database_user_t));
+    database_user_t* nuser = new database_user_t;
     nuser->m_name = netbuf_new(username.c_str(), username.length());
     
     std::string key; std::string iv;
@@ -22,7 +22,9 @@
 */
 
 #include "encryption.h"
+#include "crc32c.h"
 #include <openssl/pem.h>
+#include <algorithm> // std::min
 
 GBEGIN_DECL
 
@@ -74,10 +76,22 @@ namespace Encryption
             OpenSSL_add_all_algorithms();
 
         out = (encryption_t*) malloc(sizeof(encryption_t));
-        out->keypair = RSA_generate_key(2048, RSA_F4, 0, 0);
+        out->key     = nullptr;
+        out->keypair = nullptr;
+
+        // The key is generated with EVP, and its RSA structure is kept for the functions
+        // which still use it (crypt(), encryption_get_publickey()).
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+        if(ctx && EVP_PKEY_keygen_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0 &&
+           EVP_PKEY_keygen(ctx, &out->key) > 0)
+        {
+            out->keypair = EVP_PKEY_get1_RSA(out->key);
+        }
+        EVP_PKEY_CTX_free(ctx);
 
         if(!out->keypair)
         {
+            EVP_PKEY_free(out->key);
             free(out);
             out = nullptr;
             return GERROR_ENCRYPT_GENERATE;
@@ -92,6 +106,7 @@ namespace Encryption
             return GERROR_BADARGS;
 
         RSA_free(in->keypair);
+        EVP_PKEY_free(in->key);
         free(in);
         return GERROR_NONE;
     }
@@ -124,6 +139,108 @@ namespace Encryption
         return result;
     }
 
+    /** @brief Reads a public key, as given by encryption_get_publickey().
+     *  @return The key, to free with EVP_PKEY_free(), or null if it is not valid.
+    **/
+    static EVP_PKEY* createPublicKey(const buffer_t& pubkey)
+    {
+        BIO* keybio = BIO_new_mem_buf(const_cast<unsigned char*>(pubkey.buf), (int) pubkey.size);
+        if(!keybio)
+            return nullptr;
+
+        EVP_PKEY* key = PEM_read_bio_PUBKEY(keybio, NULL, NULL, NULL);
+        BIO_free(keybio);
+        return key;
+    }
+
+    /** @brief Crypt data for the owner of a public key, who only can
+     *  decrypt it with decrypt_private().
+     *  @param pubkey : The public key of the receiver.
+     *  @param to     : Buffer to store data. Size of buffer must be RSA_SIZE.
+     *  @param from   : Buffer to read the data.
+     *  @param flen   : Size of buffer from. Must be inferior or equal to RSA_SIZE - 11.
+     *  @return The size of the crypted data, or -1 on error.
+    **/
+    int crypt_public(buffer_t& pubkey, unsigned char* to, unsigned char* from, size_t flen)
+    {
+        EVP_PKEY* key = createPublicKey(pubkey);
+        if(!key)
+            return -1;
+
+        EVP_PKEY_CTX* ctx    = EVP_PKEY_CTX_new(key, NULL);
+        size_t        len    = RSA_SIZE;
+        int           result = -1;
+        if(ctx && EVP_PKEY_encrypt_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0 &&
+           EVP_PKEY_encrypt(ctx, to, &len, from, flen) > 0)
+        {
+            result = (int) len;
+        }
+
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(key);
+        return result;
+    }
+
+    /** @brief Decrypt data crypted with crypt_public() and our public key.
+     *  @param rsa  : RSA private key
+     *  @param to   : Buffer to hold the data. Size of this buffer must be RSA_SIZE.
+     *  @param from : Buffer to decrypt.
+     *  @param flen : Lenght of this buffer. It must not be superior to RSA_SIZE.
+     *  @return The size of the data, or -1 on error.
+    **/
+    int decrypt_private(encryption_t* rsa, unsigned char* to, unsigned char* from, size_t flen)
+    {
+        EVP_PKEY_CTX* ctx    = EVP_PKEY_CTX_new(rsa->key, NULL);
+        size_t        len    = RSA_SIZE;
+        int           result = -1;
+        if(ctx && EVP_PKEY_decrypt_init(ctx) > 0 && EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) > 0 &&
+           EVP_PKEY_decrypt(ctx, to, &len, from, flen) > 0)
+        {
+            result = (int) len;
+        }
+
+        EVP_PKEY_CTX_free(ctx);
+        return result;
+    }
+
+    /** @brief Sign len bytes, with their SHA-256.
+     *  @param sig : Buffer to store the signature. Size of buffer must be RSA_SIZE.
+     *  @return The size of the signature, or -1 on error.
+    **/
+    int sign(encryption_t* rsa, const void* data, size_t len, unsigned char* sig)
+    {
+        EVP_MD_CTX* ctx    = EVP_MD_CTX_create();
+        size_t      siglen = RSA_SIZE;
+        int         result = -1;
+        if(ctx && EVP_DigestSignInit(ctx, NULL, EVP_sha256(), NULL, rsa->key) == 1 &&
+           EVP_DigestSignUpdate(ctx, data, len) == 1 && EVP_DigestSignFinal(ctx, sig, &siglen) == 1)
+        {
+            result = (int) siglen;
+        }
+
+        EVP_MD_CTX_destroy(ctx);
+        return result;
+    }
+
+    /** @brief Returns true if sig is the signature of len bytes by the owner
+     *  of given public key.
+    **/
+    bool verify(buffer_t& pubkey, const void* data, size_t len, const unsigned char* sig, size_t siglen)
+    {
+        EVP_PKEY* key = createPublicKey(pubkey);
+        if(!key)
+            return false;
+
+        EVP_MD_CTX* ctx    = EVP_MD_CTX_create();
+        bool        result = ctx && EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL, key) == 1 &&
+                             EVP_DigestVerifyUpdate(ctx, data, len) == 1 &&
+                             EVP_DigestVerifyFinal(ctx, sig, siglen) == 1;
+
+        EVP_MD_CTX_destroy(ctx);
+        EVP_PKEY_free(key);
+        return result;
+    }
+
     gerror_t encryption_get_publickey(encryption_t* enc, buffer_t*& out)
     {
         if(!enc || !out)
@@ -437,6 +554,168 @@ namespace Encryption
         
         return GERROR_NONE;
     }
+    
+    /** @brief Computes the SHA-256 of len bytes.
+     *  @param out : Buffer to hold the digest. Its size must be HASH_SIZE.
+    **/
+    gerror_t hash_data(const void* data, size_t len, unsigned char* out)
+    {
+        EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        EVP_DigestUpdate(ctx, data, len);
+        EVP_DigestFinal_ex(ctx, out, NULL);
+        EVP_MD_CTX_destroy(ctx);
+        return GERROR_NONE;
+    }
+    
+    /** @brief Computes the SHA-256 of a file.
+     *  @param fd  : File descriptor, read with pread() so its offset is kept.
+     *  @param len : Number of bytes to hash from the beginning of the file.
+     *  @param out : Buffer to hold the digest. Its size must be HASH_SIZE.
+     *  @param crc : If not null, receives the CRC32C of the same bytes,
+     *  computed from the same reads.
+     *  @param blocksize : Size of the blocks whose CRC32C are given in
+     *  blocks. The last block may be shorter.
+     *  @param blocks : If not null, receives the CRC32C of every block,
+     *  so the CRC of any run of blocks is found with crc32c_combine()
+     *  without reading the file again. crc is then combined from them.
+     *
+     *  @return
+     *  - GERROR_NONE on success.
+     *  - GERROR_IO_CANTREAD if the file is shorter than len, or can't be read.
+     *  - GERROR_ALLOC if the buffer can't be allocated.
+    **/
+    gerror_t hash_file(int fd, uint64_t len, unsigned char* out, uint32_t* crc, uint32_t blocksize, std::vector<uint32_t>* blocks)
+    {
+        const size_t   BUFSIZE = 1 << 20;
+        unsigned char* buf     = (unsigned char*) malloc(BUFSIZE);
+        if(!buf)
+            return GERROR_ALLOC;
+        
+        EVP_MD_CTX*    ctx     = EVP_MD_CTX_create();
+        gerror_t       err     = GERROR_NONE;
+        
+        if(blocks && blocksize == 0)
+            blocks = nullptr;
+        if(blocks)
+            blocks->clear();
+        
+        uint32_t block   = 0; // CRC of the current block.
+        uint32_t inblock = 0; // Bytes of the current block.
+        
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        if(crc)
+            *crc = 0;
+        for(uint64_t done = 0; done < len; )
+        {
+            ssize_t ret = pread(fd, buf, (size_t) std::min<uint64_t>(BUFSIZE, len - done), (off_t) done);
+            if(ret <= 0)
+            {
+                err = GERROR_IO_CANTREAD;
+                break;
+            }
+            
+            EVP_DigestUpdate(ctx, buf, (size_t) ret);
+            if(blocks)
+            {
+                // A read may end in the middle of a block.
+                for(size_t pos = 0; pos < (size_t) ret; )
+                {
+                    size_t n = std::min<size_t>((size_t) ret - pos, blocksize - inblock);
+                    block    = crc32c(block, buf + pos, n);
+                    inblock += (uint32_t) n;
+                    pos     += n;
+                    
+                    if(inblock == blocksize || done + pos == len)
+                    {
+                        blocks->push_back(block);
+                        if(crc)
+                            *crc = crc32c_combine(*crc, block, inblock);
+                        block   = 0;
+                        inblock = 0;
+                    }
+                }
+            }
+            else if(crc)
+            {
+                *crc = crc32c(*crc, buf, (size_t) ret);
+            }
+            done += (uint64_t) ret;
+        }
+        EVP_DigestFinal_ex(ctx, out, NULL);
+        
+        EVP_MD_CTX_destroy(ctx);
+        free(buf);
+        return err;
+    }
+    
+    /** @brief Creates a SHA-256 computed from bytes given in several parts.
+     *  Returns null if it can't be allocated.
+    **/
+    hash_t* hash_create()
+    {
+        hash_t* ctx = EVP_MD_CTX_create();
+        if(ctx)
+            EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        return ctx;
+    }
+    
+    /** @brief Adds len bytes to a SHA-256.
+    **/
+    void hash_update(hash_t* ctx, const void* data, size_t len)
+    {
+        EVP_DigestUpdate(ctx, data, len);
+    }
+    
+    /** @brief Adds len bytes of a file, from offset, to a SHA-256.
+     *
+     *  @return
+     *  - GERROR_NONE on success.
+     *  - GERROR_IO_CANTREAD if the file is shorter, or can't be read. Part
+     *  of the bytes may have been added.
+     *  - GERROR_ALLOC if the buffer can't be allocated.
+    **/
+    gerror_t hash_update_file(hash_t* ctx, int fd, uint64_t offset, uint64_t len)
+    {
+        const size_t   BUFSIZE = 1 << 20;
+        unsigned char* buf     = (unsigned char*) malloc((size_t) std::min<uint64_t>(BUFSIZE, len > 0 ? len : 1));
+        if(!buf)
+            return GERROR_ALLOC;
+        
+        gerror_t err = GERROR_NONE;
+        for(uint64_t done = 0; done < len; )
+        {
+            ssize_t ret = pread(fd, buf, (size_t) std::min<uint64_t>(BUFSIZE, len - done), (off_t) (offset + done));
+            if(ret < 0 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+            {
+                err = GERROR_IO_CANTREAD;
+                break;
+            }
+            
+            EVP_DigestUpdate(ctx, buf, (size_t) ret);
+            done += (uint64_t) ret;
+        }
+        
+        free(buf);
+        return err;
+    }
+    
+    /** @brief Gives the digest of the bytes added to a SHA-256, in out
+     *  (HASH_SIZE bytes), and starts it again.
+    **/
+    void hash_final(hash_t* ctx, unsigned char* out)
+    {
+        EVP_DigestFinal_ex(ctx, out, NULL);
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    }
+    
+    void hash_destroy(hash_t* ctx)
+    {
+        if(ctx)
+            EVP_MD_CTX_destroy(ctx);
+    }
 }
 
 gerror_t encryption_init()
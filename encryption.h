@@ -27,6 +27,8 @@
 
 GBEGIN_DECL
 
+#define HASH_SIZE 32 // Size of a SHA-256 digest.
+
 namespace Encryption
 {
     // This encryption module is from
@@ -34,7 +36,8 @@ namespace Encryption
 
     // A structure holding the RSA key pair.
     typedef struct {
-        RSA* keypair;
+        RSA*      keypair;
+        EVP_PKEY* key;     // The same key pair, for the EVP functions.
     } encryption_t;
 
     // The BIO structure with a buffer integrated.
@@ -48,6 +51,10 @@ namespace Encryption
     gerror_t encryption_destroy(encryption_t* in);
     int      crypt(encryption_t* rsa, unsigned char* to, unsigned char* from, size_t flen);
     int      decrypt(buffer_t& pubkey, unsigned char* to, unsigned char* from, size_t flen);
+    int      crypt_public(buffer_t& pubkey, unsigned char* to, unsigned char* from, size_t flen);
+    int      decrypt_private(encryption_t* rsa, unsigned char* to, unsigned char* from, size_t flen);
+    int      sign(encryption_t* rsa, const void* data, size_t len, unsigned char* sig);
+    bool     verify(buffer_t& pubkey, const void* data, size_t len, const unsigned char* sig, size_t siglen);
 
     // Return in a buffer_t the public key.
     gerror_t encryption_get_publickey(encryption_t* enc, buffer_t*& out);
@@ -65,6 +72,23 @@ namespace Encryption
     gerror_t AESCrypt(unsigned char* inbuf, uint32_t inbufsize, unsigned char*& outbuf, int* outlen, std::string& key, std::string& iv, bool encrypt);
     
     gerror_t aes256_file(bool should_encrypt, FILE* ifp, FILE* ofp, unsigned char* ckey, unsigned char* ivec);
+    
+    // Computes the SHA-256 of len bytes, in out (HASH_SIZE bytes).
+    gerror_t hash_data(const void* data, size_t len, unsigned char* out);
+    
+    // Computes the SHA-256 of the first len bytes of a file, in out (HASH_SIZE bytes), their CRC32C if crc is not null,
+    // and the CRC32C of each of their blocks of blocksize bytes if blocks is not null.
+    gerror_t hash_file(int fd, uint64_t len, unsigned char* out, uint32_t* crc = nullptr,
+                       uint32_t blocksize = 0, std::vector<uint32_t>* blocks = nullptr);
+    
+    // A SHA-256 computed from bytes given in several parts.
+    typedef EVP_MD_CTX hash_t;
+    
+    hash_t*  hash_create();
+    void     hash_update(hash_t* ctx, const void* data, size_t len);
+    gerror_t hash_update_file(hash_t* ctx, int fd, uint64_t offset, uint64_t len);
+    void     hash_final(hash_t* ctx, unsigned char* out);
+    void     hash_destroy(hash_t* ctx);
 }
 
 typedef Encryption::encryption_t crypt_t;
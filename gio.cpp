@@ -0,0 +1,689 @@
+/*
+ File        : gio.cpp
+ Description : File streams used by transfers, with an io_uring backend on Linux.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "gio.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(__linux__) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       define GIO_HAS_URING 1
+#   endif
+#endif
+
+#ifdef GIO_HAS_URING
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <sys/uio.h>
+#endif
+
+#ifndef O_BINARY
+#   define O_BINARY 0
+#endif
+
+GBEGIN_DECL
+
+#ifdef GIO_HAS_URING
+
+/* ******************************************************************* */
+/*                          io_uring backend                           */
+/* ******************************************************************* */
+
+// liburing is not required : the three system calls and the ring layout are enough here.
+
+struct gio_uring_t
+{
+    int                  fd;
+    uint32_t             entries;
+
+    unsigned*            sq_head;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    struct io_uring_sqe* sqes;
+    uint32_t             tosubmit;
+
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void*                sq_ptr;
+    size_t               sq_size;
+    void*                cq_ptr;
+    size_t               cq_size;
+    size_t               sqes_size;
+};
+
+static int gio_sys_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int gio_sys_enter(int fd, unsigned tosubmit, unsigned mincomplete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, tosubmit, mincomplete, flags, nullptr, 0);
+}
+
+static int gio_sys_register(int fd, unsigned opcode, const void* arg, unsigned nargs)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void gio_uring_destroy(gio_uring_t*& uring)
+{
+    if(!uring)
+        return;
+
+    if(uring->sqes)
+        munmap(uring->sqes, uring->sqes_size);
+    if(uring->cq_ptr && uring->cq_ptr != uring->sq_ptr)
+        munmap(uring->cq_ptr, uring->cq_size);
+    if(uring->sq_ptr)
+        munmap(uring->sq_ptr, uring->sq_size);
+
+    close(uring->fd);
+    delete uring;
+    uring = nullptr;
+}
+
+/** @brief Creates a ring and registers given buffers in it.
+ *  @return nullptr if io_uring can't be used.
+**/
+static gio_uring_t* gio_uring_create(uint32_t entries, unsigned char* buffers, uint32_t count, uint32_t size)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = gio_sys_setup(entries, &p);
+    if(fd < 0)
+        return nullptr;
+
+    gio_uring_t* uring = new gio_uring_t;
+    memset(uring, 0, sizeof(gio_uring_t));
+    uring->fd      = fd;
+    uring->entries = p.sq_entries;
+
+    uring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring->cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+        uring->sq_size = uring->cq_size = std::max(uring->sq_size, uring->cq_size);
+
+    uring->sq_ptr = mmap(nullptr, uring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(uring->sq_ptr == MAP_FAILED) {
+        uring->sq_ptr = nullptr;
+        gio_uring_destroy(uring);
+        return nullptr;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ptr = uring->sq_ptr;
+    }
+    else {
+        uring->cq_ptr = mmap(nullptr, uring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(uring->cq_ptr == MAP_FAILED) {
+            uring->cq_ptr = nullptr;
+            gio_uring_destroy(uring);
+            return nullptr;
+        }
+    }
+
+    uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        gio_uring_destroy(uring);
+        return nullptr;
+    }
+
+    unsigned char* sq = (unsigned char*) uring->sq_ptr;
+    unsigned char* cq = (unsigned char*) uring->cq_ptr;
+    uring->sq_head  = (unsigned*) (sq + p.sq_off.head);
+    uring->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+    uring->sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+    uring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    uring->sqes     = (struct io_uring_sqe*) sqes;
+    uring->cq_head  = (unsigned*) (cq + p.cq_off.head);
+    uring->cq_tail  = (unsigned*) (cq + p.cq_off.tail);
+    uring->cq_mask  = (unsigned*) (cq + p.cq_off.ring_mask);
+    uring->cqes     = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    // Registered buffers are pinned once, instead of at every operation.
+    struct iovec iovs[GIO_BUFCOUNT];
+    for(uint32_t i = 0; i < count && i < GIO_BUFCOUNT; ++i) {
+        iovs[i].iov_base = buffers + i * size;
+        iovs[i].iov_len  = size;
+    }
+
+    if(gio_sys_register(fd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+        gio_uring_destroy(uring);
+        return nullptr;
+    }
+
+    return uring;
+}
+
+/** @brief Queues a fixed-buffer read or write of given slot. It is submitted
+ *  with the next gio_uring_wait().
+**/
+static bool gio_uring_queue(gio_uring_t* uring, uint8_t opcode, int fd, unsigned char* buf, uint32_t idx, uint32_t len, uint64_t offset)
+{
+    unsigned tail = *uring->sq_tail;
+    unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    if(tail - head >= uring->entries)
+        return false;
+
+    unsigned             index = tail & *uring->sq_mask;
+    struct io_uring_sqe* sqe   = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = opcode;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64_t) (uintptr_t) buf;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->buf_index = (uint16_t) idx;
+    sqe->user_data = idx;
+
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring->tosubmit++;
+    return true;
+}
+
+/** @brief Submits the queued operations without waiting for them.
+**/
+static void gio_uring_submit(gio_uring_t* uring)
+{
+    while(uring->tosubmit > 0)
+    {
+        int ret = gio_sys_enter(uring->fd, uring->tosubmit, 0, 0);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return; // gio_uring_wait() will try again.
+
+        uring->tosubmit -= std::min((unsigned) ret, uring->tosubmit);
+    }
+}
+
+/** @brief Submits the queued operations and waits for at least one
+ *  completion, which is stored in its slot.
+**/
+static gerror_t gio_uring_wait(gio_uring_t* uring, gio_slot_t* slots)
+{
+    while(1)
+    {
+        unsigned head = *uring->cq_head;
+        unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if(head != tail && uring->tosubmit == 0)
+        {
+            struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+            if(cqe->user_data < GIO_BUFCOUNT)
+            {
+                slots[cqe->user_data].res  = cqe->res;
+                slots[cqe->user_data].busy = false;
+            }
+            __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return GERROR_NONE;
+        }
+
+        unsigned wait = head != tail ? 0 : 1;
+        int ret = gio_sys_enter(uring->fd, uring->tosubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return GERROR_IO_CANTREAD;
+        }
+
+        uring->tosubmit -= std::min((unsigned) ret, uring->tosubmit);
+    }
+}
+
+#else
+
+struct gio_uring_t { int fd; };
+
+static void gio_uring_destroy(gio_uring_t*&) { }
+static gio_uring_t* gio_uring_create(uint32_t, unsigned char*, uint32_t, uint32_t) { return nullptr; }
+static bool gio_uring_queue(gio_uring_t*, uint8_t, int, unsigned char*, uint32_t, uint32_t, uint64_t) { return false; }
+static void gio_uring_submit(gio_uring_t*) { }
+static gerror_t gio_uring_wait(gio_uring_t*, gio_slot_t*) { return GERROR_NOTIMPLEMENTED; }
+
+#define IORING_OP_READ_FIXED  0
+#define IORING_OP_WRITE_FIXED 0
+
+#endif // GIO_HAS_URING
+
+/* ******************************************************************* */
+/*                             File streams                            */
+/* ******************************************************************* */
+
+////////////////////////////////////////////////////////////
+/** @brief Returns true if io_uring can be used on this system.
+ *  The result is computed once.
+**/
+////////////////////////////////////////////////////////////
+bool gio_uring_available()
+{
+    static int available = -1;
+    if(available < 0)
+    {
+        unsigned char buf[16];
+        gio_uring_t* uring = gio_uring_create(2, buf, 1, sizeof(buf));
+        available = uring ? 1 : 0;
+        gio_uring_destroy(uring);
+    }
+    return available == 1;
+}
+
+static gerror_t gio_open(gio_file_t*& file, int fd, bool writing, bool useuring)
+{
+    file = new gio_file_t;
+    memset(file, 0, sizeof(gio_file_t));
+    file->fd      = fd;
+    file->writing = writing;
+    file->error   = GERROR_NONE;
+
+    if(useuring && gio_uring_available())
+    {
+        file->buffers = (unsigned char*) malloc(GIO_BUFCOUNT * GIO_BUFSIZE);
+        if(file->buffers)
+            file->uring = gio_uring_create(GIO_BUFCOUNT * 2, file->buffers, GIO_BUFCOUNT, GIO_BUFSIZE);
+
+        if(!file->uring && file->buffers) {
+            free(file->buffers);
+            file->buffers = nullptr;
+        }
+    }
+
+    return GERROR_NONE;
+}
+
+/** @brief Waits for given slot to be completed.
+**/
+static gerror_t gio_wait_slot(gio_file_t* file, uint32_t idx)
+{
+    while(file->slots[idx].busy)
+    {
+        gerror_t err = gio_uring_wait(file->uring, file->slots);
+        if(err != GERROR_NONE)
+            return err;
+    }
+
+    gio_slot_t& slot = file->slots[idx];
+    if(slot.res < 0 || (uint32_t) slot.res != slot.len)
+        return file->writing ? GERROR_IO_CANTWRITE : GERROR_IO_CANTREAD;
+
+    return GERROR_NONE;
+}
+
+/** @brief Submits a read of the next part of the file in given slot.
+**/
+static void gio_read_ahead(gio_file_t* file, uint32_t idx)
+{
+    gio_slot_t& slot = file->slots[idx];
+    slot.offset = file->offset;
+    slot.len    = (uint32_t) std::min<uint64_t>(GIO_BUFSIZE, file->size - file->offset);
+    slot.pos    = 0;
+    slot.res    = 0;
+
+    if(slot.len == 0)
+        return;
+
+    if(gio_uring_queue(file->uring, IORING_OP_READ_FIXED, file->fd, file->buffers + idx * GIO_BUFSIZE, idx, slot.len, slot.offset))
+    {
+        slot.busy     = true;
+        file->offset += slot.len;
+    }
+    else
+    {
+        slot.len = 0;
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Opens a file to read it sequentially.
+ *
+ *  With io_uring, the first GIO_BUFCOUNT buffers are read immediately
+ *  in the background.
+ *
+ *  @param file     : A pointer to null, filled with the file.
+ *  @param filename : File to open.
+ *  @param useuring : False to never use io_uring.
+ *
+ *  @return
+ *  - GERROR_NONE         : File opened. Its size is in file->size.
+ *  - GERROR_BADARGS      : file is not null or filename is null.
+ *  - GERROR_CANTOPENFILE : The file can't be opened.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_open_read(gio_file_t*& file, const char* filename, bool useuring)
+{
+    if(file || !filename)
+        return GERROR_BADARGS;
+
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if(fd < 0)
+        return GERROR_CANTOPENFILE;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return GERROR_CANTOPENFILE;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    // The file is read from start to end, so the kernel reads further ahead.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    gio_open(file, fd, false, useuring);
+    file->size = (uint64_t) st.st_size;
+
+    if(file->uring)
+    {
+        for(uint32_t i = 0; i < GIO_BUFCOUNT; ++i)
+            gio_read_ahead(file, i);
+        gio_uring_submit(file->uring);
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Opens (and truncates) a file to write it sequentially.
+ *  @see gio_open_read() for the arguments.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_open_write(gio_file_t*& file, const char* filename, bool useuring)
+{
+    if(file || !filename)
+        return GERROR_BADARGS;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if(fd < 0)
+        return GERROR_CANTOPENFILE;
+
+    return gio_open(file, fd, true, useuring);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Reads exactly len bytes from the file.
+ *
+ *  @return
+ *  - GERROR_NONE        : data is filled.
+ *  - GERROR_IO_CANTREAD : The file is too short or can't be read.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_read(gio_file_t* file, void* data, size_t len)
+{
+    if(!file || file->writing || (!data && len))
+        return GERROR_BADARGS;
+
+    unsigned char* out = (unsigned char*) data;
+
+    if(!file->uring)
+    {
+        while(len > 0)
+        {
+            ssize_t ret = read(file->fd, out, len);
+            if(ret < 0 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+                return GERROR_IO_CANTREAD;
+            out += ret;
+            len -= ret;
+        }
+        return GERROR_NONE;
+    }
+
+    while(len > 0)
+    {
+        uint32_t    idx  = file->current;
+        gio_slot_t& slot = file->slots[idx];
+        if(slot.len == 0)
+            return GERROR_IO_CANTREAD;
+
+        gerror_t err = gio_wait_slot(file, idx);
+        if(err != GERROR_NONE)
+            return err;
+
+        size_t n = std::min<size_t>(len, slot.len - slot.pos);
+        memcpy(out, file->buffers + idx * GIO_BUFSIZE + slot.pos, n);
+        slot.pos += n;
+        out      += n;
+        len      -= n;
+
+        if(slot.pos == slot.len)
+        {
+            // The buffer is consumed : it reads the next part of the file while we
+            // use the other ones.
+            gio_read_ahead(file, idx);
+            gio_uring_submit(file->uring);
+            file->current = (idx + 1) % GIO_BUFCOUNT;
+        }
+    }
+
+    return GERROR_NONE;
+}
+
+/** @brief Submits the write of the current slot and moves to the next one.
+**/
+static gerror_t gio_flush_slot(gio_file_t* file)
+{
+    uint32_t    idx  = file->current;
+    gio_slot_t& slot = file->slots[idx];
+    if(slot.len == 0)
+        return GERROR_NONE;
+
+    slot.offset = file->offset;
+    if(!gio_uring_queue(file->uring, IORING_OP_WRITE_FIXED, file->fd, file->buffers + idx * GIO_BUFSIZE, idx, slot.len, slot.offset))
+        return GERROR_IO_CANTWRITE;
+
+    slot.busy     = true;
+    file->offset += slot.len;
+    file->current = (idx + 1) % GIO_BUFCOUNT;
+    gio_uring_submit(file->uring);
+
+    // The next slot may still be written : wait for it before filling it.
+    gio_slot_t& next = file->slots[file->current];
+    if(next.busy || next.len)
+    {
+        gerror_t err = gio_wait_slot(file, file->current);
+        next.len = 0;
+        if(err != GERROR_NONE)
+            return err;
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Writes len bytes at the end of the file.
+ *
+ *  With io_uring, data is copied in a buffer and written in the
+ *  background. An error may so be returned by a later call, or by
+ *  gio_close().
+ *
+ *  @return
+ *  - GERROR_NONE         : data is written (or will be).
+ *  - GERROR_IO_CANTWRITE : The file can't be written.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_write(gio_file_t* file, const void* data, size_t len)
+{
+    if(!file || !file->writing || (!data && len))
+        return GERROR_BADARGS;
+
+    if(file->error != GERROR_NONE)
+        return file->error;
+
+    const unsigned char* in = (const unsigned char*) data;
+
+    if(!file->uring)
+    {
+        while(len > 0)
+        {
+            ssize_t ret = write(file->fd, in, len);
+            if(ret < 0 && errno == EINTR)
+                continue;
+            if(ret <= 0)
+                return file->error = GERROR_IO_CANTWRITE;
+            in  += ret;
+            len -= ret;
+        }
+        return GERROR_NONE;
+    }
+
+    while(len > 0)
+    {
+        gio_slot_t& slot = file->slots[file->current];
+        size_t      n    = std::min<size_t>(len, GIO_BUFSIZE - slot.len);
+
+        memcpy(file->buffers + file->current * GIO_BUFSIZE + slot.len, in, n);
+        slot.len += n;
+        in       += n;
+        len      -= n;
+
+        if(slot.len == GIO_BUFSIZE)
+        {
+            gerror_t err = gio_flush_slot(file);
+            if(err != GERROR_NONE)
+                return file->error = err;
+        }
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Waits for every pending operation and closes the file.
+ *
+ *  @return
+ *  - GERROR_NONE : File closed.
+ *  - Any error of a pending write.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_close(gio_file_t*& file)
+{
+    if(!file)
+        return GERROR_BADARGS;
+
+    gerror_t err = file->error;
+
+    if(file->uring)
+    {
+        if(file->writing && err == GERROR_NONE)
+            err = gio_flush_slot(file);
+
+        // Every submitted operation must be completed before its buffer is freed. Writes
+        // completed while waiting for another one are only checked here.
+        for(uint32_t i = 0; i < GIO_BUFCOUNT; ++i)
+        {
+            gio_slot_t& slot = file->slots[i];
+            if(!slot.busy && !(file->writing && slot.len))
+                continue;
+
+            gerror_t serr = gio_wait_slot(file, i);
+            if(file->writing && err == GERROR_NONE)
+                err = serr;
+        }
+
+        gio_uring_destroy(file->uring);
+        free(file->buffers);
+    }
+
+    close(file->fd);
+    delete file;
+    file = nullptr;
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sets the size of an opened file to len bytes, and reserves its
+ *  blocks on the disk when the file system supports it, so they are not
+ *  allocated one by one while the file is written.
+ *
+ *  @return
+ *  - GERROR_NONE         : The file has len bytes.
+ *  - GERROR_BADARGS      : fd is invalid.
+ *  - GERROR_IO_CANTWRITE : The file can't be resized.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_allocate(int fd, uint64_t len)
+{
+    if(fd < 0)
+        return GERROR_BADARGS;
+
+    if(ftruncate(fd, (off_t) len) != 0)
+        return GERROR_IO_CANTWRITE;
+
+#ifdef __linux__
+    // If the file system can't, the file is only sparse.
+    if(len > 0)
+        fallocate(fd, 0, 0, (off_t) len);
+#endif
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Makes len bytes of an opened file, from offset, read as zeros.
+ *  They are made a hole when the file system supports it, otherwise zeros
+ *  are written.
+ *
+ *  @return
+ *  - GERROR_NONE         : The bytes are zeros.
+ *  - GERROR_BADARGS      : fd is invalid.
+ *  - GERROR_IO_CANTWRITE : The file can't be written.
+**/
+////////////////////////////////////////////////////////////
+gerror_t gio_zero(int fd, uint64_t offset, uint64_t len)
+{
+    if(fd < 0)
+        return GERROR_BADARGS;
+
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if(len == 0 || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) offset, (off_t) len) == 0)
+        return GERROR_NONE;
+#endif
+
+    static const unsigned char zeros[GIO_BUFSIZE] = { 0 };
+    while(len > 0)
+    {
+        ssize_t ret = pwrite(fd, zeros, (size_t) std::min<uint64_t>(len, GIO_BUFSIZE), (off_t) offset);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+            return GERROR_IO_CANTWRITE;
+        offset += (uint64_t) ret;
+        len    -= (uint64_t) ret;
+    }
+
+    return GERROR_NONE;
+}
+
+GEND_DECL
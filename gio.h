@@ -0,0 +1,85 @@
+/*
+ File        : gio.h
+ Description : File streams used by transfers, with an io_uring backend on Linux.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GIO__H
+#define __GIO__H
+
+#include "prerequesites.h"
+
+GBEGIN_DECL
+
+#define GIO_BUFSIZE   (64 * 1024) // Size of one registered buffer.
+#define GIO_BUFCOUNT  8           // Number of buffers in flight for one file.
+
+typedef struct gio_uring_t gio_uring_t;
+
+/** @brief State of one buffer of a file.
+**/
+typedef struct gio_slot_t
+{
+    uint64_t offset;   // Offset in the file of the buffer.
+    uint32_t len;      // Bytes of the buffer used (to write, or requested to read).
+    uint32_t pos;      // [Reading] Bytes of the buffer already given to the caller.
+    int32_t  res;      // Result of the operation, once completed.
+    bool     busy;     // True if an operation is submitted and not completed.
+} gio_slot_t;
+
+/** @brief A file read or written sequentially by a transfer.
+ *
+ *  With io_uring, reads are submitted ahead of the caller and writes are
+ *  only waited for when their buffer is needed again, so the disk works
+ *  while the caller is sending or receiving packets. Without it, every
+ *  call is a plain read() or write().
+ *
+ *  Only the file goes through the ring : the packets are still sent and
+ *  received by the transport, one call at a time. Chunked transfers do
+ *  not use these streams, they move the bytes between the file and the
+ *  socket with transport_sendfile() and transport_recvfile().
+**/
+typedef struct gio_file_t
+{
+    int           fd;
+    bool          writing;
+    uint64_t      size;                 // [Reading] Size of the file.
+    uint64_t      offset;               // Next offset to submit.
+    uint32_t      current;              // Slot being filled (writing) or read (reading).
+    gerror_t      error;                // First error of an asynchronous operation.
+
+    gio_uring_t*  uring;                // Null if io_uring is not used.
+    unsigned char* buffers;             // GIO_BUFCOUNT buffers of GIO_BUFSIZE bytes, registered in uring.
+    gio_slot_t    slots[GIO_BUFCOUNT];
+} gio_file_t;
+
+bool     gio_uring_available ();
+
+gerror_t gio_open_read  (gio_file_t*& file, const char* filename, bool useuring = true);
+gerror_t gio_open_write (gio_file_t*& file, const char* filename, bool useuring = true);
+gerror_t gio_read       (gio_file_t* file, void* data, size_t len);
+gerror_t gio_write      (gio_file_t* file, const void* data, size_t len);
+gerror_t gio_close      (gio_file_t*& file);
+gerror_t gio_allocate   (int fd, uint64_t len);
+gerror_t gio_zero       (int fd, uint64_t offset, uint64_t len);
+
+GEND_DECL
+
+#endif // __GIO__H
@@ -28,9 +28,15 @@
 #include "server.h"
 #include "database.h"
 #include "serverlistener.h"
+#include "simulation.h"
+#include "broadcast.h"
+#include <algorithm> // std::min
 
 using namespace Gangtella;
 
+// Server driven by the console.
+server_t server;
+
 void treat_command(const std::string& command)
 {
     std::vector<std::string> args;
@@ -53,13 +59,28 @@ void treat_command(const std::string& command)
         {
             if(args.size() > 2)
             {
-                client_t* to = server_find_client_by_name(&server, args[1]);
-                if(to != NULL && to->mirror != NULL)
+                char buffer[SERVER_MAXBUFSIZE];
+                memset(buffer, 0, SERVER_MAXBUFSIZE);
+                memcpy(buffer, command.c_str() + 8 + args[1].size() + 1, std::min<size_t>(command.size() - 8 - args[1].size() - 1, SERVER_MAXBUFSIZE - 1));
+                
+                // The message is sent again if the connection is closed before the client
+                // acknowledges it, and spooled if we are not connected.
+                gerror_t err = server_send_sequenced(&server, args[1], PT_CLIENT_MESSAGE, buffer, strlen(buffer) + 1);
+                if(err == GERROR_CANT_SEND_PACKET)
+                {
+                    err = server_spool(&server, args[1], SPOOL_MESSAGE, buffer, strlen(buffer) + 1);
+                    if(err == GERROR_NONE)
+                    {
+                        cout << "[Command] '" << args[1] << "' is not connected, message spooled." << endl;
+                    }
+                    else
+                    {
+                        cout << "[Command] '" << args[1] << "' is not connected : " << gerror_to_string(err) << endl;
+                    }
+                }
+                else if(err != GERROR_NONE)
                 {
-                    char buffer[SERVER_MAXBUFSIZE];
-                    memset(buffer, 0, SERVER_MAXBUFSIZE);
-                    memcpy(buffer, command.c_str() + 8 + args[1].size() + 1, command.size() - 8 - args[1].size() - 1);
-                    client_send_cryptpacket(to->mirror, PT_CLIENT_MESSAGE, buffer, SERVER_MAXBUFSIZE);
+                    cout << "[Command] Can't send message to '" << args[1] << "' : " << gerror_to_string(err) << endl;
                 }
             }
 
@@ -68,6 +89,9 @@ void treat_command(const std::string& command)
                 cout << "[Command]<help> message [client name] [message]"        << endl;
                 cout << "[Command]<help> Send a message to given active client." << endl;
             }
+
+            // The message is sent from the console thread, so no async command will end it.
+            cancel_command = true;
         }
 
 
@@ -75,13 +99,36 @@ void treat_command(const std::string& command)
         {
             if(args.size() > 1)
             {
-                for(unsigned int i = 0; i < server.clients.size(); ++i)
+                // The receiver reads a whole ClientMessagePacket.
+                char buffer[SERVER_MAXBUFSIZE];
+                memset(buffer, 0, SERVER_MAXBUFSIZE);
+                memcpy(buffer, command.c_str() + 11, std::min<size_t>(command.size() - 11, SERVER_MAXBUFSIZE - 1));
+                
+                // With a multicast tree, we only send the message to our children.
+                broadcast_t* broadcast = nullptr;
+                gerror_t     err       = server.args.multicast > 0 ?
+                                         broadcast_multicast(&server, buffer, server.args.multicast, broadcast) :
+                                         broadcast_send(&server, PT_CLIENT_MESSAGE, buffer, SERVER_MAXBUFSIZE, broadcast);
+                if(err == GERROR_NONE)
                 {
-                    client_t* to = &(server.clients[i]);
-                    if(to != NULL && to->mirror != NULL)
+                    broadcast_wait(broadcast, BROADCAST_TIMEOUT);
+                    
+                    uint32_t delivered = 0;
+                    for(unsigned int i = 0; i < broadcast->peers.size(); ++i)
                     {
-                        client_send_packet(to, PT_CLIENT_MESSAGE, command.c_str() + 11, command.size() - 11);
+                        const broadcast_peer_t& peer = broadcast->peers[i];
+                        if(peer.status == GERROR_NONE)
+                        {
+                            delivered++;
+                        }
+                        else
+                        {
+                            cout << "[Command] Message not delivered to '" << peer.name << "' : " << gerror_to_string(peer.status) << "." << endl;
+                        }
                     }
+                    
+                    cout << "[Command] Message delivered to " << delivered << "/" << broadcast->peers.size() << (server.args.multicast > 0 ? " children in " : " clients in ") << (timer_monotonic_us() - broadcast->start) / 1000 << " ms." << endl;
+                    broadcast_destroy(broadcast);
                 }
             }
 
@@ -90,6 +137,8 @@ void treat_command(const std::string& command)
                 cout << "[Command]<help> messageall [message]"                    << endl;
                 cout << "[Command]<help> Send a message to every active clients." << endl;
             }
+
+            cancel_command = true;
         }
 
 
@@ -141,7 +190,37 @@ void treat_command(const std::string& command)
 
         else if(args[0] == "version")
         {
-            async_command_launch(CMD_VERSION, args, globalsession.server);
+            async_command_launch(CMD_VERSION, args, globalsession->server);
+        }
+        
+        else if(args[0] == "peers")
+        {
+            async_command_launch(CMD_PEERS, args, &server);
+        }
+        
+        else if(args[0] == "users")
+        {
+            async_command_launch(CMD_USERS, args, &server);
+        }
+        
+        else if(args[0] == "subscribe")
+        {
+            async_command_launch(CMD_SUBSCRIBE, args, &server);
+        }
+        
+        else if(args[0] == "unsubscribe")
+        {
+            async_command_launch(CMD_UNSUBSCRIBE, args, &server);
+        }
+        
+        else if(args[0] == "publish")
+        {
+            async_command_launch(CMD_PUBLISH, args, &server);
+        }
+        
+        else if(args[0] == "relay")
+        {
+            async_command_launch(CMD_RELAY, args, &server);
         }
         
         else
@@ -151,7 +230,7 @@ void treat_command(const std::string& command)
     }
     
     if(cancel_command == true)
-        globalsession._treatingcommand = false;
+        globalsession->_treatingcommand = false;
 
     console_last_command = command;
 }
@@ -205,6 +284,48 @@ void display_help()
     << " --max-buffer  : Specify the Maximum buffer size for a packet. "    << endl; cout
     << "                 Default is 1096."                                  << endl; cout
     << " --no-ssl      : Begins a session without OpenSSL (at your own risk.)" << endl; cout
+    << " --warmup      : Reconnects at startup to the N most recently used known" << endl; cout
+    << "                 clients. Default is 0 (disabled)."                 << endl; cout
+    << " --warmup-parallel : Maximum number of warm-up connections opened at the" << endl; cout
+    << "                 same time. Default is 4."                          << endl; cout
+    << " --supervise   : Keeps opened clients connected, reconnecting them with" << endl; cout
+    << "                 a backoff when the connection is lost."            << endl; cout
+    << " --local-socket : Also listens on a Unix-domain socket, and uses it to" << endl; cout
+    << "                 connect servers on this host. Servers of the same user" << endl; cout
+    << "                 are trusted (no encryption, no user acceptation)." << endl; cout
+    << " --no-shared-memory : Do not send files to trusted local servers through" << endl; cout
+    << "                 a shared memory ring."                             << endl; cout
+    << " --no-io-uring : Do not use io_uring to read and write transfered files." << endl; cout
+    << " --multicast   : messageall goes down a multicast tree where every server" << endl; cout
+    << "                 forwards it to at most N children. Default is 0 (sent" << endl; cout
+    << "                 directly to every client)."                        << endl; cout
+    << " --gossip      : Every N ms, exchanges a digest of the known peers with a" << endl; cout
+    << "                 random client, to learn the peers we miss. Default is" << endl; cout
+    << "                 0 (disabled)."                                     << endl; cout
+    << " --spool-dir   : Directory where messages and files to peers which are" << endl; cout
+    << "                 not connected are kept. Default is 'spool'."       << endl; cout
+    << " --spool-quota : Maximum size (KB) kept for one peer. Default is 16384," << endl; cout
+    << "                 0 disables the spool."                             << endl; cout
+    << " --spool-ttl   : Time (s) a spooled message is kept. Default is 604800." << endl; cout
+    << " --chunk-size  : Size (KB) of the chunks of the files sent, from 64 to" << endl; cout
+    << "                 8192, rounded down to a multiple of 64. Default is 1024." << endl; cout
+    << " --streams     : Number of connections the chunks of a file are sent on," << endl; cout
+    << "                 at the same time. Default is 4."                   << endl; cout
+    << " --write-behind : Size (KB) of the received chunks waiting to be written" << endl; cout
+    << "                 by the disk thread. Default is 32768, 0 writes them" << endl; cout
+    << "                 from the connection."                              << endl; cout
+    << " --direct-io   : Writes the received files with O_DIRECT."          << endl; cout
+    << " --simulate    : Runs N servers in this process over an in-memory" << endl; cout
+    << "                 network, without encryption, prints the results and returns." << endl; cout
+    << " --sim-topology : 'fanout' (node 0 connects to every node) or 'ring'." << endl; cout
+    << "                 Default is fanout."                                << endl; cout
+    << " --sim-packets : Chunks sent on every simulated connection. Default is 16." << endl; cout
+    << " --sim-latency : One-way latency (us) of the simulated links. Default is 0." << endl; cout
+    << " --sim-bandwidth : Bandwidth (KB/s) of the simulated links. Default is 0" << endl; cout
+    << "                 (unlimited)."                                      << endl; cout
+    << " --sim-loss    : Percentage of lost segments on the simulated links." << endl; cout
+    << " --sim-tcp     : Simulated nodes use TCP on this host, listening from given" << endl; cout
+    << "                 port, instead of the in-memory network."         << endl; cout
     << " --logfile-info : Sets the file to redirect info log." << endl; cout
     << " --logfile-warn : Sets the file to redirect warning log." << endl; cout
     << " --logfile-err  : Sets the file to redirect error log." << endl; cout
@@ -215,11 +336,14 @@ void display_help()
     << " --usr-help    : Show a help text on how to connect to the Network."<< endl; cout
     << " --version     : Show the version number."                          << endl; cout
     << " --test-unit-a : Launch the program as Test Unit A (s-port=8888, dbname=a," << endl; cout
-    << "                 dbpass=a, s-name=a, username=a, userpass=a, log=a.log)" << endl; cout
+    << "                 dbpass=a, s-name=a, username=a, userpass=a, log=a.log," << endl; cout
+    << "                 local-socket)" << endl; cout
     << " --test-unit-b : Launch the program as Test Unit B (s-port=7777, dbname=b," << endl; cout
-    << "                 dbpass=b, s-name=b, username=b, userpass=b, log=b.log)" << endl; cout
+    << "                 dbpass=b, s-name=b, username=b, userpass=b, log=b.log," << endl; cout
+    << "                 local-socket)" << endl; cout
     << " --test-unit-c : Launch the program as Test Unit C (s-port=9999, dbname=c," << endl; cout
-    << "                 dbpass=c, s-name=c, username=c, userpass=c, log=c.log)" << endl;
+    << "                 dbpass=c, s-name=c, username=c, userpass=c, log=c.log," << endl; cout
+    << "                 local-socket)" << endl;
 
 }
 
@@ -262,6 +386,21 @@ int main(int argc, char* argv[])
     server.args.maxclients    = 10;
     server.args.maxbufsize    = 1024;
     server.args.withssl       = true;
+    server.args.warmup        = 0;
+    server.args.warmupparallel = 4;
+    server.args.supervise     = false;
+    server.args.localsocket   = false;
+    server.args.sharedmemory  = true;
+    server.args.iouring       = true;
+    server.args.multicast     = 0;
+    server.args.gossip        = 0;
+    server.args.spooldir      = "spool";
+    server.args.spoolquota    = 16384;
+    server.args.spoolttl      = 604800;
+    server.args.chunksize     = 1048576;
+    server.args.streams       = 4;
+    server.args.writebehind   = 32768;
+    server.args.directio      = false;
 
     std::string username("");
     std::string ncuserpass("");
@@ -273,6 +412,14 @@ int main(int argc, char* argv[])
     FILE* logerr  = nullptr;
     
     bool showVersionAndReturn = false;
+    
+    simulation_args_t simargs;
+    simargs.nodes    = 0;
+    simargs.topology = ST_FANOUT;
+    simargs.packets  = 16;
+    simargs.link     = transport_link_t();
+    simargs.tcpport  = 0;
+    simargs.model    = &server;
 
     for(int i = 0; i < argc; ++i)
     {
@@ -296,6 +443,111 @@ int main(int argc, char* argv[])
             server.args.maxbufsize = atoi(argv[i+1]);
             i++;
         }
+        else if(std::string("--warmup") == argv[i])
+        {
+            server.args.warmup = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--warmup-parallel") == argv[i])
+        {
+            server.args.warmupparallel = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--supervise") == argv[i])
+        {
+            server.args.supervise = true;
+        }
+        else if(std::string("--local-socket") == argv[i])
+        {
+            server.args.localsocket = true;
+        }
+        else if(std::string("--no-shared-memory") == argv[i])
+        {
+            server.args.sharedmemory = false;
+        }
+        else if(std::string("--no-io-uring") == argv[i])
+        {
+            server.args.iouring = false;
+        }
+        else if(std::string("--multicast") == argv[i])
+        {
+            server.args.multicast = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--gossip") == argv[i])
+        {
+            server.args.gossip = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--spool-dir") == argv[i])
+        {
+            server.args.spooldir = argv[i+1];
+            i++;
+        }
+        else if(std::string("--spool-quota") == argv[i])
+        {
+            server.args.spoolquota = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--spool-ttl") == argv[i])
+        {
+            server.args.spoolttl = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--chunk-size") == argv[i])
+        {
+            server.args.chunksize = atoi(argv[i+1]) * 1024;
+            i++;
+        }
+        else if(std::string("--streams") == argv[i])
+        {
+            server.args.streams = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--write-behind") == argv[i])
+        {
+            server.args.writebehind = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--direct-io") == argv[i])
+        {
+            server.args.directio = true;
+        }
+        else if(std::string("--simulate") == argv[i])
+        {
+            simargs.nodes = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--sim-topology") == argv[i])
+        {
+            simargs.topology = std::string("ring") == argv[i+1] ? ST_RING : ST_FANOUT;
+            i++;
+        }
+        else if(std::string("--sim-packets") == argv[i])
+        {
+            simargs.packets = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--sim-latency") == argv[i])
+        {
+            simargs.link.latency = atoi(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--sim-bandwidth") == argv[i])
+        {
+            simargs.link.bandwidth = strtoull(argv[i+1], nullptr, 10) * 1024;
+            i++;
+        }
+        else if(std::string("--sim-loss") == argv[i])
+        {
+            simargs.link.loss = atof(argv[i+1]);
+            i++;
+        }
+        else if(std::string("--sim-tcp") == argv[i])
+        {
+            simargs.tcpport = (uint16_t) atoi(argv[i+1]);
+            i++;
+        }
         else if(std::string("--help") == argv[i])
         {
             display_help();
@@ -354,6 +606,7 @@ int main(int argc, char* argv[])
             server.args.port = 8888;
             server.args.name = "A";
             dbname           = "test-unit-a.db";
+            server.args.localsocket = true;
             ncdbpass         = "a";
             username         = "a";
             ncuserpass       = "a";
@@ -367,6 +620,7 @@ int main(int argc, char* argv[])
             server.args.port = 7777;
             server.args.name = "B";
             dbname           = "test-unit-b.db";
+            server.args.localsocket = true;
             ncdbpass         = "b";
             username         = "b";
             ncuserpass       = "b";
@@ -380,6 +634,7 @@ int main(int argc, char* argv[])
             server.args.port = 9999;
             server.args.name = "C";
             dbname           = "test-unit-c.db";
+            server.args.localsocket = true;
             ncdbpass         = "c";
             username         = "c";
             ncuserpass       = "c";
@@ -398,6 +653,13 @@ int main(int argc, char* argv[])
     gnotifiate_info("GangTella v.%s.", GANGTELLA_VERSION);
     if(showVersionAndReturn) return EXIT_SUCCESS;
     
+    if(simargs.nodes > 0) {
+        gerror_t err = simulation_run(simargs);
+        if(err != GERROR_NONE)
+            gnotifiate_error("[Main] Simulation failed : %s", gerror_to_string(err));
+        return err == GERROR_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    
     // Register our listener.
     TestServerListener* tsl = new TestServerListener;
     server.addListener(tsl);
@@ -554,11 +816,7 @@ int main(int argc, char* argv[])
         exit(GERROR_USR_BADPSWD);
     }
 
-    // Now, we have a valid session.
-
-    globalsession.database = database;
-    globalsession.user     = user;
-    globalsession.server   = &server;
+    // Now, we have a valid session. It is given to the server once created.
 
     // In debug mode, we display some usefull informations for the running user.
 
@@ -573,8 +831,12 @@ int main(int argc, char* argv[])
 
     // Creating the server to accept connections.
 
-    server_create();
-    server_initialize();
+    server_create(&server);
+    server.session.database = database;
+    server_login_user(&server, user);
+    globalsession           = &server.session;
+    
+    server_initialize(&server);
 
     // User always should use the Crypted version, but at his own risk he can use the
     // noncrypted one. Thought other server may require that yours should be using
@@ -613,12 +875,47 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
 
-    globalsession._treatingcommand = false;
+    // Start the supervisor before the warm-up, so warm-up peers are supervised.
+    if(server.args.supervise)
+    {
+        if(server_supervisor_start(&server) != GERROR_NONE)
+        {
+            cout << "[Main] Can't start the clients supervisor." << endl;
+        }
+    }
+
+    // Learn the peers known by our clients, if asked.
+    if(server.args.gossip > 0)
+    {
+        if(server_gossip_start(&server) != GERROR_NONE)
+        {
+            cout << "[Main] Can't start gossiping about known peers." << endl;
+        }
+    }
+
+    // Reconnect to the known clients in background, if asked.
+    if(server.args.warmup > 0)
+    {
+        if(server_warmup(&server, globalsession->user, server.args.warmup, server.args.warmupparallel) != GERROR_NONE)
+        {
+            cout << "[Main] Can't start warm-up of known clients." << endl;
+        }
+    }
+
+    globalsession->_treatingcommand = false;
     std::string tmp;
     while(1)
     {
         char buf[server.args.maxbufsize];
-        cout << "@" << (const char*) globalsession.user->m_name->buf << ":> "; gthread_mutex_unlock(&__console_mutex);
+        
+        // Every user may have been unlogged by the last command.
+        std::string prompt;
+        gthread_mutex_lock(&server.mutex);
+        if(globalsession->user)
+            prompt = (const char*) globalsession->user->m_name->buf;
+        gthread_mutex_unlock(&server.mutex);
+        
+        cout << "@" << prompt << ":> "; gthread_mutex_unlock(&__console_mutex);
         std::cin.getline(buf, server.args.maxbufsize - 1);
         tmp = buf;
         if(tmp == "exit")
@@ -630,14 +927,14 @@ int main(int argc, char* argv[])
         }
         else
         {
-            globalsession._treatingcommand = true;
+            globalsession->_treatingcommand = true;
             treat_command(tmp);
-            while(globalsession._treatingcommand);
+            while(globalsession->_treatingcommand);
         }
     }
     
-    cout << "[Main] Saving database '" << globalsession.database->m_name->buf << "'." << endl;
-    database_save(globalsession.database);
+    cout << "[Main] Saving database '" << globalsession->database->m_name->buf << "'." << endl;
+    database_save(globalsession->database);
     
     // Cleaning our listener
     server.removeListener(tsl);
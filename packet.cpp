@@ -30,11 +30,12 @@ GBEGIN_DECL
 template <> send_file_t serialize(const send_file_t& src)
 {
     send_file_t sft;
-    sft.lenght         = serialize<size_t>(src.lenght);
+    sft.lenght         = serialize<uint64_t>(src.lenght);
     sft.chunk_lenght   = serialize<uint32_t>(src.chunk_lenght);
     sft.chunk_lastsize = serialize<uint32_t>(src.chunk_lastsize);
-    sft.chunk_count    = serialize<uint32_t>(src.chunk_count);
+    sft.chunk_count    = serialize<uint64_t>(src.chunk_count);
     sft.has_chunk      = src.has_chunk;
+    sft.via_ring       = src.via_ring;
     memcpy(sft.name, src.name, SERVER_MAXBUFSIZE);
     return sft;
 }
@@ -42,11 +43,12 @@ template <> send_file_t serialize(const send_file_t& src)
 template <> send_file_t deserialize(const send_file_t& src)
 {
     send_file_t sft;
-    sft.lenght         = deserialize<size_t>(src.lenght);
+    sft.lenght         = deserialize<uint64_t>(src.lenght);
     sft.chunk_lenght   = deserialize<uint32_t>(src.chunk_lenght);
     sft.chunk_lastsize = deserialize<uint32_t>(src.chunk_lastsize);
-    sft.chunk_count    = deserialize<uint32_t>(src.chunk_count);
+    sft.chunk_count    = deserialize<uint64_t>(src.chunk_count);
     sft.has_chunk      = src.has_chunk;
+    sft.via_ring       = src.via_ring;
     memcpy(sft.name, src.name, SERVER_MAXBUFSIZE);
     return sft;
 }
@@ -91,6 +93,295 @@ template <> encrypted_info_t deserialize(const encrypted_info_t& src)
     return eit;
 }
 
+template <> multicast_t serialize(const multicast_t& src)
+{
+    multicast_t mt;
+    mt.id     = serialize<uint64_t>(src.id);
+    mt.fanout = src.fanout;
+    mt.hops   = src.hops;
+    memcpy(mt.origin,  src.origin,  SERVER_MAXBUFSIZE);
+    memcpy(mt.lo,      src.lo,      SERVER_MAXBUFSIZE);
+    memcpy(mt.hi,      src.hi,      SERVER_MAXBUFSIZE);
+    memcpy(mt.message, src.message, SERVER_MAXBUFSIZE);
+    return mt;
+}
+
+template <> multicast_t deserialize(const multicast_t& src)
+{
+    multicast_t mt;
+    mt.id     = deserialize<uint64_t>(src.id);
+    mt.fanout = src.fanout;
+    mt.hops   = src.hops;
+    memcpy(mt.origin,  src.origin,  SERVER_MAXBUFSIZE);
+    memcpy(mt.lo,      src.lo,      SERVER_MAXBUFSIZE);
+    memcpy(mt.hi,      src.hi,      SERVER_MAXBUFSIZE);
+    memcpy(mt.message, src.message, SERVER_MAXBUFSIZE);
+    return mt;
+}
+
+template <> multicast_reached_t serialize(const multicast_reached_t& src)
+{
+    multicast_reached_t mrt;
+    mrt.id   = serialize<uint64_t>(src.id);
+    mrt.last = src.last;
+    memcpy(mrt.names, src.names, SERVER_MAXBUFSIZE);
+    return mrt;
+}
+
+template <> multicast_reached_t deserialize(const multicast_reached_t& src)
+{
+    multicast_reached_t mrt;
+    mrt.id   = deserialize<uint64_t>(src.id);
+    mrt.last = src.last;
+    memcpy(mrt.names, src.names, SERVER_MAXBUFSIZE);
+    return mrt;
+}
+
+template <> route_info_t serialize(const route_info_t& src)
+{
+    route_info_t rit;
+    rit.id   = serialize<uint64_t>(src.id);
+    rit.ttl  = src.ttl;
+    rit.hops = src.hops;
+    memcpy(rit.origin,      src.origin,      SERVER_MAXBUFSIZE);
+    memcpy(rit.destination, src.destination, SERVER_MAXBUFSIZE);
+    buffer_copy(rit.pubkey, src.pubkey);
+    return rit;
+}
+
+template <> route_info_t deserialize(const route_info_t& src)
+{
+    route_info_t rit;
+    rit.id   = deserialize<uint64_t>(src.id);
+    rit.ttl  = src.ttl;
+    rit.hops = src.hops;
+    memcpy(rit.origin,      src.origin,      SERVER_MAXBUFSIZE);
+    memcpy(rit.destination, src.destination, SERVER_MAXBUFSIZE);
+    buffer_copy(rit.pubkey, src.pubkey);
+    return rit;
+}
+
+template <> relay_t serialize(const relay_t& src)
+{
+    relay_t rt;
+    memcpy(rt.origin,      src.origin,      SERVER_MAXBUFSIZE);
+    memcpy(rt.destination, src.destination, SERVER_MAXBUFSIZE);
+    rt.ttl         = src.ttl;
+    rt.ptype       = src.ptype;
+    rt.crypted     = src.crypted;
+    rt.size        = serialize<uint32_t>(src.size);
+    rt.payloadsize = serialize<uint32_t>(src.payloadsize);
+    rt.signaturesize = serialize<uint32_t>(src.signaturesize);
+    memcpy(rt.signature, src.signature, RSA_SIZE);
+    memcpy(rt.payload, src.payload, RELAY_MAXPAYLOAD);
+    return rt;
+}
+
+template <> relay_t deserialize(const relay_t& src)
+{
+    relay_t rt;
+    memcpy(rt.origin,      src.origin,      SERVER_MAXBUFSIZE);
+    memcpy(rt.destination, src.destination, SERVER_MAXBUFSIZE);
+    rt.ttl         = src.ttl;
+    rt.ptype       = src.ptype;
+    rt.crypted     = src.crypted;
+    rt.size        = deserialize<uint32_t>(src.size);
+    rt.payloadsize = deserialize<uint32_t>(src.payloadsize);
+    rt.signaturesize = deserialize<uint32_t>(src.signaturesize);
+    memcpy(rt.signature, src.signature, RSA_SIZE);
+    memcpy(rt.payload, src.payload, RELAY_MAXPAYLOAD);
+    return rt;
+}
+
+template <> gossip_digest_t serialize(const gossip_digest_t& src)
+{
+    gossip_digest_t gdt;
+    gdt.seed  = serialize<uint32_t>(src.seed);
+    gdt.count = serialize<uint32_t>(src.count);
+    memcpy(gdt.bloom, src.bloom, GOSSIP_BLOOMSIZE);
+    return gdt;
+}
+
+template <> gossip_digest_t deserialize(const gossip_digest_t& src)
+{
+    gossip_digest_t gdt;
+    gdt.seed  = deserialize<uint32_t>(src.seed);
+    gdt.count = deserialize<uint32_t>(src.count);
+    memcpy(gdt.bloom, src.bloom, GOSSIP_BLOOMSIZE);
+    return gdt;
+}
+
+// Peers are already in network byte order.
+template <> gossip_peers_t serialize(const gossip_peers_t& src)
+{
+    gossip_peers_t gpt;
+    gpt.count = serialize<uint16_t>(src.count);
+    memcpy(gpt.peers, src.peers, sizeof(gpt.peers));
+    return gpt;
+}
+
+template <> gossip_peers_t deserialize(const gossip_peers_t& src)
+{
+    gossip_peers_t gpt;
+    gpt.count = std::min<uint16_t>(deserialize<uint16_t>(src.count), GOSSIP_MAXPEERS);
+    memcpy(gpt.peers, src.peers, sizeof(gpt.peers));
+    return gpt;
+}
+
+template <> sequenced_t serialize(const sequenced_t& src)
+{
+    sequenced_t st;
+    st.epoch       = serialize<uint64_t>(src.epoch);
+    st.seq         = serialize<uint64_t>(src.seq);
+    st.oldest      = serialize<uint64_t>(src.oldest);
+    st.ptype       = src.ptype;
+    st.crypted     = src.crypted;
+    st.size        = serialize<uint32_t>(src.size);
+    st.payloadsize = serialize<uint32_t>(src.payloadsize);
+    memcpy(st.payload, src.payload, REPLAY_MAXPAYLOAD);
+    return st;
+}
+
+template <> sequenced_t deserialize(const sequenced_t& src)
+{
+    sequenced_t st;
+    st.epoch       = deserialize<uint64_t>(src.epoch);
+    st.seq         = deserialize<uint64_t>(src.seq);
+    st.oldest      = deserialize<uint64_t>(src.oldest);
+    st.ptype       = src.ptype;
+    st.crypted     = src.crypted;
+    st.size        = deserialize<uint32_t>(src.size);
+    st.payloadsize = deserialize<uint32_t>(src.payloadsize);
+    memcpy(st.payload, src.payload, REPLAY_MAXPAYLOAD);
+    return st;
+}
+
+template <> resume_t serialize(const resume_t& src)
+{
+    resume_t rt;
+    rt.epoch     = serialize<uint64_t>(src.epoch);
+    rt.peerepoch = serialize<uint64_t>(src.peerepoch);
+    rt.received  = serialize<uint64_t>(src.received);
+    rt.resend    = src.resend;
+    return rt;
+}
+
+template <> resume_t deserialize(const resume_t& src)
+{
+    resume_t rt;
+    rt.epoch     = deserialize<uint64_t>(src.epoch);
+    rt.peerepoch = deserialize<uint64_t>(src.peerepoch);
+    rt.received  = deserialize<uint64_t>(src.received);
+    rt.resend    = src.resend;
+    return rt;
+}
+
+template <> transfer_offer_t serialize(const transfer_offer_t& src)
+{
+    transfer_offer_t tot;
+    tot.id        = serialize<uint64_t>(src.id);
+    tot.length    = serialize<uint64_t>(src.length);
+    tot.crc       = serialize<uint32_t>(src.crc);
+    tot.chunksize = serialize<uint32_t>(src.chunksize);
+    tot.sparse    = src.sparse;
+    memcpy(tot.hash, src.hash, HASH_SIZE);
+    memcpy(tot.name, src.name, SERVER_MAXBUFSIZE);
+    return tot;
+}
+
+template <> transfer_offer_t deserialize(const transfer_offer_t& src)
+{
+    transfer_offer_t tot;
+    tot.id        = deserialize<uint64_t>(src.id);
+    tot.length    = deserialize<uint64_t>(src.length);
+    tot.crc       = deserialize<uint32_t>(src.crc);
+    tot.chunksize = deserialize<uint32_t>(src.chunksize);
+    tot.sparse    = src.sparse;
+    memcpy(tot.hash, src.hash, HASH_SIZE);
+    memcpy(tot.name, src.name, SERVER_MAXBUFSIZE);
+    return tot;
+}
+
+template <> transfer_bitmap_t serialize(const transfer_bitmap_t& src)
+{
+    transfer_bitmap_t tbt;
+    tbt.id       = serialize<uint64_t>(src.id);
+    tbt.page     = serialize<uint32_t>(src.page);
+    tbt.pages    = serialize<uint32_t>(src.pages);
+    tbt.complete  = src.complete;
+    tbt.chunksize = serialize<uint32_t>(src.chunksize);
+    tbt.error     = serialize<uint32_t>(src.error);
+    memcpy(tbt.bits, src.bits, TRANSFER_BITMAPSIZE);
+    return tbt;
+}
+
+template <> transfer_bitmap_t deserialize(const transfer_bitmap_t& src)
+{
+    transfer_bitmap_t tbt;
+    tbt.id       = deserialize<uint64_t>(src.id);
+    tbt.page     = deserialize<uint32_t>(src.page);
+    tbt.pages    = deserialize<uint32_t>(src.pages);
+    tbt.complete  = src.complete;
+    tbt.chunksize = deserialize<uint32_t>(src.chunksize);
+    tbt.error     = deserialize<uint32_t>(src.error);
+    memcpy(tbt.bits, src.bits, TRANSFER_BITMAPSIZE);
+    return tbt;
+}
+
+template <> transfer_chunk_t serialize(const transfer_chunk_t& src)
+{
+    transfer_chunk_t tct;
+    tct.id    = serialize<uint64_t>(src.id);
+    tct.index = serialize<uint32_t>(src.index);
+    tct.size  = serialize<uint32_t>(src.size);
+    tct.crc   = serialize<uint32_t>(src.crc);
+    return tct;
+}
+
+template <> transfer_chunk_t deserialize(const transfer_chunk_t& src)
+{
+    transfer_chunk_t tct;
+    tct.id    = deserialize<uint64_t>(src.id);
+    tct.index = deserialize<uint32_t>(src.index);
+    tct.size  = deserialize<uint32_t>(src.size);
+    tct.crc   = deserialize<uint32_t>(src.crc);
+    return tct;
+}
+
+template <> transfer_hole_t serialize(const transfer_hole_t& src)
+{
+    transfer_hole_t tht;
+    tht.id    = serialize<uint64_t>(src.id);
+    tht.index = serialize<uint32_t>(src.index);
+    tht.count = serialize<uint32_t>(src.count);
+    return tht;
+}
+
+template <> transfer_hole_t deserialize(const transfer_hole_t& src)
+{
+    transfer_hole_t tht;
+    tht.id    = deserialize<uint64_t>(src.id);
+    tht.index = deserialize<uint32_t>(src.index);
+    tht.count = deserialize<uint32_t>(src.count);
+    return tht;
+}
+
+template <> transfer_stream_t serialize(const transfer_stream_t& src)
+{
+    transfer_stream_t tst;
+    tst.id     = serialize<uint64_t>(src.id);
+    tst.client = serialize<uint32_t>(src.client);
+    return tst;
+}
+
+template <> transfer_stream_t deserialize(const transfer_stream_t& src)
+{
+    transfer_stream_t tst;
+    tst.id     = deserialize<uint64_t>(src.id);
+    tst.client = deserialize<uint32_t>(src.client);
+    return tst;
+}
+
 /* ******************************************************************* */
 
 /** @brief Allocate memory for given type of packet.
@@ -132,6 +423,44 @@ Packet* packet_choose_policy(const int type)
 		return new UserInitPacket();
 	case PT_USER_INIT_RESPONSE:
 		return new UserInitRPacket();
+    case PT_CLIENT_SHMRING:
+        return new ClientShmRingPacket();
+    case PT_BROADCAST:
+        return new BroadcastPacket();
+    case PT_CHANNEL_SUBSCRIBE:
+        return new ChannelSubscribePacket();
+    case PT_CHANNEL_UNSUBSCRIBE:
+        return new ChannelUnsubscribePacket();
+    case PT_CHANNEL_MESSAGE:
+        return new ChannelMessagePacket();
+    case PT_ROUTE_REQUEST:
+        return new RouteRequestPacket();
+    case PT_ROUTE_REPLY:
+        return new RouteReplyPacket();
+    case PT_RELAY:
+        return new RelayPacket();
+    case PT_GOSSIP_DIGEST:
+        return new GossipDigestPacket();
+    case PT_GOSSIP_PEERS:
+        return new GossipPeersPacket();
+    case PT_SPOOL_BATCH:
+        return new SpoolBatchPacket();
+    case PT_SEQUENCED:
+        return new SequencedPacket();
+    case PT_CLIENT_RESUME:
+        return new ClientResumePacket();
+    case PT_TRANSFER_OFFER:
+        return new TransferOfferPacket();
+    case PT_TRANSFER_BITMAP:
+        return new TransferBitmapPacket();
+    case PT_TRANSFER_CHUNK:
+        return new TransferChunkPacket();
+    case PT_TRANSFER_STREAM:
+        return new TransferStreamPacket();
+    case PT_TRANSFER_HOLE:
+        return new TransferHolePacket();
+    case PT_MULTICAST_REACHED:
+        return new MulticastReachedPacket();
     default:
         Packet* p = new Packet();
         p->m_type = type;
@@ -139,9 +468,24 @@ Packet* packet_choose_policy(const int type)
     }
 }
 
+/** @brief Receives at most len bytes from given socket, before deadline
+ *  (monotonic ms) if it is not negative. Returns -1 once it is passed.
+**/
+static ssize_t packet_recv_(SOCKET sock, void* buffer, size_t len, long deadline)
+{
+    if(deadline >= 0)
+    {
+        long left = deadline - timer_monotonic_ms();
+        if(transport_ready(sock, left > 0 ? (uint32_t) left : 0) != 1)
+            return -1;
+    }
+    return transport_recv(sock, buffer, len);
+}
+
 /** @brief Receive a client packet with a time out.
  *
- *  This time out is, for now, fixed to 3 seconds. 
+ *  This time out is, for now, fixed to 3 seconds. It applies to the whole
+ *  packet, not only to its first bytes. 
  *  If you want to wait untill a new packet come with connection status
  *  management, use packet_wait().
  *
@@ -163,25 +507,23 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
     if(!retsock)
         retsock = sock;
     
-    if(timedout)
-    {
-        // Set timeout to sec seconds.
-        struct timeval tv;
-        tv.tv_usec = 0;
-        tv.tv_sec  = sec;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO,(char*) &tv, sizeof(struct timeval));
-    }
+    // Wait at most sec seconds for the packet to come.
+    long deadline = timedout ? timer_monotonic_ms() + (long) sec * 1000 : -1;
 
     PacketTypePacket ptp;
 
     // Receive data
     data_t max_request[8196];
-    ssize_t n = recv(sock, max_request, sizeof(ptp), 0);
-    
-    if(n == -1)
+    ssize_t n = 0;
+    while(n < (ssize_t) sizeof(ptp))
     {
-        // An error occured
-        return nullptr;
+        ssize_t r = packet_recv_(sock, max_request + n, sizeof(ptp) - n, deadline);
+        if(r <= 0)
+        {
+            // An error occured, the connection is closed, or the packet is late.
+            return nullptr;
+        }
+        n += r;
     }
 
     // Receive the PT_PACKETTYPE packet first.
@@ -194,7 +536,9 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
     if(ptp.m_type != PT_PACKETTYPE &&
        n > 0)
     {
-        n = recv(sock, max_request + sizeof(ptp), 8196 - sizeof(ptp), 0);
+        n = packet_recv_(sock, max_request + sizeof(ptp), 8196 - sizeof(ptp), deadline);
+        if(n < 0)
+            return nullptr;
 
         // This might be an http request, so transform it to a
         // HttpRequestPacket and receive all sending request.
@@ -211,13 +555,15 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
         skipdata = true;
     }
     
-    // If packet is a PT_CONNECTION_STATUS, directly send an answer back.
+    // If packet is a PT_CONNECTION_STATUS, directly send an answer back, unless its
+    // sender does not wait for it (packet_wait()).
     if(ptp.type == PT_CONNECTIONSTATUS)
     {
 #ifdef GULTRA_DEBUG
         gnotifiate_info("[receive_packet] Received Connection status. Sending OK.");
 #endif
-        send_client_packet(retsock, SOCKET_ERROR, PT_RECEIVED_OK, nullptr, 0);
+        if(!(ptp.flags & PF_NOACK))
+            send_client_packet(retsock, SOCKET_ERROR, PT_RECEIVED_OK, nullptr, 0);
         return packet_choose_policy(PT_CONNECTIONSTATUS);
     }
     
@@ -235,6 +581,8 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
         if(!packet)
             return nullptr;
         
+        packet->setStreamedSize(sock, ptp.length);
+        
         data_t* data   = nullptr;
         size_t len     = packet->getPacketSize();
         
@@ -242,7 +590,17 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
         {
             data = (data_t*) malloc(len);
             memset(data, 0, len);
-            len = recv(sock, data, len, 0);
+            
+            // A stream transport may give the data in several parts.
+            size_t got = 0;
+            while(got < len)
+            {
+                ssize_t r = packet_recv_(sock, data + got, len - got, deadline);
+                if(r <= 0)
+                    break;
+                got += r;
+            }
+            len = got;
         }
         
         // Interpret the packet
@@ -270,6 +628,11 @@ Packet* receive_client_packet(SOCKET sock, SOCKET retsock, bool timedout, uint32
     // 29/04/2015 [Note] : If packet is an Http Request, we must not send the
     //                     first pre-answer.
     
+    // A packet sent with PF_NOACK (pipelined packets) is never answered, as its sender
+    // does not wait for it.
+    if(!skipdata && (ptp.flags & PF_NOACK))
+        return packet;
+    
     if(packet)
     {
         if(packet->m_type != PT_HTTP_REQUEST)
@@ -387,6 +750,193 @@ gerror_t packet_interpret(const uint8_t type, Packet* packet, data_t* data, size
 		memcpy(&(uip->data), data, len);
 	}
     
+    else if(type == PT_CLIENT_SHMRING)
+    {
+        ClientShmRingPacket* csrp = reinterpret_cast<ClientShmRingPacket*>(packet);
+        memcpy(csrp->name, data, len);
+        csrp->name[SHMRING_MAXNAME - 1] = '\0';
+    }
+    
+    else if(type == PT_BROADCAST)
+    {
+        BroadcastPacket* bp = reinterpret_cast<BroadcastPacket*>(packet);
+        memcpy(&(bp->data), data, len);
+        bp->data = deserialize<multicast_t>(bp->data);
+        
+        // Strings come from the network.
+        bp->data.origin [SERVER_MAXBUFSIZE - 1] = '\0';
+        bp->data.lo     [SERVER_MAXBUFSIZE - 1] = '\0';
+        bp->data.hi     [SERVER_MAXBUFSIZE - 1] = '\0';
+        bp->data.message[SERVER_MAXBUFSIZE - 1] = '\0';
+    }
+    
+    else if(type == PT_CHANNEL_SUBSCRIBE)
+    {
+        ChannelSubscribePacket* csp = reinterpret_cast<ChannelSubscribePacket*>(packet);
+        memcpy(csp->channel, data, len);
+        csp->channel[CHANNEL_MAXNAME - 1] = '\0';
+    }
+    
+    else if(type == PT_CHANNEL_UNSUBSCRIBE)
+    {
+        ChannelUnsubscribePacket* cup = reinterpret_cast<ChannelUnsubscribePacket*>(packet);
+        memcpy(cup->channel, data, len);
+        cup->channel[CHANNEL_MAXNAME - 1] = '\0';
+    }
+    
+    else if(type == PT_CHANNEL_MESSAGE)
+    {
+        ChannelMessagePacket* cmp = reinterpret_cast<ChannelMessagePacket*>(packet);
+        memcpy(&(cmp->data), data, len);
+        cmp->data.channel[CHANNEL_MAXNAME - 1]   = '\0';
+        cmp->data.message[SERVER_MAXBUFSIZE - 1] = '\0';
+    }
+    
+    else if(type == PT_ROUTE_REQUEST || type == PT_ROUTE_REPLY)
+    {
+        // Both packets hold a route_info_t.
+        route_info_t* info = type == PT_ROUTE_REQUEST ? &(reinterpret_cast<RouteRequestPacket*>(packet)->data)
+                                                      : &(reinterpret_cast<RouteReplyPacket*>(packet)->data);
+        memcpy(info, data, len);
+        *info = deserialize<route_info_t>(*info);
+        info->origin     [SERVER_MAXBUFSIZE - 1] = '\0';
+        info->destination[SERVER_MAXBUFSIZE - 1] = '\0';
+    }
+    
+    else if(type == PT_RELAY)
+    {
+        RelayPacket* rp = reinterpret_cast<RelayPacket*>(packet);
+        memcpy(&(rp->data), data, len);
+        rp->data = deserialize<relay_t>(rp->data);
+        rp->data.origin     [SERVER_MAXBUFSIZE - 1] = '\0';
+        rp->data.destination[SERVER_MAXBUFSIZE - 1] = '\0';
+        
+        if(rp->data.payloadsize > RELAY_MAXPAYLOAD || rp->data.size > RELAY_MAXDATA)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_GOSSIP_DIGEST)
+    {
+        GossipDigestPacket* gdp = reinterpret_cast<GossipDigestPacket*>(packet);
+        memcpy(&(gdp->data), data, len);
+        gdp->data = deserialize<gossip_digest_t>(gdp->data);
+    }
+    
+    else if(type == PT_GOSSIP_PEERS)
+    {
+        GossipPeersPacket* gpp = reinterpret_cast<GossipPeersPacket*>(packet);
+        memcpy(&(gpp->data), data, len);
+        gpp->data = deserialize<gossip_peers_t>(gpp->data);
+        
+        if(gpp->data.count > GOSSIP_MAXPEERS)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_SPOOL_BATCH)
+    {
+        // Records are read by server_spool_receive().
+        SpoolBatchPacket* sbp = reinterpret_cast<SpoolBatchPacket*>(packet);
+        memcpy(&(sbp->data), data, len);
+        sbp->data.count       = deserialize<uint32_t>(sbp->data.count);
+        sbp->data.size        = deserialize<uint32_t>(sbp->data.size);
+        sbp->data.payloadsize = deserialize<uint32_t>(sbp->data.payloadsize);
+        
+        if(sbp->data.size > SPOOL_BATCHSIZE || sbp->data.payloadsize > SPOOL_MAXPAYLOAD)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_SEQUENCED)
+    {
+        SequencedPacket* sp = reinterpret_cast<SequencedPacket*>(packet);
+        memcpy(&(sp->data), data, len);
+        sp->data = deserialize<sequenced_t>(sp->data);
+        
+        if(sp->data.payloadsize > REPLAY_MAXPAYLOAD || sp->data.size > REPLAY_MAXDATA)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_CLIENT_RESUME)
+    {
+        ClientResumePacket* crp = reinterpret_cast<ClientResumePacket*>(packet);
+        memcpy(&(crp->data), data, len);
+        crp->data = deserialize<resume_t>(crp->data);
+    }
+    
+    else if(type == PT_TRANSFER_OFFER)
+    {
+        TransferOfferPacket* top = reinterpret_cast<TransferOfferPacket*>(packet);
+        memcpy(&(top->data), data, len);
+        top->data = deserialize<transfer_offer_t>(top->data);
+        top->data.name[SERVER_MAXBUFSIZE - 1] = '\0';
+        
+        if(top->data.chunksize < TRANSFER_MINCHUNKSIZE || top->data.chunksize > TRANSFER_MAXCHUNKSIZE || top->data.chunksize % TRANSFER_MINCHUNKSIZE != 0)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_TRANSFER_BITMAP)
+    {
+        TransferBitmapPacket* tbp = reinterpret_cast<TransferBitmapPacket*>(packet);
+        memcpy(&(tbp->data), data, len);
+        tbp->data = deserialize<transfer_bitmap_t>(tbp->data);
+        
+        if(tbp->data.page >= tbp->data.pages || tbp->data.chunksize < TRANSFER_MINCHUNKSIZE || tbp->data.chunksize > TRANSFER_MAXCHUNKSIZE ||
+           tbp->data.chunksize % TRANSFER_MINCHUNKSIZE != 0)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_TRANSFER_CHUNK)
+    {
+        TransferChunkPacket* tcp = reinterpret_cast<TransferChunkPacket*>(packet);
+        if(len < sizeof(transfer_chunk_t))
+            return GERROR_INVALID_PACKET;
+        
+        memcpy(&(tcp->data), data, sizeof(transfer_chunk_t));
+        tcp->data = deserialize<transfer_chunk_t>(tcp->data);
+        
+        // The chunk is either left on the connection, or given with the header.
+        if(len == sizeof(transfer_chunk_t) && tcp->pending > 0)
+        {
+            if(tcp->data.size != tcp->pending)
+                return GERROR_INVALID_PACKET;
+            return GERROR_NONE;
+        }
+        
+        if(tcp->data.size != len - sizeof(transfer_chunk_t))
+            return GERROR_INVALID_PACKET;
+        
+        tcp->chunk = (data_t*) malloc(tcp->data.size > 0 ? tcp->data.size : 1);
+        if(!tcp->chunk)
+            return GERROR_ALLOC;
+        memcpy(tcp->chunk, data + sizeof(transfer_chunk_t), tcp->data.size);
+    }
+    
+    else if(type == PT_TRANSFER_STREAM)
+    {
+        TransferStreamPacket* tsp = reinterpret_cast<TransferStreamPacket*>(packet);
+        memcpy(&(tsp->data), data, len);
+        tsp->data = deserialize<transfer_stream_t>(tsp->data);
+    }
+    
+    else if(type == PT_TRANSFER_HOLE)
+    {
+        TransferHolePacket* thp = reinterpret_cast<TransferHolePacket*>(packet);
+        memcpy(&(thp->data), data, len);
+        thp->data = deserialize<transfer_hole_t>(thp->data);
+        
+        if(thp->data.count == 0)
+            return GERROR_INVALID_PACKET;
+    }
+    
+    else if(type == PT_MULTICAST_REACHED)
+    {
+        MulticastReachedPacket* mrp = reinterpret_cast<MulticastReachedPacket*>(packet);
+        memcpy(&(mrp->data), data, len);
+        mrp->data = deserialize<multicast_reached_t>(mrp->data);
+        
+        // Names come from the network.
+        mrp->data.names[SERVER_MAXBUFSIZE - 1] = '\0';
+    }
+    
     return GERROR_NONE;
 }
 
@@ -394,7 +944,9 @@ gerror_t packet_interpret(const uint8_t type, Packet* packet, data_t* data, size
  *  
  *  This is a blocking function. It waits untill a packet is received. 
  *  Everytimes the recv function timed out, it send a Connection Status packet
- *  to check validity of the connection.
+ *  to check validity of the connection. Its answer is not waited for, as
+ *  it would come through sock among the other packets of the peer : the
+ *  connection is lost if the packet can't be sent.
  *
  *  @param sock : Socket to wait.
  *  @param retpacket : A pointer to null.
@@ -421,7 +973,7 @@ gerror_t packet_wait(SOCKET sock, SOCKET retsock, PacketPtr& retpacket)
             gnotifiate_info("[packet_wait] Sending connection status.");
             // If nothing has been received, just send a connection status packet
             // to check connection with the socket.
-            gerror_t err = send_client_packet(retsock, sock, PT_CONNECTIONSTATUS, nullptr, 0);
+            gerror_t err = send_client_packet(retsock, SOCKET_ERROR, PT_CONNECTIONSTATUS, nullptr, 0);
             if(err != GERROR_NONE)
             {
 #ifdef GULTRA_DEBUG
@@ -443,6 +995,30 @@ gerror_t packet_wait(SOCKET sock, SOCKET retsock, PacketPtr& retpacket)
     return GERROR_NONE;
 }
 
+/** @brief Reads and drops len bytes from given socket, so the next
+ *  packet can be read.
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_NORECEIVE if the connection is closed before, or no byte
+ *    comes for TRANSPORT_FILETIMEOUT ms.
+**/
+gerror_t packet_drain(SOCKET sock, size_t len)
+{
+    data_t buffer[SERVER_MAXBUFSIZE];
+    while(len > 0)
+    {
+        if(transport_ready(sock, TRANSPORT_FILETIMEOUT) != 1)
+            return GERROR_NORECEIVE;
+
+        ssize_t n = transport_recv(sock, buffer, std::min<size_t>(len, sizeof(buffer)));
+        if(n <= 0)
+            return GERROR_NORECEIVE;
+        len -= (size_t) n;
+    }
+    return GERROR_NONE;
+}
+
 /** @brief Send a packet to given host using given socket.
  *
  *  @note
@@ -465,9 +1041,26 @@ gerror_t packet_wait(SOCKET sock, SOCKET retsock, PacketPtr& retpacket)
  *  @return
  *  - GERROR_NONE on success.
  *  - GERROR_BADARGS if sock is null or if packet_type is invalid.
- *  - GERROR_CANT_SEND_PACKET if recv() function fails.
+ *  - GERROR_CANT_SEND_PACKET if the transport can't send the packet.
 **/
 gerror_t send_client_packet(SOCKET upsock, SOCKET downsock, uint8_t packet_type, const void* data, size_t sz)
+{
+    return send_client_packet_file(upsock, downsock, packet_type, data, sz, -1, 0, 0);
+}
+
+/** @brief Sends a packet whose data is followed by filesize bytes of a file,
+ *  from offset. The file is sent with transport_sendfile(), so it does not go
+ *  through user space.
+ *
+ *  @param fd : The file, or -1 to send a packet as send_client_packet().
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_BADARGS if sock is null or if packet_type is invalid.
+ *  - GERROR_CANT_SEND_PACKET if the transport can't send the packet.
+**/
+gerror_t send_client_packet_file(SOCKET upsock, SOCKET downsock, uint8_t packet_type, const void* data, size_t sz,
+                                 int fd, off_t offset, size_t filesize)
 {
     if(!upsock)
         return GERROR_BADARGS;
@@ -477,23 +1070,28 @@ gerror_t send_client_packet(SOCKET upsock, SOCKET downsock, uint8_t packet_type,
 #ifdef GULTRA_DEBUG
     gnotifiate_info("[send_client_packet] Sending packet type %i.", (uint32_t) packet_type);
 #endif
-    // Send the PT_PACKETTYPE first
-    PacketTypePacket ptp(packet_type);
-    if(send(upsock, (data_t*) &ptp, ptp.getPacketSize(), 0) < 0)
+    // Send the PT_PACKETTYPE first. If we do not wait for an answer, the receiver
+    // must not send one : it would be read later as a stray packet.
+    // The data, if any, is sent with it in the same call.
+    if(fd < 0)
+        filesize = 0;
+    
+    PacketTypePacket ptp(packet_type, downsock == SOCKET_ERROR ? PF_NOACK : PF_NONE, (uint32_t) ((data ? sz : 0) + filesize));
+    transport_vec_t  vecs[2] = { { &ptp, ptp.getPacketSize() }, { data, sz } };
+    int              nvecs   = (sz > 0 && data != NULL) ? 2 : 1;
+    
+    // Other threads write to the same connection : the header and the file
+    // must follow each other.
+    transport_lock(upsock);
+    bool sent = transport_sendv(upsock, vecs, nvecs) >= 0 &&
+                (filesize == 0 || transport_sendfile(upsock, fd, offset, filesize) >= 0);
+    transport_unlock(upsock);
+    
+    if(!sent)
     {
-        gnotifiate_warn("[Packet] Can't send PT_PACKETTYPE.");
+        gnotifiate_warn("[Packet] Can't send packet type %i.", (uint32_t) packet_type);
         return GERROR_CANT_SEND_PACKET;
     }
-
-    // Send the data if any.
-    if(sz > 0 && data != NULL)
-    {
-        if(send(upsock, (data_t*) data, sz, 0) < 0)
-        {
-            gnotifiate_error("[Packet] Can't send data packet.");
-            return GERROR_CANT_SEND_PACKET;
-        }
-    }
     
     // If downsock is null, we return.
     if(downsock == SOCKET_ERROR)
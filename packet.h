@@ -6,6 +6,10 @@
 #define __PACKET__H
 
 #include "prerequesites.h"
+#include "encryption.h"
+#include "shmring.h"
+#include "transport.h"
+#include <algorithm> // std::min
 
 GBEGIN_DECL
 
@@ -15,11 +19,12 @@ GBEGIN_DECL
 **/
 struct send_file_t
 {
-    size_t    lenght;                  ///< @brief File total lenght
+    uint64_t  lenght;                  ///< @brief File total lenght
     uint32_t  chunk_lenght;            ///< @brief Non-last chunk lenght
     uint32_t  chunk_lastsize;          ///< @brief last chunk lenght
-    uint32_t  chunk_count;             ///< @brief Chunk count (including last chunk)
+    uint64_t  chunk_count;             ///< @brief Chunk count (including last chunk)
     bool       has_chunk;               ///< @brief Does this file will be send in chunks ?
+    bool       via_ring;                ///< @brief Is the file content written in the shared memory ring instead of chunks ?
     char       name[SERVER_MAXBUFSIZE]; ///< @brief File name
 
     send_file_t& operator = (const send_file_t& src) {
@@ -28,6 +33,7 @@ struct send_file_t
         chunk_lastsize = src.chunk_lastsize;
         chunk_count    = src.chunk_count;
         has_chunk      = src.has_chunk;
+        via_ring       = src.via_ring;
         memcpy(name, src.name, SERVER_MAXBUFSIZE);
         return *this;
     }
@@ -67,8 +73,275 @@ struct user_init_t {
 	char name[SERVER_MAXBUFSIZE];
 	char key [SERVER_MAXBUFSIZE];
 	char iv  [SERVER_MAXBUFSIZE];
+	char to  [SERVER_MAXBUFSIZE]; // User of the distant server this packet is for. Empty for its default user.
 };
 
+/** @brief A message sent down the multicast tree. Every node delivers it, then forwards
+ *  it to the peers whose name is strictly between lo and hi.
+**/
+struct multicast_t {
+    uint64_t id;                        // ID given by the origin, to suppress duplicates.
+    uint8_t  fanout;                    // Maximum number of children of every node.
+    uint8_t  hops;                      // Number of nodes the message went through.
+    char     origin [SERVER_MAXBUFSIZE]; // Name of the server which sent the message.
+    char     lo     [SERVER_MAXBUFSIZE]; // Lower bound of the subtree. Empty for none.
+    char     hi     [SERVER_MAXBUFSIZE]; // Upper bound of the subtree. Empty for none.
+    char     message[SERVER_MAXBUFSIZE];
+} __attribute__((packed));
+typedef struct multicast_t multicast_t;
+
+template <> multicast_t serialize(const multicast_t&);
+template <> multicast_t deserialize(const multicast_t&);
+
+/** @brief A page of the peers a node of the multicast tree is connected to in the
+ *  subtree it was given, sent back to its parent. The parent sends the message itself
+ *  to the peers of the subtree missing from every page.
+**/
+struct multicast_reached_t {
+    uint64_t id;                       // ID of the multicast.
+    uint8_t  last;                     // 1 for the last page.
+    char     names[SERVER_MAXBUFSIZE]; // Names of the peers, each followed by a null character.
+} __attribute__((packed));
+typedef struct multicast_reached_t multicast_reached_t;
+
+template <> multicast_reached_t serialize(const multicast_reached_t&);
+template <> multicast_reached_t deserialize(const multicast_reached_t&);
+
+#define CHANNEL_MAXNAME 64 // Maximum size of a channel name, including the null character.
+
+/** @brief A message published on a channel.
+**/
+struct channel_message_t {
+    char channel[CHANNEL_MAXNAME];
+    char message[SERVER_MAXBUFSIZE];
+};
+
+/** @brief Asks for (PT_ROUTE_REQUEST) or gives back (PT_ROUTE_REPLY) a route
+ *  between two servers which are not directly connected.
+**/
+struct route_info_t {
+    uint64_t id;                             // ID given by the origin, to suppress duplicates.
+    uint8_t  ttl;                            // Number of hops the packet can still do.
+    uint8_t  hops;                           // Number of hops from the sender of the packet.
+    char     origin     [SERVER_MAXBUFSIZE]; // Server which asked for the route.
+    char     destination[SERVER_MAXBUFSIZE]; // Server to reach.
+    buffer_t pubkey;                         // Public key of the sender (origin or destination).
+};
+
+template <> route_info_t serialize(const route_info_t&);
+template <> route_info_t deserialize(const route_info_t&);
+
+#define RELAY_MAXDATA    SERVER_MAXBUFSIZE                                      // Maximum size of the data of a relayed packet.
+#define RELAY_MAXPAYLOAD (((RELAY_MAXDATA / (RSA_SIZE - 11)) + 1) * RSA_SIZE) // Maximum size of this data once crypted.
+
+/** @brief A packet relayed to a server we are not connected to. Relays
+ *  forward the payload as is : it is crypted with the public key of the
+ *  destination, which only can decrypt it, and signed by the origin.
+**/
+struct relay_t {
+    char     origin     [SERVER_MAXBUFSIZE];
+    char     destination[SERVER_MAXBUFSIZE];
+    uint8_t  ttl;                       // Number of hops the packet can still do.
+    uint8_t  ptype;                     // Type of the relayed packet.
+    uint8_t  crypted;                   // 1 if payload is made of RSA blocks crypted for the destination.
+    uint32_t size;                      // Size of the data of the relayed packet.
+    uint32_t payloadsize;               // Size of payload.
+    uint32_t signaturesize;             // Size of signature, 0 if the packet is not signed.
+    data_t   signature[RSA_SIZE];       // Signature by the origin of the packet, but its ttl and signature.
+    data_t   payload[RELAY_MAXPAYLOAD];
+} __attribute__((packed));
+typedef struct relay_t relay_t;
+
+template <> relay_t serialize(const relay_t&);
+template <> relay_t deserialize(const relay_t&);
+
+#define GOSSIP_BLOOMSIZE 1024 // Size (bytes) of the Bloom filter of a gossip digest.
+#define GOSSIP_HASHES    4    // Number of bits set in the Bloom filter for every peer.
+#define GOSSIP_MAXPEERS  128  // Maximum number of peers sent in one gossip answer.
+
+/** @brief Digest of the known peers of a server, sent to a random client
+ *  at every gossip round. The bits of a peer depend on the seed, so a
+ *  false positive of a round is not one of the next.
+**/
+struct gossip_digest_t {
+    uint32_t seed;
+    uint32_t count;                    // Number of peers known by the sender.
+    uint8_t  bloom[GOSSIP_BLOOMSIZE];
+} __attribute__((packed));
+typedef struct gossip_digest_t gossip_digest_t;
+
+/** @brief A known peer, as sent in a gossip answer. Both fields are in
+ *  network byte order.
+**/
+struct gossip_peer_t {
+    uint32_t ip;
+    uint16_t port;
+} __attribute__((packed));
+typedef struct gossip_peer_t gossip_peer_t;
+
+/** @brief Peers missing from a gossip digest.
+**/
+struct gossip_peers_t {
+    uint16_t      count;
+    gossip_peer_t peers[GOSSIP_MAXPEERS];
+} __attribute__((packed));
+typedef struct gossip_peers_t gossip_peers_t;
+
+template <> gossip_digest_t serialize(const gossip_digest_t&);
+template <> gossip_digest_t deserialize(const gossip_digest_t&);
+template <> gossip_peers_t serialize(const gossip_peers_t&);
+template <> gossip_peers_t deserialize(const gossip_peers_t&);
+
+#define SPOOL_BATCHSIZE  65536                                                  // Maximum size of the records sent in one spool batch.
+#define SPOOL_MAXPAYLOAD (((SPOOL_BATCHSIZE / (RSA_SIZE - 11)) + 1) * RSA_SIZE) // Maximum size of these records once crypted.
+
+/** @brief Kind of a spooled record.
+**/
+typedef enum {
+    SPOOL_MESSAGE = 1, // A message, delivered as a PT_CLIENT_MESSAGE.
+    SPOOL_FILE    = 2  // Path of a file, sent with client_send_file() when the peer is back.
+} SpoolKind;
+
+/** @brief Header of a record in a spool file, followed by size bytes of
+ *  data. Records of a PT_SPOOL_BATCH are the same, with size in network
+ *  byte order.
+**/
+struct spool_record_t {
+    uint32_t size;
+    uint8_t  kind;
+    uint8_t  reserved[3];
+    int64_t  expires;     // Time (time(NULL)) the record is dropped.
+} __attribute__((packed));
+typedef struct spool_record_t spool_record_t;
+
+/** @brief Messages spooled while the receiver was not connected. The
+ *  records are crypted as the data of a sequenced packet.
+**/
+struct spool_batch_t {
+    uint32_t count;                     // Number of records.
+    uint32_t size;                      // Size of the records.
+    uint8_t  crypted;                   // 1 if payload is crypted by the sender.
+    uint32_t payloadsize;               // Size of payload.
+    data_t   payload[SPOOL_MAXPAYLOAD];
+} __attribute__((packed));
+typedef struct spool_batch_t spool_batch_t;
+
+#define REPLAY_MAXDATA    SERVER_MAXBUFSIZE                                       // Maximum size of the data of a sequenced packet.
+#define REPLAY_MAXPAYLOAD (((REPLAY_MAXDATA / (RSA_SIZE - 11)) + 1) * RSA_SIZE) // Maximum size of this data once crypted.
+
+/** @brief A packet of the stream of a connection, numbered so it can be
+ *  sent again after a reconnection. Sequences start at 1 for every epoch
+ *  (run) of the sender.
+**/
+struct sequenced_t {
+    uint64_t epoch;       // Epoch of the sender.
+    uint64_t seq;         // Sequence of this packet.
+    uint64_t oldest;      // Oldest sequence the sender can still send again.
+    uint8_t  ptype;       // Type of the packet.
+    uint8_t  crypted;     // 1 if payload is crypted by the sender.
+    uint32_t size;        // Size of the data.
+    uint32_t payloadsize; // Size of payload.
+    data_t   payload[REPLAY_MAXPAYLOAD];
+} __attribute__((packed));
+typedef struct sequenced_t sequenced_t;
+
+template <> sequenced_t serialize(const sequenced_t&);
+template <> sequenced_t deserialize(const sequenced_t&);
+
+/** @brief Last sequence received from a peer. It is sent when the
+ *  connection is established, so the peer sends the packets we missed
+ *  again, and every REPLAY_ACKEVERY packets, so it forgets the others.
+**/
+struct resume_t {
+    uint64_t epoch;     // Epoch of the sender.
+    uint64_t peerepoch; // Epoch of the receiver, as known by the sender (0 if none).
+    uint64_t received;  // Last sequence of peerepoch received by the sender.
+    uint8_t  resend;    // 1 if the receiver must send the next packets again.
+} __attribute__((packed));
+typedef struct resume_t resume_t;
+
+template <> resume_t serialize(const resume_t&);
+template <> resume_t deserialize(const resume_t&);
+
+#define TRANSFER_MINCHUNKSIZE 65536   // Smallest chunk size a transfer negotiates. Every chunk size is a multiple of it.
+#define TRANSFER_MAXCHUNKSIZE 8388608 // Biggest chunk size a transfer negotiates.
+#define TRANSFER_BITMAPSIZE SERVER_MAXBUFSIZE // Size (bytes) of a page of the bitmap of the received chunks.
+
+/** @brief Offer of a file transfer. The receiver answers with the bitmap
+ *  of the chunks it already has, so an interrupted transfer goes on where
+ *  it stopped.
+**/
+struct transfer_offer_t {
+    uint64_t id;                      // ID of the transfer, from the hash and name of the file.
+    uint8_t  hash[HASH_SIZE];         // SHA-256 of the file.
+    uint32_t crc;                     // CRC32C of the file, checked by the receiver once it has every chunk.
+    uint64_t length;                  // Size of the file.
+    uint32_t chunksize;               // Size of the chunks the sender proposes.
+    uint8_t  sparse;                  // 1 if the file has holes. They are not sent, and not allocated by the receiver.
+    char     name[SERVER_MAXBUFSIZE]; // Name of the file.
+} __attribute__((packed));
+typedef struct transfer_offer_t transfer_offer_t;
+
+template <> transfer_offer_t serialize(const transfer_offer_t&);
+template <> transfer_offer_t deserialize(const transfer_offer_t&);
+
+/** @brief A page of the bitmap of the chunks received. Bit i of page p is
+ *  set if chunk p * TRANSFER_BITMAPSIZE * 8 + i is received.
+**/
+struct transfer_bitmap_t {
+    uint64_t id;
+    uint32_t page;     // Index of this page.
+    uint32_t pages;    // Number of pages of the bitmap.
+    uint8_t  complete;  // 1 if the receiver has the whole file, checked with its CRC.
+    uint32_t chunksize; // Size of the chunks, but the last one, agreed by the receiver.
+    uint32_t error;     // GERROR_NONE, or why the receiver refused the offer (then the bits are empty).
+    uint8_t  bits[TRANSFER_BITMAPSIZE];
+} __attribute__((packed));
+typedef struct transfer_bitmap_t transfer_bitmap_t;
+
+template <> transfer_bitmap_t serialize(const transfer_bitmap_t&);
+template <> transfer_bitmap_t deserialize(const transfer_bitmap_t&);
+
+/** @brief Header of a chunk of a file transfer. The size bytes of the chunk
+ *  follow it, so the packet has a variable size. A chunk whose data does not
+ *  match its CRC is not recorded, so it is sent again.
+**/
+struct transfer_chunk_t {
+    uint64_t id;
+    uint32_t index; // Index of the chunk, at offset index * chunksize in the file.
+    uint32_t size;  // Size of the data following this header.
+    uint32_t crc;   // CRC32C of the data.
+} __attribute__((packed));
+typedef struct transfer_chunk_t transfer_chunk_t;
+
+template <> transfer_chunk_t serialize(const transfer_chunk_t&);
+template <> transfer_chunk_t deserialize(const transfer_chunk_t&);
+
+/** @brief Chunks of a file transfer which are only holes in the file of the
+ *  sender. The receiver makes them holes too, instead of receiving them.
+**/
+struct transfer_hole_t {
+    uint64_t id;
+    uint32_t index; // Index of the first chunk.
+    uint32_t count; // Number of chunks.
+} __attribute__((packed));
+typedef struct transfer_hole_t transfer_hole_t;
+
+template <> transfer_hole_t serialize(const transfer_hole_t&);
+template <> transfer_hole_t deserialize(const transfer_hole_t&);
+
+/** @brief First packet of an additional connection a file is sent on, in
+ *  parallel with the connection of the client. Only chunks follow it.
+**/
+struct transfer_stream_t {
+    uint64_t id;     // ID of the transfer.
+    uint32_t client; // ID the receiver gave to the sender, as in client_by_id.
+} __attribute__((packed));
+typedef struct transfer_stream_t transfer_stream_t;
+
+template <> transfer_stream_t serialize(const transfer_stream_t&);
+template <> transfer_stream_t deserialize(const transfer_stream_t&);
+
 /* ******************************************************************* */
 
 
@@ -98,10 +371,29 @@ typedef enum PacketType {
     PT_RECEIVED_BAD              = 21,   // A general answer to every packet. This special packet is send by a client as an answer
                                          // to notifiate the other client that he did not correctly received his packet.
     PT_CONNECTIONSTATUS          = 22,   // A packet with no effect. Only wait for a PT_RECEIVED_OK answer. 
+    PT_CLIENT_SHMRING            = 23,   // Name of the shared memory ring a local server will write files to.
+    PT_BROADCAST                 = 24,   // A message multicasted over the overlay tree.
+    PT_CHANNEL_SUBSCRIBE         = 25,   // The sender wants the messages published on a channel.
+    PT_CHANNEL_UNSUBSCRIBE       = 26,   // The sender does not want the messages of a channel anymore.
+    PT_CHANNEL_MESSAGE           = 27,   // A message published on a channel the receiver subscribed to.
+    PT_ROUTE_REQUEST             = 28,   // Looks for a route to a server, flooded to every peer.
+    PT_ROUTE_REPLY               = 29,   // Answer of the destination, going back along the route.
+    PT_RELAY                     = 30,   // A packet for a server the sender is not connected to.
+    PT_GOSSIP_DIGEST             = 31,   // Digest of the peers known by the sender.
+    PT_GOSSIP_PEERS              = 32,   // Known peers missing from the digest of the receiver.
+    PT_SPOOL_BATCH               = 33,   // Messages spooled while the receiver was not connected.
+    PT_SEQUENCED                 = 34,   // A packet of the stream, kept by the sender until acknowledged.
+    PT_CLIENT_RESUME             = 35,   // Last sequence received, to resume the stream.
+    PT_TRANSFER_OFFER            = 36,   // Offer of a file transfer.
+    PT_TRANSFER_BITMAP           = 37,   // Page of the bitmap of the chunks the receiver has.
+    PT_TRANSFER_CHUNK            = 38,   // A chunk of a file transfer.
+    PT_TRANSFER_STREAM           = 39,   // Opens an additional connection for the chunks of a file transfer.
+    PT_TRANSFER_HOLE             = 40,   // Chunks of a file transfer which are holes.
+    PT_MULTICAST_REACHED         = 41,   // Peers of its subtree a node of the multicast tree reaches.
     
     
     // The max number of packets.
-    PT_MAX                       = 23
+    PT_MAX                       = 42
 } PacketType;
 
 /** @brief A generic class representing a Packet.
@@ -126,6 +418,18 @@ public:
      *  Use packet_get_buffer() to get this buffer.
     **/
     virtual size_t getPacketSize() const { return 0; }
+    
+    /** @brief Sets the size of a packet of variable size, whose whole data
+     *  is given to packet_interpret(). Packets of fixed size ignore it.
+    **/
+    virtual void setPacketSize(size_t) {}
+    
+    /** @brief Sets the size of the data of a packet of variable size, as
+     *  given by its PT_PACKETTYPE, before it is read from sock. The packet
+     *  may only read a header (its getPacketSize()), and leave the rest on
+     *  sock for its handler. Packets of fixed size ignore it.
+    **/
+    virtual void setStreamedSize(SOCKET, size_t) {}
 
     /** @brief Returns the type of this packet.
     **/
@@ -144,6 +448,13 @@ public:
 
 // ----------  PT_PACKETTYPE ------------
 
+/** @brief Flags sent with the PT_PACKETTYPE packet.
+**/
+typedef enum PacketFlags {
+    PF_NONE  = 0,
+    PF_NOACK = 1  // Sender does not wait for an answer, so receiver must not send PT_RECEIVED_OK/BAD.
+} PacketFlags;
+
 /** @brief The first packet send to host is always this one.
  *  Use this Packet to tell the host you will send him a packet
  *  of given type. This type must be different from PT_UNKNOWN.
@@ -151,10 +462,12 @@ public:
 template<>
 class PacketPolicy<PT_PACKETTYPE> : public Packet {
 public:
-    uint8_t type;
+    uint8_t  type;
+    uint8_t  flags;  // PacketFlags. It uses padding bytes, so the packet size is unchanged.
+    uint32_t length; // Size of the data, read by packets of variable size. It uses padding bytes too.
 
-    PacketPolicy() : type(PT_UNKNOWN) { m_type = PT_PACKETTYPE; }
-    PacketPolicy(uint8_t _type) : type(_type) { m_type = PT_PACKETTYPE; }
+    PacketPolicy() : type(PT_UNKNOWN), flags(PF_NONE), length(0) { m_type = PT_PACKETTYPE; }
+    PacketPolicy(uint8_t _type, uint8_t _flags = PF_NONE, uint32_t _length = 0) : type(_type), flags(_flags), length(_length) { m_type = PT_PACKETTYPE; }
 
     ~PacketPolicy() {}
 
@@ -170,6 +483,8 @@ typedef PacketPolicy<PT_PACKETTYPE> PacketTypePacket;
 
 // ---------  PT_CLIENT_NAME ------------
 
+gerror_t packet_drain(SOCKET sock, size_t len);
+
 template<>
 class PacketPolicy<PT_CLIENT_NAME> : public Packet {
 public:
@@ -312,6 +627,257 @@ public:
 };
 typedef PacketPolicy<PT_USER_INIT_RESPONSE> UserInitRPacket;
 
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_CLIENT_SHMRING> : public Packet {
+public:
+    char name[SHMRING_MAXNAME];
+
+    PacketPolicy() { m_type = PT_CLIENT_SHMRING; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return SHMRING_MAXNAME; }
+};
+typedef PacketPolicy<PT_CLIENT_SHMRING> ClientShmRingPacket;
+
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_BROADCAST> : public Packet {
+public:
+    multicast_t data;
+
+    PacketPolicy() { m_type = PT_BROADCAST; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(multicast_t); }
+};
+typedef PacketPolicy<PT_BROADCAST> BroadcastPacket;
+
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_CHANNEL_SUBSCRIBE> : public Packet {
+public:
+    char channel[CHANNEL_MAXNAME];
+
+    PacketPolicy() { m_type = PT_CHANNEL_SUBSCRIBE; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return CHANNEL_MAXNAME; }
+};
+typedef PacketPolicy<PT_CHANNEL_SUBSCRIBE> ChannelSubscribePacket;
+
+template<>
+class PacketPolicy<PT_CHANNEL_UNSUBSCRIBE> : public Packet {
+public:
+    char channel[CHANNEL_MAXNAME];
+
+    PacketPolicy() { m_type = PT_CHANNEL_UNSUBSCRIBE; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return CHANNEL_MAXNAME; }
+};
+typedef PacketPolicy<PT_CHANNEL_UNSUBSCRIBE> ChannelUnsubscribePacket;
+
+template<>
+class PacketPolicy<PT_CHANNEL_MESSAGE> : public Packet {
+public:
+    channel_message_t data;
+
+    PacketPolicy() { m_type = PT_CHANNEL_MESSAGE; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(channel_message_t); }
+};
+typedef PacketPolicy<PT_CHANNEL_MESSAGE> ChannelMessagePacket;
+
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_ROUTE_REQUEST> : public Packet {
+public:
+    route_info_t data;
+
+    PacketPolicy() { m_type = PT_ROUTE_REQUEST; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(route_info_t); }
+};
+typedef PacketPolicy<PT_ROUTE_REQUEST> RouteRequestPacket;
+
+template<>
+class PacketPolicy<PT_ROUTE_REPLY> : public Packet {
+public:
+    route_info_t data;
+
+    PacketPolicy() { m_type = PT_ROUTE_REPLY; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(route_info_t); }
+};
+typedef PacketPolicy<PT_ROUTE_REPLY> RouteReplyPacket;
+
+template<>
+class PacketPolicy<PT_RELAY> : public Packet {
+public:
+    relay_t data;
+
+    PacketPolicy() { m_type = PT_RELAY; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(relay_t); }
+};
+typedef PacketPolicy<PT_RELAY> RelayPacket;
+
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_GOSSIP_DIGEST> : public Packet {
+public:
+    gossip_digest_t data;
+
+    PacketPolicy() { m_type = PT_GOSSIP_DIGEST; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(gossip_digest_t); }
+};
+typedef PacketPolicy<PT_GOSSIP_DIGEST> GossipDigestPacket;
+
+template<>
+class PacketPolicy<PT_GOSSIP_PEERS> : public Packet {
+public:
+    gossip_peers_t data;
+
+    PacketPolicy() { m_type = PT_GOSSIP_PEERS; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(gossip_peers_t); }
+};
+typedef PacketPolicy<PT_GOSSIP_PEERS> GossipPeersPacket;
+
+// ---------------------------------------
+
+template<>
+class PacketPolicy<PT_SPOOL_BATCH> : public Packet {
+public:
+    spool_batch_t data;
+
+    PacketPolicy() { m_type = PT_SPOOL_BATCH; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(spool_batch_t); }
+};
+typedef PacketPolicy<PT_SPOOL_BATCH> SpoolBatchPacket;
+
+template<>
+class PacketPolicy<PT_SEQUENCED> : public Packet {
+public:
+    sequenced_t data;
+
+    PacketPolicy() { m_type = PT_SEQUENCED; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(sequenced_t); }
+};
+typedef PacketPolicy<PT_SEQUENCED> SequencedPacket;
+
+template<>
+class PacketPolicy<PT_CLIENT_RESUME> : public Packet {
+public:
+    resume_t data;
+
+    PacketPolicy() { m_type = PT_CLIENT_RESUME; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(resume_t); }
+};
+typedef PacketPolicy<PT_CLIENT_RESUME> ClientResumePacket;
+
+template<>
+class PacketPolicy<PT_TRANSFER_OFFER> : public Packet {
+public:
+    transfer_offer_t data;
+
+    PacketPolicy() { m_type = PT_TRANSFER_OFFER; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(transfer_offer_t); }
+};
+typedef PacketPolicy<PT_TRANSFER_OFFER> TransferOfferPacket;
+
+template<>
+class PacketPolicy<PT_TRANSFER_BITMAP> : public Packet {
+public:
+    transfer_bitmap_t data;
+
+    PacketPolicy() { m_type = PT_TRANSFER_BITMAP; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(transfer_bitmap_t); }
+};
+typedef PacketPolicy<PT_TRANSFER_BITMAP> TransferBitmapPacket;
+
+template<>
+class PacketPolicy<PT_TRANSFER_CHUNK> : public Packet {
+public:
+    transfer_chunk_t data;
+    data_t*          chunk;   // data.size bytes, or null if they are left on sock.
+    size_t           length;  // Size of the packet given to packet_interpret().
+    SOCKET           sock;    // Connection the chunk is received from.
+    size_t           pending; // Bytes of the chunk left on sock. They are read by the handler, or dropped with the packet.
+
+    PacketPolicy() : chunk(nullptr), length(sizeof(transfer_chunk_t)), sock(0), pending(0) { m_type = PT_TRANSFER_CHUNK; }
+    ~PacketPolicy() { packet_drain(sock, pending); free(chunk); }
+
+    size_t getPacketSize() const { return length; }
+    void   setPacketSize(size_t sz) { length = std::min<size_t>(sz, sizeof(transfer_chunk_t) + TRANSFER_MAXCHUNKSIZE); }
+    
+    // The chunk is written to the file straight from the connection.
+    void   setStreamedSize(SOCKET s, size_t sz) {
+        sock    = s;
+        pending = sz > sizeof(transfer_chunk_t) ? std::min<size_t>(sz - sizeof(transfer_chunk_t), TRANSFER_MAXCHUNKSIZE) : 0;
+    }
+};
+typedef PacketPolicy<PT_TRANSFER_CHUNK> TransferChunkPacket;
+
+template<>
+class PacketPolicy<PT_TRANSFER_STREAM> : public Packet {
+public:
+    transfer_stream_t data;
+
+    PacketPolicy() { m_type = PT_TRANSFER_STREAM; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(transfer_stream_t); }
+};
+typedef PacketPolicy<PT_TRANSFER_STREAM> TransferStreamPacket;
+
+template<>
+class PacketPolicy<PT_TRANSFER_HOLE> : public Packet {
+public:
+    transfer_hole_t data;
+
+    PacketPolicy() { m_type = PT_TRANSFER_HOLE; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(transfer_hole_t); }
+};
+typedef PacketPolicy<PT_TRANSFER_HOLE> TransferHolePacket;
+
+template<>
+class PacketPolicy<PT_MULTICAST_REACHED> : public Packet {
+public:
+    multicast_reached_t data;
+
+    PacketPolicy() { m_type = PT_MULTICAST_REACHED; }
+    ~PacketPolicy() {}
+
+    size_t getPacketSize() const { return sizeof(multicast_reached_t); }
+};
+typedef PacketPolicy<PT_MULTICAST_REACHED> MulticastReachedPacket;
+
 typedef Packet* PacketPtr;
 
 Packet* packet_choose_policy(const int type);
@@ -321,6 +887,8 @@ gerror_t packet_get_buffer(Packet* p, unsigned char*& buf, size_t& sz);
 gerror_t packet_wait          (SOCKET sock, SOCKET retsock, PacketPtr& retpacket);
 Packet*  receive_client_packet(SOCKET sock, SOCKET retsock = 0, bool timedout = true, uint32_t sec = 3);
 gerror_t send_client_packet   (SOCKET upsock, SOCKET downsock, uint8_t packet_type, const void* data, size_t sz);
+gerror_t send_client_packet_file (SOCKET upsock, SOCKET downsock, uint8_t packet_type, const void* data, size_t sz,
+                                  int fd, off_t offset, size_t filesize);
 
 GEND_DECL
 
@@ -7,7 +7,7 @@
 GBEGIN_DECL
 
 pthread_mutex_t __console_mutex = PTHREAD_MUTEX_INITIALIZER;
-session_t globalsession;
+session_t* globalsession = nullptr;
 
 FILE* _fileInfo = NULL;
 FILE* _fileWarn = NULL;
@@ -135,6 +135,27 @@ long timer_end(timespec_t start_time){
 
 #endif
 
+long timer_monotonic_us()
+{
+#if defined(_WIN32)
+    return (long) GetTickCount64() * 1000;
+#elif defined(_OSX)
+    // clock_gettime() is not available here, the wall clock is the best we have.
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (long) now.tv_sec * 1000000 + now.tv_usec;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+long timer_monotonic_ms()
+{
+    return timer_monotonic_us() / 1000;
+}
+
 bool gthread_mutex_lock(pthread_mutex_t* mutex)
 {
     int err = pthread_mutex_lock(mutex);
@@ -228,7 +249,9 @@ static const char* __errors [GERROR_MAX] = {
     "No packets have been received.",
     "(GCrypt) Bad Position token in file.",
     "No BT_USER block before BT_CLIENT block.",
-    "A structure or an object has not been initialized."
+    "A structure or an object has not been initialized.",
+    "Can't write to file.",
+    "Bad signature."
 };
 
 const char* gerror_to_string(GError err)
@@ -544,7 +567,7 @@ void netbuf_copyraw(netbuffer_t* to, const char* from, uint16_t lenght)
     
     if(from && lenght > 0)
     {
-        to->buf = (char*) malloc(lenght);
+        to->buf = (char*) malloc(lenght + 1);
         if(!to->buf) {
 #ifdef GULTRA_DEBUG
             cout << "[netbuf] Can't allocate netbuffer data." << endl;
@@ -95,6 +95,7 @@
 #include <cstring>
 #include <cstdio>
 #include <vector>
+#include <list>
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
@@ -119,6 +120,8 @@
 #include <windows.h>
 #include <winsock2.h>
 
+#define poll WSAPoll
+
 typedef char data_t; // This type is used to send or recv data.
 typedef struct timespec timespec_t;
 
@@ -137,6 +140,7 @@ typedef struct timespec timespec_t;
 #include <sys/socket.h>
 
 #include <termios.h>
+#include <sys/time.h>
 
 #ifdef _OSX
 #   include <sys/time.h>
@@ -146,7 +150,10 @@ typedef struct timespec timespec_t;
 #endif
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <poll.h>
 //#include <unistd.h> /* close */
 #include <netdb.h> /* gethostbyname */
 #define INVALID_SOCKET -1
@@ -174,7 +181,10 @@ typedef struct timespec    timespec_t;
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <poll.h>
 //#include <unistd.h> /* close */
 #include <netdb.h> /* gethostbyname */
 #define INVALID_SOCKET -1
@@ -216,6 +226,9 @@ STATIC_ASSERT(sizeof(double)   == 8, invalid_double_size);
 #define SERVER_MAXKEYSIZE    EVP_MAX_KEY_LENGTH + EVP_MAX_IV_LENGTH + 100
 #define RSA_SIZE             256  // Size of chunk in RSA. Data must be 256 - 11 size.
 #define ID_CLIENT_INVALID    0
+#define SERVER_LOCALSOCKET   "/tmp/gangtella.%i.sock" // Path of the local socket, formatted with the server port.
+#define SERVER_ACCEPTTIMEOUT 500  // Time (ms) the server waits for a new client before checking if it must stop.
+#define SERVER_WAITSTATUS    1000 // Time (us) between two checks of server_wait_status().
 
 #ifdef _DEBUG
 #   define GULTRA_DEBUG         1    // Define this if you want every debug things.
@@ -312,8 +325,10 @@ typedef enum GError
     GERROR_GCRYPT_BADPOS     = 48,
     GERROR_DB_NOUSER         = 49,
     GERROR_NOT_INITIALIZED   = 50,
+    GERROR_IO_CANTWRITE      = 51,
+    GERROR_BADSIGNATURE      = 52, // Signature does not match the data or its signer.
 
-    GERROR_MAX               = 51  // Number of errors
+    GERROR_MAX               = 53  // Number of errors
 } GError;
 typedef int gerror_t;
 
@@ -339,6 +354,11 @@ printf("Variance = %f, Time taken (nanoseconds): %ld\n", variance, time_elapsed_
 
 */
 
+// Returns a monotonic wall-clock time in milliseconds (or microseconds). Only differences
+// between two values are meaningful. Use it to compute delays and timeouts.
+long timer_monotonic_ms();
+long timer_monotonic_us();
+
 bool gthread_mutex_lock(pthread_mutex_t* mutex);
 bool gthread_mutex_unlock(pthread_mutex_t* mutex);
 
@@ -431,12 +451,15 @@ class Server;
 struct session_t
 {
     database_t* database;
-    user_t*     user;
+    user_t*     user;       // Default user, used when no user is specified.
+    std::vector<user_t*> users; // Every users logged in, sharing the database and the server.
     Server*   server;
     bool _treatingcommand;
 };
 
-extern session_t globalsession;
+// Session of the server driven by the console. Every server has its own session,
+// this is only the one commands are sent to.
+extern session_t* globalsession;
 
 // Macro _PANIC_ON_ERROR can be set by the user before compiling the Engine to make
 // an Engine really not tolerating any error.
@@ -24,6 +24,9 @@
 #include "packet.h"
 #include "commands.h"
 #include "serverlistener.h"
+#include "broadcast.h"
+
+#include <algorithm> // std::find
 
 GBEGIN_DECL
 
@@ -60,8 +63,6 @@ public:
     
 };
 
-InternalServerListener* _listener = nullptr;
-server_t server;
 
 void* server_thread_loop (void*);
 
@@ -74,60 +75,89 @@ void* server_thread_loop (void*);
  *  - try to load a default database (users.gtl) and creates a blank one
  *  if none found.
  *
+ *  The session of the server is empty : its database and user must be
+ *  set by the caller once the server is created.
+ *
+ *  @param server : A pointer to the server structure.
+ *
  *  @return
  *  - GERROR_NONE on success.
+ *  - GERROR_BADARGS if server is null.
 **/
 ////////////////////////////////////////////////////////////
-gerror_t server_create()
+gerror_t server_create(server_t* server)
 {
+    if(!server)
+        return GERROR_BADARGS;
 
 #ifdef GULTRA_DEBUG
-    cout << "[Server] Name = '" << server.args.name << "'." << endl;
+    cout << "[Server] Name = '" << server->args.name << "'." << endl;
 #endif // GULTRA_DEBUG
 
-    server.mutex           = PTHREAD_MUTEX_INITIALIZER;
-    server.started         = false;
-    server.name            = server.args.name;
-    server.crypt           = nullptr;
-    server.status          = SS_NOTCREATED;
+    server->mutex           = PTHREAD_MUTEX_INITIALIZER;
+    server->started         = false;
+    server->name            = server->args.name;
+    server->crypt           = nullptr;
+    server->status          = SS_NOTCREATED;
+    server->pubkey          = nullptr;
+    server->localhost       = nullptr;
+    server->transport       = &transport_tcp;
+    server->br_callback     = nullptr;
+    server->bs_callback     = nullptr;
+    server->nextid          = 1;
+    server->_must_stop      = false;
+    server->_listener       = nullptr;
+    server->_supervisor     = nullptr;
+    server->_writer         = nullptr;
+    server->_gossiping      = false;
+    server->_multicastseq   = (uint32_t) time(NULL); // IDs stay new after a restart.
+    server->_epoch          = ((uint64_t) time(NULL) << 32) ^ (uint64_t) timer_monotonic_us() ^ (uint64_t) getpid();
+    
+    server->session.database         = nullptr;
+    server->session.user             = nullptr;
+    server->session.server           = server;
+    server->session._treatingcommand = false;
+    
+    memset(&server->hs_established, 0, sizeof(handshake_stats_t));
+    memset(&server->hs_logged, 0, sizeof(handshake_stats_t));
     
 /* [DEPRECATED]
-    server.logged_user     = nullptr;
-    server.logged          = false;
-    server.attachednetwork = nullptr;
+    server->logged_user     = nullptr;
+    server->logged          = false;
+    server->attachednetwork = nullptr;
 */
     
     // We set it to normal for now.
     // It is the user who set it manually to crypted.
-    server_setsendpolicy(&server, SP_NORMAL);
+    server_setsendpolicy(server, SP_NORMAL);
     
-    gthread_mutex_lock(&server.mutex);
+    gthread_mutex_lock(&server->mutex);
     {
         // If we have ssl allowed, we creates the RSA key.
-        if(server.args.withssl)
+        if(server->args.withssl)
         {
 #ifdef GULTRA_DEBUG
             cout << "[Server] Creating RSA encryption key." << endl;
 #endif // GULTRA_DEBUG
             
-            gerror_t err = Encryption::encryption_create(server.crypt);
+            gerror_t err = Encryption::encryption_create(server->crypt);
             
             if(err != GERROR_NONE) {
                 cout << "[Server] encryption_create return '" << gerror_to_string(err) << "'." << endl;
                 exit(GERROR_ENCRYPT_GENERATE);
             }
             
-            server.pubkey       = new buffer_t;
-            server.pubkey->size = 0;
-            if( (err = Encryption::encryption_get_publickey(server.crypt, server.pubkey)) != GERROR_NONE)
+            server->pubkey       = new buffer_t;
+            server->pubkey->size = 0;
+            if( (err = Encryption::encryption_get_publickey(server->crypt, server->pubkey)) != GERROR_NONE)
             {
                 cout << "[Server] Public Key Error : '" << gerror_to_string(err) << "'." << endl;
                 exit(GERROR_ENCRYPT_PUBKEY);
             }
             
-            cout << "[Server] Key lenght = " << server.pubkey->size << "." << endl;
+            cout << "[Server] Key lenght = " << server->pubkey->size << "." << endl;
 #ifdef GULTRA_DEBUG
-            cout << "[Server] Public key = '" << std::string(reinterpret_cast<char*>(server.pubkey->buf), server.pubkey->size) << "'." << endl;
+            cout << "[Server] Public key = '" << std::string(reinterpret_cast<char*>(server->pubkey->buf), server->pubkey->size) << "'." << endl;
 #endif // GULTRA_DEBUG
         }
 
@@ -158,101 +188,101 @@ gerror_t server_create()
 */
         
         cout << "[Server] Correctly created." << endl;
-        if(server.args.withssl) {
-            cout << "[Server] RSA size = " << RSA_size(server.crypt->keypair) << endl;
+        if(server->args.withssl) {
+            cout << "[Server] RSA size = " << RSA_size(server->crypt->keypair) << endl;
         }
         
-        server.status = SS_CREATED;
-        _listener = new InternalServerListener;
-        server.addListener(_listener);
+        server->status = SS_CREATED;
+        server->_listener = new InternalServerListener;
+        server->addListener(server->_listener);
     }
-    gthread_mutex_unlock(&server.mutex);
+    gthread_mutex_unlock(&server->mutex);
     return GERROR_NONE;
 }
 
 ////////////////////////////////////////////////////////////
 /** @brief Initialize a new server structure.
- *  @note This function assumes server is not null, and mutex and started
- *  are already initialized.
+ *  @note This function assumes mutex and started are already initialized,
+ *  by server_create().
+ *
+ *  @param server : A pointer to the server structure.
  *
  *  @return
  *  - GERROR_NONE on success.
  *  - GERROR_BADARGS if server is null or if maxclients is 0.
- *  - GERROR_INVALID_SOCKET if socket can't be initialized.
- *  - GERROR_INVALID_BINDING if socket can't be binded.
- *  - GERROR_INVALID_LISTENING if socket can't listen to port.
+ *  - GERROR_INVALID_LISTENING if server->transport can't listen to port.
  *  On Windows :
  *  - GERROR_WSASTARTUP if WSA can't be started.
 **/
 ////////////////////////////////////////////////////////////
-gerror_t server_initialize()
+gerror_t server_initialize(server_t* server)
 {
-    gthread_mutex_lock(&server.mutex);
+    if(!server)
+        return GERROR_BADARGS;
+    
+    gthread_mutex_lock(&server->mutex);
     {
-        if(server.args.maxclients == 0)
+        if(server->args.maxclients == 0)
         {
             cout << "[Server] Max clients number invalid (0)." << endl;
             exit(GERROR_BADARGS);
         }
         
-        if(server.args.port == 0)
+        if(server->args.port == 0)
         {
             cout << "[Server] Invalid port (0)." << endl;
             exit(GERROR_BADARGS);
         }
     }
-    gthread_mutex_unlock(&server.mutex);
+    gthread_mutex_unlock(&server->mutex);
 
     gerror_t err = NetworkInit();
     if(err != GERROR_NONE){
         //exit(err);
     }
 
-    gthread_mutex_lock(&server.mutex);
+    gthread_mutex_lock(&server->mutex);
     {
 
 #ifdef GULTRA_DEBUG
-        cout << "[Server] Initializing Server on port '" << server.args.port << "'." << endl;
+        cout << "[Server] Initializing Server on port '" << server->args.port << "'." << endl;
 #endif // GULTRA_DEBUG
 
-        server.clients.reserve(server.args.maxclients);
-        server.sock = socket(AF_INET, SOCK_STREAM, 0);
+        server->localsock = INVALID_SOCKET;
+        server->sock      = server->transport->listen((uint16_t) server->args.port);
 
-        if(server.sock == INVALID_SOCKET)
+        if(server->sock == SOCKET_ERROR)
         {
-            std::cerr << "[Server] Invalid server creation ! (Socket invalid)" << endl;
-            gthread_mutex_unlock(&server.mutex);
-            return GERROR_INVALID_SOCKET;
+            cout << "[Server] Invalid server creation ! (Can't listen on port : " << server->args.port << ".)" << endl;
+            gthread_mutex_unlock(&server->mutex);
+            return GERROR_INVALID_LISTENING;
         }
 
-        SOCKADDR_IN sin;
-        sin.sin_addr.s_addr = htonl(INADDR_ANY);
-        sin.sin_family      = AF_INET;
-        sin.sin_port        = htons(server.args.port);
-        if(bind(server.sock, (SOCKADDR*) &sin, sizeof(sin) ) == SOCKET_ERROR)
-        {
-            cout << "[Server] Invalid server creation ! (Can't bind socket on port : " << server.args.port << ".)" << endl;
+        cout << "[Server] Ready to listen on port '" << server->args.port << "'." << endl;
 
-            closesocket(server.sock);
-            gthread_mutex_unlock(&server.mutex);
-            return GERROR_INVALID_BINDING;
-        }
-
-        if(listen(server.sock, server.args.maxclients) == SOCKET_ERROR)
+        // Local clients (GUI, other nodes on this host) may also use a Unix-domain socket,
+        // with the same packets. Failing here is not fatal, as TCP is still available.
+        if(server->args.localsocket && server->transport == &transport_tcp)
         {
-            std::cerr << "[Server] Invalid server creation ! (Can't listen to clients.)" << endl;
+            std::string path = transport_local_path((uint16_t) server->args.port);
 
-            closesocket(server.sock);
-            gthread_mutex_unlock(&server.mutex);
-            return GERROR_INVALID_LISTENING;
+            server->localsock = transport_local.listen((uint16_t) server->args.port);
+            if(server->localsock == SOCKET_ERROR)
+            {
+                cout << "[Server] Can't listen on local socket '" << path << "'." << endl;
+                server->localsock = INVALID_SOCKET;
+            }
+            else
+            {
+                cout << "[Server] Ready to listen on local socket '" << path << "'." << endl;
+            }
         }
 
-        cout << "[Server] Ready to listen on port '" << server.args.port << "'." << endl;
-        server.started = true;
-        server.port    = (uint32_t) server.args.port;
-        server.status  = SS_INITED;
+        server->started = true;
+        server->port    = (uint32_t) server->args.port;
+        server->status  = SS_INITED;
     }
-    gthread_mutex_unlock(&server.mutex);
+    gthread_mutex_unlock(&server->mutex);
 
     return GERROR_NONE;
 }
@@ -307,30 +337,43 @@ gerror_t server_destroy(server_t* server)
         return GERROR_BADARGS;
     }
 
+    // The supervisor may still be running if server_stop() was not called.
+    server_supervisor_destroy(server);
+    server_spool_close(server);
+    server_replay_clear(server);
+    server_transfer_close(server);
+    broadcast_multicast_clear(server);
+
     if(!gthread_mutex_lock(&server->mutex))
         return GERROR_MUTEX_LOCK;
 
-    for(unsigned int i = 0; i < server->clients.size(); ++i)
+    for(ClientsList::iterator it = server->clients.begin(); it != server->clients.end(); ++it)
     {
         // TODO : find another way.
-        pthread_cancel(server->clients[i].server_thread);
+        pthread_cancel(it->server_thread);
         ////////////////////////////////////////////////
 
-        if(server->clients[i].sock != 0)
+        if(it->sock != 0)
         {
-            if(server->clients[i].mirror != NULL)
+            if(it->mirror != NULL)
             {
-                client_close(server->clients[i].mirror);
-                delete server->clients[i].mirror;
-                server->clients[i].mirror = 0;
+                client_close(it->mirror);
+                delete it->mirror;
+                it->mirror = 0;
             }
 
-            closesocket(server->clients[i].sock);
+            transport_close(it->sock);
         }
         
     }
 
-    closesocket(server->sock);
+    server->transport->close(server->sock);
+    
+    if(server->localsock != INVALID_SOCKET)
+    {
+        transport_local.close(server->localsock);
+        server->localsock = INVALID_SOCKET;
+    }
 
     // Destroy the RSA structures
     if(server->pubkey)
@@ -382,8 +425,12 @@ gerror_t server_destroy(server_t* server)
 
     cout << "[Server] Server destroyed." << endl;
     
-    if(_listener)
-        delete _listener;
+    if(server->_listener)
+    {
+        server->removeListener(server->_listener);
+        delete server->_listener;
+        server->_listener = nullptr;
+    }
 
     if(!gthread_mutex_unlock(&server->mutex))
         return GERROR_MUTEX_UNLOCK;
@@ -493,7 +540,8 @@ gerror_t server_setbytessendcallback(server_t* server, bytessend_t callback)
 ////////////////////////////////////////////////////////////
 PacketPtr server_receive_packet(server_t* server, client_t* client)
 {
-    Packet* pclient = receive_client_packet(client->sock);
+    // Answers must go through the mirror, where the distant server waits for them.
+    Packet* pclient = receive_client_packet(client->sock, client->mirror ? client->mirror->sock : 0);
     if(!pclient)
     {
         cout << "[Server] Invalid packet reception." << endl;
@@ -607,7 +655,7 @@ void server_preinterpret_packet(server_t* server, client_t* client, PacketPtr& p
                 while(cptr != endptr)
                 {
                     // Get the chunk packet
-                    Packet* vchunk = receive_client_packet(client->sock);
+                    Packet* vchunk = receive_client_packet(client->sock, client->mirror ? client->mirror->sock : 0);
                     if(!vchunk || vchunk->m_type != PT_ENCRYPTED_CHUNK)
                     {
                         cout << "[Server]{" << client->name << "} Can't receive Encrypted chunk !" << endl;
@@ -643,6 +691,8 @@ void server_preinterpret_packet(server_t* server, client_t* client, PacketPtr& p
 
                 // Create the packet
                 Packet* vret = packet_choose_policy(ptype);
+                if(vret)
+                    vret->setPacketSize(tot_sz);
                 // Interpret packet
                 packet_interpret(ptype, vret, (data_t*) data, tot_sz);
 
@@ -692,7 +742,7 @@ gerror_t server_end_user_connection(server_t* server, client_t* client)
 	if(!server || !client)
 		return GERROR_BADARGS;
 		
-	if(!globalsession.user)
+	if(!server->session.user || !client->logged)
 	{
 #ifdef GULTRA_DEBUG
 		cout << "[Server] Can't end user connection while not logged in (logic --')." << endl;
@@ -709,7 +759,7 @@ gerror_t server_end_user_connection(server_t* server, client_t* client)
 }
 
 ////////////////////////////////////////////////////////////
-/** @brief Unlog user from server and notifiate every clients.
+/** @brief Unlog every users from server and notifiate every clients.
  *  
  *  @return
  *  - GERROR_NONE    : No errors occured.
@@ -721,7 +771,7 @@ gerror_t server_unlog(server_t* server)
 	if(!server)
 		return GERROR_BADARGS;
 	
-	if(!globalsession.user)
+	if(!server->session.user)
 	{
 #ifdef GULTRA_DEBUG
 		cout << "[Server] Can't unlog while not logged in (logic --')." << endl;
@@ -729,22 +779,195 @@ gerror_t server_unlog(server_t* server)
 		return GERROR_NONE;
 	}
 	
-	for(unsigned int i = 0; i < server->clients.size(); ++i)
+	while(!server->session.users.empty())
 	{
-		gerror_t err = server_end_user_connection(server, &(server->clients[i]));
+		gerror_t err = server_unlog_user(server, server->session.users.back());
 		if(err != GERROR_NONE)
-			cout << "[Server] Unlog error : (" << server->clients[i].name << ") " << gerror_to_string(err) << endl;
+			return err;
 	}
 	
-	user_destroy(globalsession.user);
 	//server->logged = false;
 	cout << "[Server] Correctly unlogged." << endl;
 	return GERROR_NONE;
 }
 
-client_t* server_create_client_thread_loop(server_t* server, int i)
+////////////////////////////////////////////////////////////
+/** @brief Logs given user in the server. Every logged users share
+ *  the server database, key and listener, and are reachable by
+ *  distant users with their name.
+ *
+ *  The first logged user becomes the default user.
+ *
+ *  @return
+ *  - GERROR_NONE    : User is logged in (or already was).
+ *  - GERROR_BADARGS : server or user is null.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_login_user(server_t* server, user_t* user)
+{
+	if(!server || !user)
+		return GERROR_BADARGS;
+	
+	server_access();
+	{
+		std::vector<user_t*>& users = server->session.users;
+		if(std::find(users.begin(), users.end(), user) == users.end())
+			users.push_back(user);
+		
+		if(!server->session.user)
+			server->session.user = user;
+	}
+	server_stopaccess();
+	
+	return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Unlogs given user from the server, and from every
+ *  client it is logged with. The user stays in the database.
+ *
+ *  If it was the default user, the first remaining user becomes
+ *  the default one.
+ *
+ *  @return
+ *  - GERROR_NONE    : User is unlogged.
+ *  - GERROR_BADARGS : server or user is null.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_unlog_user(server_t* server, user_t* user)
 {
-    return server_create_client_thread_loop(server, &(server->clients.at(i)));
+	if(!server || !user)
+		return GERROR_BADARGS;
+	
+	std::vector<client_t*> peers = server_user_peers(server, user);
+	for(unsigned int i = 0; i < peers.size(); ++i)
+	{
+		gerror_t err = server_end_user_connection(server, peers[i]);
+		if(err != GERROR_NONE)
+		{
+			cout << "[Server] Unlog error : (" << peers[i]->name << ") " << gerror_to_string(err) << endl;
+		}
+	}
+	
+	server_access();
+	{
+		std::vector<user_t*>& users = server->session.users;
+		std::vector<user_t*>::iterator it = std::find(users.begin(), users.end(), user);
+		if(it != users.end())
+			users.erase(it);
+		
+		if(server->session.user == user)
+			server->session.user = users.empty() ? nullptr : users.front();
+	}
+	server_stopaccess();
+	
+	cout << "[Server] User '" << user->m_name->buf << "' unlogged." << endl;
+	return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the logged user with given name, or the default
+ *  user if name is null or empty. Returns null if no such user is
+ *  logged in.
+**/
+////////////////////////////////////////////////////////////
+user_t* server_find_user(server_t* server, const char* name)
+{
+	if(!server)
+		return nullptr;
+	
+	if(!name || name[0] == '\0')
+		return server->session.user;
+	
+	user_t* ret = nullptr;
+	server_access();
+	for(unsigned int i = 0; i < server->session.users.size(); ++i)
+	{
+		if(strcmp(server->session.users[i]->m_name->buf, name) == 0)
+		{
+			ret = server->session.users[i];
+			break;
+		}
+	}
+	server_stopaccess();
+	
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the clients given local user is logged with.
+**/
+////////////////////////////////////////////////////////////
+std::vector<client_t*> server_user_peers(server_t* server, user_t* user)
+{
+	std::vector<client_t*> ret;
+	if(!server || !user)
+		return ret;
+	
+	server_access();
+	for(ClientsList::iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+	{
+		if(it->local_user == user && it->logged)
+			ret.push_back(&(*it));
+	}
+	server_stopaccess();
+	
+	return ret;
+}
+
+/** @brief Fills a PT_USER_INIT (or PT_USER_INIT_RESPONSE) packet with given
+ *  user, for the distant user named to.
+**/
+void server_fill_userinit(user_init_t& uinit, user_t* user, const char* to)
+{
+	memset(&uinit, 0, sizeof(uinit));
+	strncpy(uinit.name, user->m_name->buf, SERVER_MAXBUFSIZE - 1);
+	strncpy(uinit.key,  user->m_key->buf,  SERVER_MAXBUFSIZE - 1);
+	strncpy(uinit.iv,   user->m_iv->buf,   SERVER_MAXBUFSIZE - 1);
+	if(to)
+		strncpy(uinit.to, to, SERVER_MAXBUFSIZE - 1);
+}
+
+/** @brief Waits SERVER_ACCEPTTIMEOUT ms for a client on given listener,
+ *  and launches the thread treating it.
+**/
+static void server_accept_(server_t* server, transport_t* transport, SOCKET listener)
+{
+    SOCKET csock = transport->accept(listener, SERVER_ACCEPTTIMEOUT);
+    if(csock == SOCKET_ERROR)
+        return;
+
+    // Local and loopback clients are identified as loopback clients, as if they used TCP.
+    SOCKADDR_IN csin;
+    memset(&csin, 0, sizeof(csin));
+    csin.sin_family      = AF_INET;
+    csin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(transport == &transport_tcp)
+    {
+        SOCKADDR_IN peer;
+        socklen_t   size = sizeof(peer);
+        if(getpeername(csock, (SOCKADDR*) &peer, &size) == 0 && peer.sin_family == AF_INET)
+            csin = peer;
+    }
+
+    /* Client acceptation
+     When the server receives a new client connection, it launches
+     a thread to treat the packet. This let us having multiple client 
+     connecting at the same time to the server.
+    */
+
+    server_launch_accepting_thread(server, csock, csin);
+}
+
+/** @brief Accepts the clients of the local socket until the server stops.
+**/
+static void* server_local_thread_loop_(void* data)
+{
+    server_t* server = (server_t*) data;
+    while(!(server->_must_stop))
+        server_accept_(server, &transport_local, server->localsock);
+    return nullptr;
 }
 
 void* server_thread_loop(void* __serv)
@@ -775,6 +998,11 @@ void* server_thread_loop(void* __serv)
     server->sendEvent(e);
     delete e;
 
+    // Clients of the local socket, if any, are accepted by another thread.
+    pthread_t localthread;
+    bool      local = server->localsock != INVALID_SOCKET &&
+                      pthread_create(&localthread, NULL, server_local_thread_loop_, server) == 0;
+
     while(!(server->_must_stop))
     {
         server_access();
@@ -784,25 +1012,12 @@ void* server_thread_loop(void* __serv)
         server_stopaccess();
         
         /* A new client come. */
-        SOCKADDR_IN csin;
-        size_t sin_size = sizeof(csin);
-        int csock = accept(server->sock, (SOCKADDR*) &csin, (socklen_t*) &sin_size);
-
-        if(csock == SOCKET_ERROR)
-        {
-            cout << "[Server] Can't accept client !" << endl;
-            return (void*) (uintptr_t) errno;
-        }
-        
-        /* Client acceptation
-         When the server receives a new client connection, it launches
-         a thread to treat the packet. This let us having multiple client 
-         connecting at the same time to the server.
-        */
-        
-        server_launch_accepting_thread(server, csock, csin);
+        server_accept_(server, server->transport, server->sock);
     }
     
+    if(local)
+        pthread_join(localthread, nullptr);
+    
     server->status = SS_STOPPED;
     return (void*) GERROR_NONE;
 }
@@ -819,8 +1034,15 @@ gerror_t server_stop(server_t* server)
     delete e1;
     
     server->_must_stop = true;
-    closesocket(server->sock);
+    server_gossip_stop(server);
     pthread_join(server->thread, nullptr);
+    server->transport->close(server->sock);
+    
+    if(server->localsock != INVALID_SOCKET)
+    {
+        transport_local.close(server->localsock);
+        server->localsock = INVALID_SOCKET;
+    }
     
     ServerStoppedEvent* e = new ServerStoppedEvent;
     e->type = "ServerStoppedEvent";
@@ -834,18 +1056,40 @@ gerror_t server_stop(server_t* server)
 client_t* server_find_client_by_name(server_t* server, const std::string& name)
 {
     gthread_mutex_lock(&server->mutex);
-    for(unsigned int i = 0; i < server->clients.size(); ++i)
+    for(ClientsList::iterator it = server->clients.begin(); it != server->clients.end(); ++it)
     {
-        if(server->clients[i].name == name)
+        if(it->name == name)
         {
             pthread_mutex_unlock(&server->mutex);
-            return &(server->clients[i]);
+            return &(*it);
         }
     }
     gthread_mutex_unlock(&server->mutex);
     return NULL;
 }
 
+/** @brief Returns the connection ID (client->mirror->id) of the established
+ *  client with given name, or ID_CLIENT_INVALID if we are not connected to it.
+**/
+uint32_t server_find_client_id(server_t* server, const std::string& name)
+{
+    uint32_t ret = ID_CLIENT_INVALID;
+
+    gthread_mutex_lock(&server->mutex);
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(client.established && client.mirror && client.name == name)
+        {
+            ret = client.mirror->id;
+            break;
+        }
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    return ret;
+}
+
 gerror_t server_abort_operation(server_t* server, client_t* client, int error)
 {
     // NOT IMPLEMENTED FOR NOW
@@ -869,13 +1113,18 @@ gerror_t server_notifiate(server_t* server, client_t* client, int error)
  *  by the server.
  *  @param adress : The adress to look at.
  *  @param port   : The port to create the connection to.
+ *  @param user   : If not null, a PT_USER_INIT packet with this local user is
+ *  sent right after the PT_CLIENT_INFO packet, without waiting for the
+ *  connection to be established.
+ *  @param to     : Name of the distant user the PT_USER_INIT packet is for. If
+ *  null or empty, it is for the default user of the distant server.
  *
  *  @return
  *  - GERROR_NONE on success.
  *  - GERROR_BADARGS if server is null or if out is different from null.
  *  - GERROR_ALLOC if an allocation problems occurs (for mirror or org client).
 **/
-gerror_t server_init_client_connection(server_t* server, client_t*& out, const char* adress, size_t port)
+gerror_t server_init_client_connection(server_t* server, client_t*& out, const char* adress, size_t port, user_t* user, const char* to)
 {
     if(!server || out != nullptr)
         return GERROR_BADARGS;
@@ -885,13 +1134,25 @@ gerror_t server_init_client_connection(server_t* server, client_t*& out, const c
     gnotifiate_info("[Server] Trying to initiate connection to client '&s:%i'...", adress, port);
         
 	// We check if connection does not already exist
+    server_access();
     out = server_client_exist(server, adress, port);
+    server_stopaccess();
     if(out)
     {
         gnotifiate_error("[Server] Client ('%s:%i') already exist (%s).", adress, port, out->name.c_str());
+        
+        if(user)
+        {
+            user_init_t uinit;
+            server_fill_userinit(uinit, user, to);
+            server->client_send(out, PT_USER_INIT, &uinit, sizeof(uinit));
+        }
+        
         return GERROR_NONE;
     }
     
+    long connectstart = timer_monotonic_us();
+    
 #ifdef GULTRA_DEBUG
     gnotifiate_info("[Server] Creating mirror client.");
 #endif
@@ -931,19 +1192,25 @@ gerror_t server_init_client_connection(server_t* server, client_t*& out, const c
         return GERROR_ALLOC;
     }
 
-    new_client->sock        = SOCKET_ERROR;
-    new_client->established = false;
-    new_client->logged      = false;
+    new_client->sock         = SOCKET_ERROR;
+    new_client->established  = false;
+    new_client->logged       = false;
+    new_client->connectstart = connectstart;
+    new_client->trusted      = mirror->trusted;
 
 #ifdef GULTRA_DEBUG
     cout << "[Server] Registering client." << endl;
 #endif // GULTRA_DEBUG
 
+    // The client is registered by copy : new_client is only used to send the handshake, and
+    // other connections may update client_by_id, so the registered client is kept here.
+    client_t* registered = nullptr;
     server_access();
     {
         // We register the client to the server
         server->clients.push_back(*new_client);
-        server->client_by_id[new_client->mirror->id] = & (server->clients.at(server->clients.size() - 1));
+        registered = & (server->clients.back());
+        server->client_by_id[new_client->mirror->id] = registered;
     }
     server_stopaccess();
 
@@ -957,14 +1224,28 @@ gerror_t server_init_client_connection(server_t* server, client_t*& out, const c
     info.idret  = ID_CLIENT_INVALID;
     info.s_port = server->port;
     strcpy(info.name, mirror->name.c_str());
-    buffer_copy(info.pubkey, *(server->pubkey));
+    if(server->pubkey)
+        buffer_copy(info.pubkey, *server->pubkey);
+    else
+        info.pubkey.size = 0;
 
     client_info_t serialized = serialize<client_info_t>(info);
     client_send_packet(new_client, PT_CLIENT_INFO, &serialized, sizeof(client_info_t));
 
+    // The handshake is pipelined : as new_client has no socket to receive answers yet,
+    // every packet sent with it is sent with PF_NOACK and we don't wait for anything.
+    // The PT_USER_INIT packet is so sent in the same round trip as PT_CLIENT_INFO.
+    if(user)
+    {
+        user_init_t uinit;
+        server_fill_userinit(uinit, user, to);
+        server->client_send(new_client, PT_USER_INIT, &uinit, sizeof(uinit));
+    }
+
     // Now the destination should receive the PT_CLIENT_INFO packet, and send us
     // PT_CLIENT_INFO        to complete the client_t structure
     // PT_CLIENT_ESTABLISHED to be sure that everythig went fine
+    // Both are sent without waiting for our answers.
     // NOTE : Once PT_CLIENT_INFO packet is sent, we only use server->client_send to send
     // packet to the client.
 
@@ -972,18 +1253,20 @@ gerror_t server_init_client_connection(server_t* server, client_t*& out, const c
     cout << "[Server] Client inited." << endl;
 #endif // GULTRA_DEBUG
 
-    out = server->client_by_id[new_client->mirror->id];
+    out = registered;
     return GERROR_NONE;
 }
 
 client_t* server_client_exist(server_t* server, const std::string& cip, const size_t& cport)
 {
-    for(unsigned int i = 0; i < server->clients.size(); ++i)
+    for(ClientsList::iterator it = server->clients.begin(); it != server->clients.end(); ++it)
     {
-        if(std::string(inet_ntoa(server->clients[i].address.sin_addr)) == cip &&
-           cport == ntohs(server->clients[i].mirror->address.sin_port) )
+        // The mirror is null while the client is being destroyed.
+        if(it->mirror != NULL &&
+           std::string(inet_ntoa(it->address.sin_addr)) == cip &&
+           cport == ntohs(it->mirror->address.sin_port) )
         {
-            return &(server->clients[i]);
+            return &(*it);
         }
     }
     
@@ -1021,7 +1304,7 @@ void server_end_client(server_t* server, const std::string& client_name)
                         client->mirror = 0;
                     }
                     
-                    closesocket(client->sock);
+                    transport_close(client->sock);
                 }
                 
                 if(client->logged)
@@ -1040,7 +1323,7 @@ void server_end_client(server_t* server, const std::string& client_name)
                 delete e2;
                 
                 // Delete the client.
-                server->clients.erase(server->clients.begin() + server_find_client_index_private_(server, client_name));
+                server_erase_client_private_(server, client);
                 server->client_by_id[id] = nullptr;
                 gthread_mutex_unlock(&server->mutex);
             }
@@ -1056,6 +1339,10 @@ void server_end_client(server_t* server, const std::string& client_name)
  *  @param out    : [deactivated] The connected user informations.
  *  @param adress : The adress of the client to connect.
  *  @param port   : The port of the client.
+ *  @param user   : The local user to connect with. If null, the default user
+ *  of the session is used.
+ *  @param to     : The distant user to connect to. If null or empty, the
+ *  default user of the distant server is used.
  *
  *  This function consist on several requests from this server to another
  *  one, aquiring some informations like currently logged user, server info, 
@@ -1069,13 +1356,20 @@ void server_end_client(server_t* server, const std::string& client_name)
  *  - GERROR_BADARGS         : Bad args given.
  *  - GERROR_INVALID_CONNECT : Can't connect to server.
 **/
-gerror_t server_init_user_connection(server_t* server, /* user_t& out, */ const char* adress, size_t port)
+gerror_t server_init_user_connection(server_t* server, /* user_t& out, */ const char* adress, size_t port, user_t* user, const char* to)
 {
 	if(!server || !adress || port == 0)
 		return GERROR_BADARGS;
+	
+	if(!user)
+		user = server->session.user;
+	if(!user)
+		return GERROR_BADARGS;
 		
+	// The PT_USER_INIT packet is sent with the connection request, so we don't
+	// have to wait for the connection to be established before sending it.
 	client_t* new_client = nullptr;
-	server_init_client_connection(server, new_client, adress, port);
+	server_init_client_connection(server, new_client, adress, port, user, to);
 	if(!new_client)
 		return GERROR_INVALID_CONNECT;
 
@@ -1084,23 +1378,46 @@ gerror_t server_init_user_connection(server_t* server, /* user_t& out, */ const
 		cout << "[Server] Can't establish client '" << adress << ":" << port << "'. (Timed out)" << endl;
 		return GERROR_INVALID_CONNECT;
 	}
-    
-    client_thread_setstatus(new_client, CO_ESTABLISHING);
 	
-	// Now client connection is established, we send a packet to init user connection
-	user_init_t uinit;
-	strcpy(uinit.name, globalsession.user->m_name->buf);
-	strcpy(uinit.key,  globalsession.user->m_key->buf);
-	strcpy(uinit.iv,   globalsession.user->m_iv->buf);
-	
-	server->client_send(new_client, PT_USER_INIT, &uinit, sizeof(uinit));
-	
-	// Wait for the client to be logged in
-	while(new_client->logged == false);
+	// Wait for the client to be logged in. The distant user may have to accept us,
+	// so there is no time out.
+	while(new_client->logged == false)
+		usleep(1000);
     
 	return GERROR_NONE;
 }
 
+////////////////////////////////////////////////////////////
+/** @brief Records the time elapsed since given start in given
+ *  handshake statistics.
+ *
+ *  @param server : The server to use.
+ *  @param stats  : Statistics to update (hs_established or hs_logged).
+ *  @param start  : Monotonic time (us) when the connection was initiated.
+ *  If 0, the connection was initiated by the distant server and nothing
+ *  is recorded.
+**/
+////////////////////////////////////////////////////////////
+void server_handshake_record(server_t* server, handshake_stats_t& stats, long start)
+{
+    if(!server || start <= 0)
+        return;
+    
+    long elapsed = timer_monotonic_us() - start;
+    
+    server_access();
+    {
+        if(stats.count == 0 || elapsed < stats.min)
+            stats.min = elapsed;
+        if(stats.count == 0 || elapsed > stats.max)
+            stats.max = elapsed;
+        
+        stats.total += elapsed;
+        stats.count++;
+    }
+    server_stopaccess();
+}
+
 /** @brief Wait for given client to be established.
  *  
  *  Use this function to wait for a client between the 'Connecting' state
@@ -1127,13 +1444,18 @@ gerror_t server_wait_establisedclient(client_t* client, uint32_t timeout)
 			elapsedTime = difftime(time(NULL), startTime);
 			if(elapsedTime > timeout)
 				return GERROR_TIMEDOUT;
+			
+			// Many connections may be waited at the same time (see server_warmup()),
+			// so do not burn a whole core for each of them.
+			usleep(1000);
 		}
 		
 		return GERROR_NONE;
 	}
 	else
 	{
-		while(client->established == false);
+		while(client->established == false)
+			usleep(1000);
 		return GERROR_NONE;
 	}
 }
@@ -1156,6 +1478,8 @@ int server_get_status(server_t* server)
 }
 
 /** @brief Wait for the server to have a given status, with a given timeout.
+ *  The status is checked every SERVER_WAITSTATUS us, so many waiting
+ *  threads don't take the processor from the thread changing it.
  *  @param server  : Pointer to the server.
  *  @param status  : Status to wait.
  *  @param timeout : Maximum time to wait. 0 is infinite.
@@ -1171,13 +1495,15 @@ gerror_t server_wait_status(server_t* server, int status, long timeout)
 			elapsedTime = difftime(time(NULL), startTime);
 			if(elapsedTime > timeout)
 				return GERROR_TIMEDOUT;
+			usleep(SERVER_WAITSTATUS);
 		}
 		
 		return GERROR_NONE;
     }
     else
     {
-        while(server->status != status) ;
+        while(server->status != status)
+            usleep(SERVER_WAITSTATUS);
         return GERROR_NONE;
     }
 }
@@ -34,6 +34,12 @@ GBEGIN_DECL
 ////////////////////////////////////////////////////////////
 typedef std::map<uint32_t, client_t*> ClientsIdMap;
 
+////////////////////////////////////////////////////////////
+/// @brief The clients of a server. A list, as client threads and
+/// ClientsIdMap keep pointers to the clients while others are erased.
+////////////////////////////////////////////////////////////
+typedef std::list<client_t> ClientsList;
+
 ////////////////////////////////////////////////////////////
 /// @brief A function to send bytes to given client.
 ////////////////////////////////////////////////////////////
@@ -67,13 +73,57 @@ typedef enum {
     
 } ServerStatus;
 
+/// @brief Latency statistics of the handshakes initiated by a server.
+/// Every times are in microseconds.
+typedef struct handshake_stats_t {
+    uint32_t count; // Number of handshakes measured.
+    long     total; // Sum of the measured times.
+    long     min;   // Fastest handshake.
+    long     max;   // Slowest handshake.
+} handshake_stats_t;
+
+// Relay tuning. Every delays are in milliseconds.
+#define RELAY_TTL      8     // Maximum number of hops of a route request or a relayed packet.
+#define RELAY_ROUTETTL 60000 // Time a learned route is kept.
+#define RELAY_TIMEOUT  3000  // Time a route request waits for the reply of the destination.
+#define RELAY_MAXKEYS  1024  // Maximum number of servers whose key is learned from route packets.
+
+/// @brief Route to a server we are not directly connected to.
+typedef struct route_t {
+    uint32_t via;     // ID of the client the packets are sent to, as in client_by_id.
+    uint8_t  hops;    // Number of hops to the destination.
+    long     expires; // Monotonic time (ms) the route is forgotten.
+    buffer_t pubkey;  // Public key of the destination, to decrypt what it relays to us.
+} route_t;
+
+// Replay buffers of the sequenced packets.
+#define REPLAY_MAXPACKETS 256 // Sequenced packets kept for one peer until it acknowledges them.
+#define REPLAY_ACKEVERY   16  // A peer acknowledges the sequenced packets it received every N packets.
+
+// File transfers. Every delays are in milliseconds.
+#define TRANSFER_RETRIES 3     // Offers sent again while the receiver misses chunks, or finds a bad hash.
+#define TRANSFER_TIMEOUT 10000 // Time the sender waits for the bitmap of the receiver.
+#define TRANSFER_MAXSTREAMS 16 // Maximum number of connections a file is sent on.
+
+typedef struct supervisor_t supervisor_t;
+typedef struct broadcast_t  broadcast_t;
+typedef struct multicast_repair_t multicast_repair_t;
+typedef struct spool_file_t spool_file_t;
+typedef struct replay_t     replay_t;
+typedef struct transfer_in_t  transfer_in_t;
+typedef struct transfer_out_t transfer_out_t;
+typedef struct transfer_writer_t transfer_writer_t;
+typedef struct transport_t  transport_t;
+
 class Server : public Emitter {
 public:
     
     SOCKET                sock;
+    SOCKET                localsock;       // Unix-domain socket for local clients. INVALID_SOCKET if not used.
+    transport_t*          transport;       // Transport of the connections opened and accepted (transport_tcp by default). Set it before server_initialize().
 
     std::string           name;            // Name displayed to other servers. This name is send to the client.
-    std::vector<client_t> clients;         // List of activated clients.
+    ClientsList           clients;         // List of activated clients.
     ClientsIdMap          client_by_id;    // Every clients by ID. This list is updated for every clients connection or deconnection.
     client_t*             localhost;       // A local client used to send packet to this server.
 
@@ -93,7 +143,32 @@ public:
 //    bool 			 	  logged;          // True if logged in.
     
     ServerStatus          status;          // Current status of the server. (By default it is SS_STOPPED then SS_STARTED).
+    
+    handshake_stats_t     hs_established;  // Time from connection initiation to PT_CLIENT_ESTABLISHED.
+    handshake_stats_t     hs_logged;       // Time from connection initiation to PT_USER_INIT_RESPONSE.
+    
+    session_t             session;         // Database and user of this server. session.server points to this server.
+    uint32_t              nextid;          // Next connection ID given by server_generate_new_id().
+    
     bool                  _must_stop;      // [Private] True when server must stop the threading loop.
+    Listener*             _listener;       // [Private] Internal listener, registered by server_create().
+    supervisor_t*         _supervisor;     // [Private] Supervisor state, created by server_supervisor_start().
+    pthread_t             _gossipthread;   // [Private] Thread started by server_gossip_start().
+    bool                  _gossiping;      // [Private] True while the gossip thread runs.
+    std::map<std::string, spool_file_t*> _spools; // [Private] Opened spool files, by destination.
+    std::map<std::string, replay_t*> _replays; // [Private] Sequenced packets sent and received, by peer name.
+    uint64_t              _epoch;          // [Private] Random ID of this run, so peers know our sequences restarted.
+    std::map<uint64_t, transfer_in_t*> _receiving;     // [Private] Files received, finished or not, by transfer ID.
+    std::multimap<uint64_t, transfer_out_t*> _sending; // [Private] Files being sent, by transfer ID.
+    transfer_writer_t*    _writer;         // [Private] Thread writing the chunks received, started with the first one.
+    std::map<uint32_t, std::list<broadcast_t*> > _broadcastanswers; // [Private] Broadcasts owed an answer, by connection ID, in the order they were written. Null for timed out ones.
+    std::vector<uint64_t> _multicastseen;  // [Private] IDs of the last multicasts received, oldest first.
+    uint32_t              _multicastseq;   // [Private] Sequence of the next multicast sent.
+    std::list<multicast_repair_t*> _multicastrepairs; // [Private] Subtrees given to our children, until they tell the peers they reach. Oldest first.
+    
+    std::vector<std::string> channels;     // Channels this server subscribed to. Protected by mutex.
+    std::map<std::string, route_t> _routes; // [Private] Routes to servers we are not connected to, by name. Protected by mutex.
+    std::map<std::string, buffer_t> _routekeys; // [Private] Public keys of the servers we learned routes to, by name. Protected by mutex.
     
 //  networkptr_t          attachednetwork; // Current attached network. Null if none.
     
@@ -103,6 +178,21 @@ public:
         bool withssl;
         std::string name;
         int port;
+        int warmup;         // Number of known clients to reconnect at startup (0 disables it).
+        int warmupparallel; // Maximum number of warm-up connections opened at the same time.
+        bool supervise;     // True if opened clients are reconnected automatically by the supervisor.
+        bool localsocket;   // True if the server also listens, and connects local servers, on a Unix-domain socket.
+        bool sharedmemory;  // True if files sent to trusted local servers go through a shared memory ring.
+        bool iouring;       // True if transfered files are read and written with io_uring when available.
+        int multicast;      // Maximum number of children of a server in the multicast tree (0 disables it).
+        int gossip;         // Delay (ms) between two gossip rounds about the known peers (0 disables it).
+        std::string spooldir; // Directory of the spool files, for peers which are not connected.
+        int spoolquota;     // Maximum size (KB) spooled for one peer (0 disables the spool).
+        int spoolttl;       // Time (s) a spooled message is kept.
+        int chunksize;      // Size (bytes) of the chunks of the files sent, and biggest one accepted when receiving.
+        int streams;        // Number of connections the chunks of a file are sent on, at the same time (1 uses only the one of the client).
+        int writebehind;    // Size (KB) of the chunks received waiting to be written by a disk thread (0 writes them from the connection).
+        bool directio;      // True if the chunks received are written with O_DIRECT, when they are aligned.
     }                     args;
     
     const char* getName() const { return "Server"; }
@@ -114,7 +204,6 @@ public:
 };
 
 typedef Server server_t; ///< @brief Compatibility typedef.
-extern server_t server;
 
 /// @brief Event sent when server is started.
 typedef Event ServerStartedEvent;
@@ -155,6 +244,16 @@ public:
     client_t* client; ///< @brief The just closed client.
 };
 
+/// @brief Sent when a client sent us a message, directly or on a channel
+/// we subscribed to.
+class ServerMessageReceivedEvent : public Event {
+public:
+    client_t*   client;  ///< @brief Client which sent the message, or relayed it to us.
+    std::string origin;  ///< @brief Name of the server which wrote the message.
+    std::string channel; ///< @brief Channel of the message. Empty for a direct message.
+    std::string message;
+};
+
 /// @brief Event send when the Server receives a HTTP request, from unknown
 /// sources.
 class ServerHttpRequestEvent : public Event {
@@ -162,11 +261,38 @@ public:
     std::string rawrequest; ///< @brief Raw HTTP request from unknown server.
 };
 
+// Supervisor tuning. Every delays are in milliseconds.
+#define SUPERVISOR_TICK              200    // Maximum delay between two checks of the supervised peers.
+#define SUPERVISOR_BACKOFF_MIN       500    // Delay before the first reconnection attempt.
+#define SUPERVISOR_BACKOFF_MAX       60000  // Maximum delay between two reconnection attempts.
+#define SUPERVISOR_CIRCUIT_THRESHOLD 5      // Number of consecutive failures opening the circuit.
+#define SUPERVISOR_CIRCUIT_COOLDOWN  300000 // Delay before trying again a peer with an open circuit.
+
+/// @brief State of a peer tracked by the supervisor.
+typedef enum {
+    PS_IDLE        = 0, // Peer is supervised, but no connection has been tried yet.
+    PS_CONNECTING  = 1, // A connection attempt is running.
+    PS_CONNECTED   = 2, // Peer is connected and established.
+    PS_BACKOFF     = 3, // Last attempt failed, waiting before the next one.
+    PS_CIRCUITOPEN = 4  // Too many failures, peer is only tried again after a cooldown.
+} PeerState;
+
+/// @brief A peer the supervisor keeps connected.
+typedef struct supervised_peer_t {
+    std::string ip;          // Resolved IP adress of the peer.
+    uint16_t    port;        // Port of the peer server.
+    PeerState   state;       // Current state.
+    uint32_t    failures;    // Number of consecutive failed attempts.
+    uint32_t    attempts;    // Total number of attempts.
+    long        nextattempt; // Monotonic time (ms) of the next attempt, in PS_BACKOFF or PS_CIRCUITOPEN.
+} supervised_peer_t;
+
 // Before using any of the functions below, be sure every field of the server's args structure
-// has been correctly filled.
+// has been correctly filled. Every server is independant : a process can run as many servers
+// as it wants, as long as they listen on different ports.
 
-gerror_t server_create                      ();
-gerror_t server_initialize					();
+gerror_t server_create                      (server_t* server);
+gerror_t server_initialize					(server_t* server);
 
 gerror_t server_launch    					(server_t* server);
 gerror_t server_stop                        (server_t* server);
@@ -180,19 +306,56 @@ PacketPtr server_receive_packet				(server_t* server, client_t* client);
 void server_preinterpret_packet             (server_t* server, client_t* client, PacketPtr& pclient);
 
 client_t* server_find_client_by_name		(server_t* server, const std::string& name);
+uint32_t server_find_client_id              (server_t* server, const std::string& name);
 
 gerror_t server_abort_operation				(server_t* server, client_t* client, int error);
 gerror_t server_notifiate                   (server_t* server, client_t* client, int error);
 
-gerror_t server_init_user_connection		(server_t* server, /* user_t& out, */ const char* adress, size_t port);
+gerror_t server_init_user_connection		(server_t* server, /* user_t& out, */ const char* adress, size_t port, user_t* user = nullptr, const char* to = nullptr);
 gerror_t server_end_user_connection         (server_t* server, client_t* client);
 gerror_t server_unlog                       (server_t* server);
 
-gerror_t server_init_client_connection		(server_t* server, client_t*& out, const char* adress, size_t port);
+gerror_t server_login_user                  (server_t* server, user_t* user);
+gerror_t server_unlog_user                  (server_t* server, user_t* user);
+user_t*  server_find_user                   (server_t* server, const char* name);
+std::vector<client_t*> server_user_peers    (server_t* server, user_t* user);
+
+gerror_t server_init_client_connection		(server_t* server, client_t*& out, const char* adress, size_t port, user_t* user = nullptr, const char* to = nullptr);
 gerror_t server_wait_establisedclient	    (client_t* client, uint32_t timeout = 0);
 void server_end_client						(server_t* server, const std::string& client_name);
 gerror_t server_check_client                (server_t* server, client_t* client);
 
+gerror_t server_warmup                      (server_t* server, user_t* user, uint32_t count, uint32_t maxparallel);
+
+gerror_t server_supervisor_start            (server_t* server);
+gerror_t server_supervisor_stop             (server_t* server);
+gerror_t server_supervise                   (server_t* server, const std::string& adress, uint16_t port);
+gerror_t server_unsupervise                 (server_t* server, const std::string& adress, uint16_t port);
+std::vector<supervised_peer_t> server_supervised_peers (server_t* server);
+const char* peerstate_to_string             (int state);
+
+gerror_t server_subscribe                   (server_t* server, const std::string& channel);
+gerror_t server_unsubscribe                 (server_t* server, const std::string& channel);
+gerror_t server_publish                     (server_t* server, const std::string& channel, const std::string& message, broadcast_t*& ret);
+bool     server_is_subscribed               (server_t* server, const std::string& channel);
+uint32_t channel_hash                       (const char* channel);
+
+gerror_t server_relay_send                  (server_t* server, const std::string& destination, uint8_t packet_type, const void* data, size_t sz);
+std::map<std::string, route_t> server_routes (server_t* server);
+
+gerror_t server_gossip_start                (server_t* server);
+gerror_t server_gossip_stop                 (server_t* server);
+
+gerror_t server_spool                       (server_t* server, const std::string& destination, uint8_t kind, const void* data, size_t sz);
+gerror_t server_spool_flush                 (server_t* server, const std::string& destination);
+size_t   server_spooled                     (server_t* server, const std::string& destination);
+
+gerror_t server_send_sequenced              (server_t* server, const std::string& destination, uint8_t packet_type, const void* data, size_t sz);
+
+gerror_t server_transfer_send               (server_t* server, client_t* client, const char* filename);
+
+void     server_handshake_record            (server_t* server, handshake_stats_t& stats, long start);
+
 int      server_get_status                  (server_t* server);
 gerror_t server_wait_status                 (server_t* server, int status, long timeout = 0);
 client_t* server_client_exist               (server_t* server, const std::string& cip, const size_t& cport);
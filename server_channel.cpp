@@ -0,0 +1,235 @@
+/*
+ File        : server_channel.cpp
+ Description : Publish/subscribe channels between connected servers.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+#include <algorithm>
+
+GBEGIN_DECL
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the hash a channel is indexed with in the
+ *  subscriptions of a connection (FNV-1a).
+ *
+ *  @note
+ *  Two channels may have the same hash. A server so may receive
+ *  a message it did not subscribe to, and must check it with
+ *  server_is_subscribed().
+**/
+////////////////////////////////////////////////////////////
+uint32_t channel_hash(const char* channel)
+{
+    uint32_t hash = 2166136261u;
+    for(; *channel; ++channel)
+        hash = (hash ^ (uint8_t) *channel) * 16777619u;
+    return hash;
+}
+
+/** @brief Returns true if given channel name can be sent in a packet.
+**/
+static bool channel_is_valid_(const std::string& channel)
+{
+    return !channel.empty() && channel.size() < CHANNEL_MAXNAME;
+}
+
+/** @brief Keeps only the clients subscribed to the channel hash given
+ *  in data.
+**/
+static bool channel_filter_(const client_t& client, void* data)
+{
+    uint32_t hash = *(uint32_t*) data;
+    return std::binary_search(client.channels.begin(), client.channels.end(), hash);
+}
+
+/** @brief Tells every established client about a change of our
+ *  subscriptions.
+**/
+static gerror_t server_channel_broadcast_(server_t* server, uint8_t packet_type, const std::string& channel)
+{
+    char name[CHANNEL_MAXNAME];
+    memset(name, 0, CHANNEL_MAXNAME);
+    memcpy(name, channel.c_str(), channel.size());
+
+    broadcast_t* broadcast = nullptr;
+    gerror_t     err       = broadcast_send(server, packet_type, name, CHANNEL_MAXNAME, broadcast);
+    if(err != GERROR_NONE)
+        return err;
+
+    err = broadcast_wait(broadcast, BROADCAST_TIMEOUT);
+    broadcast_destroy(broadcast);
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Subscribes this server to given channel.
+ *
+ *  Every connected server is told, and clients connected later
+ *  are told when they are established.
+ *
+ *  @return
+ *  - GERROR_NONE on success, or if already subscribed.
+ *  - GERROR_BADARGS if server is null or channel is invalid.
+ *  - @see broadcast_wait() if a client did not receive the
+ *  subscription.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_subscribe(server_t* server, const std::string& channel)
+{
+    if(!server || !channel_is_valid_(channel))
+        return GERROR_BADARGS;
+
+    gthread_mutex_lock(&server->mutex);
+    bool known = std::find(server->channels.begin(), server->channels.end(), channel) != server->channels.end();
+    if(!known)
+        server->channels.push_back(channel);
+    gthread_mutex_unlock(&server->mutex);
+
+    if(known)
+        return GERROR_NONE;
+
+    return server_channel_broadcast_(server, PT_CHANNEL_SUBSCRIBE, channel);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Unsubscribes this server from given channel.
+ *
+ *  @return
+ *  - GERROR_NONE on success, or if not subscribed.
+ *  - GERROR_BADARGS if server is null or channel is invalid.
+ *  - @see broadcast_wait() if a client did not receive the
+ *  unsubscription.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_unsubscribe(server_t* server, const std::string& channel)
+{
+    if(!server || !channel_is_valid_(channel))
+        return GERROR_BADARGS;
+
+    gthread_mutex_lock(&server->mutex);
+    std::vector<std::string>::iterator it = std::find(server->channels.begin(), server->channels.end(), channel);
+    bool known = it != server->channels.end();
+    if(known)
+        server->channels.erase(it);
+    gthread_mutex_unlock(&server->mutex);
+
+    if(!known)
+        return GERROR_NONE;
+
+    return server_channel_broadcast_(server, PT_CHANNEL_UNSUBSCRIBE, channel);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns true if this server subscribed to given
+ *  channel.
+**/
+////////////////////////////////////////////////////////////
+bool server_is_subscribed(server_t* server, const std::string& channel)
+{
+    gthread_mutex_lock(&server->mutex);
+    bool ret = std::find(server->channels.begin(), server->channels.end(), channel) != server->channels.end();
+    gthread_mutex_unlock(&server->mutex);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Publishes a message on given channel.
+ *
+ *  The message is only sent to the clients which subscribed to
+ *  the channel, as a broadcast.
+ *
+ *  @param ret : Set to the broadcast, to give to broadcast_wait()
+ *  and broadcast_destroy().
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_BADARGS if server is null or channel is invalid.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_publish(server_t* server, const std::string& channel, const std::string& message, broadcast_t*& ret)
+{
+    ret = nullptr;
+    if(!server || !channel_is_valid_(channel))
+        return GERROR_BADARGS;
+
+    channel_message_t data;
+    memset(&data, 0, sizeof(channel_message_t));
+    memcpy(data.channel, channel.c_str(), channel.size());
+    memcpy(data.message, message.c_str(), std::min<size_t>(message.size(), SERVER_MAXBUFSIZE - 1));
+
+    uint32_t hash = channel_hash(data.channel);
+    return broadcast_send(server, PT_CHANNEL_MESSAGE, &data, sizeof(channel_message_t), ret, channel_filter_, &hash);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends our subscriptions to a newly established client.
+ *
+ *  They are sent without waiting for answers, as this is done
+ *  by the threads reading the connection.
+**/
+////////////////////////////////////////////////////////////
+void server_channels_announce(server_t* server, client_t* client)
+{
+    if(!client->mirror)
+        return;
+
+    gthread_mutex_lock(&server->mutex);
+    std::vector<std::string> channels = server->channels;
+    gthread_mutex_unlock(&server->mutex);
+
+    for(unsigned int i = 0; i < channels.size(); ++i)
+    {
+        char name[CHANNEL_MAXNAME];
+        memset(name, 0, CHANNEL_MAXNAME);
+        memcpy(name, channels[i].c_str(), channels[i].size());
+        send_client_packet(client->mirror->sock, SOCKET_ERROR, PT_CHANNEL_SUBSCRIBE, name, CHANNEL_MAXNAME);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Updates the subscriptions of a client, when it sent
+ *  us PT_CHANNEL_SUBSCRIBE or PT_CHANNEL_UNSUBSCRIBE.
+ *
+ *  Hashes are kept once per subscribed channel, so unsubscribing
+ *  a channel keeps another one with the same hash.
+**/
+////////////////////////////////////////////////////////////
+void server_channel_update(server_t* server, client_t* client, const char* channel, bool subscribe)
+{
+    uint32_t hash = channel_hash(channel);
+
+    gthread_mutex_lock(&server->mutex);
+    std::vector<uint32_t>& channels = client->channels;
+    std::vector<uint32_t>::iterator it = std::lower_bound(channels.begin(), channels.end(), hash);
+    if(subscribe)
+        channels.insert(it, hash);
+    else if(it != channels.end() && *it == hash)
+        channels.erase(it);
+    gthread_mutex_unlock(&server->mutex);
+
+#ifdef GULTRA_DEBUG
+    cout << "[Server]{" << client->name << "} " << (subscribe ? "Subscribed to" : "Unsubscribed from") << " channel '" << channel << "'." << endl;
+#endif // GULTRA_DEBUG
+}
+
+GEND_DECL
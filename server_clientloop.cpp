@@ -23,10 +23,28 @@
 
 #include "server.h"
 #include "server_intern.h"
+#include "broadcast.h"
 #include "commands.h"
+#include "gio.h"
 
 GBEGIN_DECL
 
+/** @brief Copies the distant user described in given packet to the client's
+ *  logged_user. Its buffers may not exist yet, or have been freed by a previous
+ *  PT_USER_END.
+**/
+static void server_copy_logged_user_(client_t* client, const user_init_t& data)
+{
+    user_t* user = client->logged_user;
+    if(!user->m_name) user->m_name = netbuf_new(0);
+    if(!user->m_key)  user->m_key  = netbuf_new(0);
+    if(!user->m_iv)   user->m_iv   = netbuf_new(0);
+
+    netbuf_copyraw(user->m_name, data.name, strlen(data.name));
+    netbuf_copyraw(user->m_key,  data.key,  strlen(data.key));
+    netbuf_copyraw(user->m_iv,   data.iv,   strlen(data.iv));
+}
+
 void* server_client_thread_loop(void* data)
 {
     client_t* client = (client_t*) data;
@@ -57,13 +75,19 @@ void* server_client_thread_loop(void* data)
             if(client->mirror != NULL)
             {
                 cid   = client->mirror->id;
+                broadcast_forget(org, cid);
                 client_close(client->mirror, false);
                 
                 delete client->mirror;
                 client->mirror = 0;
             }
             
-            closesocket(client->sock);
+            if(client->ringout)
+                shmring_close(client->ringout);
+            if(client->ringin)
+                shmring_close(client->ringin);
+            
+            transport_close(client->sock);
             client->sock = 0;
             /*
              if(client->logged)
@@ -77,12 +101,20 @@ void* server_client_thread_loop(void* data)
             cout << "[Server]{" << client->name << "} Closed client." << endl;
             
             // Erasing client from vectors
-            int cindex = server_find_client_index_private_(org, client->name);
-            
             gthread_mutex_lock(&org->mutex);
-            org->clients.erase(org->clients.begin() + cindex);
+            
+            // Launch an event to notifiate Listeners that the Client has been
+            // closed, as in server_end_client().
+            ServerClientClosedEvent* e = new ServerClientClosedEvent;
+            e->type   = "ServerClientClosedEvent";
+            e->parent = org;
+            e->client = client;
+            org->sendEvent(e);
+            delete e;
+            
             if(cid != ID_CLIENT_INVALID)
                 org->client_by_id[cid] = nullptr;
+            server_erase_client_private_(org, client);
             gthread_mutex_unlock(&org->mutex);
             
             if(pclient)
@@ -90,12 +122,160 @@ void* server_client_thread_loop(void* data)
             
             return NULL;
         }
+        else if(pclient->m_type == PT_RECEIVED_OK     ||
+                pclient->m_type == PT_RECEIVED_BAD    ||
+                pclient->m_type == PT_CONNECTIONSTATUS)
+        {
+            // Answers to broadcasts, late answers, or answers read here instead of by the thread
+            // which waits for them. Connection status is already answered by receive_client_packet().
+            if(pclient->m_type != PT_CONNECTIONSTATUS && client->mirror)
+                broadcast_acknowledge(org, client->mirror->id, pclient->m_type == PT_RECEIVED_OK);
+            delete pclient;
+        }
+        else if(pclient->m_type == PT_CLIENT_SENDFILE_CHUNK)
+        {
+            // A chunk outside of a file transfer (sent by the simulation) : it is already
+            // acknowledged by receive_client_packet().
+            delete pclient;
+        }
         else if(pclient->m_type == PT_CLIENT_MESSAGE)
         {
             ClientMessagePacket* cmp = reinterpret_cast<ClientMessagePacket*>(pclient);
             std::string message = cmp->buffer;
             cout << "[Server]{" << client->name << "} " << message << endl;
             delete cmp;
+            
+            ServerMessageReceivedEvent* e = new ServerMessageReceivedEvent;
+            e->type    = "ServerMessageReceivedEvent";
+            e->parent  = org;
+            e->client  = client;
+            e->origin  = client->name;
+            e->message = message;
+            org->sendEvent(e);
+            delete e;
+        }
+        else if(pclient->m_type == PT_CHANNEL_MESSAGE)
+        {
+            // The sender only publishes to subscribers, but two channels may share
+            // the same hash in its index.
+            ChannelMessagePacket* cmp = reinterpret_cast<ChannelMessagePacket*>(pclient);
+            if(server_is_subscribed(org, cmp->data.channel))
+            {
+                cout << "[Server]{" << client->name << "}<" << cmp->data.channel << "> " << cmp->data.message << endl;
+                
+                ServerMessageReceivedEvent* e = new ServerMessageReceivedEvent;
+                e->type    = "ServerMessageReceivedEvent";
+                e->parent  = org;
+                e->client  = client;
+                e->origin  = client->name;
+                e->channel = cmp->data.channel;
+                e->message = cmp->data.message;
+                org->sendEvent(e);
+                delete e;
+            }
+            delete cmp;
+        }
+        else if(pclient->m_type == PT_CHANNEL_SUBSCRIBE)
+        {
+            ChannelSubscribePacket* csp = reinterpret_cast<ChannelSubscribePacket*>(pclient);
+            server_channel_update(org, client, csp->channel, true);
+            delete csp;
+        }
+        else if(pclient->m_type == PT_CHANNEL_UNSUBSCRIBE)
+        {
+            ChannelUnsubscribePacket* cup = reinterpret_cast<ChannelUnsubscribePacket*>(pclient);
+            server_channel_update(org, client, cup->channel, false);
+            delete cup;
+        }
+        else if(pclient->m_type == PT_BROADCAST)
+        {
+            // A message going down the multicast tree. We are one of its nodes.
+            BroadcastPacket* bp = reinterpret_cast<BroadcastPacket*>(pclient);
+            broadcast_relay(org, client, bp->data);
+            delete bp;
+        }
+        else if(pclient->m_type == PT_MULTICAST_REACHED)
+        {
+            // A child of a multicast we sent or forwarded tells the peers it reaches.
+            MulticastReachedPacket* mrp = reinterpret_cast<MulticastReachedPacket*>(pclient);
+            broadcast_multicast_reached(org, client, mrp->data);
+            delete mrp;
+        }
+        else if(pclient->m_type == PT_ROUTE_REQUEST)
+        {
+            RouteRequestPacket* rrp = reinterpret_cast<RouteRequestPacket*>(pclient);
+            server_route_request(org, client, rrp->data);
+            delete rrp;
+        }
+        else if(pclient->m_type == PT_ROUTE_REPLY)
+        {
+            RouteReplyPacket* rrp = reinterpret_cast<RouteReplyPacket*>(pclient);
+            server_route_reply(org, client, rrp->data);
+            delete rrp;
+        }
+        else if(pclient->m_type == PT_RELAY)
+        {
+            // A packet going to another server, or relayed to us.
+            RelayPacket* rp = reinterpret_cast<RelayPacket*>(pclient);
+            server_relay_receive(org, client, rp->data);
+            delete rp;
+        }
+        else if(pclient->m_type == PT_GOSSIP_DIGEST)
+        {
+            GossipDigestPacket* gdp = reinterpret_cast<GossipDigestPacket*>(pclient);
+            server_gossip_digest(org, client, gdp->data);
+            delete gdp;
+        }
+        else if(pclient->m_type == PT_GOSSIP_PEERS)
+        {
+            GossipPeersPacket* gpp = reinterpret_cast<GossipPeersPacket*>(pclient);
+            server_gossip_peers(org, client, gpp->data);
+            delete gpp;
+        }
+        else if(pclient->m_type == PT_SPOOL_BATCH)
+        {
+            // Messages spooled by the client while we were not connected.
+            SpoolBatchPacket* sbp = reinterpret_cast<SpoolBatchPacket*>(pclient);
+            server_spool_receive(org, client, sbp->data);
+            delete sbp;
+        }
+        else if(pclient->m_type == PT_SEQUENCED)
+        {
+            SequencedPacket* sp = reinterpret_cast<SequencedPacket*>(pclient);
+            server_replay_receive(org, client, sp->data);
+            delete sp;
+        }
+        else if(pclient->m_type == PT_CLIENT_RESUME)
+        {
+            // The client tells us what it received, after a reconnection or every REPLAY_ACKEVERY packets.
+            ClientResumePacket* crp = reinterpret_cast<ClientResumePacket*>(pclient);
+            server_replay_resume(org, client, crp->data);
+            delete crp;
+        }
+        else if(pclient->m_type == PT_TRANSFER_OFFER)
+        {
+            TransferOfferPacket* top = reinterpret_cast<TransferOfferPacket*>(pclient);
+            server_transfer_offer(org, client, top->data);
+            delete top;
+        }
+        else if(pclient->m_type == PT_TRANSFER_BITMAP)
+        {
+            // The client tells us which chunks of a file we send it already has.
+            TransferBitmapPacket* tbp = reinterpret_cast<TransferBitmapPacket*>(pclient);
+            server_transfer_bitmap(org, client, tbp->data);
+            delete tbp;
+        }
+        else if(pclient->m_type == PT_TRANSFER_CHUNK)
+        {
+            TransferChunkPacket* tcp = reinterpret_cast<TransferChunkPacket*>(pclient);
+            server_transfer_chunk(org, client, tcp);
+            delete tcp;
+        }
+        else if(pclient->m_type == PT_TRANSFER_HOLE)
+        {
+            TransferHolePacket* thp = reinterpret_cast<TransferHolePacket*>(pclient);
+            server_transfer_hole(org, client, thp->data);
+            delete thp;
         }
         else if(pclient->m_type == PT_CLIENT_ESTABLISHED)
         {
@@ -103,14 +283,25 @@ void* server_client_thread_loop(void* data)
             client->established = true;
             delete pclient;
             
-            // We directly register the client to the user in the session. The user will be saved
-            // when terminating the session.
+            server_handshake_record(org, org->hs_established, client->connectstart);
+            server_channels_announce(org, client);
+            server_replay_announce(org, client);
+            server_spool_flush_async(org, client->name);
             
-            database_clientinfo_t dbclient;
-            dbclient.ip   = std::string(inet_ntoa(client->address.sin_addr));
-            dbclient.port = (uint16_t) ntohs(client->mirror->address.sin_port);
+            // We directly register the client to the user in the session. The user will be saved
+            // when terminating the session. A server may run without session (benchmarks).
             
-            user_register_client(globalsession.user, dbclient);
+            if(org->session.user)
+            {
+                database_clientinfo_t dbclient;
+                dbclient.ip   = std::string(inet_ntoa(client->address.sin_addr));
+                dbclient.port = (uint16_t) ntohs(client->mirror->address.sin_port);
+                
+                // Known clients are also read by the gossip.
+                gthread_mutex_lock(&org->mutex);
+                user_register_client(org->session.user, dbclient);
+                gthread_mutex_unlock(&org->mutex);
+            }
         }
         
         /*  ------ PT_USER_INIT ----------------------------------------------------------------------
@@ -135,16 +326,18 @@ void* server_client_thread_loop(void* data)
             cout << "[Server]{" << client->name << "} Connected user '" << uip->data.name << "'." << endl;
 #endif
             
-            // We must be logged in to accept this client.
-            if(globalsession.user)
+            // The local user asked for must be logged in to accept this client. Every logged
+            // user is reachable by its name, the default one with an empty name.
+            user_t* local = server_find_user(org, uip->data.to);
+            if(local)
             {
                 //              networkptr_t net = server.attachednetwork;
                 
                 // Verify that user isn't already accepted.
-                if(user_has_accepted(globalsession.user, uip->data.name))
+                if(user_has_accepted(local, uip->data.name))
                 {
                     const char* uname = uip->data.name;
-                    database_accepted_user_t* user = user_find_accepted(globalsession.user, uname);
+                    database_accepted_user_t* user = user_find_accepted(local, uname);
                     if(user->keys.key != std::string(uip->data.key) ||
                        user->keys.iv != std::string(uip->data.iv) )
                     {
@@ -162,22 +355,19 @@ void* server_client_thread_loop(void* data)
                         
                         // User is already accepted, so register it normally.
                         user_init_t uinit;
-                        strcpy(uinit.name, globalsession.user->m_name->buf);
-                        strcpy(uinit.key,  globalsession.user->m_key->buf);
-                        strcpy(uinit.iv,   globalsession.user->m_iv->buf);
+                        server_fill_userinit(uinit, local, uip->data.name);
                         org->client_send(client, PT_USER_INIT_RESPONSE, &uinit, sizeof(uinit));
                         
                         /*strcpy(client->logged_user->m_name->buf, uip->data.name);
                         strcpy(client->logged_user->m_key->buf, uip->data.key);
                         strcpy(client->logged_user->m_iv->buf, uip->data.iv);*/
-                        netbuf_copyraw(client->logged_user->m_name, uip->data.name, strlen(uip->data.name));
-                        netbuf_copyraw(client->logged_user->m_key, uip->data.key, strlen(uip->data.key));
-                        netbuf_copyraw(client->logged_user->m_iv, uip->data.iv, strlen(uip->data.iv));
+                        server_copy_logged_user_(client, uip->data);
                         
                         
                         client->logged            = true;
+                        client->local_user        = local;
                         
-                        cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' accepted." << endl;
+                        cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' accepted by '" << local->m_name->buf << "'." << endl;
                         
                         ClientUserLoggedEvent* e = new ClientUserLoggedEvent;
                         e->type   = "ClientUserLoggedEvent";
@@ -191,13 +381,23 @@ void* server_client_thread_loop(void* data)
                 
                 else
                 {
-                    cout << "[Server]{" << client->name << "} Do you accept user '" << uip->data.name << "' ? [Y/n]" << endl;
-                    
-                    // If this server is logged in, we will ask for the user if we should accept this userinit command.
                     std::string lastcmd;
-                    console_reset_lastcommand();
-                    console_waitfor_command();
-                    lastcmd = console_get_lastcommand();
+                    if(client->trusted)
+                    {
+                        // A local process of our own user : the kernel already told us who
+                        // it is, so we don't have to ask.
+                        cout << "[Server]{" << client->name << "} Trusted local user '" << uip->data.name << "'." << endl;
+                        lastcmd = "Y";
+                    }
+                    else
+                    {
+                        cout << "[Server]{" << client->name << "} Do you accept user '" << uip->data.name << "' ? [Y/n]" << endl;
+                        
+                        // If this server is logged in, we will ask for the user if we should accept this userinit command.
+                        console_reset_lastcommand();
+                        console_waitfor_command();
+                        lastcmd = console_get_lastcommand();
+                    }
                     
                     if(lastcmd != "n" || lastcmd != "N")
                     {
@@ -207,9 +407,7 @@ void* server_client_thread_loop(void* data)
 #endif // GULTRA_DEBUG
                         
                         user_init_t uinit;
-                        strcpy(uinit.name, globalsession.user->m_name->buf);
-                        strcpy(uinit.key,  globalsession.user->m_key->buf);
-                        strcpy(uinit.iv,   globalsession.user->m_iv->buf);
+                        server_fill_userinit(uinit, local, uip->data.name);
                         org->client_send(client, PT_USER_INIT_RESPONSE, &uinit, sizeof(uinit));
                         
                         /* strbufcreateandcopy(client->logged_user->name, client->logged_user->lname,
@@ -219,13 +417,12 @@ void* server_client_thread_loop(void* data)
                         strbufcreateandcopy(client->logged_user->iv, client->logged_user->liv,
                                             uip->data.iv, strlen(uip->data.iv)); */
                         
-                        netbuf_copyraw(client->logged_user->m_name, uip->data.name, strlen(uip->data.name));
-                        netbuf_copyraw(client->logged_user->m_key, uip->data.key, strlen(uip->data.key));
-                        netbuf_copyraw(client->logged_user->m_iv, uip->data.name, strlen(uip->data.iv));
+                        server_copy_logged_user_(client, uip->data);
                         
-                        client->logged = true;
+                        client->logged     = true;
+                        client->local_user = local;
                         
-                        cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' accepted." << endl;
+                        cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' accepted by '" << local->m_name->buf << "'." << endl;
                     }
                     else
                     {
@@ -242,8 +439,8 @@ void* server_client_thread_loop(void* data)
                 // end the user initialization.
                 org->client_send(client, PT_USER_INIT_NOTLOGGED, nullptr, 0);
                 
-                cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' tried to logged in to you but"
-                << " you are not logged in. Please log in." << endl;
+                cout << "[Server]{" << client->name << "} User '" << uip->data.name << "' tried to logged in to '"
+                << uip->data.to << "' but this user is not logged in." << endl;
             }
             
             delete pclient;
@@ -270,15 +467,30 @@ void* server_client_thread_loop(void* data)
              */
             
             if(client->logged_user) {
-                client->logged = true;
+                client->logged     = true;
+                client->local_user = server_find_user(org, uip->data.to);
                 cout << "[Server]{" << client->name << "} Connected user '" << uip->data.name << "'." << endl;
+                
+                // The distant user is now a known peer of the local user which asked for it.
+                if(client->local_user && client->mirror)
+                {
+                    database_clientinfo_t dbclient;
+                    dbclient.ip   = std::string(inet_ntoa(client->address.sin_addr));
+                    dbclient.port = (uint16_t) ntohs(client->mirror->address.sin_port);
+                    
+                    gthread_mutex_lock(&org->mutex);
+                    user_register_client(client->local_user, dbclient);
+                    gthread_mutex_unlock(&org->mutex);
+                }
+                
+                server_handshake_record(org, org->hs_logged, client->connectstart);
             }
             else {
                 cout << "[Server]{" << client->name << "} Can't register new user '" << uip->data.name << "'." << endl;
                 
                 // Error during the operation, we abort current operation from the client side.
                 // Telling him the error.
-                server_notifiate(&server, client, GERROR_BADUSR/*REG*/);
+                server_notifiate(org, client, GERROR_BADUSR/*REG*/);
             }
             
             delete pclient;
@@ -299,7 +511,10 @@ void* server_client_thread_loop(void* data)
         
         else if(pclient->m_type == PT_USER_INIT_AEXIST)
         {
-            cout << "[Server]{" << client->name << "} User '" << globalsession.user->m_name->buf << "' already exists in client database." << endl;
+            user_t* local = client->local_user ? client->local_user : org->session.user;
+            if(local) {
+                cout << "[Server]{" << client->name << "} User '" << local->m_name->buf << "' already exists in client database." << endl;
+            }
             delete pclient;
         }
         
@@ -325,6 +540,30 @@ void* server_client_thread_loop(void* data)
             delete pclient;
         }
         
+        else if(pclient->m_type == PT_CLIENT_SHMRING)
+        {
+            // A local server will write the files it sends us in this ring. Rings are
+            // only accepted from trusted servers, as they share our memory.
+            ClientShmRingPacket* csrp = reinterpret_cast<ClientShmRingPacket*>(pclient);
+            if(client->trusted)
+            {
+                if(client->ringin)
+                    shmring_close(client->ringin);
+                
+                gerror_t err = shmring_open(client->ringin, std::string(csrp->name));
+                if(err != GERROR_NONE) {
+                    cout << "[Server]{" << client->name << "} Can't open shared memory ring : " << gerror_to_string(err) << endl;
+                }
+#ifdef GULTRA_DEBUG
+                else {
+                    cout << "[Server]{" << client->name << "} Opened shared memory ring '" << csrp->name << "'." << endl;
+                }
+#endif // GULTRA_DEBUG
+            }
+            
+            delete csrp;
+        }
+        
         else if(pclient->m_type == PT_CLIENT_SENDFILE_INFO)
         {
             ClientSendFileInfoPacket* csfip = reinterpret_cast<ClientSendFileInfoPacket*>(pclient);
@@ -336,11 +575,12 @@ void* server_client_thread_loop(void* data)
             }
             
             std::string fname(csfip->info.name);                   // File name
-            uint32_t    flen   = (uint32_t) csfip->info.lenght;          // File Lenght
+            uint64_t    flen   = csfip->info.lenght;          // File Lenght
             uint32_t    clen   = csfip->info.chunk_lenght;    // Lenght of one chunk
             uint32_t    clsz   = csfip->info.chunk_lastsize;  // Lenght of the last chunk
-            uint32_t    cnum   = csfip->info.chunk_count;     // Number of chunks
+            uint64_t    cnum   = csfip->info.chunk_count;     // Number of chunks
             bool        chunks = csfip->info.has_chunk;            // True if we have more than one chunk.
+            bool        ring   = csfip->info.via_ring;             // True if the file is in the shared memory ring.
             
             
             cout << "[Server]{" << client->name << "} Receiving file." << endl;
@@ -359,9 +599,20 @@ void* server_client_thread_loop(void* data)
             pclient = nullptr;
             csfip   = nullptr;
             
+            // Chunks are written from packets of SERVER_MAXBUFSIZE bytes, and must make the whole file.
+            if((!ring && !chunks && flen > SERVER_MAXBUFSIZE) ||
+               (!ring && chunks && (cnum == 0 || clen > SERVER_MAXBUFSIZE || clsz > SERVER_MAXBUFSIZE ||
+                                    (cnum - 1) * clen + clsz != flen)))
+            {
+                cout << "[Server]{" << client->name << "} Invalid file info." << endl;
+                server_abort_operation(org, client, GERROR_INVALID_PACKET);
+                
+                goto clientloop_continue;
+            }
+            
             // We open a file for writing
-            std::ofstream ofs(fname, std::ofstream::binary);
-            if(!ofs)
+            gio_file_t* ofs = nullptr;
+            if(gio_open_write(ofs, fname.c_str(), org->args.iouring) != GERROR_NONE)
             {
                 // We can't open the file so abort the operation
                 cout << "[Server]{" << client->name << "} Can't open file." << endl;
@@ -373,7 +624,56 @@ void* server_client_thread_loop(void* data)
                 goto clientloop_continue;
             }
             
-            if(chunks)
+            // The file is allocated at its full size, so it does not grow on every write.
+            gio_allocate(ofs->fd, flen);
+            
+            if(ring)
+            {
+                // The file comes from the shared memory ring : we write it from there
+                // as soon as the distant server has put some bytes in it.
+                gerror_t err = client->ringin ? GERROR_NONE : GERROR_NORECEIVE;
+                uint64_t sz  = 0;
+                
+                while(err == GERROR_NONE && sz < flen)
+                {
+                    const unsigned char* ptr = nullptr;
+                    size_t               len = 0;
+                    
+                    err = shmring_peek(client->ringin, ptr, len);
+                    if(err != GERROR_NONE)
+                        break;
+                    
+                    if(len > flen - sz)
+                        len = flen - sz;
+                    
+                    gio_write(ofs, ptr, len);
+                    shmring_consume(client->ringin, len);
+                    sz += len;
+                    
+                    if(org->br_callback)
+                        org->br_callback(fname, sz, flen);
+                }
+                
+                gerror_t werr = gio_close(ofs);
+                if(werr != GERROR_NONE) {
+                    cout << "[Server]{" << client->name << "} Can't write file '" << fname << "'." << endl;
+                }
+                
+                if(err != GERROR_NONE)
+                {
+                    cout << "[Server]{" << client->name << "} Can't read shared memory ring : " << gerror_to_string(err) << endl;
+                    
+                    // The distant server closes its ring on error, so a new one will be sent.
+                    if(client->ringin)
+                        shmring_close(client->ringin);
+                    
+                    server_abort_operation(org, client, GERROR_NORECEIVE);
+                }
+                
+                goto clientloop_continue;
+            }
+            
+            else if(chunks)
             {
                 // We have cnum chunks to receive.
                 
@@ -381,9 +681,9 @@ void* server_client_thread_loop(void* data)
                 cout << "[Server]{" << client->name << "} Receiving File chunks." << endl;
 #endif // GULTRA_DEBUG
                 
-                uint32_t sz          = 0;        // Current bytes received (for bytes received callback)
-                uint32_t chunk_num   = 0;        // Current chunk number.
-                uint32_t last_chunk  = cnum - 1; // Last chunk number.
+                uint64_t sz          = 0;        // Current bytes received (for bytes received callback)
+                uint64_t chunk_num   = 0;        // Current chunk number.
+                uint64_t last_chunk  = cnum - 1; // Last chunk number.
                 bool     mstop       = false;    // Do we have to break the loop ?
                 while(!mstop)
                 {
@@ -393,7 +693,7 @@ void* server_client_thread_loop(void* data)
                     {
                         // We can't receive the chunk, so close the stream and abort the operation.
                         cout << "[Server]{" << client->name << "} Can't receive correct chunk." << endl;
-                        ofs.close();
+                        gio_close(ofs);
                         
                         // This send a PT_ABORT_OPERATION packet wich signal the client it must abort the current operation
                         // because this server can't continue it.
@@ -404,12 +704,12 @@ void* server_client_thread_loop(void* data)
                     
                     // Reinterpret the chunk
                     ClientSendFileChunkPacket* chunk = reinterpret_cast<ClientSendFileChunkPacket*>(vchunk);
-                    if(!chunk)
+                    if(!chunk || chunk->m_type != PT_CLIENT_SENDFILE_CHUNK)
                     {
-                        // We can't reinterpret the vchunk.
+                        // We can't reinterpret the vchunk, or it is another packet.
                         cout << "[Server]{" << client->name << "} Can't reinterpret correct chunk." << endl;
                         delete vchunk;
-                        ofs.close();
+                        gio_close(ofs);
                         
                         // This send a PT_ABORT_OPERATION packet wich signal the client it must abort the current operation
                         // because this server can't continue it.
@@ -421,7 +721,7 @@ void* server_client_thread_loop(void* data)
                     // Write last chunk
                     if(chunk_num == last_chunk)
                     {
-                        ofs.write(chunk->chunk, clsz);
+                        gio_write(ofs, chunk->chunk, clsz);
                         sz   += clsz;
                         mstop = true;
                         
@@ -434,7 +734,7 @@ void* server_client_thread_loop(void* data)
                     // Write normal chunk
                     else
                     {
-                        ofs.write(chunk->chunk, clen);
+                        gio_write(ofs, chunk->chunk, clen);
                         sz += clen;
                         
 #ifdef GULTRA_DEBUG
@@ -454,7 +754,9 @@ void* server_client_thread_loop(void* data)
                 
                 // Client may send PT_CLIENT_SENDFILE_TERMINATE packet but ignore it.
                 // Close the stream.
-                ofs.close();
+                if(gio_close(ofs) != GERROR_NONE) {
+                    cout << "[Server]{" << client->name << "} Can't write file '" << fname << "'." << endl;
+                }
                 goto clientloop_continue;
             }
             
@@ -467,7 +769,7 @@ void* server_client_thread_loop(void* data)
                 {
                     // We can't receive the chunk, so close the stream and abort the operation.
                     cout << "[Server]{" << client->name << "} Can't receive correct chunk." << endl;
-                    ofs.close();
+                    gio_close(ofs);
                     
                     // This send a PT_ABORT_OPERATION packet wich signal the client it must abort the current operation
                     // because this server can't continue it.
@@ -478,12 +780,12 @@ void* server_client_thread_loop(void* data)
                 
                 // Reinterpret the chunk
                 ClientSendFileChunkPacket* chunk = reinterpret_cast<ClientSendFileChunkPacket*>(vchunk);
-                if(!chunk)
+                if(!chunk || chunk->m_type != PT_CLIENT_SENDFILE_CHUNK)
                 {
-                    // We can't reinterpret the vchunk.
+                    // We can't reinterpret the vchunk, or it is another packet.
                     cout << "[Server]{" << client->name << "} Can't reinterpret correct chunk." << endl;
                     delete vchunk;
-                    ofs.close();
+                    gio_close(ofs);
                     
                     // This send a PT_ABORT_OPERATION packet wich signal the client it must abort the current operation
                     // because this server can't continue it.
@@ -493,7 +795,7 @@ void* server_client_thread_loop(void* data)
                 }
                 
                 // Here we write the entire file lenght.
-                ofs.write(chunk->chunk, flen);
+                gio_write(ofs, chunk->chunk, flen);
                 
 #ifdef GULTRA_DEBUG
                 cout << "[Server] Written chunk -> " << flen << " bytes." << endl;
@@ -504,7 +806,9 @@ void* server_client_thread_loop(void* data)
                 
                 // Delete chunk and close the stream.
                 delete chunk;
-                ofs.close();
+                if(gio_close(ofs) != GERROR_NONE) {
+                    cout << "[Server]{" << client->name << "} Can't write file '" << fname << "'." << endl;
+                }
                 
                 goto clientloop_continue;
             }
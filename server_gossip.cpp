@@ -0,0 +1,365 @@
+/*
+ File        : server_gossip.cpp
+ Description : Spreads the known peers between servers, by gossiping digests
+               of the known peers and answering with the missing ones.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+#include <set>
+
+GBEGIN_DECL
+
+#define GOSSIP_SLEEP    100  // Maximum time (ms) the gossip thread sleeps before checking it must stop.
+#define GOSSIP_MAXKNOWN 1024 // Number of known clients from which gossiped peers are no longer learned.
+
+/** @brief Returns the key of a peer in a set of known peers.
+**/
+static uint64_t gossip_key_(const gossip_peer_t& peer)
+{
+    return ((uint64_t) peer.ip << 16) | peer.port;
+}
+
+/** @brief Converts a known client to a gossiped peer. Returns false if
+ *  its adress is not a valid IPv4 adress.
+**/
+static bool gossip_peer_of_(const database_clientinfo_t& client, gossip_peer_t& out)
+{
+    struct in_addr addr;
+    if(inet_pton(AF_INET, client.ip.c_str(), &addr) != 1 || client.port == 0)
+        return false;
+
+    out.ip   = addr.s_addr;
+    out.port = htons(client.port);
+    return true;
+}
+
+/** @brief Returns the peers known by the user of the session.
+**/
+static std::vector<gossip_peer_t> gossip_known_(server_t* server)
+{
+    std::vector<gossip_peer_t> ret;
+
+    gthread_mutex_lock(&server->mutex);
+    if(server->session.user)
+    {
+        const std::vector<database_clientinfo_t>& clients = server->session.user->clients;
+        ret.reserve(clients.size());
+        for(unsigned int i = 0; i < clients.size(); ++i)
+        {
+            gossip_peer_t peer;
+            if(gossip_peer_of_(clients[i], peer))
+                ret.push_back(peer);
+        }
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    return ret;
+}
+
+/** @brief Computes the bits of a peer in a Bloom filter made with given
+ *  seed (FNV-1a and double hashing).
+**/
+static void gossip_bits_(uint32_t seed, const gossip_peer_t& peer, uint32_t bits[GOSSIP_HASHES])
+{
+    uint8_t bytes[10];
+    memcpy(bytes,     &seed,      4);
+    memcpy(bytes + 4, &peer.ip,   4);
+    memcpy(bytes + 8, &peer.port, 2);
+
+    uint32_t h1 = 2166136261u;
+    uint32_t h2 = 5381u;
+    for(unsigned int i = 0; i < sizeof(bytes); ++i)
+    {
+        h1 = (h1 ^ bytes[i]) * 16777619u;
+        h2 = h2 * 33u + bytes[i];
+    }
+    h2 |= 1;
+
+    for(unsigned int i = 0; i < GOSSIP_HASHES; ++i)
+        bits[i] = (h1 + i * h2) % (GOSSIP_BLOOMSIZE * 8);
+}
+
+/** @brief Returns true if given peer may be in the digest.
+**/
+static bool gossip_digest_has_(const gossip_digest_t& digest, const gossip_peer_t& peer)
+{
+    uint32_t bits[GOSSIP_HASHES];
+    gossip_bits_(digest.seed, peer, bits);
+
+    for(unsigned int i = 0; i < GOSSIP_HASHES; ++i)
+    {
+        if(!(digest.bloom[bits[i] / 8] & (1 << (bits[i] % 8))))
+            return false;
+    }
+    return true;
+}
+
+/** @brief Returns true if we gossip with given client : its connection is
+ *  established, and its user has been accepted by one of ours. Anyone else
+ *  could fill the known clients of our user, which are saved in the database.
+**/
+static bool gossip_trusts_(const client_t& client)
+{
+    return client.established && client.mirror && client.logged;
+}
+
+/** @brief Sends the digest of our known peers to a random established
+ *  and accepted client.
+**/
+static void gossip_round_(server_t* server, unsigned int& seed)
+{
+    std::vector<uint32_t> ids;
+    gthread_mutex_lock(&server->mutex);
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(gossip_trusts_(client))
+            ids.push_back(client.mirror->id);
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    if(ids.empty())
+        return;
+
+    uint32_t                   id    = ids[rand_r(&seed) % ids.size()];
+    std::vector<gossip_peer_t> known = gossip_known_(server);
+
+    gossip_digest_t digest;
+    memset(&digest, 0, sizeof(gossip_digest_t));
+    digest.seed  = (uint32_t) rand_r(&seed);
+    digest.count = (uint32_t) known.size();
+
+    for(unsigned int i = 0; i < known.size(); ++i)
+    {
+        uint32_t bits[GOSSIP_HASHES];
+        gossip_bits_(digest.seed, known[i], bits);
+        for(unsigned int j = 0; j < GOSSIP_HASHES; ++j)
+            digest.bloom[bits[j] / 8] |= (uint8_t) (1 << (bits[j] % 8));
+    }
+
+    digest = serialize<gossip_digest_t>(digest);
+    broadcast_forward(server, PT_GOSSIP_DIGEST, &digest, sizeof(gossip_digest_t), broadcast_filter_id, &id);
+}
+
+void* server_gossip_thread_loop(void* data)
+{
+    server_t*    server = (server_t*) data;
+    unsigned int seed   = (unsigned int) (time(NULL) ^ server->port);
+
+    while(server->_gossiping && !server->_must_stop)
+    {
+        // Rounds are jittered between half and one and a half interval, so
+        // servers started together do not gossip at the same time.
+        long interval = server->args.gossip;
+        long deadline = timer_monotonic_ms() + interval / 2 + rand_r(&seed) % (interval + 1);
+
+        while(server->_gossiping && !server->_must_stop && timer_monotonic_ms() < deadline)
+            usleep(std::min<long>(GOSSIP_SLEEP, deadline - timer_monotonic_ms() + 1) * 1000);
+
+        if(server->_gossiping && !server->_must_stop)
+            gossip_round_(server, seed);
+    }
+
+    return nullptr;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Starts gossiping about the known peers.
+ *
+ *  Every server.args.gossip ms (with jitter), the digest of the
+ *  peers known by the session user is sent to one random client
+ *  whose user we accepted,
+ *  which answers with the peers missing from it. The traffic of
+ *  a server so stays the same whatever the size of the mesh, and
+ *  every peer is known by everyone after O(log n) rounds.
+ *
+ *  @return
+ *  - GERROR_NONE            : Gossip is started.
+ *  - GERROR_BADARGS         : server is null, or server.args.gossip
+ *  is not positive.
+ *  - GERROR_THREAD_CREATION : The gossip thread can't be created.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_gossip_start(server_t* server)
+{
+    if(!server || server->args.gossip <= 0)
+        return GERROR_BADARGS;
+
+    if(server->_gossiping)
+        return GERROR_NONE;
+
+    server->_gossiping = true;
+    if(pthread_create(&server->_gossipthread, nullptr, server_gossip_thread_loop, server) != 0)
+    {
+        server->_gossiping = false;
+        cout << "[Gossip] Can't create gossip thread." << endl;
+        return GERROR_THREAD_CREATION;
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Stops gossiping. It is called by server_stop().
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_gossip_stop(server_t* server)
+{
+    if(!server)
+        return GERROR_BADARGS;
+
+    if(!server->_gossiping)
+        return GERROR_NONE;
+
+    server->_gossiping = false;
+    pthread_join(server->_gossipthread, nullptr);
+    return GERROR_NONE;
+}
+
+/** @brief Adds the peers we did not know to the known clients of the
+ *  session user, as the least recently used : they are only reconnected
+ *  by the warm-up after the peers we were connected to. No peer is added
+ *  once the user knows GOSSIP_MAXKNOWN clients.
+ *
+ *  @return The number of peers added.
+**/
+static uint32_t gossip_learn_(server_t* server, const gossip_peer_t* peers, uint32_t count)
+{
+    uint32_t learned = 0;
+
+    gthread_mutex_lock(&server->mutex);
+    if(server->session.user)
+    {
+        std::vector<database_clientinfo_t>& clients = server->session.user->clients;
+
+        std::set<uint64_t> keys;
+        for(unsigned int i = 0; i < clients.size(); ++i)
+        {
+            gossip_peer_t peer;
+            if(gossip_peer_of_(clients[i], peer))
+                keys.insert(gossip_key_(peer));
+        }
+
+        std::vector<database_clientinfo_t> added;
+        for(unsigned int i = 0; i < count && clients.size() + added.size() < GOSSIP_MAXKNOWN; ++i)
+        {
+            const gossip_peer_t& peer = peers[i];
+            if(peer.port == 0 || !keys.insert(gossip_key_(peer)).second)
+                continue;
+
+            // Ourself, as known by the peers on this host.
+            if(ntohs(peer.port) == server->port && (ntohl(peer.ip) >> 24) == 127)
+                continue;
+
+            char buf[INET_ADDRSTRLEN];
+            struct in_addr addr;
+            addr.s_addr = peer.ip;
+
+            database_clientinfo_t dbclient;
+            dbclient.ip   = inet_ntop(AF_INET, &addr, buf, sizeof(buf)) ? buf : "";
+            dbclient.port = ntohs(peer.port);
+            added.push_back(dbclient);
+        }
+
+        clients.insert(clients.begin(), added.begin(), added.end());
+        learned = (uint32_t) added.size();
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    return learned;
+}
+
+/** @brief Returns the adress of the server of given client, as it would
+ *  be known by us if we had connected to it.
+**/
+static gossip_peer_t gossip_peer_of_client_(const client_t* client)
+{
+    gossip_peer_t ret;
+    ret.ip   = client->address.sin_addr.s_addr;
+    ret.port = client->mirror->address.sin_port;
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_GOSSIP_DIGEST received from given client,
+ *  answering with the known peers missing from it.
+ *
+ *  At most GOSSIP_MAXPEERS are sent, starting at a random peer :
+ *  the others are sent in the next rounds. The client itself is
+ *  a peer we know from now on, even if it connected to us.
+ *  Digests of clients we did not accept are ignored.
+**/
+////////////////////////////////////////////////////////////
+void server_gossip_digest(server_t* server, client_t* client, const gossip_digest_t& digest)
+{
+    if(!gossip_trusts_(*client))
+        return;
+
+    gossip_peer_t sender = gossip_peer_of_client_(client);
+    gossip_learn_(server, &sender, 1);
+
+    std::vector<gossip_peer_t> known = gossip_known_(server);
+    if(known.empty())
+        return;
+
+    gossip_peers_t answer;
+    memset(&answer, 0, sizeof(gossip_peers_t));
+
+    size_t start = digest.seed % known.size();
+    for(size_t i = 0; i < known.size() && answer.count < GOSSIP_MAXPEERS; ++i)
+    {
+        const gossip_peer_t& peer = known[(start + i) % known.size()];
+        if(gossip_key_(peer) != gossip_key_(sender) && !gossip_digest_has_(digest, peer))
+            answer.peers[answer.count++] = peer;
+    }
+
+#ifdef GULTRA_DEBUG
+    cout << "[Gossip]{" << client->name << "} Knows " << digest.count << " peers, we know " << known.size() << ", sending " << answer.count << "." << endl;
+#endif // GULTRA_DEBUG
+
+    if(answer.count == 0)
+        return;
+
+    uint32_t id = client->mirror->id;
+    answer = serialize<gossip_peers_t>(answer);
+    broadcast_forward(server, PT_GOSSIP_PEERS, &answer, sizeof(gossip_peers_t), broadcast_filter_id, &id);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_GOSSIP_PEERS received from given client. Peers
+ *  from clients we did not accept are ignored.
+**/
+////////////////////////////////////////////////////////////
+void server_gossip_peers(server_t* server, client_t* client, const gossip_peers_t& peers)
+{
+    if(!gossip_trusts_(*client))
+        return;
+
+    uint32_t learned = gossip_learn_(server, peers.peers, peers.count);
+    if(learned > 0)
+    {
+        cout << "[Gossip]{" << client->name << "} Learned " << learned << " peers." << endl;
+    }
+}
+
+GEND_DECL
@@ -32,8 +32,32 @@ extern void         server_launch_accepting_thread      (server_t* server, int c
 extern std::string  server_http_get_page                (server_t* server, HttpRequestPacket* packet);
 extern uint32_t     server_generate_new_id              (server_t* cserver);
 extern client_t*    server_create_client_thread_loop    (server_t* server, client_t* client);
-extern int          server_find_client_index_private_   (server_t* cserver, const std::string& name);
+extern void         server_erase_client_private_        (server_t* cserver, const client_t* client);
 extern void         server_launch_minimal               (server_t* server, void* (*command)(void*));
+extern void         server_supervisor_destroy           (server_t* server);
+extern void         server_fill_userinit                (user_init_t& uinit, user_t* user, const char* to);
+extern void         server_channels_announce            (server_t* server, client_t* client);
+extern void         server_channel_update               (server_t* server, client_t* client, const char* channel, bool subscribe);
+extern void         server_route_request                (server_t* server, client_t* client, const route_info_t& info);
+extern void         server_route_reply                  (server_t* server, client_t* client, const route_info_t& info);
+extern void         server_relay_receive                (server_t* server, client_t* client, const relay_t& relay);
+extern void         server_gossip_digest                (server_t* server, client_t* client, const gossip_digest_t& digest);
+extern void         server_gossip_peers                 (server_t* server, client_t* client, const gossip_peers_t& peers);
+extern void         server_spool_receive                (server_t* server, client_t* client, const spool_batch_t& batch);
+extern void         server_spool_flush_async            (server_t* server, const std::string& destination);
+extern void         server_spool_close                  (server_t* server);
+extern void         server_replay_receive               (server_t* server, client_t* client, const sequenced_t& packet);
+extern void         server_replay_resume                (server_t* server, client_t* client, const resume_t& resume);
+extern void         server_replay_announce              (server_t* server, client_t* client);
+extern void         server_replay_clear                 (server_t* server);
+extern gerror_t     server_replay_crypt                 (server_t* server, const void* data, size_t sz, data_t* payload, uint8_t& crypted, uint32_t& payloadsize);
+extern gerror_t     server_replay_decrypt               (client_t* client, uint8_t crypted, const data_t* payload, uint32_t payloadsize, uint32_t size, data_t* out);
+extern void         server_transfer_offer               (server_t* server, client_t* client, const transfer_offer_t& offer);
+extern void         server_transfer_bitmap              (server_t* server, client_t* client, const transfer_bitmap_t& bitmap);
+extern void         server_transfer_chunk               (server_t* server, client_t* client, TransferChunkPacket* packet);
+extern void         server_transfer_hole                (server_t* server, client_t* client, const transfer_hole_t& hole);
+extern void         server_transfer_stream              (server_t* server, SOCKET sock, const SOCKADDR_IN& address, const transfer_stream_t& stream);
+extern void         server_transfer_close               (server_t* server);
 
 GEND_DECL
 
@@ -29,20 +29,18 @@ GBEGIN_DECL
 #define server_access() gthread_mutex_lock(&server->mutex)
 #define server_stopaccess() gthread_mutex_unlock(&server->mutex)
 
-/** @brief Find the index of a client. */
-int server_find_client_index_private_(server_t* cserver, const std::string& name)
+/** @brief Erases given client from the clients of the server. The server
+ *  mutex must be locked. */
+void server_erase_client_private_(server_t* cserver, const client_t* client)
 {
-    gthread_mutex_lock(&cserver->mutex);
-    for(unsigned int i = 0; i < cserver->clients.size(); ++i)
+    for(ClientsList::iterator it = cserver->clients.begin(); it != cserver->clients.end(); ++it)
     {
-        if(cserver->clients[i].name == name)
+        if(&(*it) == client)
         {
-            gthread_mutex_unlock(&cserver->mutex);
-            return i;
+            cserver->clients.erase(it);
+            return;
         }
     }
-    gthread_mutex_unlock(&cserver->mutex);
-    return -1;
 }
 
 client_t* server_create_client_thread_loop(server_t* server, client_t* client)
@@ -70,8 +68,8 @@ std::string server_http_compute_home(server_t* server)
     << "  </head>"
     << "  <body>"
     << "    <h1>" << server->name << " Home</h1>";
-    if(globalsession.user)
-        hp << "    <p>Current user logged : " << globalsession.user->m_name->buf << ".</p>";
+    if(server->session.user)
+        hp << "    <p>Current user logged : " << server->session.user->m_name->buf << ".</p>";
     hp << "  </body>"
     << "</html>";
     return hp.str();
@@ -111,7 +109,6 @@ std::string server_http_get_page(server_t* server, HttpRequestPacket* packet)
 /** @brief Generate a new id for given server. */
 uint32_t server_generate_new_id(server_t* cserver)
 {
-    static uint32_t ret2 = 1;
     uint32_t ret;
     if(!cserver)
         ret = 0;
@@ -127,8 +124,8 @@ uint32_t server_generate_new_id(server_t* cserver)
         }
         
         // Case 2 : return the next connection slot
-        ret = ret2;
-        ret2++;
+        ret = cserver->nextid;
+        cserver->nextid++;
     }
     return ret;
 }
@@ -191,9 +188,10 @@ void* accepting_thread_loop(void* data)
                     
                 }
                 
-                new_client->name.append(cip->info.name);
+                new_client->name    = cip->info.name;
                 new_client->sock    = csock;
                 new_client->address = csin;
+                new_client->trusted = client_socket_is_trusted(csock);
                 buffer_copy(new_client->pubkey, cip->info.pubkey);
                 
                 // We create also the mirror connection
@@ -217,7 +215,10 @@ void* accepting_thread_loop(void* data)
                 info.s_port = server->port;
                 info.idret  = new_client->id;
                 strcpy(info.name, new_client->mirror->name.c_str());
-                buffer_copy(info.pubkey, *(server->pubkey));
+                if(server->pubkey)
+                    buffer_copy(info.pubkey, *server->pubkey);
+                else
+                    info.pubkey.size = 0;
                 
                 client_info_t serialized = serialize<client_info_t>(info);
                 if(send_client_packet(new_client->mirror->sock, SOCKET_ERROR, PT_CLIENT_INFO, &serialized, sizeof(serialized)) != GERROR_NONE)
@@ -230,24 +231,26 @@ void* accepting_thread_loop(void* data)
                     return nullptr;
                 }
                 
+                client_t* cclient = nullptr;
                 gthread_mutex_lock(&server->mutex);
                 {
                     // Registering in the server
                     server->clients.push_back(*new_client);
-                    server->client_by_id[new_client->mirror->id] = & (server->clients.at(server->clients.size() - 1));
+                    cclient = & (server->clients.back());
+                    server->client_by_id[new_client->mirror->id] = cclient;
                 }
                 gthread_mutex_unlock(&server->mutex);
                 
-                client_t* cclient = server->client_by_id[new_client->mirror->id];
                 cclient->established = true;
                 
                 // If everything is alright, we can tell user
                 cout << "[Server] New Client connected (name = '" << cclient->name << "', id = '" << cclient->mirror->id << "')." << endl;
                 
                 // 04/05/2015 : We must create here the logged_user field if it has not been done already.
-                if(!new_client->logged_user)
+                // It is set on the registered client, new_client being only the copied template.
+                if(!cclient->logged_user)
                 {
-                    new_client->logged_user = new user_t();
+                    cclient->logged_user = new user_t();
                 }
                 
                 // Notifiate the Listeners that a new client has been created.
@@ -259,19 +262,34 @@ void* accepting_thread_loop(void* data)
                 delete e;
                 
                 // We now send the PT_CONNECTION_ESTABLISHED packet and create the client thread.
-                server->client_send(cclient, PT_CLIENT_ESTABLISHED, NULL, 0);
+                // It holds no data, so it is sent uncrypted, and we don't wait for the answer : the
+                // client thread can start while the packet travels.
+                send_client_packet(cclient->mirror->sock, SOCKET_ERROR, PT_CLIENT_ESTABLISHED, NULL, 0);
                 server_create_client_thread_loop(server, cclient);
+                server_channels_announce(server, cclient);
+                server_replay_announce(server, cclient);
+                server_spool_flush_async(server, cclient->name);
+                
+                // The client is added, so other connections can be initiated again.
+                server_access();
+                {
+                    server->status = SS_STARTED;
+                }
+                server_stopaccess();
             }
             
             else
             {
                 // We retrieve the client
+                server_access();
                 client_t* new_client = server->client_by_id[cip->info.idret];
+                server_stopaccess();
                 new_client->id      = cip->info.id;
-                new_client->name.append(cip->info.name);
+                new_client->name    = cip->info.name;
                 new_client->sock    = csock;
                 new_client->address = csin;
                 new_client->server  = (void*) server;
+                new_client->trusted = client_socket_is_trusted(csock);
                 buffer_copy(new_client->pubkey, cip->info.pubkey);
                 
 #ifdef GULTRA_DEBUG
@@ -305,6 +323,12 @@ void* accepting_thread_loop(void* data)
                 
                 // Once complete we create the thread
                 server_create_client_thread_loop(server, new_client);
+                
+                server_access();
+                {
+                    server->status = SS_STARTED;
+                }
+                server_stopaccess();
             }
             
         }
@@ -314,6 +338,16 @@ void* accepting_thread_loop(void* data)
             return nullptr;
         }
         
+        // An additional connection of a file transfer : this thread receives its chunks.
+        else if(pclient->m_type == PT_TRANSFER_STREAM)
+        {
+            TransferStreamPacket* tsp = reinterpret_cast<TransferStreamPacket*>(pclient);
+            transfer_stream_t stream = tsp->data;
+            delete tsp;
+            
+            server_transfer_stream(server, csock, csin, stream);
+        }
+        
         // Client can also send an http request
         else if(pclient->m_type == PT_HTTP_REQUEST)
         {
@@ -331,9 +365,9 @@ void* accepting_thread_loop(void* data)
             hp << "\r\n";
             hp << buf;
             
-            send(csock, hp.str().c_str(), hp.str().size(), 0);
+            transport_send(csock, hp.str().c_str(), hp.str().size());
             //                send(csock, buf.c_str(),      buf.size(),      0);
-            closesocket(csock);
+            transport_close(csock);
             
             // Notifiate the listeners of the http request.
             ServerHttpRequestEvent* e = new ServerHttpRequestEvent;
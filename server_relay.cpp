@@ -0,0 +1,558 @@
+/*
+ File        : server_relay.cpp
+ Description : Relays packets to servers we are not directly connected to.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+
+GBEGIN_DECL
+
+/** @brief Keeps every client but the one whose connection ID is given
+ *  in data.
+**/
+static bool relay_filter_except_(const client_t& client, void* data)
+{
+    return client.mirror->id != *(uint32_t*) data;
+}
+
+/** @brief Looks for a valid route to given server.
+ *
+ *  A route is valid until it expires, or until the client it goes
+ *  through is closed.
+**/
+static bool relay_route_find_(server_t* server, const std::string& name, route_t& out)
+{
+    bool ret = false;
+
+    gthread_mutex_lock(&server->mutex);
+    std::map<std::string, route_t>::iterator it = server->_routes.find(name);
+    if(it != server->_routes.end())
+    {
+        if(it->second.expires > timer_monotonic_ms() && server->client_by_id.count(it->second.via))
+        {
+            out = it->second;
+            ret = true;
+        }
+        else
+        {
+            server->_routes.erase(it);
+        }
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    return ret;
+}
+
+/** @brief Looks for the public key we trust for given server : the one it
+ *  gave when it connected to us, else the first one learned from its route
+ *  packets. Called with server->mutex locked.
+**/
+static bool relay_key_find_(server_t* server, const std::string& name, buffer_t& out)
+{
+    for(ClientsList::const_iterator it = server->clients.begin(); it != server->clients.end(); ++it)
+    {
+        const client_t& client = *it;
+        if(client.established && client.name == name && client.pubkey.size > 0)
+        {
+            // The server may have restarted with a new key since we learned one.
+            std::map<std::string, buffer_t>::iterator it = server->_routekeys.find(name);
+            if(it != server->_routekeys.end())
+                buffer_copy(it->second, client.pubkey);
+
+            buffer_copy(out, client.pubkey);
+            return true;
+        }
+    }
+
+    std::map<std::string, buffer_t>::const_iterator it = server->_routekeys.find(name);
+    if(it == server->_routekeys.end())
+        return false;
+
+    buffer_copy(out, it->second);
+    return true;
+}
+
+/** @brief Remembers that given server can be reached through the client
+ *  with connection ID via.
+ *
+ *  Route packets are not signed : the key they carry is only accepted if
+ *  it is the one we already know for the server (see relay_key_find_()),
+ *  and is remembered for the next ones otherwise. In SSL mode, a route
+ *  without key is refused, as we would send in clear along it.
+ *
+ *  The hop count is not checked either, so a known route is never replaced
+ *  by a shorter one : it is kept until it expires, unless the same client
+ *  refreshes it. The first reply, which took the fastest path, wins.
+ *
+ *  @return false if the route was refused.
+**/
+static bool relay_route_learn_(server_t* server, const std::string& name, uint32_t via, uint8_t hops, const buffer_t& pubkey)
+{
+    if(name.empty() || name == server->name)
+        return false;
+    if(server->crypt && pubkey.size == 0)
+        return false;
+
+    long        now    = timer_monotonic_ms();
+    const char* reason = nullptr;
+
+    gthread_mutex_lock(&server->mutex);
+    {
+        buffer_t known;
+        if(relay_key_find_(server, name, known))
+        {
+            if(known.size != pubkey.size || memcmp(known.buf, pubkey.buf, known.size) != 0)
+                reason = "its key is not the one we know";
+        }
+        else if(server->_routekeys.size() >= RELAY_MAXKEYS)
+        {
+            reason = "too many keys are known";
+        }
+        else
+        {
+            buffer_copy(server->_routekeys[name], pubkey);
+        }
+
+        std::map<std::string, route_t>::iterator it = server->_routes.find(name);
+        if(!reason && (it == server->_routes.end() || it->second.expires <= now || it->second.via == via))
+        {
+            route_t& route = server->_routes[name];
+            route.via     = via;
+            route.hops    = hops;
+            route.expires = now + RELAY_ROUTETTL;
+            buffer_copy(route.pubkey, pubkey);
+        }
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    if(reason)
+    {
+        cout << "[Relay] Ignored route to '" << name << "' through connection " << via << " : " << reason << "." << endl;
+        return false;
+    }
+
+#ifdef GULTRA_DEBUG
+    cout << "[Relay] Route to '" << name << "' through connection " << via << " (" << (uint32_t) hops << " hops)." << endl;
+#endif // GULTRA_DEBUG
+
+    return true;
+}
+
+/** @brief Sends a route packet to the client with connection ID via,
+ *  without waiting for the answer.
+**/
+static gerror_t relay_route_send_(server_t* server, uint8_t packet_type, const route_info_t& info, uint32_t via)
+{
+    route_info_t serialized = serialize<route_info_t>(info);
+    return broadcast_forward(server, packet_type, &serialized, sizeof(route_info_t), broadcast_filter_id, &via);
+}
+
+/** @brief Floods a route request to every client but the one with
+ *  connection ID except.
+**/
+static gerror_t relay_route_flood_(server_t* server, const route_info_t& info, uint32_t except)
+{
+    route_info_t serialized = serialize<route_info_t>(info);
+    return broadcast_forward(server, PT_ROUTE_REQUEST, &serialized, sizeof(route_info_t), relay_filter_except_, &except);
+}
+
+/** @brief Asks every client for a route to given server, and waits for
+ *  the reply of the destination.
+ *
+ *  @return
+ *  - GERROR_NONE if a route has been found.
+ *  - GERROR_CANT_SEND_PACKET if we have no client to ask.
+ *  - GERROR_TIMEDOUT if the destination did not reply in time.
+**/
+static gerror_t relay_route_discover_(server_t* server, const std::string& destination, route_t& out)
+{
+    route_info_t info;
+    memset(&info, 0, sizeof(route_info_t));
+    info.id   = broadcast_new_id(server);
+    info.ttl  = RELAY_TTL;
+    info.hops = 0;
+    strncpy(info.origin,      server->name.c_str(), SERVER_MAXBUFSIZE - 1);
+    strncpy(info.destination, destination.c_str(),  SERVER_MAXBUFSIZE - 1);
+    if(server->pubkey)
+        buffer_copy(info.pubkey, *server->pubkey);
+    else
+        info.pubkey.size = 0;
+
+    // Copies of our request coming back to us are ignored.
+    broadcast_seen(server, info.id);
+
+    gerror_t err = relay_route_flood_(server, info, ID_CLIENT_INVALID);
+    if(err != GERROR_NONE)
+        return err;
+
+    // The reply is read by a client thread, which fills the routes.
+    long deadline = timer_monotonic_ms() + RELAY_TIMEOUT;
+    while(timer_monotonic_ms() < deadline)
+    {
+        if(relay_route_find_(server, destination, out))
+            return GERROR_NONE;
+        usleep(1000);
+    }
+
+    return GERROR_TIMEDOUT;
+}
+
+/** @brief Fills copy with what the origin of a relay signs : the serialized
+ *  relay, but its ttl which changes at every hop, and its signature.
+ *  @return The number of bytes signed.
+**/
+static size_t relay_signed_(const relay_t& relay, relay_t* copy)
+{
+    *copy = serialize<relay_t>(relay);
+    copy->ttl           = 0;
+    copy->signaturesize = 0;
+    memset(copy->signature, 0, RSA_SIZE);
+
+    return offsetof(relay_t, payload) + std::min<size_t>(relay.payloadsize, RELAY_MAXPAYLOAD);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a packet to a server, even if we are not
+ *  connected to it.
+ *
+ *  If the destination is a client, the packet is sent directly.
+ *  Otherwise, it is sent along a route, found by flooding a
+ *  route request if none is known. Routes are cached for
+ *  RELAY_ROUTETTL ms.
+ *
+ *  The data is crypted with the public key the destination gave
+ *  in its PT_ROUTE_REPLY, so only the destination can decrypt it,
+ *  and signed by this server : the relays forward it untouched.
+ *  In SSL mode, the destination refuses relays which are not.
+ *
+ *  @param destination : Name of the destination server.
+ *  @param packet_type : Type of the packet. Only PT_CLIENT_MESSAGE
+ *  is delivered by relayed servers for now.
+ *  @param sz : Size of the data, at most RELAY_MAXDATA.
+ *
+ *  @return
+ *  - GERROR_NONE if the first relay received the packet.
+ *  - GERROR_BADARGS if server is null, destination is empty or
+ *  data is too big.
+ *  - GERROR_TIMEDOUT if no route was found.
+ *  - @see broadcast_wait() if the first relay did not receive it.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_relay_send(server_t* server, const std::string& destination, uint8_t packet_type, const void* data, size_t sz)
+{
+    if(!server || destination.empty() || destination.size() >= SERVER_MAXBUFSIZE || sz > RELAY_MAXDATA)
+        return GERROR_BADARGS;
+
+    client_t* direct = server_find_client_id(server, destination) != ID_CLIENT_INVALID ? server_find_client_by_name(server, destination) : nullptr;
+    if(direct)
+        return server->client_send(direct, packet_type, data, sz);
+
+    route_t  route;
+    gerror_t err = GERROR_NONE;
+    if(!relay_route_find_(server, destination, route))
+    {
+        err = relay_route_discover_(server, destination, route);
+        if(err != GERROR_NONE)
+        {
+            cout << "[Relay] No route to '" << destination << "' (" << gerror_to_string(err) << ")." << endl;
+            return err;
+        }
+    }
+
+    relay_t* relay = new relay_t;
+    memset(relay, 0, sizeof(relay_t));
+    strncpy(relay->origin,      server->name.c_str(), SERVER_MAXBUFSIZE - 1);
+    strncpy(relay->destination, destination.c_str(),  SERVER_MAXBUFSIZE - 1);
+    relay->ttl   = RELAY_TTL;
+    relay->ptype = packet_type;
+    relay->size  = (uint32_t) sz;
+
+    if(server->crypt && route.pubkey.size > 0)
+    {
+        // Same blocks as client_send_cryptpacket(), ending with the remainder, but
+        // crypted with the key the destination gave in its PT_ROUTE_REPLY.
+        unsigned char* from = reinterpret_cast<unsigned char*>(const_cast<void*>(data));
+        relay->crypted = 1;
+        for(size_t done = 0; done < sz; done += RSA_SIZE - 11)
+        {
+            size_t len = std::min<size_t>(sz - done, RSA_SIZE - 11);
+            int    ret = Encryption::crypt_public(route.pubkey, relay->payload + relay->payloadsize, from + done, len);
+            if(ret <= 0)
+            {
+                delete relay;
+                return GERROR_ENCRYPT_WRITE;
+            }
+            relay->payloadsize += (uint32_t) ret;
+        }
+
+        // The relays could otherwise send anything in our name.
+        relay_t* copy = new relay_t;
+        size_t   len  = relay_signed_(*relay, copy);
+        int      ret  = Encryption::sign(server->crypt, copy, len, relay->signature);
+        delete copy;
+        if(ret <= 0)
+        {
+            delete relay;
+            return GERROR_ENCRYPT_WRITE;
+        }
+        relay->signaturesize = (uint32_t) ret;
+    }
+    else
+    {
+        relay->crypted     = 0;
+        relay->payloadsize = (uint32_t) sz;
+        memcpy(relay->payload, data, sz);
+    }
+
+    *relay = serialize<relay_t>(*relay);
+
+    broadcast_t* broadcast = nullptr;
+    err = broadcast_send(server, PT_RELAY, relay, sizeof(relay_t), broadcast, broadcast_filter_id, &route.via);
+    delete relay;
+
+    if(err == GERROR_NONE)
+    {
+        err = broadcast->peers.empty() ? GERROR_CANT_SEND_PACKET : broadcast_wait(broadcast, BROADCAST_TIMEOUT);
+        broadcast_destroy(broadcast);
+    }
+
+#ifdef GULTRA_DEBUG
+    cout << "[Relay] Sent packet type " << (uint32_t) packet_type << " to '" << destination << "' (" << (uint32_t) route.hops << " hops) : " << gerror_to_string(err) << endl;
+#endif // GULTRA_DEBUG
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns a copy of the routes known by this server.
+**/
+////////////////////////////////////////////////////////////
+std::map<std::string, route_t> server_routes(server_t* server)
+{
+    gthread_mutex_lock(&server->mutex);
+    std::map<std::string, route_t> ret = server->_routes;
+    gthread_mutex_unlock(&server->mutex);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_ROUTE_REQUEST received from given client.
+ *
+ *  We learn the route back to the origin, then reply if we are
+ *  the destination, forward the request to the destination if it
+ *  is our client, or flood it to our other clients.
+**/
+////////////////////////////////////////////////////////////
+void server_route_request(server_t* server, client_t* client, const route_info_t& info)
+{
+    if(!client->mirror || broadcast_seen(server, info.id))
+        return;
+
+    uint32_t via = client->mirror->id;
+    if(!relay_route_learn_(server, info.origin, via, info.hops + 1, info.pubkey))
+        return;
+
+    route_info_t next = info;
+    next.hops = info.hops + 1;
+    next.ttl  = info.ttl - 1;
+
+    if(server->name == info.destination)
+    {
+        route_info_t reply;
+        memset(&reply, 0, sizeof(route_info_t));
+        reply.id   = info.id;
+        reply.ttl  = RELAY_TTL;
+        reply.hops = 0;
+        strncpy(reply.origin,      info.origin,          SERVER_MAXBUFSIZE - 1);
+        strncpy(reply.destination, server->name.c_str(), SERVER_MAXBUFSIZE - 1);
+        if(server->pubkey)
+            buffer_copy(reply.pubkey, *server->pubkey);
+        else
+            reply.pubkey.size = 0;
+
+        relay_route_send_(server, PT_ROUTE_REPLY, reply, via);
+        return;
+    }
+
+    uint32_t direct = server_find_client_id(server, info.destination);
+    if(direct != ID_CLIENT_INVALID)
+    {
+        relay_route_send_(server, PT_ROUTE_REQUEST, next, direct);
+    }
+    else if(info.ttl > 1)
+    {
+        relay_route_flood_(server, next, via);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_ROUTE_REPLY received from given client.
+ *
+ *  We learn the route to the destination, and forward the reply
+ *  back to the origin if it is not us.
+**/
+////////////////////////////////////////////////////////////
+void server_route_reply(server_t* server, client_t* client, const route_info_t& info)
+{
+    if(!client->mirror)
+        return;
+
+    if(!relay_route_learn_(server, info.destination, client->mirror->id, info.hops + 1, info.pubkey))
+        return;
+
+    if(server->name == info.origin || info.ttl <= 1)
+        return;
+
+    route_info_t next = info;
+    next.hops = info.hops + 1;
+    next.ttl  = info.ttl - 1;
+
+    uint32_t via    = server_find_client_id(server, info.origin);
+    route_t  route;
+    if(via == ID_CLIENT_INVALID && relay_route_find_(server, info.origin, route))
+        via = route.via;
+
+    if(via != ID_CLIENT_INVALID)
+        relay_route_send_(server, PT_ROUTE_REPLY, next, via);
+}
+
+/** @brief Checks the signature of a relay sent to us, with the public key
+ *  of its origin, and decrypts its payload with our private key.
+**/
+static gerror_t relay_decrypt_(server_t* server, const relay_t& relay, data_t* out)
+{
+    if(!relay.crypted)
+    {
+        // In SSL mode, anyone could send a clear relay in the name of any server.
+        if(server->crypt)
+            return GERROR_BADSIGNATURE;
+
+        memcpy(out, relay.payload, std::min(relay.size, relay.payloadsize));
+        return GERROR_NONE;
+    }
+
+    if(!server->crypt)
+        return GERROR_ENCRYPT_PUBKEY;
+    if(relay.signaturesize == 0 || relay.signaturesize > RSA_SIZE || relay.payloadsize > RELAY_MAXPAYLOAD)
+        return GERROR_BADSIGNATURE;
+
+    buffer_t pubkey;
+    gthread_mutex_lock(&server->mutex);
+    bool known = relay_key_find_(server, relay.origin, pubkey);
+    gthread_mutex_unlock(&server->mutex);
+    if(!known)
+        return GERROR_ENCRYPT_PUBKEY;
+
+    relay_t* copy  = new relay_t;
+    size_t   len   = relay_signed_(relay, copy);
+    bool     valid = Encryption::verify(pubkey, copy, len, relay.signature, relay.signaturesize);
+    delete copy;
+    if(!valid)
+        return GERROR_BADSIGNATURE;
+
+    unsigned char block[RSA_SIZE];
+    size_t        done = 0;
+    for(uint32_t i = 0; i + RSA_SIZE <= relay.payloadsize; i += RSA_SIZE)
+    {
+        int len = Encryption::decrypt_private(server->crypt, block, const_cast<unsigned char*>(relay.payload + i), RSA_SIZE);
+        if(len < 0 || done + len > relay.size)
+            return GERROR_BADCIPHER;
+
+        memcpy(out + done, block, len);
+        done += len;
+    }
+
+    return done == relay.size ? GERROR_NONE : GERROR_BADCIPHER;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_RELAY received from given client.
+ *
+ *  A relay for us is decrypted and delivered. Others are
+ *  forwarded untouched to the destination if it is our client,
+ *  or along the route to it.
+**/
+////////////////////////////////////////////////////////////
+void server_relay_receive(server_t* server, client_t* client, const relay_t& relay)
+{
+    if(server->name == relay.destination)
+    {
+        data_t data[RELAY_MAXDATA];
+        memset(data, 0, RELAY_MAXDATA);
+
+        gerror_t err = relay_decrypt_(server, relay, data);
+        if(err != GERROR_NONE)
+        {
+            cout << "[Relay]{" << relay.origin << "} Can't read relayed packet (" << gerror_to_string(err) << ")." << endl;
+            return;
+        }
+
+        if(relay.ptype == PT_CLIENT_MESSAGE)
+        {
+            std::string message(reinterpret_cast<const char*>(data), strnlen(reinterpret_cast<const char*>(data), relay.size));
+            cout << "[Server]{" << relay.origin << "} " << message << endl;
+
+            ServerMessageReceivedEvent* e = new ServerMessageReceivedEvent;
+            e->type    = "ServerMessageReceivedEvent";
+            e->parent  = server;
+            e->client  = client;
+            e->origin  = relay.origin;
+            e->message = message;
+            server->sendEvent(e);
+            delete e;
+        }
+        else
+        {
+            cout << "[Relay]{" << relay.origin << "} Relayed packet type " << (uint32_t) relay.ptype << " is not supported." << endl;
+        }
+        return;
+    }
+
+    if(relay.ttl <= 1)
+    {
+#ifdef GULTRA_DEBUG
+        cout << "[Relay] Dropped packet from '" << relay.origin << "' to '" << relay.destination << "' : TTL expired." << endl;
+#endif // GULTRA_DEBUG
+        return;
+    }
+
+    uint32_t via   = server_find_client_id(server, relay.destination);
+    route_t  route;
+    if(via == ID_CLIENT_INVALID && relay_route_find_(server, relay.destination, route))
+        via = route.via;
+
+    if(via == ID_CLIENT_INVALID)
+    {
+        cout << "[Relay] No route to '" << relay.destination << "', dropped packet from '" << relay.origin << "'." << endl;
+        return;
+    }
+
+    relay_t* next = new relay_t;
+    *next = relay;
+    next->ttl--;
+    *next = serialize<relay_t>(*next);
+    broadcast_forward(server, PT_RELAY, next, sizeof(relay_t), broadcast_filter_id, &via);
+    delete next;
+}
+
+GEND_DECL
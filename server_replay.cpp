@@ -0,0 +1,526 @@
+/*
+ File        : server_replay.cpp
+ Description : Numbers the packets of the stream to a peer, and keeps them until
+               it acknowledges them, so they are sent again after a reconnection.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+#include <deque>
+
+GBEGIN_DECL
+
+/** @brief The stream between this server and a peer. It is kept when the
+ *  connection is closed, as the peer is known by its name.
+**/
+struct replay_t
+{
+    uint64_t                 sent;      // Last sequence sent.
+    std::deque<sequenced_t*> packets;   // Packets sent and not acknowledged, oldest first. They are serialized.
+    uint64_t                 peerepoch; // Epoch of the peer, 0 if we received nothing.
+    uint64_t                 received;  // Last sequence of peerepoch received.
+    uint64_t                 peeroldest; // Oldest sequence of peerepoch the peer can still send again.
+    std::map<uint64_t, sequenced_t*> early; // Packets received after a gap, kept until the missing ones come.
+    uint32_t                 unacked;   // Packets received since our last acknowledgement.
+    pthread_mutex_t          mutex;     // Protects the stream. Its packets are written with it locked, so they are in order on the connection.
+};
+
+// Protects the streams of every server, by peer name. A stream is only locked by
+// its own mutex, so writing to a slow peer does not hold the others.
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Returns the stream with given peer, creating it if needed, with
+ *  its mutex locked.
+**/
+static replay_t* replay_lock_(server_t* server, const std::string& name)
+{
+    gthread_mutex_lock(&replay_mutex);
+    replay_t*& replay = server->_replays[name];
+    if(!replay)
+    {
+        replay = new replay_t;
+        replay->sent      = 0;
+        replay->peerepoch  = 0;
+        replay->received   = 0;
+        replay->peeroldest = 0;
+        replay->unacked    = 0;
+        pthread_mutex_init(&replay->mutex, nullptr);
+    }
+    replay_t* ret = replay;
+    gthread_mutex_unlock(&replay_mutex);
+
+    gthread_mutex_lock(&ret->mutex);
+    return ret;
+}
+
+/** @brief Starts receiving a new epoch of the peer : its sequences
+ *  restarted, and the packets kept from the previous one are dropped.
+ *  @note The mutex of the stream must be locked.
+**/
+static void replay_restart_(replay_t* replay, uint64_t epoch)
+{
+    replay->peerepoch  = epoch;
+    replay->received   = 0;
+    replay->peeroldest = 0;
+
+    for(std::map<uint64_t, sequenced_t*>::iterator it = replay->early.begin(); it != replay->early.end(); ++it)
+        delete it->second;
+    replay->early.clear();
+}
+
+/** @brief Returns the oldest sequence we can send again.
+ *  @note The mutex of the stream must be locked.
+**/
+static uint64_t replay_oldest_(const replay_t* replay)
+{
+    return replay->sent - replay->packets.size() + 1;
+}
+
+/** @brief Forgets the packets the peer received.
+ *  @note The mutex of the stream must be locked.
+**/
+static void replay_acknowledge_(replay_t* replay, uint64_t received)
+{
+    while(!replay->packets.empty() && replay_oldest_(replay) <= received)
+    {
+        delete replay->packets.front();
+        replay->packets.pop_front();
+    }
+}
+
+/** @brief Sends the last sequence we received from given client, as
+ *  filled in resume.
+**/
+static void replay_send_resume_(client_t* client, resume_t resume)
+{
+    resume = serialize<resume_t>(resume);
+    send_client_packet(client->mirror->sock, SOCKET_ERROR, PT_CLIENT_RESUME, &resume, sizeof(resume_t));
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Crypts data sent to a peer with the private key of this
+ *  server, in the same blocks as client_send_cryptpacket(), ending
+ *  with the remainder. Without SSL, the data is copied as is.
+ *
+ *  @param payload : Buffer of at least ((sz / (RSA_SIZE - 11)) + 1)
+ *  * RSA_SIZE bytes.
+ *  @param crypted : [out] 1 if payload is crypted.
+ *  @param payloadsize : [out] Size of payload.
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_ENCRYPT_WRITE if the data can't be crypted.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_replay_crypt(server_t* server, const void* data, size_t sz, data_t* payload, uint8_t& crypted, uint32_t& payloadsize)
+{
+    payloadsize = 0;
+
+    if(!server->crypt)
+    {
+        crypted     = 0;
+        payloadsize = (uint32_t) sz;
+        memcpy(payload, data, sz);
+        return GERROR_NONE;
+    }
+
+    unsigned char* from = reinterpret_cast<unsigned char*>(const_cast<void*>(data));
+    crypted = 1;
+    for(size_t done = 0; done < sz; done += RSA_SIZE - 11)
+    {
+        size_t len = std::min<size_t>(sz - done, RSA_SIZE - 11);
+        int    ret = Encryption::crypt(server->crypt, payload + payloadsize, from + done, len);
+        if(ret <= 0)
+            return GERROR_ENCRYPT_WRITE;
+        payloadsize += (uint32_t) ret;
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Decrypts size bytes crypted by given client with
+ *  server_replay_crypt(), in out.
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_BADCIPHER if payload is not size bytes crypted by the
+ *  client.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_replay_decrypt(client_t* client, uint8_t crypted, const data_t* payload, uint32_t payloadsize, uint32_t size, data_t* out)
+{
+    if(!crypted)
+    {
+        memcpy(out, payload, std::min(size, payloadsize));
+        return GERROR_NONE;
+    }
+
+    unsigned char block[RSA_SIZE];
+    size_t        done = 0;
+    for(uint32_t i = 0; i + RSA_SIZE <= payloadsize; i += RSA_SIZE)
+    {
+        int len = Encryption::decrypt(client->pubkey, block, const_cast<unsigned char*>(payload + i), RSA_SIZE);
+        if(len < 0 || done + len > size)
+            return GERROR_BADCIPHER;
+
+        memcpy(out + done, block, len);
+        done += len;
+    }
+
+    return done == size ? GERROR_NONE : GERROR_BADCIPHER;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a packet of the stream to given peer.
+ *
+ *  The packet is numbered, and kept until the peer acknowledges
+ *  it (every REPLAY_ACKEVERY packets). If the connection is
+ *  closed before, the packet is sent again when the peer connects
+ *  again, after the last packet it received. At most
+ *  REPLAY_MAXPACKETS are kept for a peer : older ones are lost if
+ *  it does not acknowledge them.
+ *
+ *  The data is crypted by this server, as for relayed packets.
+ *
+ *  @param destination : Name of the peer server.
+ *  @param packet_type : Type of the packet. Only PT_CLIENT_MESSAGE
+ *  is delivered by the peers for now.
+ *  @param sz : Size of the data, at most REPLAY_MAXDATA.
+ *
+ *  @return
+ *  - GERROR_NONE if the packet is sent or kept to be sent again.
+ *  - GERROR_BADARGS if server is null, destination is empty or
+ *  data is too big.
+ *  - GERROR_CANT_SEND_PACKET if we are not connected to the peer :
+ *  the packet is not kept.
+ *  - GERROR_ENCRYPT_WRITE if the data can't be crypted.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_send_sequenced(server_t* server, const std::string& destination, uint8_t packet_type, const void* data, size_t sz)
+{
+    if(!server || destination.empty() || !data || sz > REPLAY_MAXDATA)
+        return GERROR_BADARGS;
+
+    uint32_t id = server_find_client_id(server, destination);
+    if(id == ID_CLIENT_INVALID)
+        return GERROR_CANT_SEND_PACKET;
+
+    sequenced_t* packet = new sequenced_t;
+    memset(packet, 0, sizeof(sequenced_t));
+    packet->epoch = server->_epoch;
+    packet->ptype = packet_type;
+    packet->size  = (uint32_t) sz;
+
+    uint8_t  crypted     = 0;
+    uint32_t payloadsize = 0;
+    if(server_replay_crypt(server, data, sz, packet->payload, crypted, payloadsize) != GERROR_NONE)
+    {
+        delete packet;
+        return GERROR_ENCRYPT_WRITE;
+    }
+    packet->crypted     = crypted;
+    packet->payloadsize = payloadsize;
+
+    replay_t* replay = replay_lock_(server, destination);
+    packet->seq = ++replay->sent;
+
+    replay->packets.push_back(packet);
+    if(replay->packets.size() > REPLAY_MAXPACKETS)
+    {
+        delete replay->packets.front();
+        replay->packets.pop_front();
+    }
+
+    uint64_t seq   = packet->seq;
+    packet->oldest = replay_oldest_(replay);
+    *packet        = serialize<sequenced_t>(*packet);
+
+    gerror_t err = broadcast_forward(server, PT_SEQUENCED, packet, sizeof(sequenced_t), broadcast_filter_id, &id);
+    gthread_mutex_unlock(&replay->mutex);
+
+    if(err != GERROR_NONE)
+    {
+        // The packet is sent again by server_replay_resume().
+        cout << "[Replay] Can't send packet " << seq << " to '" << destination << "', it will be sent on reconnection." << endl;
+    }
+
+#ifdef GULTRA_DEBUG
+    cout << "[Replay] Sent packet " << seq << " (type " << (uint32_t) packet_type << ") to '" << destination << "'." << endl;
+#endif // GULTRA_DEBUG
+
+    return GERROR_NONE;
+}
+
+/** @brief Decrypts the data of a sequenced packet, with the public key
+ *  of given client.
+**/
+static gerror_t replay_decrypt_(client_t* client, const sequenced_t& packet, data_t* out)
+{
+    return server_replay_decrypt(client, packet.crypted, packet.payload, packet.payloadsize, packet.size, out);
+}
+
+/** @brief Delivers the data of a sequenced packet received from given
+ *  client.
+**/
+static void replay_deliver_(server_t* server, client_t* client, const sequenced_t& packet)
+{
+    data_t data[REPLAY_MAXDATA];
+    memset(data, 0, REPLAY_MAXDATA);
+
+    gerror_t err = replay_decrypt_(client, packet, data);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Replay]{" << client->name << "} Can't read packet " << packet.seq << " (" << gerror_to_string(err) << ")." << endl;
+        return;
+    }
+
+    if(packet.ptype == PT_CLIENT_MESSAGE)
+    {
+        std::string message(reinterpret_cast<const char*>(data), strnlen(reinterpret_cast<const char*>(data), packet.size));
+        cout << "[Server]{" << client->name << "} " << message << endl;
+
+        ServerMessageReceivedEvent* e = new ServerMessageReceivedEvent;
+        e->type    = "ServerMessageReceivedEvent";
+        e->parent  = server;
+        e->client  = client;
+        e->origin  = client->name;
+        e->message = message;
+        server->sendEvent(e);
+        delete e;
+    }
+    else
+    {
+        cout << "[Replay]{" << client->name << "} Sequenced packet type " << (uint32_t) packet.ptype << " is not supported." << endl;
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_SEQUENCED received from given client.
+ *
+ *  Packets already received are dropped. A packet after a gap is
+ *  kept (at most REPLAY_MAXPACKETS of them) while the client can
+ *  still send the missing ones : it does when we tell it the last
+ *  one we received, and the kept packets are then delivered after
+ *  them. Once the client can't send them anymore, the missing
+ *  packets are lost and the stream goes on.
+**/
+////////////////////////////////////////////////////////////
+void server_replay_receive(server_t* server, client_t* client, const sequenced_t& packet)
+{
+    if(!client->mirror)
+        return;
+
+    resume_t ack;
+    bool     mustack = false;
+    bool     dropped = false;
+    uint64_t lost    = 0;
+
+    std::vector<sequenced_t*> ready;
+
+    replay_t* replay = replay_lock_(server, client->name);
+    if(replay->peerepoch != packet.epoch)
+    {
+        // The client restarted : its sequences restarted too.
+        replay_restart_(replay, packet.epoch);
+    }
+
+    replay->peeroldest = std::max(replay->peeroldest, packet.oldest);
+
+    if(packet.seq <= replay->received || replay->early.count(packet.seq) ||
+       (packet.seq > replay->received + 1 && replay->early.size() >= REPLAY_MAXPACKETS))
+    {
+        // Already received, or kept. When too many packets are kept, this one is
+        // dropped : the client still has it, as we did not acknowledge it.
+        dropped = true;
+    }
+    else
+    {
+        replay->early[packet.seq] = new sequenced_t(packet);
+    }
+
+    // Takes the kept packets which come next, skipping the packets the client lost.
+    while(!replay->early.empty())
+    {
+        std::map<uint64_t, sequenced_t*>::iterator it = replay->early.begin();
+        if(it->first != replay->received + 1)
+        {
+            if(replay->peeroldest <= replay->received + 1)
+                break;
+
+            // The client can't send the packets before peeroldest anymore.
+            uint64_t skipped = std::min(it->first, replay->peeroldest) - 1;
+            lost            += skipped - replay->received;
+            replay->received = skipped;
+            continue;
+        }
+
+        replay->received = it->first;
+        ready.push_back(it->second);
+        replay->early.erase(it);
+
+        if(++replay->unacked >= REPLAY_ACKEVERY)
+        {
+            replay->unacked = 0;
+            mustack         = true;
+        }
+    }
+
+    if(mustack)
+    {
+        ack.epoch     = server->_epoch;
+        ack.peerepoch = replay->peerepoch;
+        ack.received  = replay->received;
+        ack.resend    = 0;
+    }
+    gthread_mutex_unlock(&replay->mutex);
+
+    if(mustack)
+        replay_send_resume_(client, ack);
+
+#ifdef GULTRA_DEBUG
+    if(dropped)
+    {
+        cout << "[Replay]{" << client->name << "} Dropped packet " << packet.seq << "." << endl;
+    }
+    else if(ready.empty())
+    {
+        cout << "[Replay]{" << client->name << "} Kept packet " << packet.seq << " until the missing ones come." << endl;
+    }
+#endif // GULTRA_DEBUG
+
+    if(lost > 0)
+    {
+        cout << "[Replay]{" << client->name << "} Lost " << lost << " packets." << endl;
+    }
+
+    for(size_t i = 0; i < ready.size(); ++i)
+    {
+        replay_deliver_(server, client, *ready[i]);
+        delete ready[i];
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_CLIENT_RESUME received from given client.
+ *
+ *  The packets it received are forgotten. If it asks for them,
+ *  the others are sent again, in order.
+**/
+////////////////////////////////////////////////////////////
+void server_replay_resume(server_t* server, client_t* client, const resume_t& resume)
+{
+    if(!client->mirror)
+        return;
+
+    uint32_t id      = client->mirror->id;
+    uint32_t resent  = 0;
+    gerror_t err     = GERROR_NONE;
+
+    replay_t* replay = replay_lock_(server, client->name);
+    if(replay->peerepoch != resume.epoch)
+        replay_restart_(replay, resume.epoch);
+
+    // What the client received before we restarted is not ours.
+    uint64_t received = resume.peerepoch == server->_epoch ? resume.received : 0;
+    replay_acknowledge_(replay, received);
+
+    if(resume.resend)
+    {
+        uint64_t oldest = serialize<uint64_t>(replay_oldest_(replay));
+        for(size_t i = 0; i < replay->packets.size() && err == GERROR_NONE; ++i)
+        {
+            sequenced_t* packet = replay->packets[i];
+            packet->oldest = oldest;
+
+            err = broadcast_forward(server, PT_SEQUENCED, packet, sizeof(sequenced_t), broadcast_filter_id, &id);
+            if(err == GERROR_NONE)
+                resent++;
+        }
+    }
+    gthread_mutex_unlock(&replay->mutex);
+
+    if(resent > 0)
+    {
+        cout << "[Replay]{" << client->name << "} Resumed stream, sent " << resent << " packets again." << endl;
+    }
+    if(err != GERROR_NONE)
+    {
+        cout << "[Replay]{" << client->name << "} Can't resume stream (" << gerror_to_string(err) << ")." << endl;
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Tells a newly established client the last packet we
+ *  received from it, so it sends the next ones again.
+**/
+////////////////////////////////////////////////////////////
+void server_replay_announce(server_t* server, client_t* client)
+{
+    if(!client->mirror)
+        return;
+
+    resume_t resume;
+    resume.epoch     = server->_epoch;
+    resume.peerepoch = 0;
+    resume.received  = 0;
+    resume.resend    = 1;
+
+    gthread_mutex_lock(&replay_mutex);
+    std::map<std::string, replay_t*>::iterator it = server->_replays.find(client->name);
+    replay_t* replay = it != server->_replays.end() ? it->second : nullptr;
+    gthread_mutex_unlock(&replay_mutex);
+
+    if(replay)
+    {
+        gthread_mutex_lock(&replay->mutex);
+        replay->unacked  = 0;
+        resume.peerepoch = replay->peerepoch;
+        resume.received  = replay->received;
+        gthread_mutex_unlock(&replay->mutex);
+    }
+
+    replay_send_resume_(client, resume);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Destroys the replay buffers of given server. It is
+ *  called by server_destroy().
+**/
+////////////////////////////////////////////////////////////
+void server_replay_clear(server_t* server)
+{
+    gthread_mutex_lock(&replay_mutex);
+    for(std::map<std::string, replay_t*>::iterator it = server->_replays.begin(); it != server->_replays.end(); ++it)
+    {
+        replay_t* replay = it->second;
+        for(size_t i = 0; i < replay->packets.size(); ++i)
+            delete replay->packets[i];
+        replay_restart_(replay, 0);
+        pthread_mutex_destroy(&replay->mutex);
+        delete replay;
+    }
+    server->_replays.clear();
+    gthread_mutex_unlock(&replay_mutex);
+}
+
+GEND_DECL
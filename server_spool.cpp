@@ -0,0 +1,588 @@
+/*
+ File        : server_spool.cpp
+ Description : Keeps on disk what is sent to peers which are not connected,
+               and sends it in batches when they are back.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+GBEGIN_DECL
+
+#define SPOOL_MAGIC   "GTSPOOL1" // First bytes of a spool file.
+#define SPOOL_SEGMENT (1 << 20)  // Spool files grow by this size.
+
+/** @brief Header of a spool file. The records between head and tail are
+ *  not delivered yet.
+**/
+typedef struct spool_header_t
+{
+    char     magic[8];
+    uint64_t head;
+    uint64_t tail;
+} spool_header_t;
+
+/** @brief A spool file, mapped in memory. Records are appended at the
+ *  tail, and the head moves forward when they are delivered.
+**/
+struct spool_file_t
+{
+    int      fd;
+    data_t*  map;
+    size_t   capacity; // Size of the file, and of the mapping.
+    bool     draining; // True while a thread sends the records.
+};
+
+// Protects the spool files of every server.
+static pthread_mutex_t spool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline spool_header_t* spool_header_(spool_file_t* sf)
+{
+    return (spool_header_t*) sf->map;
+}
+
+/** @brief Returns the path of the spool file of given destination. Names
+ *  are sanitized, so they can't leave the spool directory.
+**/
+static std::string spool_path_(server_t* server, const std::string& destination)
+{
+    std::string name;
+    for(size_t i = 0; i < destination.size(); ++i)
+    {
+        char c = destination[i];
+        name += (isalnum((unsigned char) c) || c == '-' || c == '_') ? c : '_';
+    }
+
+    return server->args.spooldir + "/" + server->name + "/" + name + ".spool";
+}
+
+/** @brief Maps given size of the spool file, growing the file if needed.
+**/
+static bool spool_map_(spool_file_t* sf, size_t capacity)
+{
+    if(sf->map)
+        munmap(sf->map, sf->capacity);
+    sf->map = nullptr;
+
+    if(ftruncate(sf->fd, capacity) != 0)
+        return false;
+
+    void* map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, sf->fd, 0);
+    if(map == MAP_FAILED)
+        return false;
+
+    sf->map      = (data_t*) map;
+    sf->capacity = capacity;
+    return true;
+}
+
+/** @brief Returns the spool file of given destination, opening it if
+ *  needed.
+ *  @note spool_mutex must be locked.
+ *
+ *  @param create : If false, returns null when there is no spool file.
+**/
+static spool_file_t* spool_open_(server_t* server, const std::string& destination, bool create)
+{
+    std::map<std::string, spool_file_t*>::iterator it = server->_spools.find(destination);
+    if(it != server->_spools.end())
+        return it->second;
+
+    std::string path = spool_path_(server, destination);
+    if(create)
+    {
+        mkdir(server->args.spooldir.c_str(), 0700);
+        mkdir((server->args.spooldir + "/" + server->name).c_str(), 0700);
+    }
+
+    int fd = open(path.c_str(), create ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+    if(fd < 0)
+        return nullptr;
+
+    struct stat st;
+    fstat(fd, &st);
+
+    spool_file_t* sf = new spool_file_t;
+    sf->fd       = fd;
+    sf->map      = nullptr;
+    sf->capacity = 0;
+    sf->draining = false;
+
+    size_t capacity = st.st_size >= (off_t) sizeof(spool_header_t) ? (size_t) st.st_size : SPOOL_SEGMENT;
+    if(!spool_map_(sf, capacity))
+    {
+        cout << "[Spool] Can't map spool file '" << path << "'." << endl;
+        close(fd);
+        delete sf;
+        return nullptr;
+    }
+
+    // A new or damaged file starts empty.
+    spool_header_t* header = spool_header_(sf);
+    if(memcmp(header->magic, SPOOL_MAGIC, 8) != 0 || header->head < sizeof(spool_header_t) ||
+       header->head > header->tail || header->tail > sf->capacity)
+    {
+        memcpy(header->magic, SPOOL_MAGIC, 8);
+        header->head = sizeof(spool_header_t);
+        header->tail = sizeof(spool_header_t);
+    }
+
+    server->_spools[destination] = sf;
+    return sf;
+}
+
+/** @brief Makes room for given size at the tail : the delivered records
+ *  are dropped first, then the file grows. While a thread drains the file,
+ *  the records keep their offsets and the file only grows.
+ *  @note spool_mutex must be locked.
+**/
+static bool spool_reserve_(spool_file_t* sf, size_t size)
+{
+    spool_header_t* header = spool_header_(sf);
+    if(header->tail + size <= sf->capacity)
+        return true;
+
+    if(header->head > sizeof(spool_header_t) && !sf->draining)
+    {
+        size_t used = header->tail - header->head;
+        memmove(sf->map + sizeof(spool_header_t), sf->map + header->head, used);
+        header->head = sizeof(spool_header_t);
+        header->tail = sizeof(spool_header_t) + used;
+        if(header->tail + size <= sf->capacity)
+            return true;
+    }
+
+    size_t capacity = ((header->tail + size) / SPOOL_SEGMENT + 1) * SPOOL_SEGMENT;
+    return spool_map_(sf, capacity);
+}
+
+/** @brief Drops the expired records at the head. Nothing is dropped while
+ *  a thread drains the file : it moves the head itself, over the expired
+ *  records too.
+ *  @note spool_mutex must be locked.
+**/
+static void spool_purge_(spool_file_t* sf, int64_t now)
+{
+    spool_header_t* header = spool_header_(sf);
+    while(!sf->draining && header->head < header->tail)
+    {
+        const spool_record_t* record = (const spool_record_t*) (sf->map + header->head);
+        if(record->expires > now)
+            break;
+        header->head += sizeof(spool_record_t) + record->size;
+    }
+}
+
+/** @brief Called when every record has been delivered : the file is
+ *  shrinked back to one segment.
+ *  @note spool_mutex must be locked.
+**/
+static void spool_reset_(spool_file_t* sf)
+{
+    spool_header_t* header = spool_header_(sf);
+    header->head = sizeof(spool_header_t);
+    header->tail = sizeof(spool_header_t);
+
+    if(sf->capacity > SPOOL_SEGMENT)
+        spool_map_(sf, SPOOL_SEGMENT);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Keeps a message or a file for a peer which is not
+ *  connected.
+ *
+ *  The record is appended to the spool file of the peer, which
+ *  is mapped in memory : this never waits for the peer. It is
+ *  sent when the peer connects again, and dropped after
+ *  server.args.spoolttl seconds.
+ *
+ *  @param destination : Name of the peer server.
+ *  @param kind : SPOOL_MESSAGE or SPOOL_FILE.
+ *  @param data : The message, or the path of the file.
+ *
+ *  @return
+ *  - GERROR_NONE on success.
+ *  - GERROR_BADARGS if an argument is invalid, or the spool is
+ *  disabled.
+ *  - GERROR_BUFSIZEEXCEEDED if the quota of the peer is reached.
+ *  - GERROR_IO_CANTWRITE if the spool file can't be written.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_spool(server_t* server, const std::string& destination, uint8_t kind, const void* data, size_t sz)
+{
+    if(!server || destination.empty() || !data || server->args.spoolquota <= 0 ||
+       (kind != SPOOL_MESSAGE && kind != SPOOL_FILE) || sizeof(spool_record_t) + sz > SPOOL_BATCHSIZE)
+        return GERROR_BADARGS;
+
+    int64_t now  = (int64_t) time(NULL);
+    size_t  size = sizeof(spool_record_t) + sz;
+
+    gthread_mutex_lock(&spool_mutex);
+
+    spool_file_t* sf = spool_open_(server, destination, true);
+    if(!sf)
+    {
+        gthread_mutex_unlock(&spool_mutex);
+        return GERROR_IO_CANTWRITE;
+    }
+
+    spool_header_t* header = spool_header_(sf);
+    size_t          quota  = (size_t) server->args.spoolquota * 1024;
+    if(header->tail - header->head + size > quota)
+    {
+        spool_purge_(sf, now);
+        if(header->tail - header->head + size > quota)
+        {
+            gthread_mutex_unlock(&spool_mutex);
+            return GERROR_BUFSIZEEXCEEDED;
+        }
+    }
+
+    if(!spool_reserve_(sf, size))
+    {
+        gthread_mutex_unlock(&spool_mutex);
+        return GERROR_IO_CANTWRITE;
+    }
+
+    // The mapping may have moved.
+    header = spool_header_(sf);
+
+    spool_record_t record;
+    memset(&record, 0, sizeof(spool_record_t));
+    record.size    = (uint32_t) sz;
+    record.kind    = kind;
+    record.expires = now + server->args.spoolttl;
+
+    memcpy(sf->map + header->tail, &record, sizeof(spool_record_t));
+    memcpy(sf->map + header->tail + sizeof(spool_record_t), data, sz);
+    header->tail += size;
+
+    msync(sf->map, sf->capacity, MS_ASYNC);
+    gthread_mutex_unlock(&spool_mutex);
+
+#ifdef GULTRA_DEBUG
+    cout << "[Spool] Spooled " << sz << " bytes for '" << destination << "'." << endl;
+#endif // GULTRA_DEBUG
+
+    return GERROR_NONE;
+}
+
+/** @brief Sends a batch of count records to the peer, and waits for its
+ *  answer. The records are crypted as server_send_sequenced() does.
+**/
+static gerror_t spool_send_batch_(server_t* server, const std::string& destination, const data_t* records, uint32_t count, uint32_t size)
+{
+    uint32_t id = server_find_client_id(server, destination);
+    if(id == ID_CLIENT_INVALID)
+        return GERROR_CANT_SEND_PACKET;
+
+    spool_batch_t* batch       = new spool_batch_t;
+    uint8_t        crypted     = 0;
+    uint32_t       payloadsize = 0;
+    memset(batch, 0, sizeof(spool_batch_t));
+
+    gerror_t err = server_replay_crypt(server, records, size, batch->payload, crypted, payloadsize);
+    if(err == GERROR_NONE)
+    {
+        batch->count       = serialize<uint32_t>(count);
+        batch->size        = serialize<uint32_t>(size);
+        batch->crypted     = crypted;
+        batch->payloadsize = serialize<uint32_t>(payloadsize);
+
+        broadcast_t* broadcast = nullptr;
+        err = broadcast_send(server, PT_SPOOL_BATCH, batch, sizeof(spool_batch_t), broadcast, broadcast_filter_id, &id);
+        if(err == GERROR_NONE)
+        {
+            err = broadcast->peers.empty() ? GERROR_CANT_SEND_PACKET : broadcast_wait(broadcast, BROADCAST_TIMEOUT);
+            broadcast_destroy(broadcast);
+        }
+    }
+    delete batch;
+
+#ifdef GULTRA_DEBUG
+    cout << "[Spool] Sent batch of " << count << " messages to '" << destination << "' : " << gerror_to_string(err) << endl;
+#endif // GULTRA_DEBUG
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends what has been spooled for given peer, if it is
+ *  connected.
+ *
+ *  Messages are sent in batches of up to SPOOL_BATCHSIZE bytes,
+ *  and files in their order. Records are only dropped from the
+ *  spool once the peer received them : if the peer disconnects,
+ *  the rest is sent at the next connection.
+ *
+ *  @return
+ *  - GERROR_NONE if everything has been sent, or if there was
+ *  nothing to send.
+ *  - GERROR_BADARGS if server is null.
+ *  - GERROR_CANT_SEND_PACKET, or errors of broadcast_wait() and
+ *  client_send_file(), if the peer did not receive something.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_spool_flush(server_t* server, const std::string& destination)
+{
+    if(!server)
+        return GERROR_BADARGS;
+
+    gthread_mutex_lock(&spool_mutex);
+    spool_file_t* sf = spool_open_(server, destination, false);
+    if(!sf || sf->draining || spool_header_(sf)->head == spool_header_(sf)->tail)
+    {
+        gthread_mutex_unlock(&spool_mutex);
+        return GERROR_NONE;
+    }
+    sf->draining = true;
+    gthread_mutex_unlock(&spool_mutex);
+
+    data_t*  records   = new data_t[SPOOL_BATCHSIZE];
+    gerror_t err       = GERROR_NONE;
+    uint32_t delivered = 0;
+
+    while(err == GERROR_NONE)
+    {
+        // The records are copied, so the peer is not waited for with the mutex locked.
+        // Only this thread moves the head meanwhile (see spool_reserve_() and
+        // spool_purge_()), so next stays the offset of the first record not sent.
+        std::string file;
+        uint64_t    next  = 0;
+        int64_t     now   = (int64_t) time(NULL);
+        uint32_t    count = 0;
+        uint32_t    used  = 0; // Size of the records copied.
+
+        gthread_mutex_lock(&spool_mutex);
+        spool_header_t* header = spool_header_(sf);
+        next = header->head;
+        while(next < header->tail)
+        {
+            const spool_record_t* record = (const spool_record_t*) (sf->map + next);
+            size_t                size   = sizeof(spool_record_t) + record->size;
+            const char*           data   = (const char*) record + sizeof(spool_record_t);
+
+            if(record->expires <= now)
+            {
+                next += size;
+                continue;
+            }
+
+            if(record->kind == SPOOL_FILE)
+            {
+                // Files are sent alone, after the messages spooled before them.
+                if(count == 0)
+                {
+                    file.assign(data, strnlen(data, record->size));
+                    next += size;
+                }
+                break;
+            }
+
+            if(used + size > SPOOL_BATCHSIZE)
+                break;
+
+            spool_record_t wire = *record;
+            wire.size = serialize<uint32_t>(record->size);
+            memcpy(records + used, &wire, sizeof(spool_record_t));
+            memcpy(records + used + sizeof(spool_record_t), data, record->size);
+            used += (uint32_t) size;
+            count++;
+            next += size;
+        }
+        bool empty = next == header->head;
+        gthread_mutex_unlock(&spool_mutex);
+
+        if(empty)
+            break;
+
+        if(count > 0)
+        {
+            err = spool_send_batch_(server, destination, records, count, used);
+        }
+        else if(!file.empty())
+        {
+            client_t* client = server_find_client_id(server, destination) != ID_CLIENT_INVALID ? server_find_client_by_name(server, destination) : nullptr;
+            err = client ? client_send_file(client, file.c_str()) : GERROR_CANT_SEND_PACKET;
+            count = 1;
+        }
+
+        if(err != GERROR_NONE)
+            break;
+
+        // Delivered : the head moves over the sent and expired records.
+        gthread_mutex_lock(&spool_mutex);
+        header = spool_header_(sf);
+        header->head = next;
+        if(header->head == header->tail)
+            spool_reset_(sf);
+        gthread_mutex_unlock(&spool_mutex);
+
+        delivered += count;
+    }
+
+    delete[] records;
+
+    gthread_mutex_lock(&spool_mutex);
+    sf->draining = false;
+    msync(sf->map, sf->capacity, MS_ASYNC);
+    gthread_mutex_unlock(&spool_mutex);
+
+    if(delivered > 0)
+    {
+        cout << "[Spool] Delivered " << delivered << " spooled messages and files to '" << destination << "'." << endl;
+    }
+    if(err != GERROR_NONE)
+    {
+        cout << "[Spool] Can't deliver spooled messages to '" << destination << "' (" << gerror_to_string(err) << ")." << endl;
+    }
+
+    return err;
+}
+
+typedef struct spool_flush_t
+{
+    server_t*   server;
+    std::string destination;
+} spool_flush_t;
+
+void* server_spool_flush_loop(void* data)
+{
+    spool_flush_t* flush = (spool_flush_t*) data;
+    server_spool_flush(flush->server, flush->destination);
+    delete flush;
+    return nullptr;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends what has been spooled for given peer in its own
+ *  thread. It is called when a client is established.
+**/
+////////////////////////////////////////////////////////////
+void server_spool_flush_async(server_t* server, const std::string& destination)
+{
+    if(server->args.spoolquota <= 0 || server_spooled(server, destination) == 0)
+        return;
+
+    spool_flush_t* flush = new spool_flush_t;
+    flush->server      = server;
+    flush->destination = destination;
+
+    pthread_t thread;
+    if(pthread_create(&thread, nullptr, server_spool_flush_loop, flush) != 0)
+    {
+        cout << "[Spool] Can't create thread to deliver spooled messages." << endl;
+        delete flush;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the size of the records spooled for given
+ *  peer, and not delivered yet.
+**/
+////////////////////////////////////////////////////////////
+size_t server_spooled(server_t* server, const std::string& destination)
+{
+    if(!server || server->args.spoolquota <= 0)
+        return 0;
+
+    gthread_mutex_lock(&spool_mutex);
+    spool_file_t* sf  = spool_open_(server, destination, false);
+    size_t        ret = sf ? (size_t) (spool_header_(sf)->tail - spool_header_(sf)->head) : 0;
+    gthread_mutex_unlock(&spool_mutex);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_SPOOL_BATCH received from given client,
+ *  delivering every message as a PT_CLIENT_MESSAGE.
+**/
+////////////////////////////////////////////////////////////
+void server_spool_receive(server_t* server, client_t* client, const spool_batch_t& batch)
+{
+    data_t*  records = new data_t[SPOOL_BATCHSIZE];
+    gerror_t err     = server_replay_decrypt(client, batch.crypted, batch.payload, batch.payloadsize, batch.size, records);
+    if(err != GERROR_NONE)
+    {
+        cout << "[Spool]{" << client->name << "} Can't read spooled messages (" << gerror_to_string(err) << ")." << endl;
+        delete[] records;
+        return;
+    }
+
+    size_t offset = 0;
+    for(uint32_t i = 0; i < batch.count && offset + sizeof(spool_record_t) <= batch.size; ++i)
+    {
+        spool_record_t record;
+        memcpy(&record, records + offset, sizeof(spool_record_t));
+        record.size = deserialize<uint32_t>(record.size);
+
+        const char* data = (const char*) records + offset + sizeof(spool_record_t);
+        offset += sizeof(spool_record_t) + record.size;
+        if(offset > batch.size)
+            break;
+
+        if(record.kind != SPOOL_MESSAGE)
+            continue;
+
+        std::string message(data, strnlen(data, record.size));
+        cout << "[Server]{" << client->name << "} " << message << endl;
+
+        ServerMessageReceivedEvent* e = new ServerMessageReceivedEvent;
+        e->type    = "ServerMessageReceivedEvent";
+        e->parent  = server;
+        e->client  = client;
+        e->origin  = client->name;
+        e->message = message;
+        server->sendEvent(e);
+        delete e;
+    }
+
+    delete[] records;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Closes the spool files of given server. It is called
+ *  by server_destroy().
+**/
+////////////////////////////////////////////////////////////
+void server_spool_close(server_t* server)
+{
+    gthread_mutex_lock(&spool_mutex);
+    for(std::map<std::string, spool_file_t*>::iterator it = server->_spools.begin(); it != server->_spools.end(); ++it)
+    {
+        spool_file_t* sf = it->second;
+        msync(sf->map, sf->capacity, MS_SYNC);
+        munmap(sf->map, sf->capacity);
+        close(sf->fd);
+        delete sf;
+    }
+    server->_spools.clear();
+    gthread_mutex_unlock(&spool_mutex);
+}
+
+GEND_DECL
@@ -0,0 +1,578 @@
+/*
+ File        : server_supervisor.cpp
+ Description : Keeps the supervised peers connected, reconnecting them with
+               an exponential backoff and a circuit breaker.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "serverlistener.h"
+
+GBEGIN_DECL
+
+class SupervisorListener;
+
+/** @brief Private state of the supervisor.
+ *  Every fields are protected by the mutex.
+**/
+typedef struct supervisor_t
+{
+    server_t*                      server;
+    std::vector<supervised_peer_t> peers;
+
+    pthread_mutex_t                mutex;
+    pthread_cond_t                 cond;     // Signaled to wake up the supervisor before the next tick.
+    pthread_t                      thread;
+    bool                           started;
+    bool                           muststop;
+    unsigned int                   seed;     // Seed used to add jitter to the delays.
+    uint32_t                       running;  // Connection attempts still running.
+    SupervisorListener*            listener;
+} supervisor_t;
+
+/** @brief Protects the creation of the supervisor state of every servers.
+**/
+static pthread_mutex_t supervisor_alloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct supervisor_attempt_t
+{
+    supervisor_t* supervisor;
+    std::string   ip;
+    uint16_t      port;
+} supervisor_attempt_t;
+
+/** @brief Returns the supervisor state of given server, creating it if
+ *  needed. The supervisor is not started.
+**/
+static supervisor_t* supervisor_of_(server_t* server)
+{
+    gthread_mutex_lock(&supervisor_alloc_mutex);
+    if(!server->_supervisor)
+    {
+        supervisor_t* sv = new supervisor_t;
+        sv->server   = server;
+        sv->mutex    = PTHREAD_MUTEX_INITIALIZER;
+        sv->cond     = PTHREAD_COND_INITIALIZER;
+        sv->thread   = 0;
+        sv->started  = false;
+        sv->muststop = false;
+        sv->seed     = (unsigned int) (time(NULL) ^ server->port);
+        sv->running  = 0;
+        sv->listener = nullptr;
+        server->_supervisor = sv;
+    }
+    gthread_mutex_unlock(&supervisor_alloc_mutex);
+
+    return server->_supervisor;
+}
+
+/** @brief Find the index of given peer in the supervised list, or -1.
+ *  @note The supervisor mutex must be locked.
+**/
+static int supervisor_find_peer_(supervisor_t* sv, const std::string& ip, uint16_t port)
+{
+    for(unsigned int i = 0; i < sv->peers.size(); ++i)
+    {
+        if(sv->peers[i].ip == ip && sv->peers[i].port == port)
+            return (int) i;
+    }
+
+    return -1;
+}
+
+/** @brief Returns a delay between delay/2 and delay, so peers failing at the
+ *  same time do not all retry at the same time.
+ *  @note The supervisor mutex must be locked.
+**/
+static long supervisor_jitter_(supervisor_t* sv, long delay)
+{
+    long half = delay / 2;
+    if(half <= 0)
+        return delay;
+    return half + (long) (rand_r(&sv->seed) % (half + 1));
+}
+
+/** @brief Computes the delay before the next attempt, after given number of
+ *  consecutive failures.
+**/
+static long supervisor_backoff_(supervisor_t* sv, uint32_t failures)
+{
+    long delay = SUPERVISOR_BACKOFF_MIN;
+    for(uint32_t i = 1; i < failures && delay < SUPERVISOR_BACKOFF_MAX; ++i)
+        delay *= 2;
+
+    if(delay > SUPERVISOR_BACKOFF_MAX)
+        delay = SUPERVISOR_BACKOFF_MAX;
+    return supervisor_jitter_(sv, delay);
+}
+
+/** @brief Resolves given adress to a dotted IPv4 adress, as used by
+ *  server_client_exist().
+**/
+static bool supervisor_resolve_(const std::string& adress, std::string& out)
+{
+    struct addrinfo  hints;
+    struct addrinfo* result = nullptr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(adress.c_str(), nullptr, &hints, &result) != 0 || !result)
+        return false;
+
+    char buf[INET_ADDRSTRLEN];
+    const SOCKADDR_IN* sin = (const SOCKADDR_IN*) result->ai_addr;
+    bool ok = inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf)) != nullptr;
+    if(ok)
+        out = buf;
+
+    freeaddrinfo(result);
+    return ok;
+}
+
+void* server_supervisor_attempt_loop(void* data)
+{
+    supervisor_attempt_t* attempt = (supervisor_attempt_t*) data;
+    supervisor_t*         sv      = attempt->supervisor;
+    server_t*             server  = sv->server;
+
+    client_t* client = nullptr;
+    bool      ok     = false;
+    if(server_init_client_connection(server, client, attempt->ip.c_str(), attempt->port) == GERROR_NONE && client)
+        ok = server_wait_establisedclient(client, 4) == GERROR_NONE;
+
+    gthread_mutex_lock(&sv->mutex);
+    {
+        int idx = supervisor_find_peer_(sv, attempt->ip, attempt->port);
+        if(idx >= 0)
+        {
+            supervised_peer_t& peer = sv->peers[idx];
+            long now = timer_monotonic_ms();
+
+            if(ok)
+            {
+                peer.state    = PS_CONNECTED;
+                peer.failures = 0;
+                gnotifiate_info("[Supervisor] Peer '%s:%i' connected.", peer.ip.c_str(), (int) peer.port);
+            }
+            else
+            {
+                peer.failures++;
+                if(peer.failures >= SUPERVISOR_CIRCUIT_THRESHOLD)
+                {
+                    // Circuit is open : we stop wasting connection timeouts on this peer
+                    // and only try it again once the cooldown has elapsed.
+                    peer.state       = PS_CIRCUITOPEN;
+                    peer.nextattempt = now + supervisor_jitter_(sv, SUPERVISOR_CIRCUIT_COOLDOWN);
+                    gnotifiate_warn("[Supervisor] Peer '%s:%i' failed %i times, circuit opened for %li seconds.",
+                                    peer.ip.c_str(), (int) peer.port, (int) peer.failures, (peer.nextattempt - now) / 1000);
+                }
+                else
+                {
+                    peer.state       = PS_BACKOFF;
+                    peer.nextattempt = now + supervisor_backoff_(sv, peer.failures);
+                    gnotifiate_warn("[Supervisor] Peer '%s:%i' unreachable, retrying in %li ms.",
+                                    peer.ip.c_str(), (int) peer.port, peer.nextattempt - now);
+                }
+            }
+        }
+
+        sv->running--;
+        pthread_cond_broadcast(&sv->cond);
+    }
+    gthread_mutex_unlock(&sv->mutex);
+
+    delete attempt;
+    return nullptr;
+}
+
+/** @brief Starts a connection attempt to given peer in its own thread.
+ *  @note The supervisor mutex must be locked.
+**/
+static void supervisor_start_attempt_(supervisor_t* sv, supervised_peer_t& peer)
+{
+    supervisor_attempt_t* attempt = new supervisor_attempt_t;
+    attempt->supervisor = sv;
+    attempt->ip         = peer.ip;
+    attempt->port       = peer.port;
+
+    peer.state = PS_CONNECTING;
+    peer.attempts++;
+
+    pthread_t thread;
+    if(pthread_create(&thread, nullptr, server_supervisor_attempt_loop, attempt) != 0)
+    {
+        gnotifiate_error("[Supervisor] Can't create connection thread.");
+        delete attempt;
+
+        peer.state       = PS_BACKOFF;
+        peer.nextattempt = timer_monotonic_ms() + supervisor_backoff_(sv, peer.failures + 1);
+        return;
+    }
+
+    sv->running++;
+    pthread_detach(thread);
+}
+
+void* server_supervisor_thread_loop(void* data)
+{
+    supervisor_t* sv     = (supervisor_t*) data;
+    server_t*     server = sv->server;
+    server_wait_status(server, SS_STARTED);
+
+    gthread_mutex_lock(&sv->mutex);
+    while(!sv->muststop)
+    {
+        // The clients are looked for without the supervisor mutex, as the server
+        // events lock it while the server mutex may be locked.
+        std::vector<supervised_peer_t> connected;
+        for(unsigned int i = 0; i < sv->peers.size(); ++i)
+        {
+            if(sv->peers[i].state == PS_CONNECTED)
+                connected.push_back(sv->peers[i]);
+        }
+        gthread_mutex_unlock(&sv->mutex);
+
+        std::vector<bool> lost(connected.size(), false);
+        gthread_mutex_lock(&server->mutex);
+        for(unsigned int i = 0; i < connected.size(); ++i)
+            lost[i] = server_client_exist(server, connected[i].ip, connected[i].port) == nullptr;
+        gthread_mutex_unlock(&server->mutex);
+
+        gthread_mutex_lock(&sv->mutex);
+        long now = timer_monotonic_ms();
+
+        // The client loop destroys the client when the connection is lost, so
+        // a connected peer without client has to be reconnected.
+        for(unsigned int i = 0; i < connected.size(); ++i)
+        {
+            int idx = lost[i] ? supervisor_find_peer_(sv, connected[i].ip, connected[i].port) : -1;
+            if(idx >= 0 && sv->peers[idx].state == PS_CONNECTED)
+            {
+                supervised_peer_t& peer = sv->peers[idx];
+                peer.state       = PS_BACKOFF;
+                peer.failures    = 0;
+                peer.nextattempt = now + supervisor_jitter_(sv, SUPERVISOR_BACKOFF_MIN);
+                gnotifiate_warn("[Supervisor] Lost connection to peer '%s:%i'.", peer.ip.c_str(), (int) peer.port);
+            }
+        }
+
+        for(unsigned int i = 0; i < sv->peers.size(); ++i)
+        {
+            supervised_peer_t& peer = sv->peers[i];
+
+            if(peer.state == PS_IDLE)
+            {
+                supervisor_start_attempt_(sv, peer);
+            }
+            else if((peer.state == PS_BACKOFF || peer.state == PS_CIRCUITOPEN) && now >= peer.nextattempt)
+            {
+#ifdef GULTRA_DEBUG
+                if(peer.state == PS_CIRCUITOPEN)
+                    gnotifiate_info("[Supervisor] Trying peer '%s:%i' with open circuit.", peer.ip.c_str(), (int) peer.port);
+#endif // GULTRA_DEBUG
+                supervisor_start_attempt_(sv, peer);
+            }
+        }
+
+        struct timeval  now_tv;
+        struct timespec deadline;
+        gettimeofday(&now_tv, NULL);
+        deadline.tv_sec   = now_tv.tv_sec;
+        deadline.tv_nsec  = now_tv.tv_usec * 1000L + SUPERVISOR_TICK * 1000000L;
+        deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec  = deadline.tv_nsec % 1000000000L;
+        pthread_cond_timedwait(&sv->cond, &sv->mutex, &deadline);
+    }
+    gthread_mutex_unlock(&sv->mutex);
+
+    return nullptr;
+}
+
+/** @brief Listens to the server to react immediatly to clients closing.
+**/
+class SupervisorListener : public ServerListener
+{
+public:
+
+    void onClientClosing(const ServerClientClosingEvent* e)
+    {
+        // The client is closed on purpose (closeclient command), so we stop
+        // supervising it.
+        if(e->client && e->client->mirror)
+        {
+            server_unsupervise(reinterpret_cast<server_t*>(e->parent),
+                               inet_ntoa(e->client->address.sin_addr),
+                               ntohs(e->client->mirror->address.sin_port));
+        }
+    }
+
+    void onClientClosed(const ServerClientClosedEvent* e)
+    {
+        // Wake up the supervisor so it notices the lost peer now.
+        supervisor_t* sv = reinterpret_cast<server_t*>(e->parent)->_supervisor;
+        if(sv)
+            pthread_cond_signal(&sv->cond);
+    }
+
+    void onServerWillStop(const ServerWillStopEvent* e)
+    {
+        server_supervisor_stop(reinterpret_cast<server_t*>(e->parent));
+    }
+};
+
+////////////////////////////////////////////////////////////
+/** @brief Starts the supervisor thread.
+ *
+ *  The supervisor keeps every supervised peer connected. When
+ *  a connection is lost or can't be opened, the peer is tried
+ *  again after an exponential, jittered delay. After
+ *  SUPERVISOR_CIRCUIT_THRESHOLD consecutive failures, the peer
+ *  circuit is opened and the peer is only tried once every
+ *  SUPERVISOR_CIRCUIT_COOLDOWN.
+ *
+ *  @return
+ *  - GERROR_NONE            : Supervisor is started.
+ *  - GERROR_BADARGS         : server is null.
+ *  - GERROR_THREAD_CREATION : The supervisor thread can't be created.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_supervisor_start(server_t* server)
+{
+    if(!server)
+        return GERROR_BADARGS;
+
+    supervisor_t* sv = supervisor_of_(server);
+    gthread_mutex_lock(&sv->mutex);
+    if(sv->started)
+    {
+        gthread_mutex_unlock(&sv->mutex);
+        return GERROR_NONE;
+    }
+
+    sv->muststop = false;
+
+    if(pthread_create(&sv->thread, nullptr, server_supervisor_thread_loop, sv) != 0)
+    {
+        gthread_mutex_unlock(&sv->mutex);
+        gnotifiate_error("[Supervisor] Can't create supervisor thread.");
+        return GERROR_THREAD_CREATION;
+    }
+
+    sv->started = true;
+    if(!sv->listener)
+    {
+        sv->listener = new SupervisorListener;
+        server->addListener(sv->listener);
+    }
+    gthread_mutex_unlock(&sv->mutex);
+
+    gnotifiate_info("[Supervisor] Started.");
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Stops the supervisor thread. Supervised peers are
+ *  kept, but not reconnected anymore.
+ *
+ *  @return
+ *  - GERROR_NONE    : Supervisor is stopped.
+ *  - GERROR_BADARGS : server is null.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_supervisor_stop(server_t* server)
+{
+    if(!server)
+        return GERROR_BADARGS;
+
+    supervisor_t* sv = server->_supervisor;
+    if(!sv)
+        return GERROR_NONE;
+
+    gthread_mutex_lock(&sv->mutex);
+    if(!sv->started)
+    {
+        gthread_mutex_unlock(&sv->mutex);
+        return GERROR_NONE;
+    }
+
+    sv->muststop = true;
+    sv->started  = false;
+    pthread_cond_signal(&sv->cond);
+    gthread_mutex_unlock(&sv->mutex);
+
+    // The listener stays registered : we may be called from its onServerWillStop()
+    // handler, while the server iterates over its listeners.
+    pthread_join(sv->thread, nullptr);
+
+    gnotifiate_info("[Supervisor] Stopped.");
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Adds given peer to the supervised peers. If the
+ *  peer is already supervised, its circuit is closed and it is
+ *  tried again immediatly.
+ *
+ *  @param server : The server to use.
+ *  @param adress : Adress of the peer server.
+ *  @param port   : Port of the peer server.
+ *
+ *  @return
+ *  - GERROR_NONE         : Peer is supervised.
+ *  - GERROR_BADARGS      : server is null or port is 0.
+ *  - GERROR_INVALID_HOST : adress can't be resolved.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_supervise(server_t* server, const std::string& adress, uint16_t port)
+{
+    if(!server || port == 0)
+        return GERROR_BADARGS;
+
+    std::string ip;
+    if(!supervisor_resolve_(adress, ip))
+        return GERROR_INVALID_HOST;
+
+    supervisor_t* sv = supervisor_of_(server);
+    gthread_mutex_lock(&sv->mutex);
+    {
+        int idx = supervisor_find_peer_(sv, ip, port);
+        if(idx < 0)
+        {
+            supervised_peer_t peer;
+            peer.ip          = ip;
+            peer.port        = port;
+            peer.state       = PS_IDLE;
+            peer.failures    = 0;
+            peer.attempts    = 0;
+            peer.nextattempt = 0;
+            sv->peers.push_back(peer);
+        }
+        else if(sv->peers[idx].state == PS_BACKOFF || sv->peers[idx].state == PS_CIRCUITOPEN)
+        {
+            sv->peers[idx].state    = PS_IDLE;
+            sv->peers[idx].failures = 0;
+        }
+
+        pthread_cond_signal(&sv->cond);
+    }
+    gthread_mutex_unlock(&sv->mutex);
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Removes given peer from the supervised peers. The
+ *  connection, if any, is not closed.
+ *
+ *  @return
+ *  - GERROR_NONE         : Peer is not supervised anymore.
+ *  - GERROR_BADARGS      : server is null.
+ *  - GERROR_INVALID_HOST : adress can't be resolved.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_unsupervise(server_t* server, const std::string& adress, uint16_t port)
+{
+    if(!server)
+        return GERROR_BADARGS;
+
+    supervisor_t* sv = server->_supervisor;
+    if(!sv)
+        return GERROR_NONE;
+
+    std::string ip;
+    if(!supervisor_resolve_(adress, ip))
+        return GERROR_INVALID_HOST;
+
+    gthread_mutex_lock(&sv->mutex);
+    {
+        int idx = supervisor_find_peer_(sv, ip, port);
+        if(idx >= 0)
+            sv->peers.erase(sv->peers.begin() + idx);
+    }
+    gthread_mutex_unlock(&sv->mutex);
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns a copy of the supervised peers list.
+**/
+////////////////////////////////////////////////////////////
+std::vector<supervised_peer_t> server_supervised_peers(server_t* server)
+{
+    std::vector<supervised_peer_t> ret;
+    if(!server || !server->_supervisor)
+        return ret;
+
+    supervisor_t* sv = server->_supervisor;
+    gthread_mutex_lock(&sv->mutex);
+    ret = sv->peers;
+    gthread_mutex_unlock(&sv->mutex);
+
+    return ret;
+}
+
+/** @brief Stops the supervisor of given server and frees its state. Called
+ *  by server_destroy().
+**/
+void server_supervisor_destroy(server_t* server)
+{
+    supervisor_t* sv = server->_supervisor;
+    if(!sv)
+        return;
+
+    server_supervisor_stop(server);
+
+    // Connection attempts use the supervisor state until they end.
+    gthread_mutex_lock(&sv->mutex);
+    while(sv->running > 0)
+        pthread_cond_wait(&sv->cond, &sv->mutex);
+    gthread_mutex_unlock(&sv->mutex);
+
+    if(sv->listener)
+    {
+        server->removeListener(sv->listener);
+        delete sv->listener;
+    }
+
+    gthread_mutex_lock(&supervisor_alloc_mutex);
+    server->_supervisor = nullptr;
+    gthread_mutex_unlock(&supervisor_alloc_mutex);
+
+    delete sv;
+}
+
+const char* peerstate_to_string(int state)
+{
+    switch(state)
+    {
+        case PS_IDLE:        return "idle";
+        case PS_CONNECTING:  return "connecting";
+        case PS_CONNECTED:   return "connected";
+        case PS_BACKOFF:     return "backoff";
+        case PS_CIRCUITOPEN: return "circuit-open";
+        default:             return "unknown";
+    }
+}
+
+GEND_DECL
@@ -0,0 +1,1709 @@
+/*
+ File        : server_transfer.cpp
+ Description : Sends files in chunks the receiver records in a bitmap, so an
+               interrupted transfer goes on where it stopped.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+#include "broadcast.h"
+#include "gio.h"
+#include "crc32c.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <set>
+
+GBEGIN_DECL
+
+#define TRANSFER_MAGIC   "GTPART2" // Magic of the bitmap files.
+#define TRANSFER_PARTEXT ".gtpart" // Extension of the file being received.
+#define TRANSFER_MAPEXT  ".gtmap"  // Extension of the bitmap of the chunks received.
+#define TRANSFER_DIRECTALIGN 4096  // Alignment of the offsets, sizes and buffers written with O_DIRECT.
+#define TRANSFER_WRITEIOV    64    // Maximum number of chunks coalesced in one write.
+#define TRANSFER_READAHEAD   4     // Chunks of a range read from the disk ahead of the one sent.
+#define TRANSFER_CRCBLOCK    4096  // CRCs of chunks read at once to check a file received.
+
+/** @brief Header of a bitmap file. The bitmap follows it, then the CRC32C
+ *  of every chunk received. A bitmap is only used for the file it was made for.
+**/
+struct transfer_mapheader_t {
+    char     magic[8];
+    uint8_t  hash[HASH_SIZE];
+    uint32_t crc;
+    uint64_t length;
+    uint32_t chunksize;
+} __attribute__((packed));
+typedef struct transfer_mapheader_t transfer_mapheader_t;
+
+/** @brief A file received.
+**/
+struct transfer_in_t
+{
+    std::string          name;     // Name of the file, as offered.
+    transfer_mapheader_t header;
+    uint32_t             count;    // Number of chunks.
+    uint32_t             have;     // Number of chunks received.
+    std::vector<uint8_t> bits;     // Bitmap of the chunks received.
+    int                  fd;       // The partial file.
+    int                  directfd; // The partial file opened with O_DIRECT, or -1.
+    int                  mapfd;    // The bitmap file.
+    uint32_t             writing;  // Chunks queued to the writer, not recorded yet.
+    std::set<uint32_t>   inflight; // Chunks being received or written, not recorded yet. A copy of them is dropped.
+    Encryption::hash_t*  sha;      // SHA-256 of the partial file, up to hashed. Null while a thread adds to it.
+    uint64_t             hashed;   // Bytes of the partial file hashed, by the writer as they come in order, or read back once recorded.
+    bool                 hashing;  // True while a thread hashes the partial file, without the lock.
+    bool                 done;     // True once the file is checked and renamed. Files are closed, and the
+                                   // transfer is forgotten once no chunk of it is being written.
+};
+
+/** @brief A chunk received, waiting to be written.
+**/
+struct transfer_write_t
+{
+    uint64_t    id;
+    uint32_t    index;
+    uint64_t    offset;
+    uint32_t    size;
+    uint32_t    crc;
+    int         fd;     // Duplicate of the partial file, closed once written.
+    bool        direct; // True if fd is opened with O_DIRECT.
+    data_t*     data;
+    std::string peer;   // Name of the client which sent it.
+};
+
+/** @brief Thread writing the chunks received, so the threads receiving them
+ *  do not wait for the disk.
+**/
+struct transfer_writer_t
+{
+    pthread_t                     thread;
+    pthread_cond_t                cond;     // Signaled when chunks are queued, or written.
+    std::vector<transfer_write_t> queue;    // Chunks waiting to be written.
+    size_t                        queued;   // Bytes queued or being written.
+    size_t                        capacity; // Maximum of queued. A bigger chunk is only queued alone.
+    bool                          stop;     // True when the thread must return, once the queue is empty.
+};
+
+/** @brief Progress of a file received, given to br_callback.
+**/
+struct transfer_progress_t
+{
+    std::string name;
+    size_t      received;
+    size_t      length;
+};
+
+/** @brief A file sent, waiting for the bitmap of the receiver.
+**/
+struct transfer_out_t
+{
+    uint32_t             peer;      // ID of the client the file is sent to.
+    uint32_t             chunksize; // Size of the chunks agreed by the receiver.
+    std::vector<uint8_t> bits;      // Bitmap of the chunks the receiver has.
+    std::vector<bool>    seen;      // Pages of the bitmap received since the last offer.
+    uint32_t             pages;     // Number of pages of the bitmap, 0 until the first one is received.
+    uint32_t             received;  // Number of different pages received since the last offer.
+    bool                 complete;  // True if the receiver has the whole file.
+    gerror_t             error;     // Error the receiver refused the offer with, GERROR_NONE otherwise.
+    pthread_cond_t       cond;
+};
+
+// Protects the transfers of every server.
+static pthread_mutex_t transfer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Signaled when a thread stops hashing a file received.
+static pthread_cond_t transfer_hashcond = PTHREAD_COND_INITIALIZER;
+
+/** @brief Returns the ID of a transfer (FNV-1a). It only depends on the file
+ *  and its name, so a sender restarted offers the same transfer.
+**/
+static uint64_t transfer_id_(const transfer_offer_t& offer)
+{
+    uint64_t h = 14695981039346656037ull;
+    for(unsigned int i = 0; i < HASH_SIZE; ++i)
+        h = (h ^ offer.hash[i]) * 1099511628211ull;
+    for(const char* c = offer.name; *c; ++c)
+        h = (h ^ (uint8_t) *c) * 1099511628211ull;
+    return h;
+}
+
+/** @brief Returns the chunk size given server proposes, or accepts. It is a
+ *  multiple of TRANSFER_MINCHUNKSIZE, so the CRC of a chunk is combined from
+ *  the CRCs of its blocks (see transfer_chunk_crc_()).
+**/
+static uint32_t transfer_chunksize_(server_t* server)
+{
+    uint32_t size = (uint32_t) std::max(TRANSFER_MINCHUNKSIZE, std::min(server->args.chunksize, TRANSFER_MAXCHUNKSIZE));
+    return size - size % TRANSFER_MINCHUNKSIZE;
+}
+
+/** @brief Returns the number of chunks of a file.
+**/
+static uint32_t transfer_count_(uint64_t length, uint32_t chunksize)
+{
+    return (uint32_t) ((length + chunksize - 1) / chunksize);
+}
+
+/** @brief Returns the number of pages of the bitmap of given number of chunks.
+**/
+static uint32_t transfer_pages_(uint32_t count)
+{
+    uint32_t pages = (uint32_t) (((uint64_t) count + TRANSFER_BITMAPSIZE * 8 - 1) / (TRANSFER_BITMAPSIZE * 8));
+    return pages > 0 ? pages : 1;
+}
+
+static bool transfer_has_(const std::vector<uint8_t>& bits, uint32_t index)
+{
+    return index / 8 < bits.size() && (bits[index / 8] & (1 << (index % 8)));
+}
+
+/** @brief Returns the offset of the CRC of a chunk in the bitmap file.
+**/
+static off_t transfer_crcoffset_(const transfer_in_t* in, uint32_t index)
+{
+    return (off_t) (sizeof(transfer_mapheader_t) + in->bits.size() + (uint64_t) index * sizeof(uint32_t));
+}
+
+/** @brief Writes the header and an empty bitmap to the bitmap file.
+**/
+static bool transfer_map_reset_(transfer_in_t* in)
+{
+    std::fill(in->bits.begin(), in->bits.end(), 0);
+    in->have   = 0;
+    in->hashed = 0;
+
+    return ftruncate(in->mapfd, 0) == 0 &&
+           pwrite(in->mapfd, &in->header, sizeof(transfer_mapheader_t), 0) == (ssize_t) sizeof(transfer_mapheader_t) &&
+           ftruncate(in->mapfd, transfer_crcoffset_(in, in->count)) == 0;
+}
+
+static void transfer_in_close_(transfer_in_t* in)
+{
+    if(in->fd >= 0)
+        close(in->fd);
+    if(in->directfd >= 0)
+        close(in->directfd);
+    if(in->mapfd >= 0)
+        close(in->mapfd);
+    in->fd       = -1;
+    in->directfd = -1;
+    in->mapfd    = -1;
+
+    Encryption::hash_destroy(in->sha);
+    in->sha = nullptr;
+}
+
+/** @brief Opens the partial file of an offer, and loads its bitmap if it was
+ *  made for the same file. Returns null if the files can't be opened.
+ *
+ *  The chunk size is the one of the bitmap, so a transfer goes on with the
+ *  chunks it started with. Otherwise it is the smallest of the proposed one
+ *  and maxchunksize. Offers of chunks which are not a multiple of
+ *  TRANSFER_MINCHUNKSIZE are refused when they are read (see
+ *  packet_interpret()).
+ *
+ *  The partial file is allocated at its full size, unless the file of the
+ *  sender is sparse. If directio is true, it is also opened with O_DIRECT
+ *  for the aligned chunks.
+**/
+static transfer_in_t* transfer_open_(const transfer_offer_t& offer, uint32_t maxchunksize, bool directio)
+{
+    transfer_in_t* in = new transfer_in_t;
+    in->name     = offer.name;
+    in->have     = 0;
+    in->writing  = 0;
+    in->done     = false;
+    in->directfd = -1;
+    in->sha      = Encryption::hash_create();
+    in->hashed   = 0;
+    in->hashing  = false;
+
+    memset(&in->header, 0, sizeof(transfer_mapheader_t));
+    memcpy(in->header.magic, TRANSFER_MAGIC, sizeof(TRANSFER_MAGIC));
+    memcpy(in->header.hash, offer.hash, HASH_SIZE);
+    in->header.crc       = offer.crc;
+    in->header.length    = offer.length;
+    in->header.chunksize = std::min(offer.chunksize, maxchunksize);
+
+    in->fd    = open((in->name + TRANSFER_PARTEXT).c_str(), O_RDWR | O_CREAT, 0644);
+    in->mapfd = open((in->name + TRANSFER_MAPEXT).c_str(),  O_RDWR | O_CREAT, 0644);
+    bool sized = offer.sparse ? ftruncate(in->fd, (off_t) offer.length) == 0 : gio_allocate(in->fd, offer.length) == GERROR_NONE;
+    if(in->fd < 0 || in->mapfd < 0 || !sized || !in->sha)
+    {
+        transfer_in_close_(in);
+        delete in;
+        return nullptr;
+    }
+
+#ifdef O_DIRECT
+    if(directio)
+        in->directfd = open((in->name + TRANSFER_PARTEXT).c_str(), O_WRONLY | O_DIRECT);
+#endif // O_DIRECT
+
+    transfer_mapheader_t header;
+    bool same = pread(in->mapfd, &header, sizeof(transfer_mapheader_t), 0) == (ssize_t) sizeof(transfer_mapheader_t) &&
+                memcmp(&header, &in->header, offsetof(transfer_mapheader_t, chunksize)) == 0 &&
+                header.chunksize >= TRANSFER_MINCHUNKSIZE && header.chunksize <= TRANSFER_MAXCHUNKSIZE &&
+                header.chunksize % TRANSFER_MINCHUNKSIZE == 0;
+    if(same)
+        in->header.chunksize = header.chunksize;
+
+    // Chunks are indexed on 32 bits.
+    if((offer.length + in->header.chunksize - 1) / in->header.chunksize > UINT32_MAX)
+    {
+        transfer_in_close_(in);
+        delete in;
+        return nullptr;
+    }
+
+    in->count = transfer_count_(offer.length, in->header.chunksize);
+    in->bits.assign((in->count + 7) / 8, 0);
+
+    if(same && pread(in->mapfd, in->bits.data(), in->bits.size(), sizeof(transfer_mapheader_t)) == (ssize_t) in->bits.size())
+    {
+        for(uint32_t i = 0; i < in->count; ++i)
+            in->have += transfer_has_(in->bits, i) ? 1 : 0;
+        return in;
+    }
+
+    if(!transfer_map_reset_(in))
+    {
+        transfer_in_close_(in);
+        delete in;
+        return nullptr;
+    }
+    return in;
+}
+
+/** @brief Computes the CRC of a file from the CRCs of its chunks, so the
+ *  file is not read again. Returns false if they can't be read.
+**/
+static bool transfer_crc_(const transfer_in_t* in, uint32_t& crc)
+{
+    std::vector<uint32_t> crcs(TRANSFER_CRCBLOCK);
+
+    crc = 0;
+    for(uint32_t first = 0; first < in->count; first += TRANSFER_CRCBLOCK)
+    {
+        uint32_t n   = std::min<uint32_t>(TRANSFER_CRCBLOCK, in->count - first);
+        ssize_t  len = (ssize_t) (n * sizeof(uint32_t));
+        if(pread(in->mapfd, crcs.data(), (size_t) len, transfer_crcoffset_(in, first)) != len)
+            return false;
+
+        for(uint32_t i = 0; i < n; ++i)
+        {
+            uint64_t offset = (uint64_t) (first + i) * in->header.chunksize;
+            crc = crc32c_combine(crc, crcs[i], std::min<uint64_t>(in->header.chunksize, in->header.length - offset));
+        }
+    }
+    return true;
+}
+
+/** @brief Checks the SHA-256 and the CRC of a file whose chunks are all
+ *  received and hashed, and renames it. If one is wrong, every chunks are
+ *  received again.
+ *
+ *  The SHA-256 is the one of the bytes read back from the partial file, so
+ *  it also checks what was written to the disk, and not only the chunks
+ *  received.
+ *  @note transfer_mutex must be locked.
+**/
+static void transfer_finish_(const std::string& peer, transfer_in_t* in)
+{
+    unsigned char hash[HASH_SIZE];
+    Encryption::hash_final(in->sha, hash);
+
+    uint32_t crc;
+    if(memcmp(hash, in->header.hash, HASH_SIZE) != 0 || !transfer_crc_(in, crc) || crc != in->header.crc)
+    {
+        cout << "[Transfer]{" << peer << "} File '" << in->name << "' is corrupted. Receiving it again." << endl;
+        transfer_map_reset_(in);
+        return;
+    }
+
+    if(rename((in->name + TRANSFER_PARTEXT).c_str(), in->name.c_str()) != 0)
+    {
+        // The hash is started again : the file is read again at next try.
+        in->hashed = 0;
+        cout << "[Transfer]{" << peer << "} Can't rename file '" << in->name << "'." << endl;
+        return;
+    }
+
+    transfer_in_close_(in);
+    unlink((in->name + TRANSFER_MAPEXT).c_str());
+    in->bits.clear();
+    in->done = true;
+
+    cout << "[Transfer]{" << peer << "} Received file '" << in->name << "'." << endl;
+}
+
+/** @brief Forgets a finished transfer once none of its chunks is being
+ *  written. A new offer of the file is then checked against the file
+ *  itself, by transfer_received_().
+ *  @note transfer_mutex must be locked.
+**/
+static void transfer_forget_(server_t* server, uint64_t id)
+{
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(id);
+    if(it != server->_receiving.end() && it->second->done && it->second->writing == 0)
+    {
+        delete it->second;
+        server->_receiving.erase(it);
+    }
+}
+
+/** @brief Returns true if the file of an offer has already been received :
+ *  it is there, with the length, hash and CRC offered.
+**/
+static bool transfer_received_(const transfer_offer_t& offer)
+{
+    struct stat st;
+    if(stat(offer.name, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size != offer.length)
+        return false;
+
+    int fd = open(offer.name, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    unsigned char hash[HASH_SIZE];
+    uint32_t      crc  = 0;
+    bool          same = Encryption::hash_file(fd, offer.length, hash, &crc) == GERROR_NONE &&
+                         memcmp(hash, offer.hash, HASH_SIZE) == 0 && crc == offer.crc;
+    close(fd);
+    return same;
+}
+
+/** @brief Records a chunk written to the partial file with its CRC.
+ *  Returns false if the chunk is not recorded. The file is finished by
+ *  transfer_hash_(), once every chunk is recorded.
+ *  @note transfer_mutex must be locked.
+**/
+static bool transfer_record_(server_t* server, const std::string& peer, uint64_t id, uint32_t index, uint32_t crc, transfer_progress_t& progress)
+{
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(id);
+    if(it == server->_receiving.end() || it->second->done || transfer_has_(it->second->bits, index))
+        return false;
+
+    transfer_in_t* in = it->second;
+
+    // The bit is written after the chunk and its CRC : a chunk in the bitmap is always in the file.
+    uint8_t& byte = in->bits[index / 8];
+    uint8_t  mask = (uint8_t) (1 << (index % 8));
+    byte |= mask;
+
+    if(pwrite(in->mapfd, &crc, sizeof(uint32_t), transfer_crcoffset_(in, index)) != (ssize_t) sizeof(uint32_t) ||
+       pwrite(in->mapfd, &byte, 1, (off_t) (sizeof(transfer_mapheader_t) + index / 8)) != 1)
+    {
+        byte &= (uint8_t) ~mask;
+        cout << "[Transfer]{" << peer << "} Can't write file '" << in->name << "'." << endl;
+        return false;
+    }
+
+    in->have++;
+    progress.name     = in->name;
+    progress.length   = (size_t) in->header.length;
+    progress.received = (size_t) std::min<uint64_t>((uint64_t) in->have * in->header.chunksize, in->header.length);
+    return true;
+}
+
+/** @brief Reads back and hashes the chunks of a file recorded after the
+ *  bytes already hashed, then finishes the file once every chunk is
+ *  recorded and hashed. The transfer may be forgotten on return.
+ *
+ *  The file is read without the lock. If another thread is already
+ *  hashing it, this one returns : the other thread hashes the new chunks
+ *  before it stops.
+ *  @note transfer_mutex must be locked.
+**/
+static void transfer_hash_(server_t* server, const std::string& peer, uint64_t id)
+{
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(id);
+    if(it == server->_receiving.end() || it->second->done || it->second->hashing)
+        return;
+
+    transfer_in_t* in = it->second;
+    while(true)
+    {
+        uint32_t index = (uint32_t) (in->hashed / in->header.chunksize);
+        while(index < in->count && transfer_has_(in->bits, index))
+            ++index;
+
+        uint64_t end = std::min<uint64_t>((uint64_t) index * in->header.chunksize, in->header.length);
+        if(end <= in->hashed)
+            break;
+
+        // A chunk recorded is never written again, so it can be read without the lock.
+        Encryption::hash_t* sha    = in->sha;
+        uint64_t            offset = in->hashed;
+        int                 fd     = dup(in->fd);
+        in->sha     = nullptr;
+        in->hashing = true;
+        gthread_mutex_unlock(&transfer_mutex);
+
+        bool read = fd >= 0 && Encryption::hash_update_file(sha, fd, offset, end - offset) == GERROR_NONE;
+        if(fd >= 0)
+            close(fd);
+
+        gthread_mutex_lock(&transfer_mutex);
+        pthread_cond_broadcast(&transfer_hashcond);
+
+        // The transfers may be closed meanwhile.
+        it = server->_receiving.find(id);
+        if(it == server->_receiving.end())
+        {
+            Encryption::hash_destroy(sha);
+            return;
+        }
+
+        in          = it->second;
+        in->sha     = sha;
+        in->hashing = false;
+
+        if(!read)
+        {
+            // The hash is started again, from the beginning of the file, with the next chunk recorded.
+            unsigned char hash[HASH_SIZE];
+            Encryption::hash_final(in->sha, hash);
+            in->hashed = 0;
+
+            cout << "[Transfer]{" << peer << "} Can't read file '" << in->name << "'." << endl;
+            return;
+        }
+        in->hashed = end;
+    }
+
+    if(in->have == in->count && in->hashed == in->header.length)
+    {
+        transfer_finish_(peer, in);
+        transfer_forget_(server, id);
+    }
+}
+
+/** @brief Hashes, from memory, the chunks [first, last[ of a batch written
+ *  which follow the bytes of their file already hashed. They are so not read
+ *  back from the file when they come in order ; the others are read back by
+ *  transfer_hash_(). The chunks are those of one transfer, sorted by offset.
+ *
+ *  The chunks are hashed without the lock, as transfer_hash_() does.
+ *  @note transfer_mutex must be locked.
+**/
+static void transfer_hash_written_(server_t* server, const std::vector<transfer_write_t>& batch, const std::vector<bool>& written,
+                                   size_t first, size_t last)
+{
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(batch[first].id);
+    if(it == server->_receiving.end() || it->second->done || it->second->hashing)
+        return;
+
+    transfer_in_t* in = it->second;
+    while(first < last && batch[first].offset < in->hashed)
+        ++first;
+
+    // Chunks not recorded (corrupted on the disk, or cut by a reset) stop the run.
+    uint64_t end  = in->hashed;
+    size_t   stop = first;
+    while(stop < last && written[stop] && batch[stop].offset == end && transfer_has_(in->bits, batch[stop].index))
+        end += batch[stop++].size;
+    if(stop == first)
+        return;
+
+    Encryption::hash_t* sha = in->sha;
+    uint64_t            id  = batch[first].id;
+    in->sha     = nullptr;
+    in->hashing = true;
+    gthread_mutex_unlock(&transfer_mutex);
+
+    for(size_t i = first; i < stop; ++i)
+        Encryption::hash_update(sha, batch[i].data, batch[i].size);
+
+    gthread_mutex_lock(&transfer_mutex);
+    pthread_cond_broadcast(&transfer_hashcond);
+
+    // The transfers may be closed meanwhile.
+    it = server->_receiving.find(id);
+    if(it == server->_receiving.end())
+    {
+        Encryption::hash_destroy(sha);
+        return;
+    }
+
+    in          = it->second;
+    in->sha     = sha;
+    in->hashing = false;
+    in->hashed  = end;
+}
+
+/** @brief Writes the queued chunks, sorted by transfer and offset so the
+ *  contiguous ones are written at once, then records them.
+**/
+static void* transfer_writer_loop_(void* data)
+{
+    server_t* server = reinterpret_cast<server_t*>(data);
+
+    gthread_mutex_lock(&transfer_mutex);
+    transfer_writer_t* writer = server->_writer;
+    while(true)
+    {
+        while(writer->queue.empty() && !writer->stop)
+            pthread_cond_wait(&writer->cond, &transfer_mutex);
+        if(writer->queue.empty())
+            break;
+
+        std::vector<transfer_write_t> batch;
+        batch.swap(writer->queue);
+        gthread_mutex_unlock(&transfer_mutex);
+
+        std::sort(batch.begin(), batch.end(), [](const transfer_write_t& a, const transfer_write_t& b) {
+            return a.id != b.id ? a.id < b.id : a.offset < b.offset;
+        });
+
+        std::vector<bool> written(batch.size(), false);
+        for(size_t first = 0; first < batch.size(); )
+        {
+            struct iovec iov[TRANSFER_WRITEIOV];
+            size_t       last  = first;
+            size_t       total = 0;
+            do
+            {
+                iov[last - first].iov_base = batch[last].data;
+                iov[last - first].iov_len  = batch[last].size;
+                total += batch[last].size;
+                ++last;
+            }
+            while(last < batch.size() && last - first < TRANSFER_WRITEIOV &&
+                  batch[last].id == batch[first].id && batch[last].direct == batch[first].direct &&
+                  batch[last].offset == batch[last - 1].offset + batch[last - 1].size);
+
+            bool ok = pwritev(batch[first].fd, iov, (int) (last - first), (off_t) batch[first].offset) == (ssize_t) total;
+            for(size_t i = first; i < last; ++i)
+                written[i] = ok;
+            first = last;
+        }
+
+        for(size_t i = 0; i < batch.size(); ++i)
+            close(batch[i].fd);
+
+        std::vector<transfer_progress_t> progress;
+        gthread_mutex_lock(&transfer_mutex);
+        for(size_t i = 0; i < batch.size(); ++i)
+        {
+            std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(batch[i].id);
+            if(it != server->_receiving.end())
+            {
+                it->second->writing--;
+                it->second->inflight.erase(batch[i].index);
+            }
+            transfer_forget_(server, batch[i].id);
+            writer->queued -= batch[i].size;
+
+            transfer_progress_t p;
+            if(!written[i])
+            {
+                cout << "[Transfer]{" << batch[i].peer << "} Can't write chunk " << batch[i].index << "." << endl;
+            }
+            else if(transfer_record_(server, batch[i].peer, batch[i].id, batch[i].index, batch[i].crc, p))
+            {
+                progress.push_back(p);
+            }
+        }
+        pthread_cond_broadcast(&writer->cond);
+        gthread_mutex_unlock(&transfer_mutex);
+
+        if(server->br_callback)
+        {
+            for(size_t i = 0; i < progress.size(); ++i)
+                server->br_callback(progress[i].name, progress[i].received, progress[i].length);
+        }
+
+        // The chunks written are hashed here, so the threads receiving them do not wait
+        // for it either. The batch is sorted by transfer.
+        gthread_mutex_lock(&transfer_mutex);
+        for(size_t first = 0; first < batch.size(); )
+        {
+            size_t last = first + 1;
+            while(last < batch.size() && batch[last].id == batch[first].id)
+                ++last;
+
+            transfer_hash_written_(server, batch, written, first, last);
+            transfer_hash_(server, batch[first].peer, batch[first].id);
+            first = last;
+        }
+
+        for(size_t i = 0; i < batch.size(); ++i)
+            free(batch[i].data);
+    }
+    gthread_mutex_unlock(&transfer_mutex);
+    return nullptr;
+}
+
+/** @brief Returns the writer of given server, started if needed. Returns null
+ *  if the write-behind is disabled, or the thread can't be started.
+ *  @note transfer_mutex must be locked.
+**/
+static transfer_writer_t* transfer_writer_(server_t* server)
+{
+    if(server->args.writebehind <= 0)
+        return nullptr;
+
+    if(!server->_writer)
+    {
+        transfer_writer_t* writer = new transfer_writer_t;
+        writer->queued   = 0;
+        writer->capacity = (size_t) server->args.writebehind * 1024;
+        writer->stop     = false;
+        pthread_cond_init(&writer->cond, NULL);
+
+        // The thread takes the writer once we unlock transfer_mutex.
+        server->_writer = writer;
+        if(pthread_create(&writer->thread, NULL, transfer_writer_loop_, server) != 0)
+        {
+            server->_writer = nullptr;
+            pthread_cond_destroy(&writer->cond);
+            delete writer;
+            return nullptr;
+        }
+    }
+
+    return server->_writer->stop ? nullptr : server->_writer;
+}
+
+/** @brief Receives exactly len bytes from the connection. Fails if no byte
+ *  comes for TRANSPORT_FILETIMEOUT ms.
+**/
+static bool transfer_recv_(SOCKET sock, data_t* data, size_t len)
+{
+    while(len > 0)
+    {
+        if(transport_ready(sock, TRANSPORT_FILETIMEOUT) != 1)
+            return false;
+
+        ssize_t n = transport_recv(sock, data, len);
+        if(n <= 0)
+            return false;
+        data += n;
+        len  -= (size_t) n;
+    }
+    return true;
+}
+
+/** @brief Answers an offer with a bitmap giving the error we can't receive
+ *  the file for, so the sender stops at once.
+**/
+static void transfer_refuse_(server_t* server, client_t* client, const transfer_offer_t& offer, gerror_t error)
+{
+    transfer_bitmap_t bitmap;
+    memset(&bitmap, 0, sizeof(transfer_bitmap_t));
+    bitmap.id        = transfer_id_(offer);
+    bitmap.pages     = 1;
+    bitmap.chunksize = std::min(offer.chunksize, transfer_chunksize_(server));
+    bitmap.error     = (uint32_t) error;
+
+    uint32_t peer = client->mirror->id;
+    bitmap = serialize<transfer_bitmap_t>(bitmap);
+    broadcast_forward(server, PT_TRANSFER_BITMAP, &bitmap, sizeof(transfer_bitmap_t), broadcast_filter_id, &peer);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_TRANSFER_OFFER received from given client,
+ *  answering with the bitmap of the chunks we have.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_offer(server_t* server, client_t* client, const transfer_offer_t& offer)
+{
+    if(!client->mirror)
+        return;
+
+    uint64_t id = transfer_id_(offer);
+
+    transfer_bitmap_t bitmap;
+    memset(&bitmap, 0, sizeof(transfer_bitmap_t));
+    bitmap.id = id;
+
+    std::vector<uint8_t> bits;
+
+    gthread_mutex_lock(&transfer_mutex);
+    bool known = server->_receiving.count(id) > 0;
+    gthread_mutex_unlock(&transfer_mutex);
+
+    // A file already received, and not changed since, is not received again.
+    if(!known && transfer_received_(offer))
+    {
+        bitmap.complete  = 1;
+        bitmap.chunksize = std::min(offer.chunksize, transfer_chunksize_(server));
+        bitmap.pages     = 1;
+    }
+    else
+    {
+        gthread_mutex_lock(&transfer_mutex);
+        transfer_in_t*& in = server->_receiving[id];
+        if(!in)
+        {
+            in = transfer_open_(offer, transfer_chunksize_(server), server->args.directio);
+            if(!in)
+            {
+                server->_receiving.erase(id);
+                gthread_mutex_unlock(&transfer_mutex);
+
+                cout << "[Transfer]{" << client->name << "} Can't open file '" << offer.name << "'." << endl;
+                transfer_refuse_(server, client, offer, GERROR_CANTOPENFILE);
+                return;
+            }
+
+#ifdef GULTRA_DEBUG
+            cout << "[Transfer]{" << client->name << "} Offered '" << in->name << "', " << in->have << "/" << in->count << " chunks of " << in->header.chunksize << " bytes received." << endl;
+#endif // GULTRA_DEBUG
+        }
+
+        bitmap.chunksize = in->header.chunksize;
+        bitmap.pages     = transfer_pages_(in->count);
+
+        // The chunks being written, and the file being hashed, are waited for, so the bitmap
+        // has every chunk received. The file may be finished meanwhile, and forgotten.
+        std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(id);
+        while(it != server->_receiving.end() && ((server->_writer && it->second->writing > 0) || it->second->hashing))
+        {
+            pthread_cond_wait(it->second->hashing ? &transfer_hashcond : &server->_writer->cond, &transfer_mutex);
+            it = server->_receiving.find(id);
+        }
+
+        // A file whose chunks were all received before a restart is only checked now.
+        if(it != server->_receiving.end() && !it->second->done && it->second->have == it->second->count)
+        {
+            transfer_hash_(server, client->name, id);
+            it = server->_receiving.find(id);
+        }
+
+        if(it == server->_receiving.end())
+        {
+            bitmap.complete = 1;
+        }
+        else
+        {
+            transfer_in_t* current = it->second;
+            bitmap.complete = current->done ? 1 : 0;
+            bits            = current->bits;
+            transfer_forget_(server, id);
+        }
+        gthread_mutex_unlock(&transfer_mutex);
+    }
+
+    bits.resize((size_t) bitmap.pages * TRANSFER_BITMAPSIZE, 0);
+
+    uint32_t peer = client->mirror->id;
+    for(uint32_t page = 0; page < bitmap.pages; ++page)
+    {
+        transfer_bitmap_t out = bitmap;
+        out.page = page;
+        memcpy(out.bits, &bits[(size_t) page * TRANSFER_BITMAPSIZE], TRANSFER_BITMAPSIZE);
+
+        out = serialize<transfer_bitmap_t>(out);
+        if(broadcast_forward(server, PT_TRANSFER_BITMAP, &out, sizeof(transfer_bitmap_t), broadcast_filter_id, &peer) != GERROR_NONE)
+            break;
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_TRANSFER_CHUNK received from given client.
+ *
+ *  The chunk is checked against its CRC, from memory or, when it is
+ *  received straight in the file, from the page cache. A corrupted chunk
+ *  is not recorded, so the sender sends it again at next offer.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_chunk(server_t* server, client_t* client, TransferChunkPacket* packet)
+{
+    const transfer_chunk_t& chunk = packet->data;
+
+    gthread_mutex_lock(&transfer_mutex);
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(chunk.id);
+    if(it == server->_receiving.end() || it->second->done)
+    {
+        gthread_mutex_unlock(&transfer_mutex);
+        return;
+    }
+
+    transfer_in_t* in     = it->second;
+    uint64_t       offset = (uint64_t) chunk.index * in->header.chunksize;
+    if(chunk.index >= in->count || chunk.size != std::min<uint64_t>(in->header.chunksize, in->header.length - offset))
+    {
+        gthread_mutex_unlock(&transfer_mutex);
+        cout << "[Transfer]{" << client->name << "} Invalid chunk " << chunk.index << " of file '" << in->name << "'." << endl;
+        return;
+    }
+
+    // A chunk received twice (sent again with an offer while the first copy was on its
+    // way) is only written once : a copy written over a chunk recorded could corrupt it.
+    if(transfer_has_(in->bits, chunk.index) || in->inflight.count(chunk.index))
+    {
+        gthread_mutex_unlock(&transfer_mutex);
+        return;
+    }
+
+    // With a writer, the chunk is only queued, once there is room for it.
+    transfer_writer_t* writer = transfer_writer_(server);
+    if(writer)
+    {
+        while(!writer->stop && writer->queued > 0 && writer->queued + chunk.size > writer->capacity)
+            pthread_cond_wait(&writer->cond, &transfer_mutex);
+
+        // The file may be finished while we waited.
+        if(writer->stop || in->done || transfer_has_(in->bits, chunk.index) || in->inflight.count(chunk.index))
+        {
+            gthread_mutex_unlock(&transfer_mutex);
+            return;
+        }
+
+        writer->queued += chunk.size;
+        in->writing++;
+    }
+    in->inflight.insert(chunk.index);
+
+    // The chunk is received and written without the lock, as it may come from the connection.
+    // The file may be renamed meanwhile by another client sending it, but it stays opened.
+    transfer_write_t write;
+    write.id     = chunk.id;
+    write.index  = chunk.index;
+    write.offset = offset;
+    write.size   = chunk.size;
+    write.crc    = chunk.crc;
+    write.peer   = client->name;
+    write.direct = writer && in->directfd >= 0 && offset % TRANSFER_DIRECTALIGN == 0 && chunk.size % TRANSFER_DIRECTALIGN == 0 &&
+                   (packet->pending > 0 || ((uintptr_t) packet->chunk % TRANSFER_DIRECTALIGN) == 0);
+    write.fd     = dup(write.direct ? in->directfd : in->fd);
+    write.data   = nullptr;
+    std::string name = in->name;
+    gthread_mutex_unlock(&transfer_mutex);
+
+    bool     done = false;
+    uint32_t crc  = 0;
+    if(write.fd >= 0 && writer)
+    {
+        if(packet->pending > 0)
+        {
+            if(posix_memalign((void**) &write.data, TRANSFER_DIRECTALIGN, write.size > 0 ? write.size : 1) != 0)
+                write.data = nullptr;
+            done = write.data && transfer_recv_(packet->sock, write.data, write.size);
+        }
+        else
+        {
+            // Crypted chunks are already in memory.
+            std::swap(write.data, packet->chunk);
+            done = true;
+        }
+
+        if(done)
+            crc = crc32c(0, write.data, write.size);
+    }
+    else if(write.fd >= 0)
+    {
+        if(packet->pending > 0)
+        {
+            done = transport_recvfile(packet->sock, write.fd, (off_t) offset, chunk.size) == (ssize_t) chunk.size &&
+                   crc32c_file(write.fd, offset, chunk.size, crc, true) == GERROR_NONE;
+        }
+        else
+        {
+            done = pwrite(write.fd, packet->chunk, chunk.size, (off_t) offset) == (ssize_t) chunk.size;
+            crc  = crc32c(0, packet->chunk, chunk.size);
+        }
+    }
+
+    // What is left of the chunk can't be read anymore.
+    packet->pending = 0;
+
+    // A corrupted chunk may be written, but it stays missing in the bitmap.
+    bool corrupted = done && crc != chunk.crc;
+    done           = done && !corrupted;
+
+    if(writer)
+    {
+        gthread_mutex_lock(&transfer_mutex);
+        if(done)
+        {
+            writer->queue.push_back(write);
+        }
+        else
+        {
+            std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(chunk.id);
+            if(it != server->_receiving.end())
+            {
+                it->second->writing--;
+                it->second->inflight.erase(chunk.index);
+            }
+            transfer_forget_(server, chunk.id);
+            writer->queued -= chunk.size;
+        }
+        pthread_cond_broadcast(&writer->cond);
+        gthread_mutex_unlock(&transfer_mutex);
+
+        if(done)
+            return;
+
+        if(write.fd >= 0)
+            close(write.fd);
+        free(write.data);
+    }
+    else if(write.fd >= 0)
+    {
+        close(write.fd);
+    }
+
+    // Without a writer, the chunk is recorded, and the file hashed, by this thread.
+    transfer_progress_t progress;
+    bool recorded = false;
+    if(!writer)
+    {
+        gthread_mutex_lock(&transfer_mutex);
+        it = server->_receiving.find(chunk.id);
+        if(it != server->_receiving.end())
+            it->second->inflight.erase(chunk.index);
+
+        if(done)
+        {
+            recorded = transfer_record_(server, client->name, chunk.id, chunk.index, chunk.crc, progress);
+            transfer_hash_(server, client->name, chunk.id);
+        }
+        gthread_mutex_unlock(&transfer_mutex);
+    }
+
+    if(corrupted)
+    {
+        cout << "[Transfer]{" << client->name << "} Chunk " << chunk.index << " of file '" << name << "' is corrupted. Receiving it again." << endl;
+        return;
+    }
+
+    if(!done)
+    {
+        cout << "[Transfer]{" << client->name << "} Can't write file '" << name << "'." << endl;
+        return;
+    }
+
+    if(recorded && server->br_callback)
+        server->br_callback(progress.name, progress.received, progress.length);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_TRANSFER_HOLE received from given client : the
+ *  chunks are made a hole in the partial file, and recorded.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_hole(server_t* server, client_t* client, const transfer_hole_t& hole)
+{
+    gthread_mutex_lock(&transfer_mutex);
+    std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.find(hole.id);
+    if(it == server->_receiving.end() || it->second->done)
+    {
+        gthread_mutex_unlock(&transfer_mutex);
+        return;
+    }
+
+    transfer_in_t* in = it->second;
+    if(hole.index >= in->count || hole.count > in->count - hole.index)
+    {
+        gthread_mutex_unlock(&transfer_mutex);
+        cout << "[Transfer]{" << client->name << "} Invalid hole " << hole.index << " of file '" << in->name << "'." << endl;
+        return;
+    }
+
+    // The hole is written without the lock, as chunks are (see server_transfer_chunk()).
+    // The file may be finished and forgotten meanwhile, but it stays opened.
+    uint32_t    chunksize = in->header.chunksize;
+    uint64_t    length    = in->header.length;
+    std::string name      = in->name;
+    int         fd        = dup(in->fd);
+    gthread_mutex_unlock(&transfer_mutex);
+
+    uint64_t offset = (uint64_t) hole.index * chunksize;
+    uint64_t end    = std::min<uint64_t>((uint64_t) (hole.index + hole.count) * chunksize, length);
+    bool     done   = fd >= 0 && gio_zero(fd, offset, end - offset) == GERROR_NONE;
+    if(fd >= 0)
+        close(fd);
+
+    if(!done)
+    {
+        cout << "[Transfer]{" << client->name << "} Can't write file '" << name << "'." << endl;
+        return;
+    }
+
+    transfer_progress_t progress;
+    bool recorded = false;
+    gthread_mutex_lock(&transfer_mutex);
+    for(uint32_t i = 0; i < hole.count; ++i)
+    {
+        uint64_t start = (uint64_t) (hole.index + i) * chunksize;
+        uint32_t crc   = crc32c_zeros(std::min<uint64_t>(chunksize, length - start));
+        if(transfer_record_(server, client->name, hole.id, hole.index + i, crc, progress))
+            recorded = true;
+    }
+    transfer_hash_(server, client->name, hole.id);
+    gthread_mutex_unlock(&transfer_mutex);
+
+    if(recorded && server->br_callback)
+        server->br_callback(progress.name, progress.received, progress.length);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Receives the chunks sent on an additional connection, opened
+ *  with a PT_TRANSFER_STREAM, until the sender closes it.
+ *
+ *  The connection is only accepted from the address of the client it
+ *  tells, for a transfer this client offered. It is closed on return.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_stream(server_t* server, SOCKET sock, const SOCKADDR_IN& address, const transfer_stream_t& stream)
+{
+    // The client may be closed while the stream runs, so only its name is kept.
+    client_t peer;
+    bool     known = false;
+
+    gthread_mutex_lock(&server->mutex);
+    ClientsIdMap::const_iterator it = server->client_by_id.find(stream.client);
+    if(it != server->client_by_id.end() && it->second && it->second->established &&
+       it->second->address.sin_addr.s_addr == address.sin_addr.s_addr)
+    {
+        peer.name = it->second->name;
+        known     = true;
+    }
+    gthread_mutex_unlock(&server->mutex);
+
+    gthread_mutex_lock(&transfer_mutex);
+    known = known && server->_receiving.count(stream.id) > 0;
+    gthread_mutex_unlock(&transfer_mutex);
+
+    if(!known)
+    {
+        cout << "[Transfer] Refused a stream for an unknown transfer." << endl;
+        transport_close(sock);
+        return;
+    }
+
+#ifdef GULTRA_DEBUG
+    cout << "[Transfer]{" << peer.name << "} Opened a stream." << endl;
+#endif // GULTRA_DEBUG
+
+    // PT_CONNECTIONSTATUS is answered by receive_client_packet().
+    Packet* packet = nullptr;
+    while(!server->_must_stop && (packet = receive_client_packet(sock, 0, true, TRANSFER_TIMEOUT / 1000)) != nullptr)
+    {
+        bool valid = packet->m_type == PT_CONNECTIONSTATUS;
+        if(packet->m_type == PT_TRANSFER_CHUNK)
+        {
+            TransferChunkPacket* tcp = reinterpret_cast<TransferChunkPacket*>(packet);
+            valid = tcp->data.id == stream.id;
+            if(valid)
+                server_transfer_chunk(server, &peer, tcp);
+        }
+
+        delete packet;
+        if(!valid)
+            break;
+    }
+
+    transport_close(sock);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Handles a PT_TRANSFER_BITMAP received from given client,
+ *  waking up the sender of the file.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_bitmap(server_t* server, client_t* client, const transfer_bitmap_t& bitmap)
+{
+    if(!client->mirror)
+        return;
+
+    gthread_mutex_lock(&transfer_mutex);
+    typedef std::multimap<uint64_t, transfer_out_t*>::iterator iterator;
+    std::pair<iterator, iterator> range = server->_sending.equal_range(bitmap.id);
+    for(iterator it = range.first; it != range.second; ++it)
+    {
+        transfer_out_t* out = it->second;
+        if(out->peer != client->mirror->id)
+            continue;
+
+        if(out->pages != bitmap.pages)
+        {
+            out->pages    = bitmap.pages;
+            out->received = 0;
+            out->bits.assign((size_t) bitmap.pages * TRANSFER_BITMAPSIZE, 0);
+            out->seen.assign(bitmap.pages, false);
+        }
+
+        memcpy(&out->bits[(size_t) bitmap.page * TRANSFER_BITMAPSIZE], bitmap.bits, TRANSFER_BITMAPSIZE);
+        if(!out->seen[bitmap.page])
+        {
+            out->seen[bitmap.page] = true;
+            out->received++;
+        }
+
+        out->chunksize = bitmap.chunksize;
+        out->complete  = bitmap.complete != 0;
+        out->error     = (gerror_t) bitmap.error;
+        pthread_cond_broadcast(&out->cond);
+    }
+    gthread_mutex_unlock(&transfer_mutex);
+}
+
+/** @brief Waits for every pages of the bitmap of the receiver.
+ *  @return GERROR_NONE, GERROR_TIMEDOUT, or the error the receiver
+ *  refused the offer with.
+**/
+static gerror_t transfer_wait_(transfer_out_t* out)
+{
+    long deadline = timer_monotonic_us() + (long) TRANSFER_TIMEOUT * 1000;
+
+    gthread_mutex_lock(&transfer_mutex);
+    while(!out->complete && out->error == GERROR_NONE && (out->pages == 0 || out->received < out->pages))
+    {
+        long left = deadline - timer_monotonic_us();
+        if(left <= 0)
+            break;
+
+        struct timeval  now;
+        struct timespec ts;
+        gettimeofday(&now, NULL);
+        long usec = now.tv_usec + left % 1000000;
+        ts.tv_sec  = now.tv_sec + left / 1000000 + usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+
+        pthread_cond_timedwait(&out->cond, &transfer_mutex, &ts);
+    }
+
+    gerror_t ret = out->error != GERROR_NONE ? out->error :
+                   (out->complete || (out->pages > 0 && out->received == out->pages)) ? GERROR_NONE : GERROR_TIMEDOUT;
+    gthread_mutex_unlock(&transfer_mutex);
+    return ret;
+}
+
+/** @brief Returns true if the packets sent to given client are not crypted,
+ *  so the chunks can be sent straight from the file.
+**/
+static bool transfer_zerocopy_(server_t* server, client_t* client)
+{
+    return server->client_send == client_send_packet || client->trusted;
+}
+
+/** @brief Chunks of a file, sent by several threads at the same time.
+**/
+struct transfer_send_t
+{
+    server_t*               server;
+    client_t*               client;
+    int                     fd;
+    const transfer_offer_t* offer;
+    uint64_t                id;
+    uint32_t                chunksize;
+    const std::vector<uint32_t>* blocks; // CRC32C of every TRANSFER_MINCHUNKSIZE bytes of the file, computed with its hash.
+    bool                    zerocopy;
+    uint64_t                sent;   // Bytes the receiver has, or which were sent, for bs_callback.
+    bool                    failed; // True once the transfer can't go on, so every range stops.
+    pthread_mutex_t         mutex;  // Protects sent and failed.
+};
+
+/** @brief A range of the missing chunks, sent on one connection.
+**/
+struct transfer_range_t
+{
+    transfer_send_t* send;
+    SOCKET           sock;   // Additional connection, or INVALID_SOCKET for the one of the client.
+    const uint32_t*  chunks; // Indexes of the chunks, in order.
+    size_t           count;
+    gerror_t         err;
+    pthread_t        thread;
+};
+
+/** @brief Opens an additional connection to the server at given address, for
+ *  the chunks of transfer id. clientid is the ID this server gave us.
+ *  Returns INVALID_SOCKET on failure.
+**/
+static SOCKET transfer_stream_open_(server_t* server, const SOCKADDR_IN& address, uint32_t clientid, uint64_t id)
+{
+    char ip[INET_ADDRSTRLEN];
+    if(!inet_ntop(AF_INET, &address.sin_addr, ip, sizeof(ip)))
+        return INVALID_SOCKET;
+
+    client_t stream;
+    stream.name   = server->name;
+    stream.server = (void*) server;
+    if(client_create(&stream, ip, ntohs(address.sin_port)) != GERROR_NONE)
+        return INVALID_SOCKET;
+
+    transfer_stream_t hello;
+    hello.id     = id;
+    hello.client = clientid;
+    hello        = serialize<transfer_stream_t>(hello);
+    if(send_client_packet(stream.sock, SOCKET_ERROR, PT_TRANSFER_STREAM, &hello, sizeof(transfer_stream_t)) != GERROR_NONE)
+    {
+        transport_close(stream.sock);
+        return INVALID_SOCKET;
+    }
+
+    return stream.sock;
+}
+
+/** @brief Returns true if len bytes of the file, from offset, are only a hole.
+**/
+static bool transfer_is_hole_(int fd, uint64_t offset, uint64_t len)
+{
+#ifdef SEEK_DATA
+    off_t data = lseek(fd, (off_t) offset, SEEK_DATA);
+    return data < 0 ? errno == ENXIO : (uint64_t) data >= offset + len;
+#else
+    return false;
+#endif // SEEK_DATA
+}
+
+/** @brief Sends the chunks [index, index + count[ as a hole.
+**/
+static gerror_t transfer_send_hole_(transfer_send_t* send, uint32_t index, uint32_t count)
+{
+    transfer_hole_t hole;
+    hole.id    = send->id;
+    hole.index = index;
+    hole.count = count;
+    hole       = serialize<transfer_hole_t>(hole);
+    if(send->server->client_send(send->client, PT_TRANSFER_HOLE, &hole, sizeof(transfer_hole_t)) != GERROR_NONE)
+        return GERROR_CANT_SEND_PACKET;
+
+    uint64_t offset = (uint64_t) index * send->chunksize;
+    send->sent += std::min<uint64_t>((uint64_t) count * send->chunksize, send->offer->length - offset);
+    if(send->server->bs_callback)
+        send->server->bs_callback(send->offer->name, (size_t) send->sent, (size_t) send->offer->length);
+    return GERROR_NONE;
+}
+
+/** @brief Asks the kernel to read a chunk of the file in the background, so
+ *  it is in the page cache when it is sent.
+**/
+static void transfer_readahead_(transfer_send_t* send, uint32_t index)
+{
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t offset = (uint64_t) index * send->chunksize;
+    uint64_t size   = std::min<uint64_t>(send->chunksize, send->offer->length - offset);
+    posix_fadvise(send->fd, (off_t) offset, (off_t) size, POSIX_FADV_WILLNEED);
+#endif // POSIX_FADV_WILLNEED
+}
+
+/** @brief Returns the CRC32C of a chunk, combined from the CRCs of its blocks.
+ *  The chunk size is a multiple of the block size, TRANSFER_MINCHUNKSIZE.
+**/
+static uint32_t transfer_chunk_crc_(const transfer_send_t* send, uint32_t index, uint32_t size)
+{
+    size_t   block = (size_t) ((uint64_t) index * send->chunksize / TRANSFER_MINCHUNKSIZE);
+    uint32_t crc   = 0;
+    for(uint32_t done = 0; done < size && block < send->blocks->size(); done += TRANSFER_MINCHUNKSIZE, ++block)
+        crc = crc32c_combine(crc, (*send->blocks)[block], std::min<uint32_t>(TRANSFER_MINCHUNKSIZE, size - done));
+    return crc;
+}
+
+/** @brief Sends a range of chunks. Their CRCs come from the blocks hashed
+ *  with the offer, so chunks which are not crypted are sent straight from the
+ *  file, without this process reading them. Crypted chunks are read just
+ *  after their header, so the packet is sent without a copy.
+ *
+ *  The disk reads the next TRANSFER_READAHEAD chunks while a chunk is sent.
+**/
+static void* transfer_send_range_(void* data)
+{
+    transfer_range_t* range = reinterpret_cast<transfer_range_t*>(data);
+    transfer_send_t*  send  = range->send;
+
+    data_t* packet = (data_t*) malloc(sizeof(transfer_chunk_t) + (send->zerocopy ? 0 : send->chunksize));
+    if(!packet)
+    {
+        range->err = GERROR_ALLOC;
+        return nullptr;
+    }
+
+    for(size_t i = 0; i < range->count && i < TRANSFER_READAHEAD; ++i)
+        transfer_readahead_(send, range->chunks[i]);
+
+    range->err   = GERROR_NONE;
+    bool stopped = false;
+    for(size_t i = 0; i < range->count && !stopped; ++i)
+    {
+        if(i + TRANSFER_READAHEAD < range->count)
+            transfer_readahead_(send, range->chunks[i + TRANSFER_READAHEAD]);
+
+        uint32_t index  = range->chunks[i];
+        uint64_t offset = (uint64_t) index * send->chunksize;
+        uint32_t size   = (uint32_t) std::min<uint64_t>(send->chunksize, send->offer->length - offset);
+
+        // A file changed since its offer does not match these CRCs : its chunks are refused.
+        uint32_t crc = transfer_chunk_crc_(send, index, size);
+        if(!send->zerocopy && pread(send->fd, packet + sizeof(transfer_chunk_t), size, (off_t) offset) != (ssize_t) size)
+        {
+            range->err = GERROR_IO_CANTREAD;
+            break;
+        }
+
+        transfer_chunk_t chunk;
+        chunk.id    = send->id;
+        chunk.index = index;
+        chunk.size  = size;
+        chunk.crc   = crc;
+        chunk       = serialize<transfer_chunk_t>(chunk);
+        memcpy(packet, &chunk, sizeof(transfer_chunk_t));
+
+        gerror_t err;
+        if(range->sock != INVALID_SOCKET)
+            err = send_client_packet_file(range->sock, SOCKET_ERROR, PT_TRANSFER_CHUNK, packet, sizeof(transfer_chunk_t), send->fd, (off_t) offset, size);
+        else if(send->zerocopy)
+            err = client_send_packet_file(send->client, PT_TRANSFER_CHUNK, packet, sizeof(transfer_chunk_t), send->fd, (off_t) offset, size);
+        else
+            err = send->server->client_send(send->client, PT_TRANSFER_CHUNK, packet, sizeof(transfer_chunk_t) + size);
+
+        if(err != GERROR_NONE)
+        {
+            range->err = GERROR_CANT_SEND_PACKET;
+            break;
+        }
+
+        gthread_mutex_lock(&send->mutex);
+        send->sent += size;
+        stopped     = send->failed;
+        if(send->server->bs_callback)
+            send->server->bs_callback(send->offer->name, (size_t) send->sent, (size_t) send->offer->length);
+        gthread_mutex_unlock(&send->mutex);
+    }
+
+    free(packet);
+
+    // Chunks lost with an additional connection are only sent again at next offer.
+    if(range->err != GERROR_NONE && (range->sock == INVALID_SOCKET || range->err != GERROR_CANT_SEND_PACKET))
+    {
+        gthread_mutex_lock(&send->mutex);
+        send->failed = true;
+        gthread_mutex_unlock(&send->mutex);
+    }
+
+    // The receiver answers once it wrote every chunk before, so they are in its
+    // bitmap when the file is offered again. If it is late, they are only sent again.
+    else if(range->err == GERROR_NONE && range->sock != INVALID_SOCKET && !stopped)
+        send_client_packet(range->sock, range->sock, PT_CONNECTIONSTATUS, NULL, 0);
+
+    return nullptr;
+}
+
+/** @brief Sends the chunks the receiver does not have, in chunks of
+ *  chunksize bytes.
+ *
+ *  If the chunks are not crypted, the missing chunks are split in
+ *  server.args.streams ranges, sent at the same time on as many connections.
+ *  The first range uses the connection of the client, the others additional
+ *  connections opened for this call.
+ *
+ *  If the file is sparse, the chunks which are only holes are sent first, by
+ *  runs of contiguous chunks, without their data.
+**/
+static gerror_t transfer_send_missing_(server_t* server, client_t* client, int fd, const transfer_offer_t& offer,
+                                       const std::vector<uint32_t>& blocks, uint64_t id, uint32_t chunksize, const std::vector<uint8_t>& bits)
+{
+    // The client may be closed while its holes are sent.
+    client_t* mirror = client->mirror;
+    if(!mirror)
+        return GERROR_CANT_SEND_PACKET;
+
+    SOCKADDR_IN address  = mirror->address;
+    uint32_t    clientid = client->id;
+
+    transfer_send_t send;
+    send.server    = server;
+    send.client    = client;
+    send.fd        = fd;
+    send.offer     = &offer;
+    send.id        = id;
+    send.chunksize = chunksize;
+    send.blocks    = &blocks;
+    send.zerocopy  = transfer_zerocopy_(server, client);
+    send.sent      = offer.length;
+    send.failed    = false;
+
+    std::vector<uint32_t> missing;
+    uint32_t count = transfer_count_(offer.length, chunksize);
+    for(uint32_t index = 0; index < count; ++index)
+    {
+        if(!transfer_has_(bits, index))
+            send.sent -= std::min<uint64_t>(chunksize, offer.length - (uint64_t) index * chunksize);
+    }
+
+    uint32_t holes = 0; // Length of the current run of holes, ending at index.
+    for(uint32_t index = 0; index <= count; ++index)
+    {
+        uint64_t offset = (uint64_t) index * chunksize;
+        bool     hole   = index < count && !transfer_has_(bits, index) && offer.sparse &&
+                          transfer_is_hole_(fd, offset, std::min<uint64_t>(chunksize, offer.length - offset));
+        if(hole)
+        {
+            holes++;
+            continue;
+        }
+
+        if(holes > 0 && transfer_send_hole_(&send, index - holes, holes) != GERROR_NONE)
+            return GERROR_CANT_SEND_PACKET;
+        holes = 0;
+
+        if(index < count && !transfer_has_(bits, index))
+            missing.push_back(index);
+    }
+
+    if(missing.empty())
+        return GERROR_NONE;
+
+    // Additional connections are not crypted.
+    size_t streams = send.zerocopy ? (size_t) std::max(1, std::min(server->args.streams, TRANSFER_MAXSTREAMS)) : 1;
+    streams        = std::max<size_t>(1, std::min(streams, missing.size()));
+
+    std::vector<transfer_range_t> ranges(1);
+    ranges[0].sock = INVALID_SOCKET;
+    for(size_t i = 1; i < streams; ++i)
+    {
+        SOCKET sock = transfer_stream_open_(server, address, clientid, id);
+        if(sock == INVALID_SOCKET)
+        {
+            cout << "[Transfer] Can't open stream to '" << client->name << "'. Sending on " << ranges.size() << " connections." << endl;
+            break;
+        }
+
+        ranges.push_back(transfer_range_t());
+        ranges.back().sock = sock;
+    }
+
+    pthread_mutex_init(&send.mutex, NULL);
+    for(size_t i = 0; i < ranges.size(); ++i)
+    {
+        size_t begin     = missing.size() * i / ranges.size();
+        size_t end       = missing.size() * (i + 1) / ranges.size();
+        ranges[i].send   = &send;
+        ranges[i].chunks = missing.data() + begin;
+        ranges[i].count  = end - begin;
+        ranges[i].err    = GERROR_NONE;
+
+        // A range which can't be started is sent again at next offer.
+        if(i > 0 && pthread_create(&ranges[i].thread, NULL, transfer_send_range_, &ranges[i]) != 0)
+        {
+            transport_close(ranges[i].sock);
+            ranges[i].sock = INVALID_SOCKET;
+        }
+    }
+
+    transfer_send_range_(&ranges[0]);
+
+    gerror_t err = ranges[0].err;
+    for(size_t i = 1; i < ranges.size(); ++i)
+    {
+        if(ranges[i].sock == INVALID_SOCKET)
+            continue;
+
+        pthread_join(ranges[i].thread, NULL);
+        transport_close(ranges[i].sock);
+        if(err == GERROR_NONE && ranges[i].err != GERROR_CANT_SEND_PACKET)
+            err = ranges[i].err;
+    }
+    pthread_mutex_destroy(&send.mutex);
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sends a file to given client.
+ *
+ *  The file is offered with its SHA-256, its CRC32C computed from the same
+ *  reads, and the chunk size we propose (server.args.chunksize). The client
+ *  answers with the chunk size it accepts, and the bitmap of the chunks it
+ *  already has. Only the missing chunks are sent, each one with its CRC32C,
+ *  then the file is offered again until the client has it whole with the
+ *  right CRC. Chunks the client found corrupted are missing from its bitmap,
+ *  so only they are sent again. The client keeps its bitmap on disk,
+ *  next to the partial file : a transfer cut by a disconnection, or
+ *  a restart of either server, goes on where it stopped when the
+ *  file is sent again.
+ *
+ *  Uncrypted chunks are sent on server.args.streams connections at the
+ *  same time, the receiver writing each of them at its offset.
+ *
+ *  @param filename : Path of the file, which is also its name on the
+ *  client. Its size must be inferior to SERVER_MAXBUFSIZE.
+ *
+ *  @return
+ *  - GERROR_NONE             : The client has the file.
+ *  - GERROR_BADARGS          : An argument is null.
+ *  - GERROR_BUFSIZEEXCEEDED  : filename is too long.
+ *  - GERROR_CANTOPENFILE     : The file can't be opened.
+ *  - GERROR_IO_CANTREAD      : The file can't be read.
+ *  - GERROR_CANT_SEND_PACKET : A packet could not be sent.
+ *  - GERROR_TIMEDOUT         : The client did not send its bitmap
+ *  in TRANSFER_TIMEOUT ms.
+ *  - GERROR_ANSWER_BAD       : The client still misses the file after
+ *  TRANSFER_RETRIES offers.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_transfer_send(server_t* server, client_t* client, const char* filename)
+{
+    if(!server || !client || !filename || !client->mirror)
+        return GERROR_BADARGS;
+
+    if(strlen(filename) >= SERVER_MAXBUFSIZE)
+        return GERROR_BUFSIZEEXCEEDED;
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+    {
+        cout << "[Transfer] Can't open file '" << filename << "'." << endl;
+        return GERROR_CANTOPENFILE;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    // The file is hashed, then every range is sent, from start to end.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif // POSIX_FADV_SEQUENTIAL
+
+    struct stat st;
+    uint32_t crc;
+    std::vector<uint32_t> blocks;
+    transfer_offer_t offer;
+    memset(&offer, 0, sizeof(transfer_offer_t));
+    strncpy(offer.name, filename, SERVER_MAXBUFSIZE - 1);
+    offer.chunksize = transfer_chunksize_(server);
+
+    if(fstat(fd, &st) != 0 || Encryption::hash_file(fd, (uint64_t) st.st_size, offer.hash, &crc, TRANSFER_MINCHUNKSIZE, &blocks) != GERROR_NONE)
+    {
+        close(fd);
+        cout << "[Transfer] Can't read file '" << filename << "'." << endl;
+        return GERROR_IO_CANTREAD;
+    }
+
+    offer.crc       = crc;
+    offer.length    = (uint64_t) st.st_size;
+#ifdef SEEK_HOLE
+    // Every file ends with a hole, at its end if it has no other one.
+    off_t hole      = lseek(fd, 0, SEEK_HOLE);
+    offer.sparse    = (hole >= 0 && (uint64_t) hole < offer.length) ? 1 : 0;
+#endif // SEEK_HOLE
+    uint64_t id     = transfer_id_(offer);
+
+    transfer_out_t* out = new transfer_out_t;
+    out->peer      = client->mirror->id;
+    out->chunksize = offer.chunksize;
+    out->pages     = 0;
+    out->received = 0;
+    out->complete = false;
+    out->error    = GERROR_NONE;
+    pthread_cond_init(&out->cond, NULL);
+
+    gthread_mutex_lock(&transfer_mutex);
+    std::multimap<uint64_t, transfer_out_t*>::iterator self = server->_sending.insert(std::make_pair(id, out));
+    gthread_mutex_unlock(&transfer_mutex);
+
+    cout << "[Transfer] Sending file '" << filename << "' to '" << client->name << "'." << endl;
+    if(server->bs_callback)
+        server->bs_callback(offer.name, 0, (size_t) offer.length);
+
+    gerror_t err = GERROR_ANSWER_BAD;
+    for(unsigned int round = 0; round <= TRANSFER_RETRIES; ++round)
+    {
+        gthread_mutex_lock(&transfer_mutex);
+        out->received = 0;
+        out->complete = false;
+        out->error    = GERROR_NONE;
+        out->seen.assign(out->pages, false);
+        gthread_mutex_unlock(&transfer_mutex);
+
+        transfer_offer_t sent = serialize<transfer_offer_t>(offer);
+        if(server->client_send(client, PT_TRANSFER_OFFER, &sent, sizeof(transfer_offer_t)) != GERROR_NONE)
+        {
+            err = GERROR_CANT_SEND_PACKET;
+            break;
+        }
+
+        err = transfer_wait_(out);
+        if(err != GERROR_NONE)
+            break;
+
+        gthread_mutex_lock(&transfer_mutex);
+        bool                 complete  = out->complete;
+        uint32_t             chunksize = out->chunksize;
+        std::vector<uint8_t> bits      = out->bits;
+        gthread_mutex_unlock(&transfer_mutex);
+
+        if(complete)
+            break;
+
+        err = transfer_send_missing_(server, client, fd, offer, blocks, id, chunksize, bits);
+        if(err != GERROR_NONE)
+            break;
+
+        err = GERROR_ANSWER_BAD;
+    }
+
+    gthread_mutex_lock(&transfer_mutex);
+    server->_sending.erase(self);
+    gthread_mutex_unlock(&transfer_mutex);
+
+    pthread_cond_destroy(&out->cond);
+    delete out;
+    close(fd);
+
+    if(err == GERROR_NONE)
+    {
+        cout << "[Transfer] File '" << filename << "' correctly send to client '" << client->name << "'." << endl;
+    }
+    else
+    {
+        cout << "[Transfer] Can't send file '" << filename << "' : " << gerror_to_string(err) << endl;
+    }
+    return err;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Closes the files being received. Their bitmaps are kept, so
+ *  they go on when the server is restarted.
+**/
+////////////////////////////////////////////////////////////
+void server_transfer_close(server_t* server)
+{
+    // The writer writes every chunk queued before returning.
+    gthread_mutex_lock(&transfer_mutex);
+    transfer_writer_t* writer = server->_writer;
+    if(writer)
+    {
+        writer->stop = true;
+        pthread_cond_broadcast(&writer->cond);
+        gthread_mutex_unlock(&transfer_mutex);
+
+        pthread_join(writer->thread, NULL);
+
+        gthread_mutex_lock(&transfer_mutex);
+        server->_writer = nullptr;
+        pthread_cond_destroy(&writer->cond);
+        delete writer;
+    }
+
+    for(std::map<uint64_t, transfer_in_t*>::iterator it = server->_receiving.begin(); it != server->_receiving.end(); ++it)
+    {
+        transfer_in_close_(it->second);
+        delete it->second;
+    }
+    server->_receiving.clear();
+    gthread_mutex_unlock(&transfer_mutex);
+}
+
+GEND_DECL
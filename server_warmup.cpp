@@ -0,0 +1,220 @@
+/*
+ File        : server_warmup.cpp
+ Description : Reconnects to the known clients of the user at startup.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "server.h"
+#include "server_intern.h"
+
+GBEGIN_DECL
+
+/** @brief Shared state of one warm-up phase.
+**/
+typedef struct warmup_t
+{
+    server_t*                          server;
+    std::vector<database_clientinfo_t> peers;       // Clients to connect, most recent first.
+    uint32_t                           maxparallel; // Maximum number of running connections.
+
+    pthread_mutex_t                    mutex;
+    pthread_cond_t                     cond;        // Signaled every time a connection ends.
+    uint32_t                           running;     // Number of connections currently being opened.
+    uint32_t                           succeeded;   // Number of established connections.
+} warmup_t;
+
+typedef struct warmup_peer_t
+{
+    warmup_t*             warmup;
+    database_clientinfo_t peer;
+} warmup_peer_t;
+
+void* server_warmup_peer_loop(void* data)
+{
+    warmup_peer_t* wp     = (warmup_peer_t*) data;
+    warmup_t*      warmup = wp->warmup;
+    server_t*      server = warmup->server;
+    bool           ok     = false;
+
+    client_t* client = server_client_exist(server, wp->peer.ip, wp->peer.port);
+    if(client)
+    {
+        // Already connected (the distant server may have been faster than us).
+        ok = true;
+    }
+    else if(server_init_client_connection(server, client, wp->peer.ip.c_str(), wp->peer.port) == GERROR_NONE && client)
+    {
+        ok = server_wait_establisedclient(client, 4) == GERROR_NONE;
+    }
+
+    if(!ok) {
+        gnotifiate_warn("[Server] Warm-up : can't connect to '%s:%i'.", wp->peer.ip.c_str(), (int) wp->peer.port);
+    }
+    
+    // The supervisor keeps the peer connected from now, and retries it if we failed.
+    if(server->args.supervise)
+        server_supervise(server, wp->peer.ip, wp->peer.port);
+
+    gthread_mutex_lock(&warmup->mutex);
+    {
+        warmup->running--;
+        if(ok)
+            warmup->succeeded++;
+        pthread_cond_signal(&warmup->cond);
+    }
+    gthread_mutex_unlock(&warmup->mutex);
+
+    delete wp;
+    return nullptr;
+}
+
+void* server_warmup_thread_loop(void* data)
+{
+    warmup_t* warmup = (warmup_t*) data;
+    server_t* server = warmup->server;
+
+    server_wait_status(server, SS_STARTED);
+
+#ifdef GULTRA_DEBUG
+    timespec_t st = timer_start();
+#endif // GULTRA_DEBUG
+
+    for(unsigned int i = 0; i < warmup->peers.size(); ++i)
+    {
+        // We never open more than maxparallel connections at the same time, as every
+        // connection also makes the distant server dial back to us.
+        gthread_mutex_lock(&warmup->mutex);
+        while(warmup->running >= warmup->maxparallel)
+            pthread_cond_wait(&warmup->cond, &warmup->mutex);
+        warmup->running++;
+        gthread_mutex_unlock(&warmup->mutex);
+
+        warmup_peer_t* wp = new warmup_peer_t;
+        wp->warmup = warmup;
+        wp->peer   = warmup->peers[i];
+
+        pthread_t thread;
+        if(pthread_create(&thread, nullptr, server_warmup_peer_loop, wp) != 0)
+        {
+            gnotifiate_error("[Server] Warm-up : can't create connection thread.");
+            delete wp;
+
+            gthread_mutex_lock(&warmup->mutex);
+            warmup->running--;
+            gthread_mutex_unlock(&warmup->mutex);
+            continue;
+        }
+
+        pthread_detach(thread);
+    }
+
+    // Wait for every connections to end.
+    gthread_mutex_lock(&warmup->mutex);
+    while(warmup->running > 0)
+        pthread_cond_wait(&warmup->cond, &warmup->mutex);
+    gthread_mutex_unlock(&warmup->mutex);
+
+    gnotifiate_info("[Server] Warm-up terminated : %i/%i clients connected.", (int) warmup->succeeded, (int) warmup->peers.size());
+
+#ifdef GULTRA_DEBUG
+    long ten = timer_end(st);
+    gnotifiate_info("[Server] Warm-up time elapsed (microseconds) = %li.", ten/1000);
+#endif // GULTRA_DEBUG
+
+    pthread_mutex_destroy(&warmup->mutex);
+    pthread_cond_destroy(&warmup->cond);
+    delete warmup;
+    return nullptr;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Reconnects to the most recently used known clients of
+ *  given user.
+ *
+ *  The connections are opened in a background thread, so this
+ *  function returns immediately. At most maxparallel connections
+ *  are opened at the same time.
+ *
+ *  @param server      : The server to use.
+ *  @param user        : The user whose known clients are used.
+ *  @param count       : Maximum number of clients to connect. It
+ *  is also limited by the server max clients number.
+ *  @param maxparallel : Maximum number of connections opened at the
+ *  same time. 0 means 1.
+ *
+ *  @return
+ *  - GERROR_NONE            : Warm-up started (or nothing to do).
+ *  - GERROR_BADARGS         : server or user is null.
+ *  - GERROR_THREAD_CREATION : The warm-up thread can't be created.
+**/
+////////////////////////////////////////////////////////////
+gerror_t server_warmup(server_t* server, user_t* user, uint32_t count, uint32_t maxparallel)
+{
+    if(!server || !user)
+        return GERROR_BADARGS;
+
+    if(server->args.maxclients > 0 && count > (uint32_t) server->args.maxclients)
+        count = (uint32_t) server->args.maxclients;
+
+    std::vector<database_clientinfo_t> recent = user_get_recent_clients(user, count);
+
+    warmup_t* warmup    = new warmup_t;
+    warmup->server      = server;
+    warmup->maxparallel = maxparallel > 0 ? maxparallel : 1;
+    warmup->running     = 0;
+    warmup->succeeded   = 0;
+    pthread_mutex_init(&warmup->mutex, nullptr);
+    pthread_cond_init(&warmup->cond, nullptr);
+
+    for(unsigned int i = 0; i < recent.size(); ++i)
+    {
+        // Do not connect to ourselves.
+        if(recent[i].port == server->args.port &&
+           (recent[i].ip == "127.0.0.1" || recent[i].ip == "localhost"))
+            continue;
+
+        warmup->peers.push_back(recent[i]);
+    }
+
+    if(warmup->peers.empty())
+    {
+        gnotifiate_info("[Server] Warm-up : no known clients to connect.");
+        pthread_mutex_destroy(&warmup->mutex);
+        pthread_cond_destroy(&warmup->cond);
+        delete warmup;
+        return GERROR_NONE;
+    }
+
+    gnotifiate_info("[Server] Warm-up : connecting to %i known clients (%i at a time).", (int) warmup->peers.size(), (int) warmup->maxparallel);
+
+    pthread_t thread;
+    if(pthread_create(&thread, nullptr, server_warmup_thread_loop, warmup) != 0)
+    {
+        pthread_mutex_destroy(&warmup->mutex);
+        pthread_cond_destroy(&warmup->cond);
+        delete warmup;
+        return GERROR_THREAD_CREATION;
+    }
+
+    pthread_detach(thread);
+    return GERROR_NONE;
+}
+
+GEND_DECL
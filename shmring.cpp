@@ -0,0 +1,347 @@
+/*
+ File        : shmring.cpp
+ Description : Shared memory rings used to send bulk data to a server on the same host.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "shmring.h"
+#include <algorithm>
+
+#ifndef _WIN32
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#endif
+
+GBEGIN_DECL
+
+#ifndef _WIN32
+
+#define SHMRING_WAITSTEP 100 // Time (ms) of one wait step, so the closed flag is checked regularly.
+
+/** @brief Waits until given wake counter is different from value, or for
+ *  SHMRING_WAITSTEP milliseconds.
+ *
+ *  The other side of the ring is another process, so on Linux we use a
+ *  shared futex on the counter. Elsewhere we only sleep a bit.
+**/
+static void shmring_wait(volatile uint32_t* word, uint32_t value)
+{
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec  = 0;
+    ts.tv_nsec = SHMRING_WAITSTEP * 1000000L;
+    syscall(SYS_futex, (uint32_t*) word, FUTEX_WAIT, value, &ts, nullptr, 0);
+#else
+    if(*word == value)
+        usleep(1000);
+#endif
+}
+
+/** @brief Increments given wake counter and wakes up the other side.
+**/
+static void shmring_wake(volatile uint32_t* word)
+{
+    __atomic_add_fetch(word, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t*) word, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+static gerror_t shmring_map(shmring_t*& ring, const std::string& name, int fd, size_t mapsize, bool owner)
+{
+    void* addr = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(addr == MAP_FAILED)
+        return GERROR_ALLOC;
+
+    ring          = new shmring_t;
+    ring->name    = name;
+    ring->header  = (shmring_header_t*) addr;
+    ring->data    = ((unsigned char*) addr) + sizeof(shmring_header_t);
+    ring->mapsize = mapsize;
+    ring->owner   = owner;
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Creates a new ring. The creator of the ring is its
+ *  producer.
+ *
+ *  The name of the ring (ring->name) must be given to the other
+ *  side so it can open it with shmring_open().
+ *
+ *  @param ring : A pointer to null, filled with the new ring.
+ *  @param size : Size of the data part. It must be a power of two.
+ *
+ *  @return
+ *  - GERROR_NONE        : Ring created.
+ *  - GERROR_BADARGS     : ring is not null or size is not a power of two.
+ *  - GERROR_CANTOPENFILE: The shared memory object can't be created.
+ *  - GERROR_ALLOC       : The shared memory can't be mapped.
+**/
+////////////////////////////////////////////////////////////
+gerror_t shmring_create(shmring_t*& ring, uint32_t size)
+{
+    static uint32_t counter = 0;
+
+    if(ring || size == 0 || (size & (size - 1)) != 0)
+        return GERROR_BADARGS;
+
+    char name[SHMRING_MAXNAME];
+    sprintf(name, SHMRING_NAME, (int) getpid(), __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+        return GERROR_CANTOPENFILE;
+
+    size_t mapsize = sizeof(shmring_header_t) + size;
+    if(ftruncate(fd, mapsize) != 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return GERROR_CANTOPENFILE;
+    }
+
+    gerror_t err = shmring_map(ring, name, fd, mapsize, true);
+    if(err != GERROR_NONE)
+    {
+        shm_unlink(name);
+        return err;
+    }
+
+    // ftruncate() filled the memory with zeros, so only the constants are set.
+    ring->header->size  = size;
+    __atomic_store_n(&ring->header->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Opens a ring created by another process. We are its
+ *  consumer.
+ *
+ *  The shared memory object is unlinked once mapped, as nobody else
+ *  has to open it.
+ *
+ *  @return
+ *  - GERROR_NONE        : Ring opened.
+ *  - GERROR_BADARGS     : ring is not null, or the object is not a ring.
+ *  - GERROR_CANTOPENFILE: The shared memory object can't be opened.
+ *  - GERROR_ALLOC       : The shared memory can't be mapped.
+**/
+////////////////////////////////////////////////////////////
+gerror_t shmring_open(shmring_t*& ring, const std::string& name)
+{
+    if(ring || name.empty())
+        return GERROR_BADARGS;
+
+    int fd = shm_open(name.c_str(), O_RDWR, S_IRUSR | S_IWUSR);
+    if(fd < 0)
+        return GERROR_CANTOPENFILE;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size <= sizeof(shmring_header_t))
+    {
+        close(fd);
+        return GERROR_BADARGS;
+    }
+
+    gerror_t err = shmring_map(ring, name, fd, (size_t) st.st_size, false);
+    shm_unlink(name.c_str());
+
+    if(err != GERROR_NONE)
+        return err;
+
+    if(__atomic_load_n(&ring->header->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+       sizeof(shmring_header_t) + ring->header->size != ring->mapsize)
+    {
+        munmap(ring->header, ring->mapsize);
+        delete ring;
+        ring = nullptr;
+        return GERROR_BADARGS;
+    }
+
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Leaves the ring, unmaps it and destroys the structure.
+ *  The other side sees the ring closed and stops waiting on it.
+**/
+////////////////////////////////////////////////////////////
+gerror_t shmring_close(shmring_t*& ring)
+{
+    if(!ring)
+        return GERROR_BADARGS;
+
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+    shmring_wake(&ring->header->datawake);
+    shmring_wake(&ring->header->spacewake);
+
+    // If the consumer never opened the ring, the name is still there.
+    if(ring->owner)
+        shm_unlink(ring->name.c_str());
+
+    munmap(ring->header, ring->mapsize);
+    delete ring;
+    ring = nullptr;
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Waits for free space in the ring (producer side).
+ *
+ *  @param ptr     : Filled with where to write the data.
+ *  @param len     : Filled with the number of bytes which can be
+ *  written at ptr (never 0 on success).
+ *  @param timeout : Time (ms) to wait for the consumer to free space.
+ *
+ *  @return
+ *  - GERROR_NONE     : Space available.
+ *  - GERROR_TIMEDOUT : The consumer did not read anything in time.
+ *  - GERROR_NORECEIVE: The consumer left the ring.
+**/
+////////////////////////////////////////////////////////////
+gerror_t shmring_reserve(shmring_t* ring, unsigned char*& ptr, size_t& len, uint32_t timeout)
+{
+    if(!ring)
+        return GERROR_BADARGS;
+
+    shmring_header_t* header = ring->header;
+    const uint64_t    size   = header->size;
+    const uint64_t    head   = header->head;
+    long              start  = timer_monotonic_ms();
+
+    while(1)
+    {
+        uint32_t wake = __atomic_load_n(&header->spacewake, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+
+        if(head - tail < size)
+        {
+            uint64_t pos  = head & (size - 1);
+            uint64_t free = size - (head - tail);
+            ptr = ring->data + pos;
+            len = (size_t) std::min(free, size - pos);
+            return GERROR_NONE;
+        }
+
+        if(__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            return GERROR_NORECEIVE;
+        if(timer_monotonic_ms() - start > (long) timeout)
+            return GERROR_TIMEDOUT;
+
+        shmring_wait(&header->spacewake, wake);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Publishes len bytes written after shmring_reserve().
+**/
+////////////////////////////////////////////////////////////
+void shmring_commit(shmring_t* ring, size_t len)
+{
+    if(!ring || !len)
+        return;
+
+    __atomic_store_n(&ring->header->head, ring->header->head + len, __ATOMIC_RELEASE);
+    shmring_wake(&ring->header->datawake);
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Waits for data in the ring (consumer side).
+ *
+ *  @param ptr     : Filled with where to read the data.
+ *  @param len     : Filled with the number of bytes which can be
+ *  read at ptr (never 0 on success).
+ *  @param timeout : Time (ms) to wait for the producer to write.
+ *
+ *  @return
+ *  - GERROR_NONE     : Data available.
+ *  - GERROR_TIMEDOUT : The producer did not write anything in time.
+ *  - GERROR_NORECEIVE: The producer left the ring.
+**/
+////////////////////////////////////////////////////////////
+gerror_t shmring_peek(shmring_t* ring, const unsigned char*& ptr, size_t& len, uint32_t timeout)
+{
+    if(!ring)
+        return GERROR_BADARGS;
+
+    shmring_header_t* header = ring->header;
+    const uint64_t    size   = header->size;
+    const uint64_t    tail   = header->tail;
+    long              start  = timer_monotonic_ms();
+
+    while(1)
+    {
+        uint32_t wake = __atomic_load_n(&header->datawake, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        if(head != tail)
+        {
+            uint64_t pos = tail & (size - 1);
+            ptr = ring->data + pos;
+            len = (size_t) std::min(head - tail, size - pos);
+            return GERROR_NONE;
+        }
+
+        if(__atomic_load_n(&header->closed, __ATOMIC_ACQUIRE))
+            return GERROR_NORECEIVE;
+        if(timer_monotonic_ms() - start > (long) timeout)
+            return GERROR_TIMEDOUT;
+
+        shmring_wait(&header->datawake, wake);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Frees len bytes read after shmring_peek().
+**/
+////////////////////////////////////////////////////////////
+void shmring_consume(shmring_t* ring, size_t len)
+{
+    if(!ring || !len)
+        return;
+
+    __atomic_store_n(&ring->header->tail, ring->header->tail + len, __ATOMIC_RELEASE);
+    shmring_wake(&ring->header->spacewake);
+}
+
+#else
+
+// Local servers never use a Unix-domain socket on Windows, so rings are never used.
+
+gerror_t shmring_create(shmring_t*&, uint32_t)                                       { return GERROR_NOTIMPLEMENTED; }
+gerror_t shmring_open(shmring_t*&, const std::string&)                               { return GERROR_NOTIMPLEMENTED; }
+gerror_t shmring_close(shmring_t*&)                                                  { return GERROR_NOTIMPLEMENTED; }
+gerror_t shmring_reserve(shmring_t*, unsigned char*&, size_t&, uint32_t)             { return GERROR_NOTIMPLEMENTED; }
+void     shmring_commit(shmring_t*, size_t)                                          { }
+gerror_t shmring_peek(shmring_t*, const unsigned char*&, size_t&, uint32_t)          { return GERROR_NOTIMPLEMENTED; }
+void     shmring_consume(shmring_t*, size_t)                                         { }
+
+#endif // _WIN32
+
+GEND_DECL
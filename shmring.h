@@ -0,0 +1,79 @@
+/*
+ File        : shmring.h
+ Description : Shared memory rings used to send bulk data to a server on the same host.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SHMRING__H
+#define __SHMRING__H
+
+#include "prerequesites.h"
+
+GBEGIN_DECL
+
+#define SHMRING_NAME     "/gangtella.%i.%u" // Name of a ring, formatted with the creator pid and a counter.
+#define SHMRING_MAXNAME  64                 // Maximum size of a ring name, including the null character.
+#define SHMRING_SIZE     (4 * 1024 * 1024)  // Default data size of a ring (must be a power of two).
+#define SHMRING_MAGIC    0x47545247         // 'GTRG'
+#define SHMRING_TIMEOUT  5000               // Time (ms) a ring side waits for the other side to make progress.
+
+/** @brief Header of a ring, at the beginning of the shared memory.
+ *
+ *  head is only written by the producer and tail only by the consumer,
+ *  so they live on different cache lines. Both are byte counters which
+ *  never wrap back to 0 ; the position in the data is counter & (size - 1).
+**/
+typedef struct shmring_header_t
+{
+    uint32_t          magic;
+    uint32_t          size;                                  // Size of the data part.
+
+    volatile uint64_t head  __attribute__((aligned(64)));    // Total bytes written by the producer.
+    volatile uint32_t datawake;                              // Incremented by the producer when it writes data.
+
+    volatile uint64_t tail  __attribute__((aligned(64)));    // Total bytes read by the consumer.
+    volatile uint32_t spacewake;                             // Incremented by the consumer when it frees space.
+
+    volatile uint32_t closed __attribute__((aligned(64)));   // Set by one side when it leaves the ring.
+} shmring_header_t;
+
+/** @brief A single producer, single consumer ring mapped in shared memory.
+**/
+typedef struct shmring_t
+{
+    std::string       name;     // Name of the shared memory object.
+    shmring_header_t* header;   // Mapped header.
+    unsigned char*    data;     // Mapped data, right after the header.
+    size_t            mapsize;  // Total mapped size.
+    bool              owner;    // True if we created the ring (we are the producer).
+} shmring_t;
+
+gerror_t shmring_create  (shmring_t*& ring, uint32_t size = SHMRING_SIZE);
+gerror_t shmring_open    (shmring_t*& ring, const std::string& name);
+gerror_t shmring_close   (shmring_t*& ring);
+
+gerror_t shmring_reserve (shmring_t* ring, unsigned char*& ptr, size_t& len, uint32_t timeout = SHMRING_TIMEOUT);
+void     shmring_commit  (shmring_t* ring, size_t len);
+gerror_t shmring_peek    (shmring_t* ring, const unsigned char*& ptr, size_t& len, uint32_t timeout = SHMRING_TIMEOUT);
+void     shmring_consume (shmring_t* ring, size_t len);
+
+GEND_DECL
+
+#endif // __SHMRING__H
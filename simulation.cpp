@@ -0,0 +1,374 @@
+/*
+ File        : simulation.cpp
+ Description : Runs many virtual nodes in this process over the loopback transport.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "simulation.h"
+#include "packet.h"
+
+GBEGIN_DECL
+
+// A virtual node is a server, started as the console one but with the loopback transport :
+// connections go through server_init_client_connection() and the client threads of the
+// servers, so the simulation measures the real handshake and the real packet paths.
+
+typedef struct simulation_t simulation_t;
+
+/** @brief A connection opened by node from to node to.
+**/
+typedef struct sim_conn_t
+{
+    simulation_t* sim;
+    uint32_t      from;
+    uint32_t      to;
+    pthread_t     thread;
+
+    client_t*     client;     // Client of node to, in the server of node from.
+    bool          established;
+    long          handshake;  // Time (us) from open to PT_CLIENT_ESTABLISHED.
+    uint64_t      bytes;      // Payload bytes acknowledged by the distant node.
+} sim_conn_t;
+
+struct simulation_t
+{
+    simulation_args_t        args;
+    std::vector<server_t*>   nodes;
+    std::vector<sim_conn_t>  conns;
+
+    pthread_mutex_t          mutex;
+    pthread_cond_t           cond;
+    uint32_t                 handshaken; // Connections which ended their handshake (or failed it).
+    bool                     transfer;   // True once connections may send their packets.
+};
+
+/** @brief Returns the resident memory of this process in bytes, or 0 if
+ *  unknown.
+**/
+static uint64_t simulation_rss()
+{
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(!f)
+        return 0;
+
+    unsigned long size = 0, resident = 0;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    return n == 2 ? (uint64_t) resident * sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+/** @brief Returns the port node id listens on.
+**/
+static uint16_t simulation_port(const simulation_t* sim, uint32_t id)
+{
+    return (uint16_t) (sim->args.tcpport ? sim->args.tcpport + id : id + 1);
+}
+
+/** @brief Creates and launches the server of node id, listening on
+ *  simulation_port().
+ *
+ *  The node takes the arguments of args.model. It does not crypt, as
+ *  generating a RSA key per node would take most of the run, and runs
+ *  none of the optional services (spool, supervisor, gossip...).
+**/
+static gerror_t simulation_node_start(simulation_t* sim, uint32_t id, server_t*& ret)
+{
+    server_t* server = new server_t;
+    if(sim->args.model)
+        server->args = sim->args.model->args;
+
+    char name[SERVER_MAXBUFSIZE];
+    snprintf(name, SERVER_MAXBUFSIZE, "node%u", id);
+
+    server->args.name         = name;
+    server->args.port         = (int) simulation_port(sim, id);
+    server->args.maxbufsize   = SERVER_MAXBUFSIZE;
+    server->args.withssl      = false;
+    server->args.warmup       = 0;
+    server->args.supervise    = false;
+    server->args.localsocket  = false;
+    server->args.sharedmemory = false;
+    server->args.multicast    = 0;
+    server->args.gossip       = 0;
+    server->args.spoolquota   = 0;
+
+    // Clients are kept in a vector whose addresses must not change.
+    server->args.maxclients   = (sim->args.topology == ST_FANOUT && id == 0) ? (int) sim->args.nodes : 2;
+
+    server_create(server);
+    server->transport = sim->args.tcpport ? &transport_tcp : &transport_loopback;
+
+    gerror_t err = server_initialize(server);
+    if(err == GERROR_NONE)
+        err = server_launch(server);
+    if(err == GERROR_NONE)
+        err = server_wait_status(server, SS_STARTED, SIMULATION_TIMEOUT);
+
+    if(err != GERROR_NONE)
+    {
+        delete server;
+        return err;
+    }
+
+    ret = server;
+    return GERROR_NONE;
+}
+
+void* simulation_conn_loop(void* data)
+{
+    sim_conn_t*   conn = (sim_conn_t*) data;
+    simulation_t* sim  = conn->sim;
+    server_t*     from = sim->nodes[conn->from];
+    long          st   = timer_monotonic_us();
+
+    // The client is established by the client thread of the server, once it reads
+    // PT_CLIENT_ESTABLISHED.
+    if(server_init_client_connection(from, conn->client, "127.0.0.1", simulation_port(sim, conn->to)) == GERROR_NONE && conn->client)
+    {
+        long deadline = timer_monotonic_ms() + SIMULATION_TIMEOUT * 1000;
+        while(!conn->client->established && timer_monotonic_ms() < deadline)
+            usleep(100);
+        conn->established = conn->client->established;
+    }
+    conn->handshake = timer_monotonic_us() - st;
+
+    // Every connection waits for the others to be established, so handshakes and
+    // transfers are measured separately.
+    gthread_mutex_lock(&sim->mutex);
+    sim->handshaken++;
+    pthread_cond_broadcast(&sim->cond);
+    while(!sim->transfer)
+        pthread_cond_wait(&sim->cond, &sim->mutex);
+    gthread_mutex_unlock(&sim->mutex);
+
+    if(conn->established)
+    {
+        char chunk[SERVER_MAXBUFSIZE];
+        memset(chunk, (int) conn->from, SERVER_MAXBUFSIZE);
+
+        for(uint32_t i = 0; i < sim->args.packets; ++i)
+        {
+            if(client_send_packet(conn->client, PT_CLIENT_SENDFILE_CHUNK, chunk, SERVER_MAXBUFSIZE) != GERROR_NONE)
+                break;
+            conn->bytes += SERVER_MAXBUFSIZE;
+        }
+
+        // The distant node closes its side, then our client thread sees the connection closed.
+        client_send_packet(conn->client, PT_CLIENT_CLOSING_CONNECTION, nullptr, 0);
+    }
+
+    return nullptr;
+}
+
+/** @brief Waits for every client of given node to be closed, until
+ *  deadline (ms).
+ *
+ *  @return True if the node has no more clients.
+**/
+static bool simulation_node_closed(server_t* server, long deadline)
+{
+    while(1)
+    {
+        gthread_mutex_lock(&server->mutex);
+        bool closed = server->clients.empty();
+        gthread_mutex_unlock(&server->mutex);
+
+        if(closed)
+            return true;
+        if(timer_monotonic_ms() >= deadline)
+            return false;
+        usleep(1000);
+    }
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Runs a simulation and prints its results.
+ *
+ *  Every node is started, then every connection of the topology is
+ *  opened at the same time. Once every handshake ended, every
+ *  connection sends its packets, each one waiting for its answer as
+ *  with a file transfer.
+ *
+ *  Results are the handshake rate, the transfer throughput and the
+ *  memory used by every node and its connections.
+ *
+ *  @return
+ *  - GERROR_NONE            : The simulation ran.
+ *  - GERROR_BADARGS         : Less than 2 or more than SIMULATION_MAXNODES nodes.
+ *  - An error of server_initialize() or server_launch() if a node can't start.
+ *  - GERROR_THREAD_CREATION : A connection thread can't be created.
+**/
+////////////////////////////////////////////////////////////
+gerror_t simulation_run(const simulation_args_t& args)
+{
+    if(args.nodes < 2 || args.nodes > SIMULATION_MAXNODES)
+        return GERROR_BADARGS;
+
+    simulation_t* sim = new simulation_t;
+    sim->args       = args;
+    sim->handshaken = 0;
+    sim->transfer   = false;
+    pthread_mutex_init(&sim->mutex, nullptr);
+    pthread_cond_init(&sim->cond, nullptr);
+
+    // Every thread of the nodes takes a small stack, as there may be thousands of them.
+#ifdef __GLIBC__
+    pthread_attr_t defattr, attr;
+    pthread_getattr_default_np(&defattr);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SIMULATION_STACKSIZE);
+    pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+#endif // __GLIBC__
+
+    transport_loopback_setlink(args.link);
+
+    if(args.tcpport) {
+        cout << "[Simulation] " << args.nodes << " nodes (" << (args.topology == ST_RING ? "ring" : "fanout") << "), TCP from port "
+             << args.tcpport << "." << endl;
+    }
+    else {
+        cout << "[Simulation] " << args.nodes << " nodes (" << (args.topology == ST_RING ? "ring" : "fanout") << "), latency "
+             << args.link.latency << " us, bandwidth " << args.link.bandwidth / 1024 << " KB/s, loss " << args.link.loss << " %." << endl;
+    }
+
+    gerror_t err     = GERROR_NONE;
+    uint64_t rssbase = simulation_rss();
+
+    // Start the nodes.
+    for(uint32_t i = 0; i < args.nodes; ++i)
+    {
+        server_t* server = nullptr;
+        if((err = simulation_node_start(sim, i, server)) != GERROR_NONE)
+            break;
+        sim->nodes.push_back(server);
+    }
+
+    // Open every connection.
+    uint32_t nconns = err == GERROR_NONE ? (args.topology == ST_RING ? args.nodes : args.nodes - 1) : 0;
+    sim->conns.resize(nconns);
+
+    long     st      = timer_monotonic_us();
+    uint32_t running = 0;
+    for(uint32_t i = 0; i < nconns; ++i, ++running)
+    {
+        sim_conn_t& conn = sim->conns[i];
+        conn.sim         = sim;
+        conn.from        = args.topology == ST_RING ? i : 0;
+        conn.to          = args.topology == ST_RING ? (i + 1) % args.nodes : i + 1;
+        conn.client      = nullptr;
+        conn.established = false;
+        conn.handshake   = 0;
+        conn.bytes       = 0;
+
+        if(pthread_create(&conn.thread, nullptr, simulation_conn_loop, &conn) != 0) {
+            err = GERROR_THREAD_CREATION;
+            break;
+        }
+    }
+
+    gthread_mutex_lock(&sim->mutex);
+    while(sim->handshaken < running)
+        pthread_cond_wait(&sim->cond, &sim->mutex);
+    gthread_mutex_unlock(&sim->mutex);
+
+    long     hsend       = timer_monotonic_us();
+    uint64_t rssnodes    = simulation_rss();
+    uint32_t established = 0;
+    long     hstotal     = 0;
+    for(uint32_t i = 0; i < running; ++i) {
+        if(sim->conns[i].established) {
+            established++;
+            hstotal += sim->conns[i].handshake;
+        }
+    }
+
+    // Transfer.
+    gthread_mutex_lock(&sim->mutex);
+    sim->transfer = true;
+    pthread_cond_broadcast(&sim->cond);
+    gthread_mutex_unlock(&sim->mutex);
+
+    uint64_t bytes = 0;
+    for(uint32_t i = 0; i < running; ++i) {
+        pthread_join(sim->conns[i].thread, nullptr);
+        bytes += sim->conns[i].bytes;
+    }
+    long trend = timer_monotonic_us();
+
+    // Results, if every node started.
+    if(err == GERROR_NONE)
+    {
+        double hstime = (hsend - st) / 1000.0;
+        double trtime = (trend - hsend) / 1000.0;
+
+        cout << "[Simulation] Handshakes : " << established << "/" << running << " in " << hstime << " ms ("
+             << (hstime > 0 ? established * 1000.0 / hstime : 0) << " handshakes/s, average "
+             << (established ? hstotal / established / 1000.0 : 0) << " ms)." << endl;
+        cout << "[Simulation] Transfer   : " << bytes / SERVER_MAXBUFSIZE << " packets, " << bytes / 1024 << " KB in " << trtime << " ms ("
+             << (trtime > 0 ? bytes / 1024.0 / 1024.0 * 1000.0 / trtime : 0) << " MB/s)." << endl;
+        if(rssnodes > rssbase && !sim->nodes.empty()) {
+            cout << "[Simulation] Memory     : " << (rssnodes - rssbase) / 1024.0 / sim->nodes.size() << " KB per node ("
+                 << (rssnodes - rssbase) / 1024 << " KB for nodes and connections)." << endl;
+        }
+    }
+
+    // Stop the nodes, once every connection is closed. Every server loop is told to stop
+    // first, so they all end within one SERVER_ACCEPTTIMEOUT. A node whose clients are
+    // not closed in time (a late handshake) is stopped but not destroyed, as their
+    // threads still use it.
+    for(uint32_t i = 0; i < sim->nodes.size(); ++i)
+        sim->nodes[i]->_must_stop = true;
+
+    long     deadline = timer_monotonic_ms() + SIMULATION_TIMEOUT * 1000;
+    uint32_t kept     = 0;
+    for(uint32_t i = 0; i < sim->nodes.size(); ++i) {
+        bool closed = simulation_node_closed(sim->nodes[i], deadline);
+        server_stop(sim->nodes[i]);
+        if(closed) {
+            server_destroy(sim->nodes[i]);
+            delete sim->nodes[i];
+        }
+        else {
+            kept++;
+        }
+    }
+
+    if(kept > 0) {
+        cout << "[Simulation] " << kept << " nodes still had clients and were not destroyed." << endl;
+    }
+
+    transport_loopback_setlink(transport_link_t());
+#ifdef __GLIBC__
+    pthread_setattr_default_np(&defattr);
+    pthread_attr_destroy(&defattr);
+#endif // __GLIBC__
+    pthread_mutex_destroy(&sim->mutex);
+    pthread_cond_destroy(&sim->cond);
+    delete sim;
+
+    return err;
+}
+
+GEND_DECL
@@ -0,0 +1,60 @@
+/*
+ File        : simulation.h
+ Description : Runs many virtual nodes in this process over the loopback transport.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SIMULATION__H
+#define __SIMULATION__H
+
+#include "prerequesites.h"
+#include "transport.h"
+#include "server.h"
+
+GBEGIN_DECL
+
+#define SIMULATION_MAXNODES  4000        // Every node is a server, with several threads per connection.
+#define SIMULATION_STACKSIZE (256 * 1024) // Stack of the node threads, as there may be thousands of them.
+#define SIMULATION_TIMEOUT   30          // Time (s) a node waits for a handshake or its clients to close.
+
+/** @brief Topologies of the simulated network.
+**/
+typedef enum SimulationTopology {
+    ST_FANOUT = 0, // Node 0 connects to every other node.
+    ST_RING   = 1  // Every node connects to the next one.
+} SimulationTopology;
+
+/** @brief Parameters of a simulation.
+**/
+typedef struct simulation_args_t
+{
+    uint32_t           nodes;     // Number of virtual nodes.
+    SimulationTopology topology;
+    uint32_t           packets;   // Chunk packets sent on every connection after the handshake.
+    transport_link_t   link;      // Link between every nodes.
+    uint16_t           tcpport;   // First TCP port of the nodes, which then use TCP on this host. 0 uses the loopback transport.
+    const server_t*    model;     // Server whose arguments the nodes take (may be null).
+} simulation_args_t;
+
+gerror_t simulation_run(const simulation_args_t& args);
+
+GEND_DECL
+
+#endif // __SIMULATION__H
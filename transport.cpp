@@ -0,0 +1,1030 @@
+/*
+ File        : transport.cpp
+ Description : Transports used by the packet layer to move bytes between two servers.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "transport.h"
+#include <deque>
+
+#ifndef _WIN32
+#   include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#   include <fcntl.h>
+#   include <sys/sendfile.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#   define MSG_NOSIGNAL 0
+#endif
+
+GBEGIN_DECL
+
+/* ******************************************************************* */
+/*                              File copies                            */
+/* ******************************************************************* */
+
+/** @brief Sends a file with the sendv() of given transport, through a
+ *  buffer. Returns len, or -1 on error.
+**/
+static ssize_t copy_sendfile(transport_t* transport, SOCKET sock, int fd, off_t offset, size_t len)
+{
+    unsigned char* buffer = (unsigned char*) malloc(TRANSPORT_FILEBUFSIZE);
+    if(!buffer)
+        return -1;
+
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t n = pread(fd, buffer, std::min<size_t>(TRANSPORT_FILEBUFSIZE, len - done), offset + (off_t) done);
+        if(n <= 0)
+            break;
+
+        transport_vec_t vec = { buffer, (size_t) n };
+        if(transport->sendv(sock, &vec, 1) < 0)
+            break;
+        done += (size_t) n;
+    }
+
+    free(buffer);
+    return done == len ? (ssize_t) len : -1;
+}
+
+/** @brief Receives a file with the recv() of given transport, through
+ *  a buffer. Returns len, or -1 on error or if no byte comes for
+ *  TRANSPORT_FILETIMEOUT ms.
+**/
+static ssize_t copy_recvfile(transport_t* transport, SOCKET sock, int fd, off_t offset, size_t len)
+{
+    unsigned char* buffer = (unsigned char*) malloc(TRANSPORT_FILEBUFSIZE);
+    if(!buffer)
+        return -1;
+
+    size_t done = 0;
+    while(done < len)
+    {
+        if(transport->ready(sock, TRANSPORT_FILETIMEOUT) != 1)
+            break;
+
+        ssize_t n = transport->recv(sock, buffer, std::min<size_t>(TRANSPORT_FILEBUFSIZE, len - done));
+        if(n <= 0 || pwrite(fd, buffer, (size_t) n, offset + (off_t) done) != n)
+            break;
+        done += (size_t) n;
+    }
+
+    free(buffer);
+    return done == len ? (ssize_t) len : -1;
+}
+
+/* ******************************************************************* */
+/*                             TCP transport                           */
+/* ******************************************************************* */
+
+/** @brief Makes a send to given socket fail once it waited TRANSPORT_SENDTIMEOUT
+ *  ms for the peer to read, so a stuck peer does not keep the write lock of
+ *  its connection (see transport_lock()).
+**/
+static void tcp_sendtimeout(SOCKET sock)
+{
+#ifdef _WIN32
+    DWORD timeout = TRANSPORT_SENDTIMEOUT;
+#else
+    struct timeval timeout;
+    timeout.tv_sec  = TRANSPORT_SENDTIMEOUT / 1000;
+    timeout.tv_usec = (TRANSPORT_SENDTIMEOUT % 1000) * 1000;
+#endif // _WIN32
+
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*) &timeout, sizeof(timeout));
+}
+
+static SOCKET tcp_open(const char* address, uint16_t port)
+{
+    IN_ADDR host;
+    if(transport_resolve(address, host) != GERROR_NONE)
+        return SOCKET_ERROR;
+
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == INVALID_SOCKET)
+        return SOCKET_ERROR;
+
+    SOCKADDR_IN sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_addr   = host;
+    sin.sin_port   = htons(port);
+    sin.sin_family = AF_INET;
+
+    if(connect(sock, (SOCKADDR*) &sin, sizeof(SOCKADDR)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return SOCKET_ERROR;
+    }
+
+    tcp_sendtimeout(sock);
+    return sock;
+}
+
+static SOCKET tcp_listen(uint16_t port)
+{
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock == INVALID_SOCKET)
+        return SOCKET_ERROR;
+
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse));
+
+    SOCKADDR_IN sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port        = htons(port);
+    sin.sin_family      = AF_INET;
+
+    if(bind(sock, (SOCKADDR*) &sin, sizeof(sin)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return SOCKET_ERROR;
+    }
+
+    // The backlog only holds the connections not accepted yet : many peers may connect
+    // (or connect back) at the same time, whatever the maximum number of clients.
+    if(listen(sock, SOMAXCONN) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return SOCKET_ERROR;
+    }
+
+    return sock;
+}
+
+static int tcp_ready(SOCKET sock, uint32_t timeout)
+{
+    struct pollfd fd;
+    fd.fd      = sock;
+    fd.events  = POLLIN;
+    fd.revents = 0;
+
+    int ret = poll(&fd, 1, (int) timeout);
+    if(ret < 0)
+        return -1;
+    return ret > 0 ? 1 : 0;
+}
+
+static SOCKET tcp_accept(SOCKET listener, uint32_t timeout)
+{
+    if(tcp_ready(listener, timeout) != 1)
+        return SOCKET_ERROR;
+
+    SOCKADDR_IN csin;
+    socklen_t   size = sizeof(csin);
+    SOCKET      sock = accept(listener, (SOCKADDR*) &csin, &size);
+    if(sock == INVALID_SOCKET)
+        return SOCKET_ERROR;
+
+    tcp_sendtimeout(sock);
+    return sock;
+}
+
+static ssize_t tcp_sendv(SOCKET sock, const transport_vec_t* vecs, int count)
+{
+    ssize_t total = 0;
+
+#ifndef _WIN32
+    // Every buffer goes in one system call, and so generally in the same segment.
+    struct iovec iovs[8];
+    int          done = 0;
+    size_t       skip = 0; // Bytes of vecs[done] already sent.
+
+    while(done < count)
+    {
+        int n = 0;
+        for(int i = done; i < count && n < 8; ++i, ++n)
+        {
+            iovs[n].iov_base = (char*) vecs[i].data + (i == done ? skip : 0);
+            iovs[n].iov_len  = vecs[i].len - (i == done ? skip : 0);
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iovs;
+        msg.msg_iovlen = n;
+
+        ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        total += ret;
+
+        // Skip what has been sent, a partial send may stop in the middle of a buffer.
+        size_t sent = (size_t) ret;
+        while(done < count && sent >= vecs[done].len - skip)
+        {
+            sent -= vecs[done].len - skip;
+            skip  = 0;
+            done++;
+        }
+        skip += sent;
+    }
+#else
+    for(int i = 0; i < count; ++i)
+    {
+        const char* data = (const char*) vecs[i].data;
+        size_t      len  = vecs[i].len;
+        while(len > 0)
+        {
+            int ret = send(sock, data, (int) len, 0);
+            if(ret < 0)
+                return -1;
+            data  += ret;
+            len   -= ret;
+            total += ret;
+        }
+    }
+#endif // _WIN32
+
+    return total;
+}
+
+static ssize_t tcp_recv(SOCKET sock, void* buffer, size_t len)
+{
+    return recv(sock, (char*) buffer, len, 0);
+}
+
+static int tcp_close(SOCKET sock)
+{
+    return closesocket(sock);
+}
+
+static ssize_t tcp_sendfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+    // The kernel copies the file to the socket, it never goes through user space.
+    size_t done = 0;
+    while(done < len)
+    {
+        off_t   off = offset + (off_t) done;
+        ssize_t n   = sendfile(sock, fd, &off, len - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if(n <= 0)
+            return -1;
+        done += (size_t) n;
+    }
+    if(done == len)
+        return (ssize_t) len;
+#endif // __linux__
+
+    return copy_sendfile(&transport_tcp, sock, fd, offset, len);
+}
+
+static ssize_t tcp_recvfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+#ifdef __linux__
+    // The data goes from the socket to a pipe, then to the file, in kernel pages.
+    int pipes[2];
+    if(len > 0 && pipe(pipes) == 0)
+    {
+        size_t received = 0; // Bytes taken from the socket.
+        size_t done     = 0; // Bytes written to the file.
+        int    error    = 0;
+        while(done < len && !error)
+        {
+            int ready = tcp_ready(sock, TRANSPORT_FILETIMEOUT);
+            if(ready != 1)
+            {
+                error = ready == 0 ? ETIMEDOUT : errno;
+                break;
+            }
+
+            ssize_t n = splice(sock, NULL, pipes[1], NULL, std::min<size_t>(TRANSPORT_FILEBUFSIZE, len - done), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                error = n < 0 ? errno : EPIPE;
+                break;
+            }
+            received += (size_t) n;
+
+            while(n > 0)
+            {
+                loff_t  off = offset + (off_t) done;
+                ssize_t m   = splice(pipes[0], NULL, fd, &off, (size_t) n, SPLICE_F_MOVE);
+                if(m < 0 && errno == EINTR)
+                    continue;
+                if(m <= 0)
+                {
+                    error = m < 0 ? errno : EIO;
+                    break;
+                }
+                n    -= m;
+                done += (size_t) m;
+            }
+        }
+
+        close(pipes[0]);
+        close(pipes[1]);
+
+        // splice() is not supported by every socket and file system. Nothing
+        // was taken from the socket then, so it is copied instead.
+        if(!error)
+            return (ssize_t) len;
+        if(received > 0 || (error != EINVAL && error != ENOSYS))
+            return -1;
+    }
+#endif // __linux__
+
+    return copy_recvfile(&transport_tcp, sock, fd, offset, len);
+}
+
+transport_t transport_tcp = {
+    "tcp", tcp_open, tcp_listen, tcp_accept, tcp_sendv, tcp_recv, tcp_ready, tcp_close, tcp_sendfile, tcp_recvfile
+};
+
+/* ******************************************************************* */
+/*                            Local transport                          */
+/* ******************************************************************* */
+
+// Unix-domain sockets, for servers of this host : the data does not go through the TCP
+// loopback stack. The address is ignored, the port names the socket file (see
+// transport_local_path()). Once connected, they are used as TCP sockets.
+
+static SOCKET local_open(const char* address, uint16_t port)
+{
+    (void) address;
+#ifndef _WIN32
+    std::string path = transport_local_path(port);
+
+    struct sockaddr_un sun;
+    if(path.size() >= sizeof(sun.sun_path) || access(path.c_str(), F_OK) != 0)
+        return SOCKET_ERROR;
+
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == INVALID_SOCKET)
+        return SOCKET_ERROR;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+
+    if(connect(sock, (SOCKADDR*) &sun, sizeof(sun)) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return SOCKET_ERROR;
+    }
+
+    tcp_sendtimeout(sock);
+    return sock;
+#else
+    return SOCKET_ERROR;
+#endif // _WIN32
+}
+
+static SOCKET local_listen(uint16_t port)
+{
+#ifndef _WIN32
+    std::string path = transport_local_path(port);
+
+    struct sockaddr_un sun;
+    if(path.size() >= sizeof(sun.sun_path))
+        return SOCKET_ERROR;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path.c_str());
+
+    // A previous server on this port may not have removed its socket file.
+    unlink(path.c_str());
+
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(sock == INVALID_SOCKET)
+        return SOCKET_ERROR;
+
+    if(bind(sock, (SOCKADDR*) &sun, sizeof(sun)) == SOCKET_ERROR ||
+       listen(sock, SOMAXCONN) == SOCKET_ERROR)
+    {
+        closesocket(sock);
+        return SOCKET_ERROR;
+    }
+
+    return sock;
+#else
+    return SOCKET_ERROR;
+#endif // _WIN32
+}
+
+static int local_close(SOCKET sock)
+{
+#ifndef _WIN32
+    // A listener removes its socket file.
+    struct sockaddr_un sun;
+    socklen_t          len       = sizeof(sun);
+    int                listening = 0;
+    socklen_t          optlen    = sizeof(listening);
+    if(getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, &listening, &optlen) == 0 && listening &&
+       getsockname(sock, (SOCKADDR*) &sun, &len) == 0 && sun.sun_family == AF_UNIX && sun.sun_path[0] != '\0')
+        unlink(sun.sun_path);
+#endif // _WIN32
+
+    return closesocket(sock);
+}
+
+transport_t transport_local = {
+    "local", local_open, local_listen, tcp_accept, tcp_sendv, tcp_recv, tcp_ready, local_close, tcp_sendfile, tcp_recvfile
+};
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the path of the socket file of the local
+ *  listener of given port.
+**/
+////////////////////////////////////////////////////////////
+std::string transport_local_path(uint16_t port)
+{
+    char path[108];
+    snprintf(path, sizeof(path), SERVER_LOCALSOCKET, (int) port);
+    return std::string(path);
+}
+
+/* ******************************************************************* */
+/*                          Loopback transport                         */
+/* ******************************************************************* */
+
+// Connections between two handles of this process, in memory. Every sendv() is kept as
+// one segment, so the receiver sees the same boundaries as with a real socket. A segment
+// is only received once the simulated link (see transport_loopback_setlink()) delivered it.
+
+typedef struct loopback_segment_t
+{
+    std::vector<unsigned char> data;
+    size_t                     pos;      // Bytes already received.
+    long                       deliverat;// Monotonic time (us) the segment arrives at.
+} loopback_segment_t;
+
+typedef struct loopback_endpoint_t
+{
+    bool                            open;
+    SOCKET                          peer;       // Other end, SOCKET_ERROR once it is closed.
+    bool                            listening;
+    uint16_t                        port;       // [Listening] Port of the listener.
+    std::deque<loopback_segment_t>  incoming;   // Data sent by the peer.
+    std::deque<SOCKET>              backlog;    // [Listening] Connections not accepted yet.
+    pthread_cond_t                  cond;       // Signaled when incoming or backlog changes, or the peer closes.
+    long                            linkfree;   // Time (us) the link to this endpoint has sent every segment.
+    uint32_t                        generation; // Incremented when the endpoint is released, see lb_handle().
+} loopback_endpoint_t;
+
+// A handle is made of the index of its endpoint and of the generation of the endpoint when
+// it was allocated. A handle kept after being closed so does not reach the next connection
+// given the same endpoint.
+#define LB_INDEXBITS 16
+#define LB_GENMASK   ((0x7FFFFFFF - TRANSPORT_LOOPBACK_BASE) >> LB_INDEXBITS)
+
+static_assert(TRANSPORT_LOOPBACK_MAX <= (1 << LB_INDEXBITS), "Loopback indexes do not fit in a handle.");
+
+static pthread_mutex_t                   lb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<loopback_endpoint_t*> lb_endpoints;
+static std::vector<uint32_t>             lb_free;
+static std::map<uint16_t, SOCKET>        lb_listeners;
+static transport_link_t                  lb_link  = { 0, 0, 0.0 };
+static uint32_t                          lb_seed  = 1;
+
+// Every function below is called with lb_mutex locked. Endpoints are never freed, only
+// reused, as other threads may still be waiting on the condition of a closed one.
+
+static SOCKET lb_handle(uint32_t idx, uint32_t generation)
+{
+    return (SOCKET) (TRANSPORT_LOOPBACK_BASE + ((generation & LB_GENMASK) << LB_INDEXBITS) + idx);
+}
+
+static uint32_t lb_index(SOCKET sock)
+{
+    return (uint32_t) (sock - TRANSPORT_LOOPBACK_BASE) & ((1u << LB_INDEXBITS) - 1);
+}
+
+static loopback_endpoint_t* lb_get(SOCKET sock)
+{
+    if(sock < TRANSPORT_LOOPBACK_BASE)
+        return nullptr;
+
+    uint32_t idx = lb_index(sock);
+    if(idx >= lb_endpoints.size() || !lb_endpoints[idx]->open || lb_handle(idx, lb_endpoints[idx]->generation) != sock)
+        return nullptr;
+    return lb_endpoints[idx];
+}
+
+static SOCKET lb_alloc()
+{
+    uint32_t idx;
+    if(!lb_free.empty()) {
+        idx = lb_free.back();
+        lb_free.pop_back();
+    }
+    else if(lb_endpoints.size() < TRANSPORT_LOOPBACK_MAX) {
+        idx = (uint32_t) lb_endpoints.size();
+        loopback_endpoint_t* ep = new loopback_endpoint_t;
+        pthread_cond_init(&ep->cond, nullptr);
+        ep->generation = 0;
+        lb_endpoints.push_back(ep);
+    }
+    else {
+        return SOCKET_ERROR;
+    }
+
+    loopback_endpoint_t* ep = lb_endpoints[idx];
+    ep->open      = true;
+    ep->peer      = SOCKET_ERROR;
+    ep->listening = false;
+    ep->port      = 0;
+    ep->linkfree  = 0;
+    return lb_handle(idx, ep->generation);
+}
+
+static void lb_release(SOCKET sock)
+{
+    loopback_endpoint_t* ep = lb_get(sock);
+    if(!ep)
+        return;
+
+    // The peer sees the end of the stream once it has read what is left.
+    loopback_endpoint_t* peer = lb_get(ep->peer);
+    if(peer) {
+        peer->peer = SOCKET_ERROR;
+        pthread_cond_broadcast(&peer->cond);
+    }
+
+    if(ep->listening)
+    {
+        lb_listeners.erase(ep->port);
+        while(!ep->backlog.empty()) {
+            SOCKET pending = ep->backlog.front();
+            ep->backlog.pop_front();
+            lb_release(pending);
+        }
+    }
+
+    // Threads may still wait on the endpoint : they are woken up and see it is closed.
+    ep->open = false;
+    ep->generation++;
+    ep->incoming.clear();
+    ep->backlog.clear();
+    pthread_cond_broadcast(&ep->cond);
+
+    lb_free.push_back(lb_index(sock));
+}
+
+/** @brief Waits on given endpoint for at most timeout microseconds
+ *  (forever if timeout is negative).
+**/
+static void lb_wait(loopback_endpoint_t* ep, long timeout)
+{
+    if(timeout < 0) {
+        pthread_cond_wait(&ep->cond, &lb_mutex);
+        return;
+    }
+
+    struct timeval  now;
+    struct timespec deadline;
+    gettimeofday(&now, NULL);
+    long usec = now.tv_usec + timeout % 1000000;
+    deadline.tv_sec  = now.tv_sec + timeout / 1000000 + usec / 1000000;
+    deadline.tv_nsec = (usec % 1000000) * 1000;
+
+    pthread_cond_timedwait(&ep->cond, &lb_mutex, &deadline);
+}
+
+/** @brief Waits until sock has a delivered segment to receive, or its peer
+ *  is closed and every segment has been received.
+ *
+ *  @param timeout : Time out in milliseconds, UINT32_MAX to wait forever.
+ *  @return 1 if ready, 0 on time out, -1 if sock is not valid anymore.
+**/
+static int lb_wait_readable(SOCKET sock, uint32_t timeout)
+{
+    long start = timer_monotonic_us();
+
+    while(1)
+    {
+        loopback_endpoint_t* ep = lb_get(sock);
+        if(!ep)
+            return -1;
+
+        long now = timer_monotonic_us();
+        if(!ep->incoming.empty() && ep->incoming.front().deliverat <= now)
+            return 1;
+        if(ep->incoming.empty() && ep->peer == SOCKET_ERROR)
+            return 1;
+
+        long wait = -1;
+        if(timeout != UINT32_MAX)
+        {
+            wait = start + (long) timeout * 1000 - now;
+            if(wait <= 0)
+                return 0;
+        }
+
+        // A segment on its way : wake up when it arrives.
+        if(!ep->incoming.empty())
+        {
+            long arrival = ep->incoming.front().deliverat - now;
+            if(wait < 0 || arrival < wait)
+                wait = arrival;
+        }
+
+        lb_wait(ep, wait);
+    }
+}
+
+static SOCKET lb_open(const char* address, uint16_t port)
+{
+    (void) address; // Every loopback listener is on this process.
+    gthread_mutex_lock(&lb_mutex);
+
+    std::map<uint16_t, SOCKET>::iterator it = lb_listeners.find(port);
+    if(it == lb_listeners.end())
+    {
+        gthread_mutex_unlock(&lb_mutex);
+        errno = ECONNREFUSED;
+        return SOCKET_ERROR;
+    }
+
+    SOCKET client = lb_alloc();
+    SOCKET server = lb_alloc();
+    if(client == SOCKET_ERROR || server == SOCKET_ERROR)
+    {
+        lb_release(client);
+        lb_release(server);
+        gthread_mutex_unlock(&lb_mutex);
+        errno = EMFILE;
+        return SOCKET_ERROR;
+    }
+
+    lb_get(client)->peer = server;
+    lb_get(server)->peer = client;
+
+    loopback_endpoint_t* listener = lb_get(it->second);
+    listener->backlog.push_back(server);
+    pthread_cond_broadcast(&listener->cond);
+
+    gthread_mutex_unlock(&lb_mutex);
+    return client;
+}
+
+static SOCKET lb_listen(uint16_t port)
+{
+    gthread_mutex_lock(&lb_mutex);
+
+    if(lb_listeners.find(port) != lb_listeners.end())
+    {
+        gthread_mutex_unlock(&lb_mutex);
+        errno = EADDRINUSE;
+        return SOCKET_ERROR;
+    }
+
+    SOCKET sock = lb_alloc();
+    if(sock != SOCKET_ERROR)
+    {
+        loopback_endpoint_t* ep = lb_get(sock);
+        ep->listening = true;
+        ep->port      = port;
+        lb_listeners[port] = sock;
+    }
+
+    gthread_mutex_unlock(&lb_mutex);
+    return sock;
+}
+
+static SOCKET lb_accept(SOCKET listener, uint32_t timeout)
+{
+    SOCKET sock  = SOCKET_ERROR;
+    long   start = timer_monotonic_ms();
+
+    gthread_mutex_lock(&lb_mutex);
+    while(1)
+    {
+        loopback_endpoint_t* ep = lb_get(listener);
+        if(!ep || !ep->listening)
+            break;
+
+        if(!ep->backlog.empty()) {
+            sock = ep->backlog.front();
+            ep->backlog.pop_front();
+            break;
+        }
+
+        long elapsed = timer_monotonic_ms() - start;
+        if(elapsed >= (long) timeout)
+            break;
+
+        lb_wait(ep, ((long) timeout - elapsed) * 1000);
+    }
+    gthread_mutex_unlock(&lb_mutex);
+
+    return sock;
+}
+
+static ssize_t lb_sendv(SOCKET sock, const transport_vec_t* vecs, int count)
+{
+    loopback_segment_t segment;
+    segment.pos = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        const unsigned char* data = (const unsigned char*) vecs[i].data;
+        segment.data.insert(segment.data.end(), data, data + vecs[i].len);
+    }
+
+    ssize_t ret = -1;
+
+    gthread_mutex_lock(&lb_mutex);
+    {
+        loopback_endpoint_t* ep   = lb_get(sock);
+        loopback_endpoint_t* peer = ep ? lb_get(ep->peer) : nullptr;
+
+        if(!ep) {
+            errno = EBADF;
+        }
+        else if(!peer) {
+            errno = EPIPE;
+        }
+        else {
+            ret = (ssize_t) segment.data.size();
+            if(ret > 0) {
+                // The segment waits for the previous ones to be sent on the link, takes
+                // its own transmission time, and arrives after the latency. A lost segment
+                // arrives one retransmission time out later, and delays the next ones.
+                long now  = timer_monotonic_us();
+                long sent = std::max(now, peer->linkfree);
+                if(lb_link.bandwidth > 0)
+                    sent += (long) (segment.data.size() * 1000000ULL / lb_link.bandwidth);
+                peer->linkfree = sent;
+
+                long arrival = sent + lb_link.latency;
+                lb_seed = lb_seed * 1103515245 + 12345;
+                if(lb_link.loss > 0.0 && ((lb_seed >> 8) % 1000000) < (uint32_t) (lb_link.loss * 10000.0))
+                    arrival += std::max((long) TRANSPORT_RETRANSMIT, 2 * (long) lb_link.latency);
+                if(!peer->incoming.empty())
+                    arrival = std::max(arrival, peer->incoming.back().deliverat);
+
+                peer->incoming.push_back(loopback_segment_t());
+                peer->incoming.back().data.swap(segment.data);
+                peer->incoming.back().pos       = 0;
+                peer->incoming.back().deliverat = arrival;
+                pthread_cond_broadcast(&peer->cond);
+            }
+        }
+    }
+    gthread_mutex_unlock(&lb_mutex);
+
+    return ret;
+}
+
+static ssize_t lb_recv(SOCKET sock, void* buffer, size_t len)
+{
+    ssize_t ret = -1;
+
+    gthread_mutex_lock(&lb_mutex);
+    if(lb_wait_readable(sock, UINT32_MAX) == 1)
+    {
+        loopback_endpoint_t* ep  = lb_get(sock);
+        unsigned char*       out = (unsigned char*) buffer;
+        ret = 0;
+
+        // As with a stream socket, one call may return the end of a segment and the
+        // beginning of the next one, if it has been delivered.
+        long now = timer_monotonic_us();
+        while((size_t) ret < len && !ep->incoming.empty() && ep->incoming.front().deliverat <= now)
+        {
+            loopback_segment_t& seg = ep->incoming.front();
+            size_t n = std::min(len - (size_t) ret, seg.data.size() - seg.pos);
+            memcpy(out + ret, &seg.data[seg.pos], n);
+            seg.pos += n;
+            ret     += n;
+
+            if(seg.pos == seg.data.size())
+                ep->incoming.pop_front();
+        }
+    }
+    else
+    {
+        errno = EBADF;
+    }
+    gthread_mutex_unlock(&lb_mutex);
+
+    return ret;
+}
+
+static int lb_ready(SOCKET sock, uint32_t timeout)
+{
+    gthread_mutex_lock(&lb_mutex);
+    int ret = lb_wait_readable(sock, timeout);
+    gthread_mutex_unlock(&lb_mutex);
+    return ret;
+}
+
+static int lb_close(SOCKET sock)
+{
+    gthread_mutex_lock(&lb_mutex);
+    int ret = lb_get(sock) ? 0 : -1;
+    lb_release(sock);
+    gthread_mutex_unlock(&lb_mutex);
+    return ret;
+}
+
+static ssize_t lb_sendfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+    return copy_sendfile(&transport_loopback, sock, fd, offset, len);
+}
+
+static ssize_t lb_recvfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+    return copy_recvfile(&transport_loopback, sock, fd, offset, len);
+}
+
+transport_t transport_loopback = {
+    "loopback", lb_open, lb_listen, lb_accept, lb_sendv, lb_recv, lb_ready, lb_close, lb_sendfile, lb_recvfile
+};
+
+////////////////////////////////////////////////////////////
+/** @brief Creates two connected loopback handles.
+ *
+ *  @return
+ *  - GERROR_NONE  : first and second are connected.
+ *  - GERROR_ALLOC : Too many loopback handles are opened.
+**/
+////////////////////////////////////////////////////////////
+gerror_t transport_loopback_pair(SOCKET& first, SOCKET& second)
+{
+    gthread_mutex_lock(&lb_mutex);
+
+    first  = lb_alloc();
+    second = lb_alloc();
+    if(first == SOCKET_ERROR || second == SOCKET_ERROR)
+    {
+        lb_release(first);
+        lb_release(second);
+        first = second = SOCKET_ERROR;
+        gthread_mutex_unlock(&lb_mutex);
+        return GERROR_ALLOC;
+    }
+
+    lb_get(first)->peer  = second;
+    lb_get(second)->peer = first;
+
+    gthread_mutex_unlock(&lb_mutex);
+    return GERROR_NONE;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Sets the link simulated between every loopback handles.
+ *  It applies to the segments sent from now.
+**/
+////////////////////////////////////////////////////////////
+void transport_loopback_setlink(const transport_link_t& link)
+{
+    gthread_mutex_lock(&lb_mutex);
+    lb_link = link;
+    gthread_mutex_unlock(&lb_mutex);
+}
+
+/* ******************************************************************* */
+/*                              Dispatching                            */
+/* ******************************************************************* */
+
+// Write locks of the connections, by handle (by endpoint for loopback handles). A lock is
+// never freed : once a handle is closed, the next connection given the same one takes it.
+static pthread_mutex_t                    tr_lockmutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<SOCKET, pthread_mutex_t*> tr_locks;
+
+static pthread_mutex_t* tr_writelock(SOCKET sock)
+{
+    if(sock >= TRANSPORT_LOOPBACK_BASE)
+        sock = lb_handle(lb_index(sock), 0);
+
+    gthread_mutex_lock(&tr_lockmutex);
+    pthread_mutex_t*& lock = tr_locks[sock];
+    if(!lock) {
+        lock = new pthread_mutex_t;
+        pthread_mutex_init(lock, nullptr);
+    }
+    gthread_mutex_unlock(&tr_lockmutex);
+    return lock;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Locks the writes to given connection, so a frame written in
+ *  several calls (a header, then a file) is not mixed with the frames
+ *  of other threads.
+**/
+////////////////////////////////////////////////////////////
+void transport_lock(SOCKET sock)
+{
+    gthread_mutex_lock(tr_writelock(sock));
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Unlocks the writes locked with transport_lock().
+**/
+////////////////////////////////////////////////////////////
+void transport_unlock(SOCKET sock)
+{
+    gthread_mutex_unlock(tr_writelock(sock));
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Returns the transport of given handle.
+**/
+////////////////////////////////////////////////////////////
+transport_t* transport_of(SOCKET sock)
+{
+    if(sock >= TRANSPORT_LOOPBACK_BASE)
+        return &transport_loopback;
+    return &transport_tcp;
+}
+
+////////////////////////////////////////////////////////////
+/** @brief Resolves given host name or dotted adress to an IPv4 adress.
+ *  Unlike gethostbyname(), it may be called by several connection
+ *  threads at the same time.
+ *
+ *  @return
+ *  - GERROR_NONE         : out is set.
+ *  - GERROR_INVALID_HOST : The host can't be resolved.
+**/
+////////////////////////////////////////////////////////////
+gerror_t transport_resolve(const char* address, IN_ADDR& out)
+{
+    struct addrinfo  hints;
+    struct addrinfo* result = nullptr;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(!address || getaddrinfo(address, nullptr, &hints, &result) != 0 || !result)
+        return GERROR_INVALID_HOST;
+
+    out = ((SOCKADDR_IN*) result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+    return GERROR_NONE;
+}
+
+ssize_t transport_sendv(SOCKET sock, const transport_vec_t* vecs, int count)
+{
+    return transport_of(sock)->sendv(sock, vecs, count);
+}
+
+ssize_t transport_send(SOCKET sock, const void* data, size_t len)
+{
+    transport_vec_t vec = { data, len };
+    return transport_of(sock)->sendv(sock, &vec, 1);
+}
+
+ssize_t transport_recv(SOCKET sock, void* buffer, size_t len)
+{
+    return transport_of(sock)->recv(sock, buffer, len);
+}
+
+int transport_ready(SOCKET sock, uint32_t timeout)
+{
+    return transport_of(sock)->ready(sock, timeout);
+}
+
+int transport_close(SOCKET sock)
+{
+    return transport_of(sock)->close(sock);
+}
+
+ssize_t transport_sendfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+    return transport_of(sock)->sendfile(sock, fd, offset, len);
+}
+
+ssize_t transport_recvfile(SOCKET sock, int fd, off_t offset, size_t len)
+{
+    return transport_of(sock)->recvfile(sock, fd, offset, len);
+}
+
+GEND_DECL
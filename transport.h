@@ -0,0 +1,103 @@
+/*
+ File        : transport.h
+ Description : Transports used by the packet layer to move bytes between two servers.
+*/
+
+/*
+ GangTella Project
+ Copyright (C) 2014 - 2015  Luk2010
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TRANSPORT__H
+#define __TRANSPORT__H
+
+#include "prerequesites.h"
+
+GBEGIN_DECL
+
+#define TRANSPORT_LOOPBACK_BASE 0x40000000 // First loopback handle. System sockets never get that high.
+#define TRANSPORT_LOOPBACK_MAX  65536      // Maximum number of loopback handles opened at the same time.
+#define TRANSPORT_RETRANSMIT    200000     // Minimum time (us) a lost loopback segment is late.
+#define TRANSPORT_FILEBUFSIZE   65536      // Size of the buffer used to copy files from or to transports without zero-copy.
+#define TRANSPORT_FILETIMEOUT   10000      // Time (ms) a file received waits for its next bytes.
+#define TRANSPORT_SENDTIMEOUT   10000      // Time (ms) a send waits for a peer which does not read.
+
+/** @brief One buffer of a vectored send.
+**/
+typedef struct transport_vec_t
+{
+    const void* data;
+    size_t      len;
+} transport_vec_t;
+
+/** @brief A transport moves bytes of a connection. Connections are
+ *  identified by a SOCKET handle, so the packet layer does not have to
+ *  know which transport it uses.
+ *
+ *  Every function follows the usual socket conventions : it returns -1
+ *  on error (and SOCKET_ERROR for handles), and recv() returns 0 when
+ *  the other side closed the connection.
+**/
+typedef struct transport_t
+{
+    const char* name;
+
+    SOCKET  (*open)   (const char* address, uint16_t port);               // Connects to given address.
+    SOCKET  (*listen) (uint16_t port);                                    // Opens a listening handle.
+    SOCKET  (*accept) (SOCKET listener, uint32_t timeout);                // Waits timeout ms for a connection. SOCKET_ERROR if none.
+    ssize_t (*sendv)  (SOCKET sock, const transport_vec_t* vecs, int count); // Sends every buffer, in order.
+    ssize_t (*recv)   (SOCKET sock, void* buffer, size_t len);            // Receives at most len bytes.
+    int     (*ready)  (SOCKET sock, uint32_t timeout);                    // 1 if recv() won't block, 0 on time out, -1 on error.
+    int     (*close)  (SOCKET sock);
+    ssize_t (*sendfile) (SOCKET sock, int fd, off_t offset, size_t len);  // Sends len bytes of a file, from offset.
+    ssize_t (*recvfile) (SOCKET sock, int fd, off_t offset, size_t len);  // Receives len bytes to a file, at offset.
+} transport_t;
+
+/** @brief Characteristics of the link simulated by the loopback transport,
+ *  for every connection and in both directions.
+**/
+typedef struct transport_link_t
+{
+    uint32_t latency;   // One-way latency (us).
+    uint64_t bandwidth; // Bytes per second, 0 for unlimited.
+    double   loss;      // Percentage of lost segments. They are retransmitted, as with TCP.
+} transport_link_t;
+
+extern transport_t transport_tcp;
+extern transport_t transport_local;
+extern transport_t transport_loopback;
+
+transport_t* transport_of        (SOCKET sock);
+gerror_t     transport_resolve   (const char* address, IN_ADDR& out);
+
+ssize_t      transport_sendv     (SOCKET sock, const transport_vec_t* vecs, int count);
+ssize_t      transport_send      (SOCKET sock, const void* data, size_t len);
+ssize_t      transport_recv      (SOCKET sock, void* buffer, size_t len);
+int          transport_ready     (SOCKET sock, uint32_t timeout);
+int          transport_close     (SOCKET sock);
+ssize_t      transport_sendfile  (SOCKET sock, int fd, off_t offset, size_t len);
+ssize_t      transport_recvfile  (SOCKET sock, int fd, off_t offset, size_t len);
+void         transport_lock      (SOCKET sock);
+void         transport_unlock    (SOCKET sock);
+
+gerror_t     transport_loopback_pair    (SOCKET& first, SOCKET& second);
+void         transport_loopback_setlink (const transport_link_t& link);
+
+std::string  transport_local_path       (uint16_t port);
+
+GEND_DECL
+
+#endif // __TRANSPORT__H
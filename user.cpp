@@ -25,6 +25,7 @@
 #include "encryption.h"
 #include "client.h"
 #include "server.h"
+#include <set>
 
 GBEGIN_DECL
 
@@ -43,7 +44,7 @@ template <> std::string to_text(const dbclientlist_t& clist)
         for (unsigned int i = 0; i < clist.size(); ++i)
         {
             ret += "$"; ret += clist[i]->ip;
-            ret += "$"; ret += clist[i]->port;
+            ret += "$"; ret += std::to_string(clist[i]->port);
         }
     }
     return ret;
@@ -71,9 +72,12 @@ template <> dbclientlist_t from_text(const std::string& clist)
                 for(unsigned int j = 0; j < res; ++j)
                 {
                     i = 2 * j + 2;
+                    if(i + 1 >= tokens.size())
+                        break;
+                    
                     dbclientptr_t more = new dbclient_t;
-                    more->port = atoi(tokens[i].c_str());
-                    more->ip   = tokens[i+1];
+                    more->ip   = tokens[i];
+                    more->port = (uint16_t) atoi(tokens[i+1].c_str());
                     ret.push_back(more);
                 }
             }
@@ -87,18 +91,14 @@ template <> dbclientlist_t from_text(const std::string& clist)
 **/
 gerror_t clientlist_complete(dbclientlist_t& list1, const dbclientlist_t& list2)
 {
+    std::set< std::pair<std::string, uint16_t> > known;
+    for(unsigned int j = 0; j < list1.size(); ++j)
+        known.insert(std::make_pair(list1[j]->ip, list1[j]->port));
+    
     for (unsigned int i = 0; i < list2.size(); ++i)
     {
         dbclientptr_t c = list2[i];
-        bool isok = false;
-        for(unsigned int j = 0; j < list1.size(); ++j)
-        {
-            dbclientptr_t c2 = list1[j];
-            if(c2->ip == c->ip && c2->port == c->port)
-                isok = true;
-        }
-        
-        if(!isok)
+        if(known.insert(std::make_pair(c->ip, c->port)).second)
         {
             dbclientptr_t newc = new dbclient_t;
             newc->ip   = c->ip;
@@ -116,7 +116,7 @@ gerror_t clientlist_complete(dbclientlist_t& list1, const dbclientlist_t& list2)
  *  from the attached network. You can't use a user from a network to connect to another
  *  one.
  *  
- *  @param net   : Network to look for in.
+ *  @param database : Database to look for in.
  *  @param user  : [out] A pointer to a pointer to returns the user. If null, no user is returned.
  *  @param uname : Name of the user to read into network. If no user is found, it creates a new
  *  entry in the network database.
@@ -130,18 +130,18 @@ gerror_t clientlist_complete(dbclientlist_t& list1, const dbclientlist_t& list2)
  *  - GERROR_USR_BADPSWD : Incorrect password.
  *  - GERROR_NET_INVALID : Network given invalid or null.
 **/
-gerror_t user_create(userptr_t* user, const std::string& uname, const std::string& upass)
+gerror_t user_create(database_t* database, userptr_t* user, const std::string& uname, const std::string& upass)
 {
-    userptr_t ret = database_find_user(globalsession.database, uname);
+    userptr_t ret = database_find_user(database, uname);
     
     // If user is not in the network database, add it.
     if(!ret)
     {
 		// Create new user
-        database_create_user(globalsession.database, uname, upass);
+        ret = database_create_user(database, uname, upass);
             
         // Return the user if possible
-        if(*user)
+        if(user)
             *user = ret;
             
         cout << "[User] Correctly created user '" << uname << "'." << endl;
@@ -152,7 +152,7 @@ gerror_t user_create(userptr_t* user, const std::string& uname, const std::strin
 	if(Encryption::user_check_password(ret->m_key->buf, ret->m_iv->buf, upass.c_str(), upass.size()))
 	{
         // Return the user if possible
-        if(*user)
+        if(user)
             *user = ret;
 
 		cout << "[User] Correctly loaded user '" << uname << "'." << endl;
@@ -192,12 +192,54 @@ gerror_t user_destroy(user_t* user)
 
 // ================================================================================================
 
+/** @brief Register a client in the user's known clients.
+ *
+ *  The list is kept in most-recently-used order : if the client is already
+ *  known, it is moved to the back of the list instead of being duplicated.
+**/
 gerror_t user_register_client(user_t* usr, const database_clientinfo_t& client)
 {
+    for(unsigned int i = 0; i < usr->clients.size(); ++i)
+    {
+        if(usr->clients[i].ip == client.ip && usr->clients[i].port == client.port)
+        {
+            usr->clients.erase(usr->clients.begin() + i);
+            break;
+        }
+    }
+    
     usr->clients.push_back(client);
     return GERROR_NONE;
 }
 
+/** @brief Returns at most count known clients, most recently used first.
+ *
+ *  Duplicated entries (from databases saved before the list was kept in
+ *  MRU order) are only returned once.
+**/
+std::vector<database_clientinfo_t> user_get_recent_clients(user_t* usr, uint32_t count)
+{
+    std::vector<database_clientinfo_t> ret;
+    if(!usr)
+        return ret;
+    
+    for(size_t i = usr->clients.size(); i > 0 && ret.size() < count; --i)
+    {
+        const database_clientinfo_t& c = usr->clients[i - 1];
+        bool known = false;
+        for(unsigned int j = 0; j < ret.size(); ++j)
+        {
+            if(ret[j].ip == c.ip && ret[j].port == c.port)
+                known = true;
+        }
+        
+        if(!known)
+            ret.push_back(c);
+    }
+    
+    return ret;
+}
+
 bool user_has_accepted(user_t* usr, const char* username)
 {
     for(unsigned int i = 0; i < usr->acceptedusers.size(); ++i)
@@ -29,11 +29,12 @@
 
 GBEGIN_DECL
 
-gerror_t user_create				 (userptr_t* user, const std::string& uname, const std::string& upass);
+gerror_t user_create				 (database_t* database, userptr_t* user, const std::string& uname, const std::string& upass);
 gerror_t user_destroy				 (user_t* user);
 
 // new API
 gerror_t user_register_client       (user_t* usr, const database_clientinfo_t& client);
+std::vector<database_clientinfo_t> user_get_recent_clients (user_t* usr, uint32_t count);
 bool     user_has_accepted          (user_t* usr, const char* username);
 database_accepted_user_t* user_find_accepted (user_t* usr, const char* username);
 